@@ -0,0 +1,193 @@
+/** FixedWidthBench.cpp
+ *
+ * Measures how many fixed-width numeric fields per second the decoders in
+ * amber/fixedwidth.h get through compared to the conversions they replaced
+ * (atof/atoi on a substring for topology files, StringToDouble on a substring
+ * for ASCII restart files). Every field of every numeric section in the test
+ * files is decoded, and the two paths are checked to give identical results.
+ *
+ * Usage: FixedWidthBench [seconds per measurement]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+typedef struct {
+    const char* begin;
+    const char* end;
+} FieldSpan;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// Collects the fields of every FLOAT or INTEGER section of a topology file
+static void prmtopFields(MappedFile const& file, ParmDataType type,
+                         vector<FieldSpan> &fields) {
+    vector<string> flags;
+    ParmSectionList sections;
+    ParmStringMap comments;
+    ParmFormatMap formats;
+    string version;
+    if (indexparm(file.data(), file.size(), flags, sections, comments, formats,
+                  version) != OK) {
+        fprintf(stderr, "Could not index topology file\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < sections.size(); i++) {
+        if (sections[i].format.dataType != type) continue;
+        const char* p = file.data() + sections[i].begin;
+        const char* end = file.data() + sections[i].end;
+        while (p < end) {
+            const char* lend = (const char*) memchr(p, '\n', end - p);
+            if (lend == NULL) lend = end;
+            const char* rend = lend;
+            while (rend > p && (rend[-1] == ' ' || rend[-1] == '\r')) rend--;
+            for (const char* f = p; f < rend; f += sections[i].width) {
+                FieldSpan span = {f, min(f + sections[i].width, rend)};
+                fields.push_back(span);
+            }
+            p = lend + 1;
+        }
+    }
+}
+
+/// Collects the 12-character fields after the two header lines of a restart
+static void rst7Fields(MappedFile const& file, vector<FieldSpan> &fields) {
+    const char* p = file.data();
+    const char* end = file.end();
+    for (int nline = 0; p < end; nline++) {
+        const char* lend = (const char*) memchr(p, '\n', end - p);
+        if (lend == NULL) lend = end;
+        if (nline >= 2)
+            for (const char* f = p; f + 12 <= lend; f += 12) {
+                FieldSpan span = {f, f + 12};
+                fields.push_back(span);
+            }
+        p = lend + 1;
+    }
+}
+
+/* The paths being compared. Each returns a checksum so the work cannot be
+ * optimized away and the two paths can be checked against each other
+ */
+static double oldReal(vector<FieldSpan> const& fields) {
+    double sum = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        sum += atof(string(fields[i].begin, fields[i].end).c_str());
+    return sum;
+}
+
+static double oldInt(vector<FieldSpan> const& fields) {
+    double sum = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        sum += atoi(string(fields[i].begin, fields[i].end).c_str());
+    return sum;
+}
+
+static double oldRst7(vector<FieldSpan> const& fields) {
+    double sum = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        sum += StringToDouble(string(fields[i].begin, fields[i].end));
+    return sum;
+}
+
+static double newReal(vector<FieldSpan> const& fields) {
+    double sum = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        sum += decodeReal(fields[i].begin, fields[i].end);
+    return sum;
+}
+
+static double newInt(vector<FieldSpan> const& fields) {
+    double sum = 0;
+    for (size_t i = 0; i < fields.size(); i++)
+        sum += decodeInt(fields[i].begin, fields[i].end);
+    return sum;
+}
+
+static double newRst7(vector<FieldSpan> const& fields) {
+    double sum = 0, value;
+    for (size_t i = 0; i < fields.size(); i++)
+        if (decodeReal(fields[i].begin, fields[i].end, value)) sum += value;
+    return sum;
+}
+
+typedef double (*DecodeFunc)(vector<FieldSpan> const&);
+
+/// Runs func repeatedly for about `seconds' and returns fields per second
+static double rate(DecodeFunc func, vector<FieldSpan> const& fields,
+                   double seconds, double &checksum) {
+    size_t n = 0;
+    double start = now(), elapsed;
+    do {
+        checksum = func(fields);
+        n += fields.size();
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return n / elapsed;
+}
+
+static bool compare(const char* file, const char* kind,
+                    vector<FieldSpan> const& fields, DecodeFunc oldFunc,
+                    DecodeFunc newFunc, double seconds) {
+    if (fields.empty()) return true;
+    double oldSum, newSum;
+    double oldRate = rate(oldFunc, fields, seconds, oldSum);
+    double newRate = rate(newFunc, fields, seconds, newSum);
+    printf("%-24s %-8s %9lu %14.3e %14.3e %8.2fx\n", file, kind,
+           (unsigned long) fields.size(), oldRate, newRate, newRate / oldRate);
+    if (oldSum != newSum) {
+        printf("  checksum mismatch: %.17g vs. %.17g\n", oldSum, newSum);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    const char* prmtops[] = {"trx.prmtop", "4096wat.parm7"};
+    const char* restarts[] = {"trx.inpcrd", "crdsonly.rst7", "crds_box.rst7",
+                              "crds_vels_box.rst7", "4096wat.rst7"};
+    bool ok = true;
+
+    printf("%-24s %-8s %9s %14s %14s %9s\n", "File", "Fields", "Count",
+           "Old (rec/s)", "New (rec/s)", "Speedup");
+
+    for (size_t i = 0; i < sizeof(prmtops) / sizeof(prmtops[0]); i++) {
+        MappedFile file;
+        if (!file.open(string("../test/files/") + prmtops[i])) {
+            fprintf(stderr, "Could not open %s\n", prmtops[i]);
+            return 1;
+        }
+        vector<FieldSpan> reals, ints;
+        prmtopFields(file, FLOAT, reals);
+        prmtopFields(file, INTEGER, ints);
+        ok = compare(prmtops[i], "FLOAT", reals, oldReal, newReal, seconds) && ok;
+        ok = compare(prmtops[i], "INTEGER", ints, oldInt, newInt, seconds) && ok;
+    }
+
+    for (size_t i = 0; i < sizeof(restarts) / sizeof(restarts[0]); i++) {
+        MappedFile file;
+        if (!file.open(string("../test/files/") + restarts[i])) {
+            fprintf(stderr, "Could not open %s\n", restarts[i]);
+            return 1;
+        }
+        vector<FieldSpan> reals;
+        rst7Fields(file, reals);
+        ok = compare(restarts[i], "F12.7", reals, oldRst7, newRst7, seconds) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,79 @@
+/** MaskBench.cpp
+ *
+ * Measures compiling Amber masks and evaluating them frame by frame, for a few
+ * masks typical of analysis: plain residue and atom selections (which are
+ * resolved entirely when compiling) and distance selections (which need a grid
+ * search every frame).
+ *
+ * Usage: MaskBench [prmtop rst7] [seconds per measurement]
+ *
+ * The default system is the 4096wat water box from the tests. Larger systems
+ * (e.g., the ones PipelineBench -keep leaves behind) show how the masks scale.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static const char* MASKS[] = {
+    ":WAT",
+    ":1-250&!@H=",
+    "@O|@%HW",
+    ":1<:5.0",
+    ":1-100<@8.0&!:1-100",
+    "(:1,2000<:10.0)>@3.0",
+};
+
+int main(int argc, char** argv) {
+    string prmtop = argc > 2 ? argv[1] : "../test/files/4096wat.parm7";
+    string rst7 = argc > 2 ? argv[2] : "../test/files/4096wat.rst7";
+    double seconds = argc > 3 ? atof(argv[3]) : argc == 2 ? atof(argv[1]) : 0.5;
+
+    AmberParm parm(prmtop);
+    AmberCoordinateFrame frame;
+    frame.readRst7(rst7);
+    vector<OpenMM::Vec3> const& positions = frame.getPositions();
+    printf("%s: %d atoms, %d residues\n\n", prmtop.c_str(), parm.getNumAtoms(),
+           parm.getNumResidues());
+
+    printf("%-24s %10s %14s %14s\n", "mask", "selected", "compile (ms)",
+           "per frame (ms)");
+    AtomSelection selection;
+    for (size_t m = 0; m < sizeof(MASKS) / sizeof(MASKS[0]); m++) {
+        int ncompiled = 0;
+        double start = now(), elapsed;
+        do {
+            AtomMask mask(parm, MASKS[m]);
+            ncompiled++;
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+        double tcompile = elapsed / ncompiled;
+
+        AtomMask mask(parm, MASKS[m]);
+        int nframes = 0;
+        start = now();
+        do {
+            mask.evaluate(positions, selection);
+            nframes++;
+            elapsed = now() - start;
+        } while (elapsed < seconds);
+        double tframe = elapsed / nframes;
+
+        printf("%-24s %10d %14.3f %14.3f\n", MASKS[m], selection.count(),
+               tcompile * 1e3, tframe * 1e3);
+    }
+
+    return 0;
+}
@@ -0,0 +1,538 @@
+/** PipelineBench.cpp
+ *
+ * Measures how loading a system scales with its size. Synthetic systems are
+ * generated by tiling the test inputs -- the 4096wat water box (periodic) and
+ * the trx protein (in vacuo, spaced far enough apart that the copies do not
+ * overlap) -- into systems of roughly 10k to 2M atoms, each written as a
+ * prmtop, an ASCII restart and (with NetCDF support) a NetCDF restart. Every
+ * system is then loaded in a fresh process, timing each stage of the
+ * load -> createSystem -> first energy pipeline and recording the peak RSS of
+ * the process once the stage is done.
+ *
+ * Usage: PipelineBench [-max natom] [-o results] [-baseline results]
+ *                      [-tolerance fraction] [-keep]
+ *
+ *  -max        Largest system to generate (default 2000000 atoms)
+ *  -o          Also write the timings to this file, for use as a baseline
+ *  -baseline   Compare against timings written earlier with -o, and fail if
+ *              any stage got slower by more than the tolerance
+ *  -tolerance  Allowed slowdown relative to the baseline (default 0.25)
+ *  -keep       Keep the generated files instead of removing them
+ */
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+/// Approximate system sizes (in atoms) that are generated
+static const int SYSTEM_SIZES[] = {10000, 100000, 500000, 1000000, 2000000};
+
+/// Space between the edges of neighboring protein copies, in angstroms
+#define PROTEIN_MARGIN 15.0
+
+typedef struct {
+    const char* name;       // prefix of the generated files
+    const char* prmtop;     // template topology and restart in ../test/files
+    const char* rst7;
+    bool periodic;
+} SystemKind;
+
+static const SystemKind SYSTEM_KINDS[] = {
+    {"water", "4096wat.parm7", "4096wat.rst7", true},
+    {"protein", "trx.prmtop", "trx.inpcrd", false},
+};
+
+typedef struct {
+    vector<string> flagList;
+    ParmDataMap parmData;
+    ParmStringMap parmComments, unkParmData;
+    ParmFormatMap parmFormats;
+    string version;
+} ParmContents;
+
+/// One timed stage of loading a system
+typedef struct {
+    string system;
+    int natom;
+    string stage;
+    double seconds;
+    double megabytes;       // size of the file read (0 if none)
+    double rssMB;           // peak RSS of the process after the stage
+} StageResult;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double peakRssMB(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss / 1024.0;    // kilobytes on Linux
+}
+
+static double fileMB(string const& fname) {
+    FILE *fp = fopen(fname.c_str(), "rb");
+    if (fp == NULL) return 0;
+    fseek(fp, 0, SEEK_END);
+    double size = ftell(fp) / 1.0e6;
+    fclose(fp);
+    return size;
+}
+
+/* Generator */
+
+/// Picks a grid of copies (each dimension n or n+1) with a total closest to
+/// the requested number of copies
+static int tileGrid(double copies, int grid[3]) {
+    int n = (int) floor(cbrt(copies));
+    if (n < 1) n = 1;
+    int best = -1;
+    for (int extra = 0; extra <= 3; extra++) {
+        int g[3] = {n, n, n};
+        for (int i = 0; i < extra; i++) g[2 - i]++;
+        int total = g[0] * g[1] * g[2];
+        if (best < 0 || fabs(total - copies) < fabs(best - copies)) {
+            best = total;
+            memcpy(grid, g, sizeof(g));
+        }
+    }
+    return best;
+}
+
+/// Shifts a (possibly negated) prmtop atom index by offset
+static int shiftIndex(int value, int offset) {
+    return value >= 0 ? value + offset : value - offset;
+}
+
+static bool inList(string const& flag, const char* const* list) {
+    for (; *list != NULL; list++)
+        if (flag == *list) return true;
+    return false;
+}
+
+/// Sections with one entry per atom (or residue, or molecule) that are
+/// repeated as they are for every copy
+static const char* const REPEATED_FLAGS[] = {
+    "ATOM_NAME", "CHARGE", "ATOMIC_NUMBER", "MASS", "ATOM_TYPE_INDEX",
+    "NUMBER_EXCLUDED_ATOMS", "RESIDUE_LABEL", "AMBER_ATOM_TYPE",
+    "TREE_CHAIN_CLASSIFICATION", "JOIN_ARRAY", "IROTAT", "ATOMS_PER_MOLECULE",
+    "RADII", "SCREEN", NULL
+};
+
+/// POINTERS entries that count something in every copy
+static const int SCALED_POINTERS[] = {
+    NATOM, NBONH, MBONA, NTHETH, MTHETA, NPHIH, MPHIA, NNB, NRES, NBONA,
+    NTHETA, NPHIA, NUMEXTRA, -1
+};
+
+/// Builds the topology of ncopies copies of a system, one after the other
+static void replicateParm(ParmContents const& in, int ncopies, int const grid[3],
+                          ParmContents &out) {
+    out = in;
+    out.parmData.clear();
+    int natom = in.parmData.find("POINTERS")->second[NATOM].i;
+
+    for (ParmDataMap::const_iterator it = in.parmData.begin();
+            it != in.parmData.end(); it++) {
+        string const& flag = it->first;
+        ParmDataVec const& src = it->second;
+        ParmDataVec &dst = out.parmData[flag];
+
+        int tuple = 0;
+        if (flag == "BONDS_INC_HYDROGEN" || flag == "BONDS_WITHOUT_HYDROGEN")
+            tuple = 3;
+        else if (flag == "ANGLES_INC_HYDROGEN" ||
+                 flag == "ANGLES_WITHOUT_HYDROGEN")
+            tuple = 4;
+        else if (flag == "DIHEDRALS_INC_HYDROGEN" ||
+                 flag == "DIHEDRALS_WITHOUT_HYDROGEN")
+            tuple = 5;
+
+        if (flag == "POINTERS") {
+            dst = src;
+            for (int i = 0; SCALED_POINTERS[i] >= 0; i++)
+                if ((size_t) SCALED_POINTERS[i] < dst.size())
+                    dst[SCALED_POINTERS[i]].i *= ncopies;
+        } else if (flag == "SOLVENT_POINTERS") {
+            dst = src;
+            dst[1].i *= ncopies;    // NSPM
+        } else if (flag == "BOX_DIMENSIONS") {
+            dst = src;
+            for (int i = 0; i < 3; i++)
+                dst[i+1].f *= grid[i];
+        } else if (inList(flag, REPEATED_FLAGS)) {
+            dst.reserve(src.size() * ncopies);
+            for (int c = 0; c < ncopies; c++)
+                dst.insert(dst.end(), src.begin(), src.end());
+        } else if (flag == "RESIDUE_POINTER" ||
+                   flag == "EXCLUDED_ATOMS_LIST" || tuple > 0) {
+            // Atom indices (coordinate indices, 3*i, for the valence terms).
+            // The 0 placeholders of atoms without exclusions stay 0
+            dst.resize(src.size() * ncopies);
+            size_t n = 0;
+            for (int c = 0; c < ncopies; c++) {
+                int offset = (tuple > 0 ? 3 : 1) * natom * c;
+                for (size_t i = 0; i < src.size(); i++, n++) {
+                    dst[n] = src[i];
+                    if (tuple > 0 && (int) (i % tuple) == tuple - 1)
+                        continue;   // parameter index
+                    if (flag == "EXCLUDED_ATOMS_LIST" && src[i].i == 0)
+                        continue;
+                    dst[n].i = shiftIndex(src[i].i, offset);
+                }
+            }
+        } else {
+            dst = src;              // parameter tables, title, ...
+        }
+    }
+}
+
+/// Tiles the coordinates (and velocities) of the template on the grid
+static void replicateFrame(AmberCoordinateFrame const& in, int const grid[3],
+                           bool periodic, AmberCoordinateFrame &out) {
+    if (periodic) {
+        in.tile(grid[0], grid[1], grid[2], out);
+        return;
+    }
+    vector<OpenMM::Vec3> const& crd = in.getPositions();
+    OpenMM::Vec3 lo = crd[0], hi = crd[0];
+    for (size_t i = 1; i < crd.size(); i++)
+        for (int d = 0; d < 3; d++) {
+            lo[d] = min(lo[d], crd[i][d]);
+            hi[d] = max(hi[d], crd[i][d]);
+        }
+    OpenMM::Vec3 spacing = hi - lo + OpenMM::Vec3(PROTEIN_MARGIN, PROTEIN_MARGIN,
+                                                  PROTEIN_MARGIN);
+    in.tile(grid[0], grid[1], grid[2], spacing, out);
+}
+
+/// Writes a NetCDF restart of the frame. Without NetCDF support (or if the
+/// file cannot be written) there is no NetCDF stage
+static void writeNetCDF(string const& fname, AmberCoordinateFrame const& frame,
+                        bool periodic) {
+#ifdef HAS_NETCDF
+    try {
+        AmberNetCDFFile file(AmberNetCDFFile::RESTART);
+        bool hasVel = !frame.getVelocities().empty();
+        file.writeFile(fname, frame.getNatom(), true, hasVel, false, periodic,
+                       false, 0, "PipelineBench synthetic system",
+                       "PipelineBench");
+        file.setCoordinates(frame.getPositions());
+        if (hasVel)
+            file.setVelocities(frame.getVelocities());
+        if (periodic) {
+            file.setCellLengths(frame.getBoxA(), frame.getBoxB(),
+                                frame.getBoxC());
+            file.setCellAngles(frame.getBoxAlpha(), frame.getBoxBeta(),
+                               frame.getBoxGamma());
+        }
+        file.close();
+    } catch (AmberCrdError &e) {
+        fprintf(stderr, "Skipping NetCDF restarts: %s\n", e.what());
+        remove(fname.c_str());
+    }
+#endif
+}
+
+/// Generates one system, returning its number of atoms
+static int generate(SystemKind const& kind, int target, string const& base) {
+    ParmContents parm;
+    string prmtop = string("../test/files/") + kind.prmtop;
+    if (readparm(prmtop, parm.flagList, parm.parmData, parm.parmComments,
+                 parm.unkParmData, parm.parmFormats, parm.version) != OK) {
+        fprintf(stderr, "Could not read %s\n", prmtop.c_str());
+        exit(1);
+    }
+    AmberCoordinateFrame frame;
+    frame.readRst7(string("../test/files/") + kind.rst7);
+
+    int grid[3];
+    int ncopies = tileGrid((double) target / frame.getNatom(), grid);
+    ParmContents big;
+    replicateParm(parm, ncopies, grid, big);
+    if (writeparm(base + ".parm7", big.flagList, big.parmData,
+                  big.parmComments, big.unkParmData, big.parmFormats,
+                  big.version) != OK) {
+        fprintf(stderr, "Could not write %s.parm7\n", base.c_str());
+        exit(1);
+    }
+
+    AmberCoordinateFrame bigFrame;
+    replicateFrame(frame, grid, kind.periodic, bigFrame);
+    bigFrame.writeRst7(base + ".rst7");
+    writeNetCDF(base + ".ncrst", bigFrame, kind.periodic);
+    return bigFrame.getNatom();
+}
+
+/* Pipeline */
+
+static void report(FILE *out, StageResult const& r) {
+    fprintf(out, "%s %d %s %.6f %.3f %.1f\n", r.system.c_str(), r.natom,
+            r.stage.c_str(), r.seconds, r.megabytes, r.rssMB);
+    fflush(out);
+}
+
+/// Loads a generated system stage by stage, reporting each one to out
+static void runPipeline(SystemKind const& kind, int natom, string const& base,
+                        FILE *out) {
+    StageResult r;
+    r.system = kind.name;
+    r.natom = natom;
+    double start;
+
+    start = now();
+    AmberParm parm(base + ".parm7");
+    r.stage = "prmtop";
+    r.seconds = now() - start;
+    r.megabytes = fileMB(base + ".parm7");
+    r.rssMB = peakRssMB();
+    report(out, r);
+
+    start = now();
+    AmberCoordinateFrame frame;
+    frame.readRst7(base + ".rst7");
+    r.stage = "rst7";
+    r.seconds = now() - start;
+    r.megabytes = fileMB(base + ".rst7");
+    r.rssMB = peakRssMB();
+    report(out, r);
+
+    if (fileMB(base + ".ncrst") > 0) {
+        start = now();
+        AmberCoordinateFrame ncframe;
+        ncframe.readRst7(base + ".ncrst");
+        r.stage = "ncrst";
+        r.seconds = now() - start;
+        r.megabytes = fileMB(base + ".ncrst");
+        r.rssMB = peakRssMB();
+        report(out, r);
+    }
+
+    start = now();
+    OpenMM::System *system;
+    if (kind.periodic)
+        system = parm.createSystem(OpenMM::NonbondedForce::PME, 8.0);
+    else
+        system = parm.createSystem(OpenMM::NonbondedForce::CutoffNonPeriodic,
+                                   20.0, "None", false, "OBC2");
+    r.stage = "createSystem";
+    r.seconds = now() - start;
+    r.megabytes = 0;
+    r.rssMB = peakRssMB();
+    report(out, r);
+
+    start = now();
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= NANOMETER_PER_ANGSTROM;
+    OpenMM::VerletIntegrator integrator(0.002);
+    OpenMM::Context *context = new OpenMM::Context(*system, integrator);
+    if (kind.periodic) {
+        UnitCell cell(frame.getBoxA(), frame.getBoxB(), frame.getBoxC(),
+                      frame.getBoxAlpha(), frame.getBoxBeta(),
+                      frame.getBoxGamma());
+        context->setPeriodicBoxVectors(cell.getVectorA()/10,
+                                       cell.getVectorB()/10,
+                                       cell.getVectorC()/10);
+    }
+    context->setPositions(positions);
+    context->getState(OpenMM::State::Energy);
+    r.stage = "energy";
+    r.seconds = now() - start;
+    r.rssMB = peakRssMB();
+    report(out, r);
+
+    delete context;
+    delete system;
+}
+
+/// Runs func(arg) in a child process (so every system starts from a clean
+/// heap and its own peak RSS), collecting the lines it writes. Returns false
+/// if the child failed
+template <typename Func>
+static bool inChild(Func func, vector<string> &lines) {
+    int fds[2];
+    if (pipe(fds) != 0) return false;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) return false;
+    if (pid == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        try {
+            func(out);
+        } catch (exception &e) {
+            fprintf(stderr, "%s\n", e.what());
+            _exit(1);
+        }
+        fclose(out);
+        _exit(0);
+    }
+    close(fds[1]);
+    FILE *in = fdopen(fds[0], "r");
+    char buf[512];
+    while (fgets(buf, sizeof(buf), in) != NULL)
+        lines.push_back(buf);
+    fclose(in);
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+namespace {
+struct Generate {
+    SystemKind const* kind;
+    int target;
+    string base;
+    void operator()(FILE *out) const {
+        fprintf(out, "%d\n", generate(*kind, target, base));
+    }
+};
+
+struct Pipeline {
+    SystemKind const* kind;
+    int natom;
+    string base;
+    void operator()(FILE *out) const {runPipeline(*kind, natom, base, out);}
+};
+}
+
+static bool parseResult(string const& line, StageResult &r) {
+    char system[64], stage[64];
+    if (sscanf(line.c_str(), "%63s %d %63s %lf %lf %lf", system, &r.natom,
+               stage, &r.seconds, &r.megabytes, &r.rssMB) != 6)
+        return false;
+    r.system = system;
+    r.stage = stage;
+    return true;
+}
+
+static void removeFiles(string const& base) {
+    remove((base + ".parm7").c_str());
+    remove((base + ".rst7").c_str());
+    remove((base + ".ncrst").c_str());
+}
+
+int main(int argc, char** argv) {
+
+    int maxAtoms = 2000000;
+    double tolerance = 0.25;
+    const char* output = NULL;
+    const char* baseline = NULL;
+    bool keep = false;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-max") == 0 && i + 1 < argc) {
+            maxAtoms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-baseline") == 0 && i + 1 < argc) {
+            baseline = argv[++i];
+        } else if (strcmp(argv[i], "-tolerance") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-keep") == 0) {
+            keep = true;
+        } else {
+            fprintf(stderr, "Usage: %s [-max natom] [-o results] "
+                    "[-baseline results] [-tolerance fraction] [-keep]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+
+    vector<StageResult> results;
+    printf("%-8s %9s %-13s %10s %10s %12s %14s\n", "System", "Atoms",
+           "Stage", "Time (s)", "MB/s", "katoms/s", "Peak RSS (MB)");
+    for (size_t k = 0; k < sizeof(SYSTEM_KINDS) / sizeof(SYSTEM_KINDS[0]);
+            k++) {
+        for (size_t s = 0; s < sizeof(SYSTEM_SIZES) / sizeof(int); s++) {
+            if (SYSTEM_SIZES[s] > maxAtoms) break;
+            char base[64];
+            sprintf(base, "PipelineBench_%s_%d", SYSTEM_KINDS[k].name,
+                    SYSTEM_SIZES[s]);
+
+            vector<string> lines;
+            Generate gen = {&SYSTEM_KINDS[k], SYSTEM_SIZES[s], base};
+            if (!inChild(gen, lines) || lines.size() != 1) {
+                fprintf(stderr, "Could not generate %s\n", base);
+                return 1;
+            }
+            Pipeline pipeline = {&SYSTEM_KINDS[k], atoi(lines[0].c_str()),
+                                 base};
+            lines.clear();
+            bool ok = inChild(pipeline, lines);
+            if (!keep) removeFiles(base);
+            for (size_t i = 0; i < lines.size(); i++) {
+                StageResult r;
+                if (!parseResult(lines[i], r)) continue;
+                results.push_back(r);
+                printf("%-8s %9d %-13s %10.3f ", r.system.c_str(), r.natom,
+                       r.stage.c_str(), r.seconds);
+                if (r.megabytes > 0)
+                    printf("%10.1f ", r.megabytes / r.seconds);
+                else
+                    printf("%10s ", "-");
+                printf("%12.1f %14.1f\n", r.natom / r.seconds / 1e3, r.rssMB);
+            }
+            if (!ok) {
+                fprintf(stderr, "Loading %s failed\n", base);
+                return 1;
+            }
+        }
+    }
+
+    if (output != NULL) {
+        FILE *fp = fopen(output, "w");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not write %s\n", output);
+            return 1;
+        }
+        for (size_t i = 0; i < results.size(); i++)
+            report(fp, results[i]);
+        fclose(fp);
+    }
+
+    bool ok = true;
+    if (baseline != NULL) {
+        FILE *fp = fopen(baseline, "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Could not read %s\n", baseline);
+            return 1;
+        }
+        char buf[512];
+        while (fgets(buf, sizeof(buf), fp) != NULL) {
+            StageResult old;
+            if (!parseResult(buf, old)) continue;
+            for (size_t i = 0; i < results.size(); i++) {
+                StageResult const& r = results[i];
+                if (r.system != old.system || r.natom != old.natom ||
+                        r.stage != old.stage)
+                    continue;
+                // Ignore differences too small to time reliably
+                if (r.seconds > old.seconds * (1 + tolerance) &&
+                        r.seconds - old.seconds > 0.01) {
+                    printf("REGRESSION: %s %d %s took %.3f s (baseline %.3f s)"
+                           "\n", r.system.c_str(), r.natom, r.stage.c_str(),
+                           r.seconds, old.seconds);
+                    ok = false;
+                }
+            }
+        }
+        fclose(fp);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,242 @@
+/** ProtonationBench.cpp
+ *
+ * Measures what a protonation state change costs when the System is rebuilt
+ * with createSystem (as constant pH codes without incremental updates do)
+ * compared to a ProtonationStateUpdater, which rewrites only the charges and
+ * 1-4 exceptions of the titrating site, and how many Monte Carlo protonation
+ * moves per second ProtonationSampler makes (each one pushing the charges to
+ * the context and evaluating the nonbonded energy). Then the energy change of
+ * a move from GBElectrostatics, which sums over the pairs of the changing
+ * atoms only, is timed against a context energy evaluation, and its Born radii
+ * are timed with and without a cutoff. Rounds of 1, 10 and 100 moves are
+ * timed with context and native energies, the native ones recomputing the
+ * Born radii every round, and the number of moves per round at which native
+ * moves break even (see ProtonationSampler::setNativeMinMoves) is printed.
+ * How the two energy evaluations compare depends on the OpenMM platform, so
+ * only a run against a real one says what a native move gains. Last, sweeps, which move every site once, are measured
+ * in context energy evaluations per sweep, site moves per second, and the
+ * fraction of site moves accepted: with context energies, with native ones,
+ * and with native ones and a 12 A cutoff, where sites farther apart than the
+ * cutoff are evaluated in parallel batches.
+ *
+ * Usage: ProtonationBench [prmtop rst7 cpin] [seconds per measurement]
+ *
+ * The default system is trx with the titratable sites of the tests, in
+ * implicit solvent (HCT).
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static OpenMM::System* buildSystem(AmberParm &parm, double cutoff=0.0) {
+    return parm.createSystem(cutoff > 0 ?
+                             OpenMM::NonbondedForce::CutoffNonPeriodic :
+                             OpenMM::NonbondedForce::NoCutoff, cutoff,
+                             string("None"), false, string("HCT"));
+}
+
+// Runs sweeps for the given time and prints a row of the sweeps table
+static void timeSweeps(const char* label, ProtonationSampler &sampler,
+                       int nsite, double seconds) {
+    sampler.resetStatistics();
+    long nsweeps = 0;
+    double start = now(), elapsed;
+    do {
+        sampler.attemptSweep();
+        nsweeps++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    long nmoves = 0, naccepted = 0;
+    for (int i = 0; i < nsite; i++) {
+        nmoves += sampler.getNumAttempts(i);
+        naccepted += sampler.getNumAccepted(i);
+    }
+    printf("%-22s %14.2f %14.1f %14.1f\n", label,
+           (double) sampler.getNumEvaluations() / nsweeps,
+           nsweeps * nsite / elapsed, 100.0 * naccepted / nmoves);
+}
+
+int main(int argc, char** argv) {
+    string prmtop = argc > 3 ? argv[1] : "../test/files/trx.prmtop";
+    string rst7 = argc > 3 ? argv[2] : "../test/files/trx.inpcrd";
+    string cpin = argc > 3 ? argv[3] : "../test/files/trx.cpin";
+    double seconds = argc > 4 ? atof(argv[4]) : argc == 2 ? atof(argv[1]) : 0.5;
+
+    AmberParm parm(prmtop);
+    TitratableSites sites(parm, cpin);
+    printf("%s: %d atoms, %d titratable sites\n\n", prmtop.c_str(),
+           parm.getNumAtoms(), sites.size());
+    if (sites.empty()) {
+        fprintf(stderr, "There are no titratable sites\n");
+        return 1;
+    }
+
+    // Rebuilding the whole system for every change
+    int nbuilt = 0;
+    double start = now(), elapsed;
+    do {
+        delete buildSystem(parm);
+        nbuilt++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double trebuild = elapsed / nbuilt;
+
+    // Toggling one site after another between its first two states
+    OpenMM::System *system = buildSystem(parm);
+    ProtonationStateUpdater updater(sites, *system);
+    long nmoves = 0;
+    start = now();
+    do {
+        for (int i = 0; i < sites.size(); i++) {
+            int state = updater.getState(i);
+            updater.setState(i, (state + 1) % sites.getNumStates(i));
+        }
+        nmoves += sites.size();
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double tupdate = elapsed / nmoves;
+    delete system;
+
+    printf("%-28s %14s\n", "per protonation change", "time (us)");
+    printf("%-28s %14.3f\n", "createSystem rebuild", trebuild * 1e6);
+    printf("%-28s %14.3f\n", "ProtonationStateUpdater", tupdate * 1e6);
+    printf("%-28s %13.0fx\n", "speedup", trebuild / tupdate);
+
+    // Monte Carlo moves at pH 7 on the default platform
+    AmberCoordinateFrame frame;
+    frame.readRst7(rst7);
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= NANOMETER_PER_ANGSTROM;
+    system = buildSystem(parm);
+    OpenMM::VerletIntegrator integrator(0.002);
+    OpenMM::Context context(*system, integrator);
+    context.setPositions(positions);
+    ProtonationSampler sampler(sites, *system, context, 7.0, 300.0, 1);
+    nmoves = 0;
+    long naccepted = 0;
+    start = now();
+    do {
+        naccepted += sampler.attemptMoves(10);
+        nmoves += 10;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    printf("\nMonte Carlo moves at pH 7: %.1f moves/s (%.1f%% accepted)\n",
+           nmoves / elapsed, 100.0 * naccepted / nmoves);
+
+    // One context energy evaluation against one native energy change
+    long nevals = 0;
+    start = now();
+    do {
+        context.getState(OpenMM::State::Energy, false,
+                         1 << AmberParm::NONBONDED_FORCE_GROUP);
+        nevals++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double tcontext = elapsed / nevals;
+
+    GBElectrostatics gb(parm, "HCT");
+    start = now();
+    gb.setPositions(frame.getPositions());
+    double tradii = now() - start;
+    GBElectrostatics gbcut(parm, "HCT", 12.0);
+    start = now();
+    gbcut.setPositions(frame.getPositions());
+    double tradiicut = now() - start;
+    vector<double> const& charges = parm.getAtomTable().charges();
+    double total = 0;
+    nevals = 0;
+    start = now();
+    do {
+        for (int i = 0; i < sites.size(); i++)
+            total += gb.getEnergyChange(charges, sites.getFirstAtom(i),
+                                        sites.getEndAtom(i),
+                                        sites.getCharges(i, 1));
+        nevals += sites.size();
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double tnative = elapsed / nevals;
+    if (total != total) {
+        fprintf(stderr, "Native energy changes are not numbers\n");
+        return 1;
+    }
+
+    printf("\n%-28s %14s\n", "per move energy", "time (us)");
+    printf("%-28s %14.3f\n", "Context nonbonded energy", tcontext * 1e6);
+    printf("%-28s %14.3f\n", "GBElectrostatics change", tnative * 1e6);
+    printf("%-28s %14.3f\n", "context / native", tcontext / tnative);
+    printf("%-28s %14.3f\n", "Born radii (per positions)", tradii * 1e6);
+    printf("%-28s %14.3f\n", "Born radii, 12 A cutoff", tradiicut * 1e6);
+
+    /* A round of moves as attemptMoves makes it, with context energies and
+     * with native ones, where every round also gets the positions from the
+     * context and recomputes the Born radii
+     */
+    nevals = 0;
+    start = now();
+    do {
+        context.getState(OpenMM::State::Positions);
+        nevals++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double tpositions = elapsed / nevals;
+    printf("\n%-22s %14s %14s\n", "per round of moves", "context (us)",
+           "native (us)");
+    const int round_sizes[] = {1, 10, 100};
+    for (int r = 0; r < 3; r++) {
+        double tround[2];
+        for (int native = 0; native < 2; native++) {
+            sampler.setEvaluator(native ? &gb : NULL);
+            long nrounds = 0;
+            start = now();
+            do {
+                sampler.attemptMoves(round_sizes[r]);
+                nrounds++;
+                elapsed = now() - start;
+            } while (elapsed < seconds);
+            tround[native] = elapsed / nrounds;
+        }
+        char label[32];
+        sprintf(label, "%d moves", round_sizes[r]);
+        printf("%-22s %14.1f %14.1f\n", label, tround[0] * 1e6,
+               tround[1] * 1e6);
+    }
+    if (tcontext > tnative)
+        printf("native break-even: %.1f moves per round\n",
+               (tpositions + tradii) / (tcontext - tnative));
+    else
+        printf("native break-even: never (a context energy is faster)\n");
+
+    // Sweeps with context energies, native ones, and native ones with a
+    // cutoff beyond which sites are batched
+    printf("\n%-22s %14s %14s %14s\n", "sweeps at pH 7", "evals/sweep",
+           "site moves/s", "accepted (%)");
+    sampler.setEvaluator(NULL);
+    timeSweeps("context", sampler, sites.size(), seconds);
+    sampler.setEvaluator(&gb);
+    timeSweeps("native", sampler, sites.size(), seconds);
+    OpenMM::System *cut = buildSystem(parm, 12.0);
+    OpenMM::VerletIntegrator cut_integrator(0.002);
+    OpenMM::Context cut_context(*cut, cut_integrator);
+    cut_context.setPositions(positions);
+    ProtonationSampler batched(sites, *cut, cut_context, 7.0, 300.0, 1);
+    batched.setEvaluator(&gbcut);
+    timeSweeps("native, 12 A cutoff", batched, sites.size(), seconds);
+    delete cut;
+    delete system;
+
+    return 0;
+}
@@ -0,0 +1,172 @@
+/** ViewBench.cpp
+ *
+ * Measures what the copying topology accessors of AmberParm (Atoms(), Bonds(),
+ * ResiduePointers(), ...) cost compared to the read-only views that replace
+ * them, both per call and in the per-residue loop typical of analysis and
+ * constant pH code, which calls the accessors once per residue.
+ *
+ * Usage: ViewBench [prmtop] [seconds per measurement]
+ *
+ * The default topology is the 4096wat water box from the tests. Larger systems
+ * (e.g., the ones PipelineBench -keep leaves behind) show the quadratic cost
+ * of the copying loop more dramatically.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+/// Keeps the compiler from discarding the work being timed
+static volatile double sink;
+
+/// Benchmarks for one accessor: each returns a value that depends on the data
+typedef double (*AccessFn)(AmberParm const& parm);
+
+static double copyAtoms(AmberParm const& parm) {
+    AtomList atoms = parm.Atoms();
+    return atoms.back().getCharge();
+}
+static double viewAtoms(AmberParm const& parm) {
+    AtomTable const& atoms = parm.getAtomTable();
+    return atoms.charges()[atoms.size()-1];
+}
+static double copyBonds(AmberParm const& parm) {
+    BondList bonds = parm.Bonds();
+    return bonds.empty() ? 0 : bonds.back().getForceConstant();
+}
+static double viewBonds(AmberParm const& parm) {
+    BondTable const& bonds = parm.getBonds();
+    return bonds.empty() ? 0 : bonds[bonds.size()-1].getForceConstant();
+}
+static double copyResiduePointers(AmberParm const& parm) {
+    return parm.ResiduePointers().back();
+}
+static double viewResiduePointers(AmberParm const& parm) {
+    return parm.getResiduePointers().back();
+}
+static double copyResidueLabels(AmberParm const& parm) {
+    return parm.ResidueLabels().back().size();
+}
+static double viewResidueLabels(AmberParm const& parm) {
+    return parm.getResidueLabels().back().size();
+}
+
+/// Seconds per call of fn, repeating it for about the given time
+static double timeCalls(AccessFn fn, AmberParm const& parm, double seconds) {
+    double start = now(), elapsed;
+    long ncalls = 0;
+    do {
+        sink = fn(parm);
+        ncalls++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    return elapsed / ncalls;
+}
+
+/* Net charge of every residue, calling the accessors once per residue. Only
+ * the first nres residues are done so that the copying version finishes
+ */
+static double residueChargesCopy(AmberParm const& parm, int nres) {
+    double total = 0;
+    for (int r = 0; r < nres; r++) {
+        vector<int> pointers = parm.ResiduePointers();
+        AtomList atoms = parm.Atoms();
+        for (int i = pointers[r]; i < pointers[r+1]; i++)
+            total += atoms[i].getCharge();
+    }
+    return total;
+}
+
+static double residueChargesView(AmberParm const& parm, int nres) {
+    double total = 0;
+    for (int r = 0; r < nres; r++) {
+        ResidueRef res = parm.getResidue(r);
+        vector<double> const& charges = parm.getAtomTable().charges();
+        for (int i = res.getFirstAtom(); i < res.getEndAtom(); i++)
+            total += charges[i];
+    }
+    return total;
+}
+
+int main(int argc, char** argv) {
+    string fname = argc > 1 ? argv[1] : "../test/files/4096wat.parm7";
+    double seconds = argc > 2 ? atof(argv[2]) : 0.5;
+
+    AmberParm parm(fname);
+    int nres = parm.getNumResidues();
+    printf("%s: %d atoms, %d bonds, %d residues\n\n", fname.c_str(),
+           parm.getNumAtoms(), (int) parm.getBonds().size(), nres);
+    if (nres == 0) {
+        fprintf(stderr, "The topology has no residues\n");
+        return 1;
+    }
+
+    struct {
+        const char* name;
+        AccessFn copy, view;
+    } accessors[] = {
+        {"atoms", copyAtoms, viewAtoms},
+        {"bonds", copyBonds, viewBonds},
+        {"residue pointers", copyResiduePointers, viewResiduePointers},
+        {"residue labels", copyResidueLabels, viewResidueLabels},
+    };
+
+    printf("%-18s %14s %14s %10s\n", "accessor", "copy (us)", "view (us)",
+           "speedup");
+    for (size_t i = 0; i < sizeof(accessors) / sizeof(accessors[0]); i++) {
+        double tcopy = timeCalls(accessors[i].copy, parm, seconds);
+        double tview = timeCalls(accessors[i].view, parm, seconds);
+        printf("%-18s %14.3f %14.5f %9.0fx\n", accessors[i].name, tcopy * 1e6,
+               tview * 1e6, tcopy / tview);
+    }
+
+    // The copying loop is quadratic, so time as many residues as fit in the
+    // time budget and extrapolate to the whole system
+    int ncopied = 0;
+    double start = now(), elapsed = 0, copyCharge = 0;
+    while (ncopied < nres && elapsed < seconds) {
+        ncopied = ncopied == 0 ? 1 : min(2 * ncopied, nres);
+        start = now();
+        copyCharge = residueChargesCopy(parm, ncopied);
+        elapsed = now() - start;
+    }
+    double tcopy = elapsed * nres / ncopied;
+
+    int nloops = 0;
+    double viewCharge = 0;
+    start = now();
+    do {
+        viewCharge = residueChargesView(parm, nres);
+        nloops++;
+        elapsed = now() - start;
+    } while (elapsed < seconds);
+    double tview = elapsed / nloops;
+
+    if (viewCharge != residueChargesView(parm, nres) ||
+            (ncopied == nres && copyCharge != viewCharge)) {
+        fprintf(stderr, "Residue charges differ between copies and views\n");
+        return 1;
+    }
+    sink = copyCharge;
+
+    printf("\nPer-residue charge loop over %d residues:\n", nres);
+    printf("  copying accessors %12.4f s%s\n", tcopy,
+           ncopied < nres ? " (extrapolated)" : "");
+    printf("  views             %12.6f s\n", tview);
+    printf("  speedup           %12.0fx\n", tcopy / tview);
+
+    return 0;
+}
@@ -0,0 +1,165 @@
+/** WriteParmBench.cpp
+ *
+ * Measures how fast writeparm writes a topology file compared to reading the
+ * same file with readparm, and to the straightforward writer that calls
+ * fprintf once per value. Every written file is checked to be byte-for-byte
+ * identical to the one that was read.
+ *
+ * Usage: WriteParmBench [seconds per measurement]
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <sys/time.h>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+#define OUTPUT_FILE "WriteParmBench.parm7"
+
+static double now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+typedef struct {
+    vector<string> flagList;
+    ParmDataMap parmData;
+    ParmStringMap parmComments, unkParmData;
+    ParmFormatMap parmFormats;
+    string version;
+} ParmContents;
+
+static bool readContents(string const& fname, ParmContents &parm) {
+    parm = ParmContents();
+    return readparm(fname, parm.flagList, parm.parmData, parm.parmComments,
+                    parm.unkParmData, parm.parmFormats, parm.version) == OK;
+}
+
+/// The writer a first implementation would use: one fprintf per value
+static bool fprintfWriter(ParmContents const& parm) {
+    FILE *fp = fopen(OUTPUT_FILE, "w");
+    if (fp == NULL) return false;
+    fprintf(fp, "%%VERSION  %s\n", parm.version.c_str());
+    for (size_t n = 0; n < parm.flagList.size(); n++) {
+        string const& flag = parm.flagList[n];
+        ParmFormatType const& fmt = parm.parmFormats.find(flag)->second;
+        fprintf(fp, "%%FLAG %s\n", flag.c_str());
+        ParmStringMap::const_iterator cit = parm.parmComments.find(flag);
+        if (cit != parm.parmComments.end())
+            for (size_t i = 0; i < cit->second.size(); i++)
+                fprintf(fp, "%%COMMENT %s\n", cit->second[i].c_str());
+        fprintf(fp, "%%FORMAT(%s)\n", fmt.fmt.c_str());
+        ParmDataMap::const_iterator dit = parm.parmData.find(flag);
+        ParmStringMap::const_iterator uit = parm.unkParmData.find(flag);
+        if (dit != parm.parmData.end() && !dit->second.empty()) {
+            int ncols, width, prec = 0;
+            string up = Amber::upper(fmt.fmt);
+            if (sscanf(up.c_str(), "%dA%d", &ncols, &width) != 2 &&
+                    sscanf(up.c_str(), "%dI%d", &ncols, &width) != 2 &&
+                    sscanf(up.c_str(), "%dE%d.%d", &ncols, &width, &prec) != 3)
+                return false;
+            ParmDataVec const& data = dit->second;
+            for (size_t i = 0; i < data.size(); i++) {
+                if (fmt.dataType == HOLLERITH)
+                    fprintf(fp, "%-*.*s", width, width, data[i].c);
+                else if (fmt.dataType == INTEGER)
+                    fprintf(fp, "%*d", width, data[i].i);
+                else
+                    fprintf(fp, "%*.*E", width, prec, data[i].f);
+                if ((i + 1) % ncols == 0 || i + 1 == data.size())
+                    fprintf(fp, "\n");
+            }
+        } else if (uit != parm.unkParmData.end()) {
+            int ncols, width = 0;
+            if (sscanf(Amber::upper(fmt.fmt).c_str(), "%dA%d", &ncols, &width) != 2)
+                width = 0;
+            for (size_t i = 0; i < uit->second.size(); i++) {
+                string const& line = uit->second[i];
+                int pad = width > 0 && line.size() % width != 0 ?
+                          width - line.size() % width : 0;
+                fprintf(fp, "%s%*s\n", line.c_str(), pad, "");
+            }
+        } else {
+            fprintf(fp, "\n");
+        }
+    }
+    return fclose(fp) == 0;
+}
+
+static bool sameFile(string const& a, string const& b) {
+    MappedFile fa, fb;
+    if (!fa.open(a) || !fb.open(b)) return false;
+    return fa.size() == fb.size() && memcmp(fa.data(), fb.data(), fa.size()) == 0;
+}
+
+int main(int argc, char** argv) {
+
+    double seconds = argc > 1 ? atof(argv[1]) : 0.5;
+    const char* prmtops[] = {"trx.prmtop", "4096wat.parm7"};
+    bool ok = true;
+
+    printf("%-16s %9s %12s %12s %12s %9s %9s\n", "File", "Size (kB)",
+           "Read (MB/s)", "fprintf", "writeparm", "vs. read",
+           "vs. fprintf");
+
+    for (size_t i = 0; i < sizeof(prmtops) / sizeof(prmtops[0]); i++) {
+        string fname = string("../test/files/") + prmtops[i];
+        ParmContents parm;
+        if (!readContents(fname, parm)) {
+            fprintf(stderr, "Could not read %s\n", fname.c_str());
+            return 1;
+        }
+        MappedFile file;
+        file.open(fname);
+        double mb = file.size() / 1.0e6;
+
+        int n = 0;
+        double start = now(), readTime;
+        do {
+            readContents(fname, parm);
+            n++;
+        } while ((readTime = now() - start) < seconds);
+        double readRate = n * mb / readTime;
+
+        n = 0;
+        start = now();
+        double printfTime;
+        do {
+            ok = fprintfWriter(parm) && ok;
+            n++;
+        } while ((printfTime = now() - start) < seconds);
+        double printfRate = n * mb / printfTime;
+        if (!sameFile(fname, OUTPUT_FILE)) {
+            printf("  fprintf writer output differs for %s\n", prmtops[i]);
+            ok = false;
+        }
+
+        n = 0;
+        start = now();
+        double writeTime;
+        do {
+            ok = writeparm(OUTPUT_FILE, parm.flagList, parm.parmData,
+                           parm.parmComments, parm.unkParmData,
+                           parm.parmFormats, parm.version) == OK && ok;
+            n++;
+        } while ((writeTime = now() - start) < seconds);
+        double writeRate = n * mb / writeTime;
+        if (!sameFile(fname, OUTPUT_FILE)) {
+            printf("  writeparm output differs for %s\n", prmtops[i]);
+            ok = false;
+        }
+
+        printf("%-16s %9.1f %12.1f %12.1f %12.1f %8.2fx %8.2fx\n", prmtops[i],
+               file.size() / 1.0e3, readRate, printfRate, writeRate,
+               writeRate / readRate, writeRate / printfRate);
+    }
+    remove(OUTPUT_FILE);
+
+    return ok ? 0 : 1;
+}
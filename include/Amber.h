@@ -7,7 +7,15 @@
 #include "amber/amber_constants.h"
 #include "amber/ambercrd.h"
 #include "amber/amberparm.h"
+#include "amber/atommask.h"
+#include "amber/constph.h"
+#include "amber/cpin.h"
 #include "amber/exceptions.h"
+#include "amber/fixedwidth.h"
+#include "amber/gbenergy.h"
+#include "amber/inputstream.h"
+#include "amber/mappedfile.h"
+#include "amber/parmsections.h"
 #include "amber/readparm.h"
 #include "amber/string_manip.h"
 #include "amber/topology.h"
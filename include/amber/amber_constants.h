@@ -17,6 +17,15 @@ static const double RADIAN_PER_DEGREE = 1 / DEGREE_PER_RADIAN;
 
 static const double AMBER_TIME_PER_PS = 20.455;
 static const double PS_PER_AMBER_TIME = 1 / AMBER_TIME_PER_PS;
+// Boltzmann's constant in kcal/mol/K, as Amber uses it
+static const double BOLTZMANN_KCAL = 1.380658e-23 * 6.0221367e23 / 4184.0;
+
+// LJ well depth in kJ/mol that createSystem gives the 1-4 exceptions without
+// one. OpenMM skips exceptions with neither a charge product nor a well depth
+// and fixes their number when a Context is made, so without it zeroing the
+// charge of a titratable proton (which often has no LJ well) would break
+// updateParametersInContext. Its energy is far below double precision
+static const double PLACEHOLDER_EPSILON = 1e-30;
 
 }; // namespace Amber
 
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include "exceptions.h"
+#include "topology.h"
 
 #include "OpenMM.h"
 
@@ -117,6 +118,35 @@ class AmberCoordinateFrame {
         /// Returns the number of atoms defined in this coordinate frame
         int getNatom(void) const {return natom_;}
 
+        /**
+         * \brief Copies the coordinates of some of the atoms into another
+         *        frame, along with the box
+         *
+         * \param keep The atoms to keep (e.g., the selection given to
+         *             AmberParm::subset for the matching topology)
+         * \param out The frame to fill. Anything it held is replaced
+         */
+        void subset(AtomSelection const& keep, AmberCoordinateFrame &out) const;
+
+        /**
+         * \brief Fills another frame with na x nb x nc copies of this one,
+         *        shifted along the box vectors
+         *
+         * Copy c = (i*nb + j)*nc + k is shifted by i, j and k box vectors and
+         * holds atoms [c*natom, (c+1)*natom), matching AmberParm::tile. The
+         * box lengths of out are scaled by na, nb and nc. Throws
+         * Amber::AmberCrdError if this frame has no box
+         */
+        void tile(int na, int nb, int nc, AmberCoordinateFrame &out) const;
+        /**
+         * \brief Like tile(na, nb, nc, out) for frames without a box, placing
+         *        the copies on an orthogonal lattice
+         *
+         * \param spacing The lattice spacing along x, y and z in angstroms
+         */
+        void tile(int na, int nb, int nc, OpenMM::Vec3 const& spacing,
+                  AmberCoordinateFrame &out) const;
+
         /**
          * \brief Reads an Amber coordinate file
          *
@@ -161,6 +191,10 @@ class AmberCoordinateFrame {
         std::vector<OpenMM::Vec3> *coordinates_;
         std::vector<OpenMM::Vec3> *velocities_;
 
+        void tile_(int na, int nb, int nc, OpenMM::Vec3 const& avec,
+                   OpenMM::Vec3 const& bvec, OpenMM::Vec3 const& cvec,
+                   AmberCoordinateFrame &out) const;
+
         void readASCII_(std::string const& filename);
         int readNetCDF_(std::string const& filename);
 
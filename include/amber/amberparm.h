@@ -10,7 +10,8 @@
 
 #include <cmath>
 #include <string>
-#include <set>
+
+#include <stdint.h>
 
 #include "topology.h"
 #include "readparm.h"
@@ -29,18 +30,21 @@ class AmberParm {
          * Optionally parses an Amber topology file
          *
          * \param filename Name of the Amber prmtop file to parse, if provided
+         * \param useCache Whether to use the binary topology cache (see
+         *                 rdparm)
          */
-        AmberParm(void) : ifbox_(0), unit_cell_(Amber::UnitCell()) {}
-        AmberParm(std::string const& filename);
-        AmberParm(const char* filename);
+        AmberParm(void) : ifbox_(0), unit_cell_(Amber::UnitCell()),
+                          graph_stale_(false) {}
+        AmberParm(std::string const& filename, bool useCache=false);
+        AmberParm(const char* filename, bool useCache=false);
 
         // Iterators
-        typedef AtomList::const_iterator atom_iterator;
-        typedef BondList::const_iterator bond_iterator;
-        typedef AngleList::const_iterator angle_iterator;
-        typedef DihedralList::const_iterator dihedral_iterator;
+        typedef AtomTable::const_iterator atom_iterator;
+        typedef BondTable::const_iterator bond_iterator;
+        typedef AngleTable::const_iterator angle_iterator;
+        typedef DihedralTable::const_iterator dihedral_iterator;
 
-        /// Iterator through atoms of this system
+        /// Iterator through atoms (as AtomRef views) of this system
         atom_iterator AtomBegin(void) const {return atoms_.begin();}
         atom_iterator AtomEnd(void) const {return atoms_.end();}
         /// Iterator through bonds of this system
@@ -120,6 +124,13 @@ class AmberParm {
          * an Amber::AmberParmError is thrown
          */
         void addBond(int i, int j, double kf, double req);
+        /**
+         * \brief Adds a new bond of an existing bond type (see addBondType)
+         *
+         * If any of the indexes or the type are out of range, an
+         * Amber::AmberParmError is thrown
+         */
+        void addBond(int i, int j, int type);
         /**
          * \brief Adds an angle to the system
          *
@@ -141,6 +152,8 @@ class AmberParm {
          * \param theteq Equilibrum angle in degrees
          */
         void addAngle(int i, int j, int k, double kf, double theteq);
+        /// Adds an angle of an existing angle type (see addAngleType)
+        void addAngle(int i, int j, int k, int type);
         /**
          * \brief Adds a dihedral to the system
          *
@@ -175,21 +188,170 @@ class AmberParm {
         void addDihedral(int i, int j, int k, int l, double kf, double phase,
                          int periodicity, double scee, double scnb,
                          bool ignore_end);
+        /// Adds a dihedral of an existing dihedral type (see addDihedralType)
+        void addDihedral(int i, int j, int k, int l, int type, bool ignore_end);
 
-        /// Returns a reference to the list of atoms in the system
-        AtomList Atoms(void) const {return atoms_;}
-        /// Returns a reference to the list of bonds in the system
-        BondList Bonds(void) const {return bonds_;}
-        /// Returns a reference to the list of angles in the system
-        AngleList Angles(void) const {return angles_;}
-        /// Returns a reference to the list of dihedrals in the system
-        DihedralList Dihedrals(void) const {return dihedrals_;}
-        /// Returns a reference to the beginning of each residue in the system
+        /* Bonded parameter types. Every bond, angle, and dihedral refers to
+         * one of these by ID, so changing a type changes all of its terms.
+         * Terms added with explicit parameters share the type of any earlier
+         * term with exactly the same parameters.
+         */
+
+        /// Adds a new bond type and returns its ID
+        int addBondType(BondType const& type) {return bonds_.addType(type);}
+        /// Adds a new angle type and returns its ID
+        int addAngleType(AngleType const& type) {
+            return angles_.addType(type);
+        }
+        /// Adds a new dihedral type and returns its ID
+        int addDihedralType(DihedralType const& type) {
+            return dihedrals_.addType(type);
+        }
+        /**
+         * \brief Changes the parameters of a bond type (and so of every bond
+         *        of that type)
+         *
+         * \param id The ID of the bond type, as used in getBonds().terms()
+         * \param type The new parameters
+         */
+        void setBondType(int id, BondType const& type);
+        void setAngleType(int id, AngleType const& type);
+        void setDihedralType(int id, DihedralType const& type);
+
+        /* Copies of the topology containers. These copy everything on each
+         * call, so prefer the views below in anything performance-sensitive
+         */
+
+        /// Returns a copy of the list of atoms in the system
+        AtomList Atoms(void) const {return atoms_.toList();}
+        /// Returns a copy of the list of bonds in the system
+        BondList Bonds(void) const {return bonds_.toList();}
+        /// Returns a copy of the list of angles in the system
+        AngleList Angles(void) const {return angles_.toList();}
+        /// Returns a copy of the list of dihedrals in the system
+        DihedralList Dihedrals(void) const {return dihedrals_.toList();}
+        /// Returns a copy of the beginning of each residue in the system
         std::vector<int> ResiduePointers(void) const {return residue_pointers_;}
-        /// Returns the list of residue names of each residue in the sysetm
+        /// Returns a copy of the residue names of each residue in the system
         std::vector<std::string> ResidueLabels(void) const {
             return residue_labels_;
         }
+
+        /* Read-only views of the topology that never copy. They are valid
+         * until the system is modified (e.g., by rdparm or add****)
+         */
+
+        /// Returns the per-atom property arrays of the system
+        AtomTable const& getAtomTable(void) const {return atoms_;}
+        /// Returns the bonds in the system and their parameter types
+        BondTable const& getBonds(void) const {return bonds_;}
+        /// Returns the angles in the system and their parameter types
+        AngleTable const& getAngles(void) const {return angles_;}
+        /// Returns the dihedrals in the system and their parameter types
+        DihedralTable const& getDihedrals(void) const {return dihedrals_;}
+        /**
+         * \brief Returns the index of the first atom of each residue, followed
+         *        by the number of atoms (so residue i spans atoms
+         *        [pointers[i], pointers[i+1]))
+         */
+        Span<int> getResiduePointers(void) const {
+            return Span<int>(residue_pointers_);
+        }
+        /// Returns the name of each residue in the system
+        Span<std::string> getResidueLabels(void) const {
+            return Span<std::string>(residue_labels_);
+        }
+
+        int getNumAtoms(void) const {return atoms_.size();}
+        int getNumResidues(void) const {return (int) residue_labels_.size();}
+
+        /// Returns residue i (from 0) as a name and a range of atoms
+        ResidueRef getResidue(int i) const {
+            return ResidueRef(i, residue_labels_[i], residue_pointers_[i],
+                              residue_pointers_[i+1]);
+        }
+
+        /**
+         * \brief Finds the residue an atom belongs to
+         *
+         * \param atom Index of the atom (from 0)
+         *
+         * \return The index of the residue, or -1 if the atom is out of range
+         *         or the system has no residues
+         */
+        int getResidueOf(int atom) const;
+
+        /**
+         * \brief Returns the bonded neighbors and the molecules of every atom
+         *
+         * The graph is built when the topology is read. After atoms or bonds
+         * are added by hand, the next call rebuilds it (so that first call
+         * must not race with other threads using the graph)
+         */
+        BondGraph const& getBondGraph(void) const {
+            if (graph_stale_) {
+                graph_.build(atoms_.size(), bonds_);
+                graph_stale_ = false;
+            }
+            return graph_;
+        }
+        /// Returns the atoms bonded to an atom, in increasing order
+        Span<int> getNeighbors(int atom) const {
+            return getBondGraph().neighbors(atom);
+        }
+        /// Number of molecules (sets of atoms connected by bonds)
+        int getNumMolecules(void) const {
+            return getBondGraph().numMolecules();
+        }
+        /// The molecule an atom belongs to (molecules are numbered in order
+        /// of their first atom)
+        int getMoleculeOf(int atom) const {
+            return getBondGraph().getMoleculeOf(atom);
+        }
+        /// The atoms of molecule m, in increasing order
+        Span<int> getMolecule(int m) const {
+            return getBondGraph().molecule(m);
+        }
+
+        /**
+         * \brief Returns a new system holding only some of the atoms
+         *
+         * \param keep The atoms to keep
+         *
+         * Atoms, residues, bonds, angles, dihedrals and exclusions are
+         * renumbered for the new system, in one linear pass through each.
+         * Bonded terms that involve any removed atom are dropped, as are
+         * residues left without atoms. The parameter types are all kept (so
+         * type IDs are the same in both systems), as is the unit cell. Use
+         * AmberCoordinateFrame::subset with the same selection for the
+         * matching coordinates.
+         */
+        AmberParm subset(AtomSelection const& keep) const;
+        /// Keeps the atoms selected by an Amber mask (see AtomMask). The mask
+        /// cannot have distance operators, which need positions
+        AmberParm subset(std::string const& mask) const;
+        /// Keeps every atom i for which keep(i) is true
+        template <class Predicate>
+        AmberParm subsetIf(Predicate keep) const {
+            AtomSelection selection(getNumAtoms());
+            for (int i = 0; i < getNumAtoms(); i++)
+                if (keep(i)) selection.set(i);
+            return subset(selection);
+        }
+        /// Removes the atoms selected by an Amber mask (e.g., ":WAT,Na+,Cl-")
+        AmberParm strip(std::string const& mask) const;
+        /**
+         * \brief Returns a system of na x nb x nc copies of this one
+         *
+         * The copies follow each other in the new system (copy c holds atoms
+         * [c*natom, (c+1)*natom)), with every topology table repeated and its
+         * atom indexes offset. Periodic cells are stacked na times along the
+         * first cell vector, nb along the second and nc along the third. Use
+         * AmberCoordinateFrame::tile with the same counts for the matching
+         * coordinates.
+         */
+        AmberParm tile(int na, int nb=1, int nc=1) const;
+
         /// Returns the UnitCell object for this system
         Amber::UnitCell getUnitCell(void) const {return unit_cell_;}
         /**
@@ -209,10 +371,11 @@ class AmberParm {
          */
         bool isExcluded(int i, int j) const {
             if (i == j) return true;
-            if (i < j) {
-                return exclusion_list_[i].count(j) > 0;
-            }
-            return exclusion_list_[j].count(i) > 0;
+            return exclusion_list_.isExcluded(i, j);
+        }
+        /// Returns the excluded pairs of the system (without 1-4 exceptions)
+        ExclusionTable const& getExclusions(void) const {
+            return exclusion_list_;
         }
 
         /**
@@ -240,9 +403,50 @@ class AmberParm {
          * Read a prmtop file and instantiate a structure from it
          *
          * \param filename Name of the prmtop file to read
+         * \param useCache If true, the parsed topology is loaded from a binary
+         *                 cache file next to the prmtop (see cacheFileName)
+         *                 when that cache was built from a prmtop with exactly
+         *                 the same contents. Otherwise the prmtop is parsed and
+         *                 the cache is (re)written if the directory is
+         *                 writable.
          */
-        void rdparm(std::string const& filename);
-        void rdparm(const char* filename);
+        void rdparm(std::string const& filename, bool useCache=false);
+        void rdparm(const char* filename, bool useCache=false);
+
+        /**
+         * \brief Returns the name of the binary cache used for a prmtop
+         *
+         * \param filename Name of the prmtop file
+         *
+         * \return Name of the cache file rdparm reads and writes
+         */
+        static std::string cacheFileName(std::string const& filename);
+
+        /**
+         * \brief Returns the atom masses after hydrogen mass repartitioning
+         *
+         * Every hydrogen bonded to a heavy atom gets the given mass, and the
+         * mass it gains is taken from that heavy atom, so the mass of each
+         * molecule is unchanged. Water molecules (one oxygen bonded to two
+         * hydrogens) and massless particles keep their masses.
+         *
+         * \param hydrogenMass Mass of the repartitioned hydrogens in daltons
+         *                     (e.g., 3.024). Zero returns the masses as is
+         *
+         * Throws Amber::AmberParmError if hydrogenMass is negative or a heavy
+         * atom would be left without mass
+         */
+        std::vector<double> getRepartitionedMasses(double hydrogenMass) const;
+
+        /**
+         * \brief Returns the residues that are water molecules
+         *
+         * A water residue has a water name (WAT, HOH, TIP3, SPC, OPC, ...) and
+         * holds one oxygen bonded to two hydrogens, plus at most two massless
+         * extra points (as in 4- and 5-site models), with no bonds to other
+         * residues.
+         */
+        std::vector<int> getWaterResidues(void) const;
 
         /**
          * \brief Creates and returns a pointer to an OpenMM::System
@@ -253,7 +457,14 @@ class AmberParm {
          * \param nonbondedCutoff Cutoff of nonbonded interactions in angstroms
          * \param constraints Can be "None", "HBonds" (for typical SHAKE), or
          *                    "AllBonds" to constrain all bonds
-         * \param rigidWater Not used right now, must be false
+         * \param rigidWater If true, make every water (see getWaterResidues)
+         *                   rigid with its two O-H distances and its H-H
+         *                   distance constrained, the form OpenMM solves with
+         *                   SETTLE. This applies for any constraints choice.
+         *                   Whatever this is, the extra points of 4- and
+         *                   5-site waters become virtual sites placed from
+         *                   the O and H atoms, and none of their bonds is
+         *                   added as a bond or a constraint
          * \param implicitSolvent Name of the GB model to use, if any. Can be
          *                        "None", "HCT", "OBC1", "OBC2", "GBn" or "GBn2"
          * \param implicitSolventKappa kappa in the Debye salt concentration
@@ -271,6 +482,10 @@ class AmberParm {
          *                            bonds. If false, don't.
          * \param useSASA If true, use the ACE SASA-based non-polar solvation
          *                free energy model for the SA part of GBSA calculations
+         * \param hydrogenMass If positive, repartition the mass of hydrogens
+         *                     to this value (in daltons; see
+         *                     getRepartitionedMasses). Together with HBonds
+         *                     constraints this permits ~4 fs time steps
          */
         OpenMM::System* createSystem(
             OpenMM::NonbondedForce::NonbondedMethod nonbondedMethod=OpenMM::NonbondedForce::NoCutoff,
@@ -286,18 +501,30 @@ class AmberParm {
             bool removeCMMotion=true,
             double ewaldErrorTolerance=0.0005,
             bool flexibleConstraints=true,
-            bool useSASA=false);
+            bool useSASA=false,
+            double hydrogenMass=0.0);
 
     private:
         int ifbox_;
-        AtomList atoms_;
-        BondList bonds_;
-        AngleList angles_;
-        DihedralList dihedrals_;
+        AtomTable atoms_;
+        BondTable bonds_;
+        AngleTable angles_;
+        DihedralTable dihedrals_;
         std::vector<int> residue_pointers_;
         std::vector<std::string> residue_labels_;
-        std::vector<std::set<int> > exclusion_list_;
+        ExclusionTable exclusion_list_;
         Amber::UnitCell unit_cell_;
+        // Derived from atoms_ and bonds_, and rebuilt after they change
+        mutable BondGraph graph_;
+        mutable bool graph_stale_;
+
+        /* Binary topology cache (parmcache.cpp). readCache_ always returns the
+         * size and content hash of the prmtop so writeCache_ can key on them
+         */
+        bool readCache_(std::string const& filename, uint64_t &hash,
+                        uint64_t &size);
+        bool writeCache_(std::string const& filename, uint64_t hash,
+                         uint64_t size) const;
 };
 
 }; // namespace Amber
@@ -0,0 +1,120 @@
+/** atommask.h
+ *
+ * Atom selections with the Amber mask syntax, compiled against an AmberParm.
+ *
+ * Supported syntax:
+ *      :{residues}     residue names or numbers (from 1), e.g. :WAT :1-250,300
+ *      @{atoms}        atom names or numbers (from 1), e.g. @CA,CB @1-20
+ *      @%{types}       atom types, e.g. @%CT,HC
+ *      ^{molecules}    molecule numbers (from 1), as in cpptraj
+ *      *               every atom
+ *      :{res}@{atoms}  the given atoms of the given residues
+ *      & | ! ( )       and, or, not, grouping (! binds tightest, then &)
+ *      X<:r X<@r       residues / atoms within r angstroms of any atom of X
+ *      X>:r X>@r       residues / atoms farther than r from every atom of X
+ *
+ * Names match exactly, except that * and = match any run of characters and ?
+ * matches any one character (e.g., @H= is every atom whose name starts with
+ * H).
+ *
+ * Everything but the distance operators depends on the topology alone, so it
+ * is evaluated once when the mask is compiled. Evaluating the mask for a frame
+ * then costs a few bitwise operations over the atoms plus a grid search for
+ * each distance operator.
+ */
+#ifndef ATOMMASK_H
+#define ATOMMASK_H
+
+#include <string>
+#include <vector>
+
+#include "amber/amberparm.h"
+#include "OpenMM.h"
+
+namespace Amber {
+
+/**
+ * An Amber mask compiled against a topology. Compile it once and evaluate it
+ * as often as needed (e.g., once per frame of a trajectory). The mask refers to
+ * the AmberParm it was compiled with, which must outlive it and not change.
+ */
+class AtomMask {
+    public:
+        /**
+         * \brief Compiles a mask
+         *
+         * \param parm The topology the mask selects atoms from
+         * \param expression The mask, e.g. ":1-250&!@H="
+         *
+         * Throws Amber::AmberMaskError if the expression is malformed
+         */
+        AtomMask(AmberParm const& parm, std::string const& expression);
+
+        std::string const& getExpression(void) const {return expression_;}
+
+        /// Whether the mask has distance operators (and so needs positions)
+        bool needsPositions(void) const;
+
+        /**
+         * \brief Selects the atoms of a mask without distance operators
+         *
+         * Throws Amber::AmberMaskError if the mask needs positions
+         */
+        AtomSelection evaluate(void) const;
+        /**
+         * \brief Selects the atoms for one frame
+         *
+         * \param positions Positions of every atom, in angstroms
+         */
+        AtomSelection evaluate(std::vector<OpenMM::Vec3> const& positions) const;
+        /// Like evaluate(positions), reusing the storage of result
+        void evaluate(std::vector<OpenMM::Vec3> const& positions,
+                      AtomSelection &result) const;
+
+    private:
+        /* The compiled mask is a tree whose leaves are fixed selections. Any
+         * operation on fixed selections alone is done while compiling, so
+         * only the distance operators (and what sits above them) remain
+         */
+        enum NodeKind {FIXED, AND, OR, NOT, WITHIN};
+        struct Node {
+            NodeKind kind;
+            int left, right;
+            AtomSelection value;    // FIXED
+            double cutoff;          // WITHIN
+            bool byResidue;         // WITHIN: select whole residues
+            bool outside;           // WITHIN: select what is NOT within
+        };
+
+        AmberParm const* parm_;
+        std::string expression_;
+        std::vector<Node> nodes_;
+        int root_;
+
+        // Parser (atommask.cpp)
+        size_t pos_;
+        int parseOr_(void);
+        int parseAnd_(void);
+        int parseUnary_(void);
+        int parsePrimary_(void);
+        int parseDistance_(int node);
+        AtomSelection parseResidues_(void);
+        AtomSelection parseAtoms_(void);
+        AtomSelection parseMolecules_(void);
+        std::vector<std::string> parseList_(void);
+        void skipSpace_(void);
+        void error_(std::string const& msg) const;
+
+        int fixed_(AtomSelection const& value);
+        int combine_(NodeKind kind, int left, int right);
+
+        void evaluate_(int node, std::vector<OpenMM::Vec3> const* positions,
+                       AtomSelection &result) const;
+        void within_(Node const& node, AtomSelection const& reference,
+                     std::vector<OpenMM::Vec3> const& positions,
+                     AtomSelection &result) const;
+};
+
+}; // namespace Amber
+
+#endif /* ATOMMASK_H */
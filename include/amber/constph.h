@@ -0,0 +1,292 @@
+/** constph.h
+ *
+ * Changing the protonation states of titratable sites in an OpenMM::System
+ * built by AmberParm::createSystem without rebuilding it.
+ *
+ * A protonation change touches only the charges of the atoms of one site (in
+ * the NonbondedForce and, with implicit solvent, the CustomGBForce) and the
+ * charge products of the 1-4 exceptions those atoms take part in. The updater
+ * keeps the indexes of those parameters, so a change costs a few dozen
+ * parameter writes, and the forces are then pushed to a Context with
+ * updateParametersInContext.
+ *
+ * ProtonationSampler builds the Monte Carlo protonation moves of implicit
+ * solvent constant pH MD on top of it.
+ */
+#ifndef CONSTPH_H
+#define CONSTPH_H
+
+#include <stdint.h>
+#include <vector>
+
+#include "amber/cpin.h"
+#include "amber/gbenergy.h"
+#include "OpenMM.h"
+
+namespace Amber {
+
+class ProtonationStateUpdater {
+    public:
+        /**
+         * \brief Binds titratable sites to a system and sets every site to its
+         *        initial state
+         *
+         * \param sites The titratable sites, which must outlive the updater
+         * \param system A system made by createSystem from the topology the
+         *               sites were read for. The updater changes its forces,
+         *               so it must outlive the updater as well
+         *
+         * OpenMM stops computing a 1-4 exception whose charge product and
+         * LJ well depth are both zero, and a Context rejects any change to
+         * how many it computes. createSystem gives the 1-4 exceptions without
+         * an LJ well a tiny placeholder one (PLACEHOLDER_EPSILON) so that
+         * zeroing a titratable proton never drops them, and the updater sets
+         * the same placeholder on the exceptions of the sites in any other
+         * system, which Contexts made after the updater then see as well
+         *
+         * Throws Amber::AmberParmError if the system does not match the
+         * topology
+         */
+        ProtonationStateUpdater(TitratableSites const& sites,
+                                OpenMM::System &system);
+
+        TitratableSites const& getSites(void) const {return *sites_;}
+
+        /// The current state of every site
+        std::vector<int> const& getStates(void) const {return states_;}
+        int getState(int site) const {return states_[site];}
+
+        /// The current charge of every atom
+        std::vector<double> const& getCharges(void) const {return charges_;}
+
+        /**
+         * \brief Changes the state of a site in the system's forces
+         *
+         * Contexts see the change after the next call to updateContext
+         */
+        void setState(int site, int state);
+        /// Calls setState for every site whose state changes
+        void setStates(std::vector<int> const& states);
+
+        /// Whether the forces changed since the last updateContext
+        bool needsUpdate(void) const {return dirty_;}
+
+        /**
+         * \brief Copies the changed charges into a context made from the
+         *        system (does nothing if no state changed)
+         */
+        void updateContext(OpenMM::Context &context);
+
+    private:
+        TitratableSites const* sites_;
+        OpenMM::NonbondedForce *nonbonded_;
+        OpenMM::CustomGBForce *gb_;     // NULL without implicit solvent
+        std::vector<int> states_;
+        std::vector<double> charges_;
+        std::vector<double> gb_params_; // scratch for per-particle parameters
+        bool dirty_;
+
+        /* The 1-4 exceptions of each site, as CSR rows: site i owns entries
+         * [pair_offsets_[i], pair_offsets_[i+1]) of the arrays below. A pair
+         * between two sites is listed under both
+         */
+        std::vector<size_t> pair_offsets_;
+        std::vector<int> pair_exception_;
+        std::vector<int> pair_i_, pair_j_;
+        std::vector<double> pair_scale_;   // 1/scee
+        std::vector<double> pair_sigma_, pair_epsilon_;
+};
+
+/**
+ * Monte Carlo protonation state moves for implicit solvent constant pH MD, as
+ * in Amber: a move switches one site to another of its states and is accepted
+ * with the Metropolis criterion on
+ *
+ *      dG = dE_elec - (STATENE_new - STATENE_old)
+ *           + kT ln(10) pH (PROTCNT_new - PROTCNT_old)
+ *
+ * where dE_elec is the change in the energy of the nonbonded force group (the
+ * nonbonded and GB forces) of the context, so the bonded terms are never
+ * evaluated.
+ *
+ * attemptSweep moves every site once. Neighboring sites (bonded to each other,
+ * or closer than the pair cutoff) also get two-site moves, which change both
+ * of them at once.
+ *
+ * With a GBElectrostatics evaluator (see setEvaluator), dE_elec comes from its
+ * Born radii at the current positions instead of from the context, which
+ * costs O(k*N) for a site of k atoms instead of a full energy evaluation. The
+ * context only gets the charges of the accepted moves. The Born radii are
+ * recomputed at the start of every round of moves (attemptMoves or
+ * attemptSweep), which costs about as much as a context energy evaluation, so
+ * native moves only pay off for rounds of several moves (see
+ * setNativeMinMoves).
+ */
+class ProtonationSampler {
+    public:
+        /**
+         * \brief Sets up Monte Carlo moves for a context
+         *
+         * \param sites The titratable sites, which must outlive the sampler
+         * \param system The GB system made by createSystem from the topology
+         *               of the sites (see ProtonationStateUpdater)
+         * \param context A context of that system, whose charges are set to
+         *                the initial states of the sites
+         * \param pH The pH of the solvent
+         * \param temperature The temperature in kelvin
+         * \param seed Seed for the random numbers. The same seed gives the
+         *             same moves for the same energies; 0 seeds from the clock
+         */
+        ProtonationSampler(TitratableSites const& sites, OpenMM::System &system,
+                           OpenMM::Context &context, double pH,
+                           double temperature=300.0, uint64_t seed=0);
+
+        double getPH(void) const {return pH_;}
+        void setPH(double pH) {pH_ = pH;}
+        double getTemperature(void) const {return temperature_;}
+        void setTemperature(double temperature) {temperature_ = temperature;}
+
+        /// The current state of every site
+        std::vector<int> const& getStates(void) const {
+            return updater_.getStates();
+        }
+
+        /**
+         * \brief Attempts moves at the current positions
+         *
+         * \param nmoves How many moves to attempt. Each picks a site at random
+         *               and proposes one of its other states at random
+         *
+         * \return How many moves were accepted
+         */
+        int attemptMoves(int nmoves=1);
+
+        /**
+         * \brief Runs MD with the context's integrator, attempting moves
+         *        every interval steps
+         *
+         * \param nsteps Number of MD steps
+         * \param interval Number of MD steps between protonation moves
+         * \param nmoves Moves attempted each time. With an evaluator, every
+         *               time also recomputes the Born radii (see
+         *               setNativeMinMoves)
+         */
+        void run(int nsteps, int interval, int nmoves=1);
+
+        /**
+         * \brief Attempts one move for every site at the current positions
+         *
+         * Every site, or pair of neighboring sites (a unit), is proposed a
+         * random other state, which is accepted or rejected on its own.
+         *
+         * With context energies each proposal costs one energy evaluation:
+         * the context only gives total energies, so the changes of several
+         * units cannot be told apart from one evaluation.
+         *
+         * With a native evaluator, units whose sites are all farther apart
+         * than the independence distance (and not bonded to each other) form
+         * batches. Their energy changes add up, so every unit of a batch gets
+         * its own energy change from the same charges, computed in parallel,
+         * and its own decision. The context receives every accepted change in
+         * one update at the end of the sweep.
+         *
+         * \return How many sites changed state
+         */
+        int attemptSweep(void);
+
+        /**
+         * \brief Sites farther apart than this (in angstroms) do not interact,
+         *        so attemptSweep evaluates their moves in one batch
+         *
+         * This is the cutoff of the nonbonded force of the system. It is 0
+         * (no batches) for NoCutoff, where every pair of sites interacts,
+         * and for Ewald and PME
+         */
+        double getIndependenceDistance(void) const {return independence_;}
+        /// Sites closer than this (in angstroms) get two-site moves
+        double getPairCutoff(void) const {return pair_cutoff_;}
+        void setPairCutoff(double cutoff);
+
+        /// Moves attempted for a site since the last resetStatistics
+        long getNumAttempts(int site) const {return attempts_[site];}
+        /// Moves accepted for a site since the last resetStatistics
+        long getNumAccepted(int site) const {return accepted_[site];}
+        /// Fraction of moves accepted for a site (0 if none were attempted)
+        double getAcceptance(int site) const {
+            return attempts_[site] ? (double) accepted_[site] / attempts_[site]
+                                   : 0.0;
+        }
+        /**
+         * \brief Computes dE_elec with a native evaluator instead of the
+         *        context
+         *
+         * \param evaluator An evaluator for the topology of the sites and the
+         *                  GB model, cutoff, and salt of the system, which
+         *                  must outlive the sampler. NULL goes back to context
+         *                  energies
+         */
+        void setEvaluator(GBElectrostatics *evaluator);
+        GBElectrostatics* getEvaluator(void) const {return evaluator_;}
+
+        /**
+         * \brief Rounds of fewer moves than this use context energies even
+         *        with an evaluator
+         *
+         * A native round costs the positions from the context and the Born
+         * radii at them once, plus a cheap energy change per move, against
+         * one context evaluation per move. It breaks even at
+         *
+         *      (t_positions + t_radii) / (t_context - t_change)
+         *
+         * moves, which depends on the system and the OpenMM platform and is
+         * reported by ProtonationBench. For attemptSweep, the moves of a round
+         * are the number of sites. The default, 1, always uses the evaluator
+         */
+        void setNativeMinMoves(int nmoves);
+        int getNativeMinMoves(void) const {return native_min_moves_;}
+
+        /// Context energy evaluations since the last resetStatistics
+        long getNumEvaluations(void) const {return evaluations_;}
+        void resetStatistics(void);
+
+    private:
+        ProtonationStateUpdater updater_;
+        OpenMM::Context *context_;
+        double pH_, temperature_;
+        uint64_t random_;
+        std::vector<long> attempts_, accepted_;
+        long evaluations_;
+        double pair_cutoff_;
+        double independence_;           // angstroms, 0 if all sites interact
+        std::vector<char> bonded_;      // nsite x nsite: sites share a bond
+        GBElectrostatics *evaluator_;   // NULL for context energies
+        int native_min_moves_;
+
+        /// Nonbonded energy of the context in kcal/mol
+        double energy_(void);
+        /// Born radii of the evaluator at the positions of the context
+        void updateEvaluator_(void);
+        /**
+         * Native dE_elec of moving the n sites of a unit to proposed states,
+         * from the current charges (scratch holds the charges with the first
+         * site moved)
+         */
+        double nativeChange_(int const* unit, int const* proposed, int n,
+                             std::vector<double> &scratch) const;
+        /// A random number in [0, 1)
+        double uniform_(void);
+        /// A random integer in [0, n)
+        int random_int_(int n) {return (int) (uniform_() * n);}
+        /// A random state of a site other than its current one
+        int propose_(int site);
+        /// dG of a site's move apart from the electrostatic energy change
+        double reference_(int site, int old, int proposed) const;
+        /* Closest approach between the atoms of every pair of sites, in
+         * nanometers, flattened to nsite x nsite (infinity for far sites)
+         */
+        void siteDistances_(double cutoff, std::vector<double> &distances);
+};
+
+}; // namespace Amber
+
+#endif /* CONSTPH_H */
@@ -0,0 +1,132 @@
+/** cpin.h
+ *
+ * Titratable sites for constant pH simulations, read from the &CNSTPH namelist
+ * of an Amber cpin file:
+ *
+ *      TRESCNT         number of titratable residues
+ *      STATEINF(i)%    FIRST_ATOM (from 1), NUM_ATOMS, FIRST_STATE,
+ *                      NUM_STATES and FIRST_CHARGE of residue i (from 0)
+ *      CHRGDAT         charges of every atom of every state of each residue
+ *      PROTCNT         number of titratable protons in each state
+ *      STATENE         reference energy of each state (kcal/mol)
+ *      RESSTATE        initial state of each residue
+ *      RESNAME         'System: ...' followed by 'Residue: NAME NUMBER'
+ *      CPH_IGB         GB model the reference energies were computed with
+ *      CPH_INTDIEL     internal dielectric of those calculations
+ *
+ * The charges of each site are kept as one contiguous states x atoms block,
+ * so switching a site to another state is a single copy of one row.
+ */
+#ifndef CPIN_H
+#define CPIN_H
+
+#include <string>
+#include <vector>
+
+#include "amber/amberparm.h"
+
+namespace Amber {
+
+/**
+ * The titratable sites of a system, bound to the AmberParm they were read
+ * against. The AmberParm must outlive the sites and keep its atoms.
+ */
+class TitratableSites {
+    public:
+        TitratableSites(void);
+        /**
+         * \brief Reads a cpin file for a topology
+         *
+         * \param parm The topology the cpin file was made for
+         * \param filename Name of the cpin file (may be gzip- or
+         *                 bzip2-compressed)
+         *
+         * Throws Amber::AmberCpinError if the file cannot be read, is
+         * malformed, or refers to atoms the topology does not have
+         */
+        TitratableSites(AmberParm const& parm, std::string const& filename);
+
+        /// Replaces the sites with the ones in a cpin file (see constructor)
+        void readCpin(AmberParm const& parm, std::string const& filename);
+
+        /// The topology the sites were read against
+        AmberParm const& getParm(void) const {return *parm_;}
+
+        /// Number of titratable sites
+        int size(void) const {return (int) first_atom_.size();}
+        bool empty(void) const {return first_atom_.empty();}
+
+        /// The residue (index in the topology) of site i
+        int getResidue(int i) const {return residue_[i];}
+        /// The residue name of site i, as given in the cpin file
+        std::string const& getResidueName(int i) const {return names_[i];}
+        /// The first atom of site i
+        int getFirstAtom(int i) const {return first_atom_[i];}
+        /// One past the last atom of site i
+        int getEndAtom(int i) const {return first_atom_[i] + num_atoms_[i];}
+        int getNumAtoms(int i) const {return num_atoms_[i];}
+        int getNumStates(int i) const {return num_states_[i];}
+        /// The state site i starts in
+        int getInitialState(int i) const {return initial_state_[i];}
+
+        /// The charges of the atoms of site i in the given state
+        Span<double> getCharges(int i, int state) const {
+            return Span<double>(&charges_[charge_offset_[i] +
+                                          (size_t) state * num_atoms_[i]],
+                                num_atoms_[i]);
+        }
+        /// The states x atoms charge block of site i, one state after another
+        Span<double> getChargeTable(int i) const {
+            return Span<double>(&charges_[charge_offset_[i]],
+                                (size_t) num_states_[i] * num_atoms_[i]);
+        }
+        /// Number of titratable protons of site i in the given state
+        int getProtonCount(int i, int state) const {
+            return proton_counts_[first_state_[i] + state];
+        }
+        /// Reference energy of site i in the given state, in kcal/mol
+        double getStateEnergy(int i, int state) const {
+            return state_energies_[first_state_[i] + state];
+        }
+
+        /**
+         * \brief Puts the charges of site i in the given state into a
+         *        per-atom charge array
+         *
+         * \param charges The charges of every atom of the system
+         */
+        void applyState(int i, int state, std::vector<double> &charges) const;
+        /// Applies applyState to every site with its state in states
+        void applyStates(std::vector<int> const& states,
+                         std::vector<double> &charges) const;
+
+        /// The initial state of every site
+        std::vector<int> const& getInitialStates(void) const {
+            return initial_state_;
+        }
+
+        /// The GB model of the reference energies (CPH_IGB)
+        int getIgb(void) const {return igb_;}
+        /// The internal dielectric of the reference energies (CPH_INTDIEL)
+        double getIntDiel(void) const {return intdiel_;}
+
+    private:
+        AmberParm const* parm_;
+        std::vector<std::string> names_;
+        std::vector<int> residue_;
+        std::vector<int> first_atom_;
+        std::vector<int> num_atoms_;
+        std::vector<int> num_states_;
+        std::vector<int> first_state_;
+        std::vector<int> initial_state_;
+        std::vector<size_t> charge_offset_;
+        std::vector<double> charges_;
+        std::vector<int> proton_counts_;
+        std::vector<double> state_energies_;
+        int igb_;
+        double intdiel_;
+};
+
+}; // namespace Amber
+
+#endif /* CPIN_H */
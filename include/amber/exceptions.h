@@ -18,6 +18,22 @@ class AmberParmError : public std::runtime_error {
             std::runtime_error(std::string(s)) {}
 };
 
+class AmberMaskError : public std::runtime_error {
+    public:
+        AmberMaskError(std::string const& s) :
+            std::runtime_error(s) {}
+        AmberMaskError(const char* s) :
+            std::runtime_error(std::string(s)) {}
+};
+
+class AmberCpinError : public std::runtime_error {
+    public:
+        AmberCpinError(std::string const& s) :
+            std::runtime_error(s) {}
+        AmberCpinError(const char* s) :
+            std::runtime_error(std::string(s)) {}
+};
+
 class AmberCrdError : public std::runtime_error {
     public:
         AmberCrdError(std::string const& s) :
@@ -0,0 +1,248 @@
+/** fixedwidth.h
+ *
+ * Contains fast decoders for the fixed-width numeric fields found in Amber
+ * topology (%dE%d.%d, %dF%d.%d and %dI%d formats) and ASCII coordinate files.
+ * They work directly on a span of characters, so no temporary std::string (or
+ * NUL-terminated copy) is needed for each field.
+ *
+ * The fast paths only handle the plain layouts Amber programs write and
+ * produce results identical to atof/atoi (the decimal conversion is exact, so
+ * the rounding matches strtod). Anything they do not recognize is handed off
+ * to the C library, so the result never differs from the old path.
+ *
+ * The matching encoders write fields exactly as printf would (which is how
+ * LEaP writes them), again with the C library as the fallback for anything the
+ * fast path cannot round correctly.
+ */
+#ifndef FIXEDWIDTH_H
+#define FIXEDWIDTH_H
+
+#include <cstddef>
+#include <stdint.h>
+
+namespace Amber {
+
+/// Largest power of ten exactly representable as a double
+#define FIXEDWIDTH_MAX_EXACT_POW10 22
+
+/// Powers of ten 10^0 through 10^22, all of which are exact in a double
+extern const double FIXEDWIDTH_POW10[FIXEDWIDTH_MAX_EXACT_POW10+1];
+
+/// Slow paths (atof/atoi/strtod on a NUL-terminated copy of the field)
+double decodeRealSlow(const char* begin, const char* end);
+int decodeIntSlow(const char* begin, const char* end);
+bool decodeRealSlow(const char* begin, const char* end, double &value);
+
+namespace FixedWidth {
+
+static inline bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static inline bool isDigit(char c) {
+    return (unsigned char)(c - '0') < 10;
+}
+
+/// Loads 8 bytes so the first character lands in the lowest byte regardless
+/// of the machine's byte order (compilers turn this into a single load)
+static inline uint64_t load8(const char* p) {
+    const unsigned char* u = (const unsigned char*) p;
+    return  (uint64_t) u[0]        | ((uint64_t) u[1] << 8)  |
+           ((uint64_t) u[2] << 16) | ((uint64_t) u[3] << 24) |
+           ((uint64_t) u[4] << 32) | ((uint64_t) u[5] << 40) |
+           ((uint64_t) u[6] << 48) | ((uint64_t) u[7] << 56);
+}
+
+/// Returns true if all 8 bytes packed by load8 are the characters 0-9
+static inline bool allDigits8(uint64_t v) {
+    return ((v & 0xF0F0F0F0F0F0F0F0ULL) == 0x3030303030303030ULL) &&
+           (((v + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) ==
+            0x3030303030303030ULL);
+}
+
+/// Converts 8 packed digit characters to their value with three multiplies
+/// instead of eight (SIMD within a register)
+static inline uint32_t parse8(uint64_t v) {
+    const uint64_t mask = 0x000000FF000000FFULL;
+    const uint64_t mul1 = 100 + (1000000ULL << 32);
+    const uint64_t mul2 = 1 + (10000ULL << 32);
+    v -= 0x3030303030303030ULL;
+    v = (v * 10) + (v >> 8);
+    v = (((v & mask) * mul1) + (((v >> 16) & mask) * mul2)) >> 32;
+    return (uint32_t) v;
+}
+
+/// Accumulates a run of digits starting at p into mantissa, 8 at a time where
+/// possible. Returns the end of the run and adds the digit count to ndigits
+static inline const char* digits(const char* p, const char* end,
+                                 uint64_t &mantissa, int &ndigits) {
+    while (end - p >= 8 && ndigits <= 11) {
+        uint64_t v = load8(p);
+        if (!allDigits8(v)) break;
+        mantissa = mantissa * 100000000ULL + parse8(v);
+        ndigits += 8;
+        p += 8;
+    }
+    while (p < end && isDigit(*p)) {
+        mantissa = mantissa * 10 + (*p - '0');
+        ndigits++;
+        p++;
+    }
+    return p;
+}
+
+/** Fast path for a decimal number, optionally with an E exponent, surrounded
+ * by blanks. Returns false (leaving value untouched) if the field is not of
+ * that form or the conversion could not be done exactly
+ */
+static inline bool fastReal(const char* p, const char* end, double &value) {
+    while (p < end && isSpace(*p)) p++;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+
+    uint64_t mantissa = 0;
+    int ndigits = 0;
+    p = digits(p, end, mantissa, ndigits);
+    int exponent = 0;
+    if (p < end && *p == '.') {
+        int before = ndigits;
+        p = digits(p + 1, end, mantissa, ndigits);
+        exponent = before - ndigits;
+    }
+    if (ndigits == 0 || ndigits > 19) return false;
+
+    if (p < end && (*p == 'E' || *p == 'e')) {
+        p++;
+        bool negexp = false;
+        if (p < end && (*p == '-' || *p == '+')) negexp = *p++ == '-';
+        if (p == end || !isDigit(*p)) return false;
+        int e = 0;
+        for (int n = 0; p < end && isDigit(*p); n++, p++) {
+            if (n == 4) return false;
+            e = e * 10 + (*p - '0');
+        }
+        exponent += negexp ? -e : e;
+    }
+    while (p < end && isSpace(*p)) p++;
+    if (p != end) return false;
+
+    // Both the mantissa and the power of ten are exact, so a single multiply
+    // or divide is correctly rounded (Clinger's fast path)
+    if (mantissa > (1ULL << 53)) return false;
+    if (exponent < -FIXEDWIDTH_MAX_EXACT_POW10 ||
+        exponent > FIXEDWIDTH_MAX_EXACT_POW10) return false;
+    double d = (double) mantissa;
+    if (exponent < 0)
+        d /= FIXEDWIDTH_POW10[-exponent];
+    else
+        d *= FIXEDWIDTH_POW10[exponent];
+    value = negative ? -d : d;
+    return true;
+}
+
+/// Fast path for an integer of at most 9 digits surrounded by blanks
+static inline bool fastInt(const char* p, const char* end, int &value) {
+    while (p < end && isSpace(*p)) p++;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    const char* start = p;
+    int i = 0;
+    while (p < end && isDigit(*p)) i = i * 10 + (*p++ - '0');
+    if (p == start || p - start > 9) return false;
+    while (p < end && isSpace(*p)) p++;
+    if (p != end) return false;
+    value = negative ? -i : i;
+    return true;
+}
+
+}; // namespace FixedWidth
+
+/**
+ * \brief Decodes a fixed-width floating point field (E or F format)
+ *
+ * \param begin Pointer to the first character of the field
+ * \param end Pointer one past the last character of the field
+ *
+ * \return The value of the field, exactly as atof would return it
+ */
+inline double decodeReal(const char* begin, const char* end) {
+    double value;
+    if (FixedWidth::fastReal(begin, end, value)) return value;
+    return decodeRealSlow(begin, end);
+}
+
+/**
+ * \brief Decodes a fixed-width floating point field, reporting bad input
+ *
+ * \param begin Pointer to the first character of the field
+ * \param end Pointer one past the last character of the field
+ * \param value (output) The value of the field
+ *
+ * \return false if the field does not begin with a number (e.g., it is blank)
+ */
+inline bool decodeReal(const char* begin, const char* end, double &value) {
+    if (FixedWidth::fastReal(begin, end, value)) return true;
+    return decodeRealSlow(begin, end, value);
+}
+
+/**
+ * \brief Decodes a fixed-width integer field (I format)
+ *
+ * \param begin Pointer to the first character of the field
+ * \param end Pointer one past the last character of the field
+ *
+ * \return The value of the field, exactly as atoi would return it
+ */
+inline int decodeInt(const char* begin, const char* end) {
+    int value;
+    if (FixedWidth::fastInt(begin, end, value)) return value;
+    return decodeIntSlow(begin, end);
+}
+
+/// Room the encoders need in their output buffer beyond the width and
+/// precision of the field (printf writes all 309 digits of a huge %f value)
+#define FIXEDWIDTH_ENCODE_SIZE 320
+
+/**
+ * \brief Writes an integer field, exactly as printf("%*d", width, value)
+ *
+ * \param value The number to write
+ * \param width The field width. Shorter numbers are padded on the left
+ * \param out (output) Buffer with room for width + FIXEDWIDTH_ENCODE_SIZE
+ *        characters
+ *
+ * \return The number of characters written (no NUL terminator is added)
+ */
+int encodeInt(int value, int width, char* out);
+
+/**
+ * \brief Writes an E-format field, exactly as printf("%*.*E", width, prec,
+ *        value)
+ *
+ * \param value The number to write
+ * \param width The field width. Shorter numbers are padded on the left
+ * \param prec The number of digits after the decimal point
+ * \param out (output) Buffer with room for width + prec +
+ *        FIXEDWIDTH_ENCODE_SIZE characters
+ *
+ * \return The number of characters written (no NUL terminator is added)
+ */
+int encodeExp(double value, int width, int prec, char* out);
+
+/**
+ * \brief Writes an F-format field, exactly as printf("%*.*f", width, prec,
+ *        value)
+ *
+ * \param value The number to write
+ * \param width The field width. Shorter numbers are padded on the left
+ * \param prec The number of digits after the decimal point
+ * \param out (output) Buffer with room for width + prec +
+ *        FIXEDWIDTH_ENCODE_SIZE characters
+ *
+ * \return The number of characters written (no NUL terminator is added)
+ */
+int encodeFixed(double value, int width, int prec, char* out);
+
+}; // namespace Amber
+
+#endif /* FIXEDWIDTH_H */
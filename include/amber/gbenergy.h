@@ -0,0 +1,141 @@
+/** gbenergy.h
+ *
+ * Native evaluation of the electrostatic energy of a system in implicit
+ * solvent, as the NonbondedForce and the CustomGBForce of the GB_* models
+ * (see gbmodels.h) compute it, and of how that energy changes when the
+ * charges of a few atoms change.
+ *
+ * The Born radii depend on the positions alone, so they are computed once per
+ * set of positions. The electrostatic energy is then a quadratic form in the
+ * charges, and changing the charges of k atoms (a protonation move) changes it
+ * by a sum over the pairs of those atoms, which costs O(k*N) rather than the
+ * O(N^2) of a full evaluation.
+ */
+#ifndef GBENERGY_H
+#define GBENERGY_H
+
+#include <string>
+#include <vector>
+
+#include "amber/amberparm.h"
+#include "OpenMM.h"
+
+namespace Amber {
+
+/**
+ * Coulomb plus generalized Born electrostatics of a topology in one of the
+ * Amber GB models, without periodic boundaries. It matches a system made by
+ * createSystem with the same model and either NoCutoff (and a cutoff of 0) or
+ * CutoffNonPeriodic (and the same cutoff). The nonpolar (SASA) term does not
+ * depend on the charges and is left out.
+ */
+class GBElectrostatics {
+    public:
+        /**
+         * \brief Sets up the GB model of a topology
+         *
+         * \param parm The topology, which must outlive the evaluator
+         * \param implicitSolvent The GB model: HCT, OBC1, OBC2, GBn, or GBn2
+         * \param cutoff Cutoff in angstroms (<= 0 for no cutoff)
+         * \param kappa The inverse Debye length in 1/angstroms
+         * \param soluteDielectric The dielectric constant of the solute
+         * \param solventDielectric The dielectric constant of the solvent
+         *
+         * Throws Amber::AmberParmError for an unknown model
+         */
+        GBElectrostatics(AmberParm const& parm,
+                         std::string const& implicitSolvent,
+                         double cutoff=0.0, double kappa=0.0,
+                         double soluteDielectric=1.0,
+                         double solventDielectric=78.5);
+
+        int getNumAtoms(void) const {return natom_;}
+        std::string const& getModel(void) const {return model_;}
+
+        /**
+         * \brief Computes the Born radii for a new set of positions
+         *
+         * \param positions Positions of every atom, in angstroms
+         */
+        void setPositions(std::vector<OpenMM::Vec3> const& positions);
+
+        /// The Born radius of every atom at the last positions, in angstroms
+        std::vector<double> getBornRadii(void) const;
+
+        /**
+         * \brief The electrostatic energy (Coulomb, scaled 1-4, and GB) in
+         *        kcal/mol at the last positions
+         *
+         * \param charges The charge of every atom
+         */
+        double getEnergy(std::vector<double> const& charges) const;
+
+        /**
+         * \brief The change in the electrostatic energy, in kcal/mol, when the
+         *        atoms [first, end) take new charges
+         *
+         * \param charges The current charge of every atom
+         * \param first First atom whose charge changes
+         * \param end One past the last atom whose charge changes
+         * \param proposed The new charges of atoms first to end-1
+         */
+        double getEnergyChange(std::vector<double> const& charges, int first,
+                               int end, Span<double> proposed) const;
+
+    private:
+        enum Model {HCT, OBC1, OBC2, GBN, GBN2};
+
+        AmberParm const* parm_;
+        std::string model_;
+        Model kind_;
+        int natom_;
+        bool has_positions_;
+        // Everything below is in OpenMM units (nm, kJ/mol)
+        double cutoff_, kappa_, pre_, post_;
+        double offset_, neck_scale_;
+
+        /* Per-atom data as separate arrays, so the pair loops vectorize: the
+         * positions, the offset and scaled offset radii of the GB force, the
+         * tanh coefficients of the OBC-type models, and the Born radii
+         */
+        std::vector<double> x_, y_, z_;
+        std::vector<double> or_, sr_;
+        std::vector<double> alpha_, beta_, gamma_;
+        std::vector<double> born_;
+
+        /* With a cutoff, the atoms sorted by the cell of a grid at least the
+         * cutoff wide that they fall in, as CSR rows, so that the Born
+         * integral of an atom only visits the 27 cells around its own
+         */
+        int cell_dims_[3];
+        std::vector<int> cell_of_;
+        std::vector<int> cell_offsets_;
+        std::vector<int> cell_atoms_;
+
+        /* The 1-4 pairs (scaled by 1/scee) and excluded pairs (scaled by 0) of
+         * every atom, as CSR rows listing each pair under both atoms. Their
+         * Coulomb interaction differs from that of the other pairs; their GB
+         * interaction does not
+         */
+        std::vector<size_t> exc_offsets_;
+        std::vector<int> exc_partner_;
+        std::vector<double> exc_scale_;
+
+        void buildCells_(void);
+        double bornIntegral_(int i) const;
+        /// What atom j adds to the descreening integral of atom i
+        double bornTerm_(int i, int j, double cut2) const;
+        /// GB plus Coulomb interaction of a pair per unit charge product
+        double pairCoefficient_(int i, int j) const;
+        /// What the exception of a pair changes in its Coulomb interaction
+        double exceptionCorrection_(int i, int j, double scale) const;
+        /// The GB self energy of an atom per squared unit charge
+        double selfCoefficient_(int i) const;
+        /// Sum over j in [begin, end) of pairCoefficient_(i, j) * charges[j]
+        double potential_(int i, int begin, int end, const double* charges)
+                const;
+};
+
+}; // namespace Amber
+
+#endif /* GBENERGY_H */
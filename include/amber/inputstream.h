@@ -0,0 +1,119 @@
+/** inputstream.h
+ *
+ * Reads a file that may be gzip- or bzip2-compressed as a plain stream of
+ * bytes. The compression is detected from the first bytes of the file (not its
+ * name), and the reading and decompressing happen on a background thread that
+ * keeps a few blocks ahead of the caller, so parsing the data overlaps with
+ * fetching and inflating the rest of it.
+ */
+#ifndef INPUTSTREAM_H
+#define INPUTSTREAM_H
+
+#include <cstddef>
+#include <string>
+
+#include <pthread.h>
+
+namespace Amber {
+
+enum Compression {NO_COMPRESSION=0, GZIP_COMPRESSION, BZIP2_COMPRESSION};
+
+/**
+ * \brief Identifies the compression of a file from its first few bytes
+ *
+ * \param data The first bytes of the file
+ * \param size How many bytes data holds
+ *
+ * \return The compression format, or NO_COMPRESSION if none is recognized
+ */
+Compression detectCompression(const char* data, size_t size);
+
+/// Returns true if this build of the library can decompress the given format
+bool canDecompress(Compression compression);
+
+class InputStream {
+    public:
+        InputStream(void);
+        ~InputStream(void);
+
+        /**
+         * \brief Opens a file and starts reading (and decompressing) it in the
+         *        background
+         *
+         * \param filename Name of the file to open
+         *
+         * \return false if the file cannot be opened or is compressed in a
+         *         format this build does not support
+         */
+        bool open(std::string const& filename);
+
+        /// Stops the background thread and closes the file
+        void close(void);
+
+        /**
+         * \brief Copies up to n bytes of (decompressed) data into buf, waiting
+         *        for the background thread if necessary
+         *
+         * \return The number of bytes copied, which is only less than n at the
+         *         end of the data (or on a decompression error)
+         */
+        size_t read(char* buf, size_t n);
+
+        /**
+         * \brief Reads the next line (without its newline), like std::getline
+         *
+         * \return false if there are no more lines
+         */
+        bool getline(std::string &line);
+
+        /// False if reading or decompressing the file failed
+        bool good(void);
+
+        /// The compression format of the open file
+        Compression compression(void) const {return compression_;}
+
+        /**
+         * \brief The expected size of the decompressed data (the file size of
+         *        an uncompressed file, the size recorded in the trailer of a
+         *        gzip file), or 0 if it is not known in advance
+         */
+        size_t sizeHint(void) const {return sizeHint_;}
+
+    private:
+        /* Decompressed blocks travel from the reader thread to the caller
+         * through a ring of NUM_BLOCKS buffers. The reader fills the block at
+         * tail_ while the caller drains the block at head_, and only the
+         * counters are shared between the two.
+         */
+        enum {NUM_BLOCKS = 4};
+
+        int fd_;
+        Compression compression_;
+        size_t sizeHint_;
+        char *input_;               // compressed input (reader thread only)
+        size_t inputSize_;          // bytes of input_ read in open()
+        char *blocks_[NUM_BLOCKS];
+        size_t lengths_[NUM_BLOCKS];
+        int head_, tail_, filled_;
+        size_t pos_;                // read position in blocks_[head_]
+        size_t heldLength_;         // length of blocks_[head_] (0 if none)
+        bool done_, error_, stop_, running_;
+        pthread_t thread_;
+        pthread_mutex_t mutex_;
+        pthread_cond_t cond_;
+
+        static void* run_(void* stream);
+        void produce_(void);
+        char* emptyBlock_(void);
+        void pushBlock_(size_t length);
+        bool readInput_(size_t &length);
+        bool nextBlock_(void);
+
+        // Not copyable -- we own a thread and a file descriptor
+        InputStream(InputStream const&);
+        InputStream& operator=(InputStream const&);
+};
+
+}; // namespace Amber
+
+#endif /* INPUTSTREAM_H */
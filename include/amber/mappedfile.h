@@ -0,0 +1,62 @@
+/** mappedfile.h
+ *
+ * Contains a small read-only wrapper around a memory-mapped file so the file
+ * parsers can work directly on the bytes of the file rather than copying each
+ * line into its own std::string. Compressed files are transparently
+ * decompressed into memory.
+ */
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+namespace Amber {
+
+class MappedFile {
+    public:
+        MappedFile(void) : data_(NULL), size_(0), mapped_(false) {}
+        ~MappedFile(void) {close();}
+
+        /**
+         * \brief Maps a file into memory for reading
+         *
+         * If the file cannot be memory-mapped (e.g., it is a pipe or lives on
+         * a filesystem that does not support mmap), its contents are read into
+         * a heap buffer instead so callers never need to care which one
+         * happened. The same goes for gzip- and bzip2-compressed files, which
+         * are decompressed into a heap buffer.
+         *
+         * \param filename Name of the file to open
+         *
+         * \return true if the file was opened successfully, false otherwise
+         */
+        bool open(std::string const& filename);
+
+        /// Unmaps (or frees) the file contents. Safe to call more than once
+        void close(void);
+
+        /// Returns a pointer to the first byte of the file (NULL if empty)
+        const char* data(void) const {return data_;}
+        /// Returns a pointer one past the last byte of the file
+        const char* end(void) const {return data_ + size_;}
+        /// Returns the size of the file in bytes
+        size_t size(void) const {return size_;}
+        /// Returns true if the contents are backed by mmap rather than the heap
+        bool isMapped(void) const {return mapped_;}
+
+    private:
+        const char* data_;
+        size_t size_;
+        bool mapped_;
+
+        bool decompress_(std::string const& filename);
+
+        // Not copyable -- we own the mapping
+        MappedFile(MappedFile const&);
+        MappedFile& operator=(MappedFile const&);
+};
+
+}; // namespace Amber
+
+#endif /* MAPPEDFILE_H */
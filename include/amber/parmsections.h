@@ -0,0 +1,162 @@
+/** parmsections.h
+ *
+ * Typed, enum-indexed storage for the standard sections of an Amber topology
+ * file. Every %FLAG that the Amber programs define has a ParmSectionId and a
+ * fixed element type, and its data is kept in one contiguous array of that type
+ * (int32_t, double or a 4-character ParmName) rather than in a string-keyed map
+ * of 8-byte ParmData unions. Code that walks a section element by element binds
+ * a reference to the array once and indexes it directly.
+ */
+#ifndef PARMSECTIONS_H
+#define PARMSECTIONS_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mappedfile.h"
+#include "readparm.h"
+
+namespace Amber {
+
+/// The standard topology file sections, in the order LEaP writes them
+enum ParmSectionId {
+    PRM_POINTERS=0,
+    PRM_ATOM_NAME,
+    PRM_CHARGE,
+    PRM_ATOMIC_NUMBER,
+    PRM_MASS,
+    PRM_ATOM_TYPE_INDEX,
+    PRM_NUMBER_EXCLUDED_ATOMS,
+    PRM_NONBONDED_PARM_INDEX,
+    PRM_RESIDUE_LABEL,
+    PRM_RESIDUE_POINTER,
+    PRM_BOND_FORCE_CONSTANT,
+    PRM_BOND_EQUIL_VALUE,
+    PRM_ANGLE_FORCE_CONSTANT,
+    PRM_ANGLE_EQUIL_VALUE,
+    PRM_DIHEDRAL_FORCE_CONSTANT,
+    PRM_DIHEDRAL_PERIODICITY,
+    PRM_DIHEDRAL_PHASE,
+    PRM_SCEE_SCALE_FACTOR,
+    PRM_SCNB_SCALE_FACTOR,
+    PRM_SOLTY,
+    PRM_LENNARD_JONES_ACOEF,
+    PRM_LENNARD_JONES_BCOEF,
+    PRM_BONDS_INC_HYDROGEN,
+    PRM_BONDS_WITHOUT_HYDROGEN,
+    PRM_ANGLES_INC_HYDROGEN,
+    PRM_ANGLES_WITHOUT_HYDROGEN,
+    PRM_DIHEDRALS_INC_HYDROGEN,
+    PRM_DIHEDRALS_WITHOUT_HYDROGEN,
+    PRM_EXCLUDED_ATOMS_LIST,
+    PRM_HBOND_ACOEF,
+    PRM_HBOND_BCOEF,
+    PRM_HBCUT,
+    PRM_AMBER_ATOM_TYPE,
+    PRM_TREE_CHAIN_CLASSIFICATION,
+    PRM_JOIN_ARRAY,
+    PRM_IROTAT,
+    PRM_SOLVENT_POINTERS,
+    PRM_ATOMS_PER_MOLECULE,
+    PRM_BOX_DIMENSIONS,
+    PRM_RADII,
+    PRM_SCREEN,
+    PRM_IPOL,
+    NUM_PRM_SECTIONS
+};
+
+/// Returns the %FLAG name of a section
+const char* parmSectionFlag(ParmSectionId id);
+
+/// Returns the element type of a section (INTEGER, FLOAT or HOLLERITH)
+ParmDataType parmSectionType(ParmSectionId id);
+
+/// Returns the id of a %FLAG name, or NUM_PRM_SECTIONS if it is not standard
+ParmSectionId parmSectionId(std::string const& flag);
+
+/* Topology file sections decoded on demand into typed arrays. open() maps and
+ * indexes the file, and a section is decoded the first time its array is asked
+ * for. Asking for a different type than the section's own (e.g., ints() of a
+ * FLOAT section, as some programs write DIHEDRAL_PERIODICITY) converts each
+ * value the way a Fortran read would. Sections whose flag is not one of the
+ * ParmSectionIds are only decoded as strings, by name. Not thread-safe.
+ */
+class ParmSectionStore {
+    public:
+        ParmSectionStore(void);
+
+        /**
+         * \brief Maps and indexes a topology file
+         *
+         * \param fname Name of the topology file to open
+         *
+         * \return Same status codes as readparm
+         */
+        ExitStatus open(std::string const& fname);
+
+        /**
+         * \brief Returns true if the section is in the file and has data. This
+         *        decodes the section if necessary
+         */
+        bool has(ParmSectionId id) {return size(id) > 0;}
+
+        /**
+         * \brief Returns the number of elements in a section (0 if it is not
+         *        in the file). This decodes the section if necessary
+         */
+        size_t size(ParmSectionId id);
+
+        /// The section's data as integers, decoding it if necessary
+        std::vector<int32_t> const& ints(ParmSectionId id);
+        /// The section's data as floating point numbers
+        std::vector<double> const& reals(ParmSectionId id);
+        /// The section's data as 4-character names
+        std::vector<ParmName> const& names(ParmSectionId id);
+        /// The section's data as strings of the full field width
+        ParmStringTable const& strings(ParmSectionId id);
+
+        /**
+         * \brief The data of any section, standard or not, as strings of the
+         *        full field width (e.g., the 1a80 RADIUS_SET, or the labels of
+         *        a custom section). Empty if the flag is not in the file
+         */
+        ParmStringTable const& strings(std::string const& flag);
+
+        /// Returns true if the section has been decoded (as any type) already
+        bool isDecoded(ParmSectionId id) const {return decoded_[id] != 0;}
+
+        /**
+         * \brief Frees the decoded data of a section. It will be decoded
+         *        again if it is requested later
+         */
+        void release(ParmSectionId id);
+
+        /// The flags in the order they appear in the file
+        std::vector<std::string> const& flags(void) const {return flagList_;}
+        /// The %VERSION string of the file
+        std::string const& version(void) const {return version_;}
+
+    private:
+        MappedFile file_;
+        ParmSectionList sections_[NUM_PRM_SECTIONS];
+        int decoded_[NUM_PRM_SECTIONS]; // bit mask of (1 << ParmDataType),
+                                        // plus one bit for strings()
+        std::vector<int32_t> ints_[NUM_PRM_SECTIONS];
+        std::vector<double> reals_[NUM_PRM_SECTIONS];
+        std::vector<ParmName> names_[NUM_PRM_SECTIONS];
+        ParmStringTable strings_[NUM_PRM_SECTIONS];
+        // Sections with non-standard flags, and those decoded so far
+        std::map<std::string, ParmSectionList> otherSections_;
+        std::map<std::string, ParmStringTable> otherStrings_;
+        std::vector<std::string> flagList_;
+        std::string version_;
+
+        // Not copyable -- we own the mapped file
+        ParmSectionStore(ParmSectionStore const&);
+        ParmSectionStore& operator=(ParmSectionStore const&);
+};
+
+}; // namespace Amber
+
+#endif /* PARMSECTIONS_H */
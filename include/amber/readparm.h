@@ -3,11 +3,13 @@
 #define READPARM_H
 
 #include <locale>
+#include <stdint.h>
 #include <string>
 #include <map>
 #include <vector>
 
 #define MAX_HOLLERITH_SIZE 8
+#define PARM_NAME_SIZE 4
 
 namespace Amber {
 
@@ -69,7 +71,9 @@ inline std::string lower(const std::string &input) {
 }
 
 /* Handle relatively simple Fortran formats, and fall back to Python parsing if
- * the format is unrecognized.
+ * the format is unrecognized. Character (A) formats of any width are
+ * HOLLERITH, but only fields up to PARM_NAME_SIZE characters wide fit in a
+ * ParmData, so readparm keeps wider sections as text (see wideHollerith).
  */
 enum ParmDataType {UNKNOWN=0, INTEGER, FLOAT, HOLLERITH};
 ParmDataType parseFormat(const std::string &fmt, int &ncols, int &width);
@@ -84,6 +88,83 @@ union ParmData {
     double f;
 };
 
+/* A fixed-width 4-character name (atom names, residue labels, atom types, ...)
+ * as stored in a typed section array. Names are padded with NUL characters,
+ * and there is no terminator when all 4 are used.
+ */
+typedef struct {
+    char c[PARM_NAME_SIZE];
+} ParmName;
+
+/// Returns the name as a string without the NUL padding
+inline std::string nameString(ParmName const& name) {
+    size_t len = 0;
+    while (len < PARM_NAME_SIZE && name.c[len] != '\0') len++;
+    return std::string(name.c, len);
+}
+
+/* Character fields of arbitrary width, e.g., the 1a80 RADIUS_SET or long
+ * labels in custom sections. Every string lives in one shared pool of
+ * characters, and string i occupies [offset(i), offset(i+1)) of it, so a
+ * section of any size costs two allocations rather than one per entry. The
+ * strings are stored without padding or terminators.
+ */
+class ParmStringTable {
+    public:
+        ParmStringTable(void) : offsets_(1, 0) {}
+
+        /// The number of strings
+        size_t size(void) const {return offsets_.size() - 1;}
+        bool empty(void) const {return offsets_.size() == 1;}
+
+        /// The characters of string i (not NUL-terminated)
+        const char* data(size_t i) const {
+            return pool_.empty() ? "" : &pool_[0] + offsets_[i];
+        }
+        /// The length of string i
+        size_t length(size_t i) const {return offsets_[i+1] - offsets_[i];}
+        /// A copy of string i
+        std::string operator[](size_t i) const {
+            return std::string(data(i), length(i));
+        }
+
+        /// Adds the characters [begin, end) as a new string
+        void push_back(const char* begin, const char* end) {
+            pool_.insert(pool_.end(), begin, end);
+            offsets_.push_back(pool_.size());
+        }
+        void push_back(std::string const& str) {
+            push_back(str.data(), str.data() + str.size());
+        }
+        /// Adds all of the strings of another table
+        void append(ParmStringTable const& other);
+
+        /// Makes room for n more strings holding chars more characters
+        void reserve(size_t n, size_t chars) {
+            offsets_.reserve(offsets_.size() + n);
+            pool_.reserve(pool_.size() + chars);
+        }
+        void clear(void) {
+            pool_.clear();
+            offsets_.assign(1, 0);
+        }
+        void swap(ParmStringTable &other) {
+            pool_.swap(other.pool_);
+            offsets_.swap(other.offsets_);
+        }
+
+        bool operator==(ParmStringTable const& other) const {
+            return pool_ == other.pool_ && offsets_ == other.offsets_;
+        }
+        bool operator!=(ParmStringTable const& other) const {
+            return !(*this == other);
+        }
+
+    private:
+        std::vector<char> pool_;
+        std::vector<size_t> offsets_;
+};
+
 typedef struct {
     ParmDataType dataType;
     std::string fmt;
@@ -94,14 +175,91 @@ typedef std::map<std::string, ParmDataVec> ParmDataMap;
 typedef std::map<std::string, std::vector<std::string> > ParmStringMap;
 typedef std::map<std::string, ParmFormatType> ParmFormatMap;
 
+/* A single %FLAG section located by the pre-scan of a topology file. The data
+ * lines of the section occupy bytes [begin, end) of the file. A flag whose data
+ * is interrupted by another %FORMAT or %COMMENT line shows up as more than one
+ * section with the same name.
+ */
+typedef struct {
+    std::string flag;
+    ParmFormatType format;
+    int ncols;
+    int width;
+    size_t begin;
+    size_t end;
+} ParmSection;
+
+typedef std::vector<ParmSection> ParmSectionList;
+
+/// Returns true for character sections too wide to store in a ParmData, which
+/// readparm (and LazyParmData) keep as raw text in unkParmData, and whose
+/// format they report as UNKNOWN
+inline bool wideHollerith(ParmSection const& sec) {
+    return sec.format.dataType == HOLLERITH && sec.width > PARM_NAME_SIZE;
+}
+
 /* Parses the Amber topology file and stores the data inside the hash maps
  * passed to the function. Returns 0 if parsing was successful and 1 otherwise
+ *
+ * Character sections wider than PARM_NAME_SIZE (see wideHollerith) are kept
+ * as text in unkParmData, and parmFormats reports them as UNKNOWN, so a
+ * section whose dataType is HOLLERITH always has its data in parmData.
+ * ParmSectionStore::strings decodes the wide sections in full.
  */
 ExitStatus readparm(const std::string &fname, std::vector<std::string> &flagList,
                     ParmDataMap &parmData, ParmStringMap &parmComments,
                     ParmStringMap &unkParmData, ParmFormatMap &parmFormats,
                     std::string &version);
 
+/* Writes a topology file from the data structures filled by readparm. Data
+ * sections are written in the order of flagList using the Fortran format in
+ * parmFormats, so a file read by readparm is written back byte for byte (as
+ * long as each flag had a single %FORMAT line before its data, and its %COMMENT
+ * lines came between the %FLAG and %FORMAT lines). Sections of unknown format
+ * are written back from unkParmData. Returns NOOPEN if the file could not be
+ * opened, ERR if a flag has no format or the write fails, and OK otherwise.
+ */
+ExitStatus writeparm(const std::string &fname,
+                     std::vector<std::string> const& flagList,
+                     ParmDataMap const& parmData,
+                     ParmStringMap const& parmComments,
+                     ParmStringMap const& unkParmData,
+                     ParmFormatMap const& parmFormats,
+                     std::string const& version);
+
+/* Scans a topology file held in memory and records the byte range and format
+ * of every section (as well as the comments, formats and version) without
+ * decoding any of the data. This is the first phase of readparm.
+ */
+ExitStatus indexparm(const char* data, size_t size,
+                     std::vector<std::string> &flagList,
+                     ParmSectionList &sections, ParmStringMap &parmComments,
+                     ParmFormatMap &parmFormats, std::string &version);
+
+/* Decodes the sections found by indexparm into parmData (or unkParmData for
+ * formats we do not understand and for wide character fields). Sections are
+ * decoded concurrently, and large sections are split into line-aligned chunks
+ * shared between threads. This is the second phase of readparm.
+ */
+void decodeparm(const char* data, ParmSectionList const& sections,
+                ParmDataMap &parmData, ParmStringMap &unkParmData);
+
+/* Decodes all of the sections passed (normally every section of a single flag)
+ * into one contiguous typed array, appending to whatever is already in out.
+ * Numbers are converted to the type of the array and names are truncated to
+ * PARM_NAME_SIZE characters. Sections of unknown format are skipped. The
+ * ParmStringTable version keeps every field whole, whatever its width, as the
+ * text of the field without its leading and trailing blanks.
+ */
+void decodeSections(const char* data, ParmSectionList const& sections,
+                    std::vector<int32_t> &out);
+void decodeSections(const char* data, ParmSectionList const& sections,
+                    std::vector<double> &out);
+void decodeSections(const char* data, ParmSectionList const& sections,
+                    std::vector<ParmName> &out);
+void decodeSections(const char* data, ParmSectionList const& sections,
+                    ParmStringTable &out);
+
 /* Parm pointers */
 enum PARM_POINTERS {
         NATOM=0,  NTYPES, NBONH,  MBONA,  NTHETH, MTHETA,
@@ -6,9 +6,15 @@
 #ifndef TOPOLOGY_H
 #define TOPOLOGY_H
 
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <map>
 #include <string>
 #include <vector>
 
+#include <stdint.h>
+
 namespace Amber {
 
 class Bond {
@@ -154,5 +160,736 @@ typedef std::vector<Angle> AngleList;
 typedef std::vector<Dihedral> DihedralList;
 typedef std::vector<Atom> AtomList;
 
+/**
+ * A read-only view of a contiguous array: a pointer and a length, without
+ * owning or copying the elements. A Span is only valid as long as the
+ * container it views is neither destroyed nor modified.
+ */
+template <typename T>
+class Span {
+    public:
+        typedef T value_type;
+        typedef const T* const_iterator;
+        typedef const T* iterator;
+
+        Span(void) : data_(NULL), size_(0) {}
+        Span(const T* data, size_t size) : data_(data), size_(size) {}
+        Span(std::vector<T> const& vec) :
+            data_(vec.empty() ? NULL : &vec[0]), size_(vec.size()) {}
+
+        const T* data(void) const {return data_;}
+        size_t size(void) const {return size_;}
+        bool empty(void) const {return size_ == 0;}
+
+        T const& operator[](size_t i) const {return data_[i];}
+        T const& front(void) const {return data_[0];}
+        T const& back(void) const {return data_[size_-1];}
+
+        const_iterator begin(void) const {return data_;}
+        const_iterator end(void) const {return data_ + size_;}
+
+        /// Copies the viewed elements into a new vector
+        std::vector<T> toVector(void) const {
+            return std::vector<T>(begin(), end());
+        }
+
+    private:
+        const T* data_;
+        size_t size_;
+};
+
+/**
+ * A view of one residue: its name and the range [getFirstAtom(),
+ * getEndAtom()) of the atoms it contains
+ */
+class ResidueRef {
+    public:
+        ResidueRef(int i, std::string const& name, int first, int end) :
+            index_(i), name_(&name), first_(first), end_(end) {}
+
+        int getIndex(void) const {return index_;}
+        std::string const& getName(void) const {return *name_;}
+
+        int getFirstAtom(void) const {return first_;}
+        /// One past the index of the last atom in the residue
+        int getEndAtom(void) const {return end_;}
+        int size(void) const {return end_ - first_;}
+        bool contains(int atom) const {return atom >= first_ && atom < end_;}
+
+    private:
+        int index_;
+        std::string const* name_;
+        int first_, end_;
+};
+
+/* Bonded terms as they are stored in a prmtop: the atoms of each term plus the
+ * ID of its parameter type, with the parameters themselves in a small table
+ * shared by every term of that type
+ */
+
+/// Parameters of one bond type
+struct BondType {
+    BondType(double kf, double req) : k(kf), req(req) {}
+    double k;   ///< Force constant (kcal/mol/A^2)
+    double req; ///< Equilibrium distance (A)
+
+    bool operator<(BondType const& other) const {
+        if (k != other.k) return k < other.k;
+        return req < other.req;
+    }
+};
+
+/// A bond as stored in a BondTable
+struct BondTerm {
+    BondTerm(int i, int j, int type) : i(i), j(j), type(type) {}
+    int i, j, type;
+
+    Bond value(BondType const& p) const {return Bond(i, j, p.k, p.req);}
+    /// The same term with every atom index moved up by offset
+    BondTerm shifted(int offset) const {
+        return BondTerm(i + offset, j + offset, type);
+    }
+};
+
+/// Parameters of one angle type
+struct AngleType {
+    AngleType(double kf, double theteq) : k(kf), theteq(theteq) {}
+    double k;      ///< Force constant (kcal/mol/radians^2)
+    double theteq; ///< Equilibrium angle (degrees)
+
+    bool operator<(AngleType const& other) const {
+        if (k != other.k) return k < other.k;
+        return theteq < other.theteq;
+    }
+};
+
+/// An angle as stored in an AngleTable
+struct AngleTerm {
+    AngleTerm(int i, int j, int k, int type) : i(i), j(j), k(k), type(type) {}
+    int i, j, k, type;
+
+    Angle value(AngleType const& p) const {
+        return Angle(i, j, k, p.k, p.theteq);
+    }
+    AngleTerm shifted(int offset) const {
+        return AngleTerm(i + offset, j + offset, k + offset, type);
+    }
+};
+
+/// Parameters of one dihedral type
+struct DihedralType {
+    DihedralType(double kf, double phase, int periodicity, double scee,
+                 double scnb) :
+        k(kf), phase(phase), periodicity(periodicity), scee(scee),
+        scnb(scnb) {}
+    double k;        ///< Force constant (kcal/mol)
+    double phase;    ///< Phase shift (degrees)
+    int periodicity;
+    double scee;     ///< 1-4 electrostatic scaling factor
+    double scnb;     ///< 1-4 vdW scaling factor
+
+    bool operator<(DihedralType const& other) const {
+        if (k != other.k) return k < other.k;
+        if (phase != other.phase) return phase < other.phase;
+        if (periodicity != other.periodicity)
+            return periodicity < other.periodicity;
+        if (scee != other.scee) return scee < other.scee;
+        return scnb < other.scnb;
+    }
+};
+
+/// A dihedral as stored in a DihedralTable
+struct DihedralTerm {
+    DihedralTerm(int i, int j, int k, int l, int type, bool ignore_end) :
+        i(i), j(j), k(k), l(l), type(type), ignore_end(ignore_end ? 1 : 0) {}
+    int i, j, k, l, type;
+    int ignore_end; ///< Nonzero if the 1-4 pair of this term is skipped
+
+    Dihedral value(DihedralType const& p) const {
+        return Dihedral(i, j, k, l, p.k, p.phase, p.periodicity, p.scee,
+                        p.scnb, ignore_end != 0);
+    }
+    DihedralTerm shifted(int offset) const {
+        return DihedralTerm(i + offset, j + offset, k + offset, l + offset,
+                            type, ignore_end != 0);
+    }
+};
+
+/**
+ * Bonded terms of one kind (Term) with their table of parameter types (Param).
+ * Indexing or iterating gives each term as a full Value (e.g., a Bond) built
+ * on the fly, while code that cares about speed or memory can work with
+ * terms() and types() directly. Changing the parameters of a type changes
+ * every term of that type at once.
+ */
+template <typename Term, typename Param, typename Value>
+class TermTable {
+    public:
+        class const_iterator {
+            public:
+                typedef std::random_access_iterator_tag iterator_category;
+                typedef Value value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef Value const* pointer;
+                typedef Value reference;
+
+                /// Holds the Value that it->getAtomI() and friends act on
+                class Arrow {
+                    public:
+                        Arrow(Value const& value) : value_(value) {}
+                        Value const* operator->(void) const {return &value_;}
+                    private:
+                        Value value_;
+                };
+
+                const_iterator(TermTable const* table, size_t i) :
+                    table_(table), i_(i) {}
+
+                Value operator*(void) const {return (*table_)[i_];}
+                Arrow operator->(void) const {return Arrow((*table_)[i_]);}
+
+                const_iterator& operator++(void) {i_++; return *this;}
+                const_iterator& operator--(void) {i_--; return *this;}
+                const_iterator operator++(int) {
+                    const_iterator old(*this);
+                    i_++;
+                    return old;
+                }
+                const_iterator operator--(int) {
+                    const_iterator old(*this);
+                    i_--;
+                    return old;
+                }
+                const_iterator& operator+=(difference_type n) {
+                    i_ += n;
+                    return *this;
+                }
+                const_iterator operator+(difference_type n) const {
+                    return const_iterator(table_, i_ + n);
+                }
+                difference_type operator-(const_iterator const& other) const {
+                    return (difference_type) i_ - (difference_type) other.i_;
+                }
+
+                bool operator==(const_iterator const& other) const {
+                    return i_ == other.i_;
+                }
+                bool operator!=(const_iterator const& other) const {
+                    return i_ != other.i_;
+                }
+                bool operator<(const_iterator const& other) const {
+                    return i_ < other.i_;
+                }
+
+            private:
+                TermTable const* table_;
+                size_t i_;
+        };
+
+        /// Number of terms
+        size_t size(void) const {return terms_.size();}
+        bool empty(void) const {return terms_.empty();}
+        /// Number of parameter types
+        int numTypes(void) const {return (int) types_.size();}
+
+        void reserve(size_t nterms) {terms_.reserve(nterms);}
+        void clear(void) {
+            terms_.clear();
+            types_.clear();
+            ids_.clear();
+        }
+
+        /// Adds a parameter type (even if an equal one exists) and returns its
+        /// ID, so types can mirror a prmtop table one-to-one
+        int addType(Param const& param) {
+            int id = (int) types_.size();
+            types_.push_back(param);
+            ids_.insert(std::make_pair(param, id));
+            return id;
+        }
+
+        /// Returns the ID of a type with exactly these parameters, adding one
+        /// if there is none yet
+        int internType(Param const& param) {
+            typename std::map<Param, int>::const_iterator it = ids_.find(param);
+            return it != ids_.end() ? it->second : addType(param);
+        }
+
+        /// Changes the parameters of every term of the given type
+        void setType(int id, Param const& param) {
+            typename std::map<Param, int>::iterator it = ids_.find(types_[id]);
+            if (it != ids_.end() && it->second == id) ids_.erase(it);
+            types_[id] = param;
+            ids_.insert(std::make_pair(param, id));
+        }
+
+        /// Appends a term (its type must already exist)
+        void add(Term const& term) {terms_.push_back(term);}
+        /// Replaces all terms
+        void assign(const Term* terms, size_t n) {
+            terms_.assign(terms, terms + n);
+        }
+        /**
+         * \brief Appends ncopies-1 more copies of the terms, copy c with its
+         *        atom indexes moved up by c*natom (see AmberParm::tile)
+         */
+        void repeat(int ncopies, int natom) {
+            size_t n = terms_.size();
+            if (n == 0 || ncopies <= 1) return;
+            Term first = terms_[0];
+            terms_.resize(n * ncopies, first);
+#ifdef _OPENMP
+#           pragma omp parallel for schedule(static)
+#endif
+            for (int c = 1; c < ncopies; c++)
+                for (size_t t = 0; t < n; t++)
+                    terms_[c * n + t] = terms_[t].shifted(c * natom);
+        }
+
+        Value operator[](size_t i) const {
+            return terms_[i].value(types_[terms_[i].type]);
+        }
+        Term const& term(size_t i) const {return terms_[i];}
+        Param const& type(int id) const {return types_[id];}
+
+        Span<Term> terms(void) const {return Span<Term>(terms_);}
+        Span<Param> types(void) const {return Span<Param>(types_);}
+
+        const_iterator begin(void) const {return const_iterator(this, 0);}
+        const_iterator end(void) const {return const_iterator(this, size());}
+
+        /// Copies every term out as a Value
+        std::vector<Value> toList(void) const {
+            std::vector<Value> list;
+            list.reserve(size());
+            for (size_t i = 0; i < size(); i++)
+                list.push_back((*this)[i]);
+            return list;
+        }
+
+    private:
+        std::vector<Term> terms_;
+        std::vector<Param> types_;
+        std::map<Param, int> ids_;
+};
+
+typedef TermTable<BondTerm, BondType, Bond> BondTable;
+typedef TermTable<AngleTerm, AngleType, Angle> AngleTable;
+typedef TermTable<DihedralTerm, DihedralType, Dihedral> DihedralTable;
+
+/**
+ * The excluded atom pairs of a system in compressed sparse row form. Row i
+ * lists (in increasing order) the atoms excluded from atom i, which in a
+ * prmtop are only those with a larger index, so each pair is stored once. A
+ * bitmask per atom also records which of the next EXCLUSION_MASK_SPAN atoms are
+ * excluded, which covers nearly every pair in a biomolecule (and every pair in
+ * water), so most lookups never touch the rows at all.
+ */
+class ExclusionTable {
+    public:
+        enum {EXCLUSION_MASK_SPAN = 64};
+
+        ExclusionTable(void) : offsets_(1, 0) {}
+
+        /// Number of atoms (rows) in the table
+        int numAtoms(void) const {return (int) masks_.size();}
+        /// Total number of excluded pairs
+        size_t size(void) const {return partners_.size();}
+
+        void reserve(int natom, size_t npairs);
+        void clear(void);
+
+        /**
+         * \brief Appends the row of the next atom
+         *
+         * \param partners Indexes of the atoms excluded from it, in any order
+         *                 but all larger than its own, so each pair is stored
+         *                 in the row isExcluded looks in
+         * \param n Number of partners (duplicates are dropped)
+         *
+         * Throws Amber::AmberParmError (leaving the table unchanged) if a
+         * partner is not larger than the index of the new atom
+         */
+        void addAtom(const int* partners, int n);
+        /// Appends ncopies-1 more copies of the table, copy c with its atom
+        /// indexes moved up by c*numAtoms() (see AmberParm::tile)
+        void repeat(int ncopies);
+
+        /// The atoms excluded from atom i, in increasing order
+        Span<int> excluded(int i) const {
+            return Span<int>(partners_.empty() ? NULL : &partners_[0] +
+                             offsets_[i], offsets_[i+1] - offsets_[i]);
+        }
+
+        /**
+         * \brief Determines if the pair is in row min(i, j) of the table
+         *
+         * \param i Index of the first atom
+         * \param j Index of the second atom (not equal to i)
+         */
+        bool isExcluded(int i, int j) const {
+            if (j < i) std::swap(i, j);
+            unsigned d = (unsigned) (j - i - 1);
+            if (d < EXCLUSION_MASK_SPAN)
+                return (masks_[i] >> d) & 1;
+            return searchRow_(i, j);
+        }
+
+        /// Row boundaries (numAtoms()+1 of them) and partners of every row
+        std::vector<size_t> const& offsets(void) const {return offsets_;}
+        std::vector<int> const& partners(void) const {return partners_;}
+
+    private:
+        std::vector<size_t> offsets_;
+        std::vector<int> partners_;
+        std::vector<uint64_t> masks_;
+
+        bool searchRow_(int i, int j) const;
+};
+
+/**
+ * The bond graph of a system in compressed sparse row form: the bonded
+ * neighbors of every atom, and the molecules (connected components of the
+ * graph) the atoms fall into. Built in a single pass over the bonds, after
+ * which every query is O(1) or O(degree).
+ *
+ * Molecules are numbered in order of their lowest atom index, so in a typical
+ * prmtop (solute first, then ions and solvent) they come out in file order.
+ */
+class BondGraph {
+    public:
+        BondGraph(void) : offsets_(1, 0), molecule_offsets_(1, 0) {}
+
+        /**
+         * \brief Builds the graph of natom atoms from a table of bonds
+         *
+         * Bonds listed more than once (or in both directions) give a single
+         * edge, and bonds of an atom to itself are ignored
+         */
+        void build(int natom, BondTable const& bonds);
+        void clear(void);
+
+        int numAtoms(void) const {return (int) molecule_ids_.size();}
+        /// Number of distinct bonded pairs
+        size_t numEdges(void) const {return neighbors_.size() / 2;}
+
+        /// The atoms bonded to atom i, in increasing order
+        Span<int> neighbors(int i) const {
+            return Span<int>(neighbors_.empty() ? NULL : &neighbors_[0] +
+                             offsets_[i], offsets_[i+1] - offsets_[i]);
+        }
+        int degree(int i) const {return (int) (offsets_[i+1] - offsets_[i]);}
+        /// Whether atoms i and j are bonded to each other, in O(degree)
+        bool bonded(int i, int j) const {
+            Span<int> n = neighbors(i);
+            return std::binary_search(n.begin(), n.end(), j);
+        }
+
+        int numMolecules(void) const {
+            return (int) molecule_offsets_.size() - 1;
+        }
+        /// The molecule atom i belongs to
+        int getMoleculeOf(int i) const {return molecule_ids_[i];}
+        /// The atoms of molecule m, in increasing order
+        Span<int> molecule(int m) const {
+            return Span<int>(molecule_atoms_.empty() ? NULL :
+                             &molecule_atoms_[0] + molecule_offsets_[m],
+                             molecule_offsets_[m+1] - molecule_offsets_[m]);
+        }
+        /// Whether molecule m is the range [first, last] of atoms, with no
+        /// atom of another molecule in between (always so in LEaP output)
+        bool isContiguous(int m) const {
+            Span<int> atoms = molecule(m);
+            return atoms.back() - atoms.front() + 1 == (int) atoms.size();
+        }
+
+        /// Neighbor list boundaries (numAtoms()+1 of them) and neighbors
+        std::vector<size_t> const& offsets(void) const {return offsets_;}
+        std::vector<int> const& neighborList(void) const {return neighbors_;}
+        /// The molecule of every atom
+        std::vector<int> const& moleculeIds(void) const {return molecule_ids_;}
+
+    private:
+        std::vector<size_t> offsets_;
+        std::vector<int> neighbors_;
+        std::vector<int> molecule_ids_;
+        std::vector<size_t> molecule_offsets_;
+        std::vector<int> molecule_atoms_;
+};
+
+/// A set of the atoms of a system, stored as one bit per atom
+class AtomSelection {
+    public:
+        AtomSelection(void) : natom_(0) {}
+        /// A selection of natom atoms, either all selected or none
+        explicit AtomSelection(int natom, bool selected=false);
+
+        int numAtoms(void) const {return natom_;}
+
+        bool contains(int i) const {return (words_[i >> 6] >> (i & 63)) & 1;}
+        void set(int i) {words_[i >> 6] |= (uint64_t) 1 << (i & 63);}
+        void reset(int i) {words_[i >> 6] &= ~((uint64_t) 1 << (i & 63));}
+        /// Selects the atoms [begin, end)
+        void setRange(int begin, int end);
+
+        /// Number of selected atoms
+        int count(void) const;
+        /// Whether no atom is selected
+        bool none(void) const;
+        /// The indexes of the selected atoms, in increasing order
+        std::vector<int> indices(void) const;
+
+        AtomSelection& operator&=(AtomSelection const& other);
+        AtomSelection& operator|=(AtomSelection const& other);
+        /// Selects exactly the atoms that were not selected
+        void invert(void);
+
+        bool operator==(AtomSelection const& other) const {
+            return natom_ == other.natom_ && words_ == other.words_;
+        }
+        bool operator!=(AtomSelection const& other) const {
+            return !(*this == other);
+        }
+
+        /// The selection as 64-atom words (atom i is bit i % 64 of word i / 64)
+        std::vector<uint64_t> const& words(void) const {return words_;}
+        void setWord(size_t w, uint64_t bits) {words_[w] = bits;}
+
+    private:
+        int natom_;
+        std::vector<uint64_t> words_;
+
+        /// Clears the bits past the last atom (so count and == work)
+        void trim_(void);
+};
+
+/**
+ * Gives each distinct string (an atom name or atom type) a small integer ID, so
+ * the atoms of a system can refer to the handful of names they share instead
+ * of each carrying its own copy
+ */
+class NameTable {
+    public:
+        /// Returns the ID of name, adding it to the table if it is new
+        int intern(std::string const& name) {
+            std::map<std::string, int>::const_iterator it = ids_.find(name);
+            if (it != ids_.end()) return it->second;
+            int id = (int) names_.size();
+            names_.push_back(name);
+            ids_.insert(std::make_pair(name, id));
+            return id;
+        }
+
+        /// Returns the ID of name, or -1 if it is not in the table
+        int find(std::string const& name) const {
+            std::map<std::string, int>::const_iterator it = ids_.find(name);
+            return it == ids_.end() ? -1 : it->second;
+        }
+
+        /// The string with the given ID
+        std::string const& operator[](int id) const {return names_[id];}
+
+        /// Number of distinct strings in the table
+        int size(void) const {return (int) names_.size();}
+
+        void clear(void) {
+            names_.clear();
+            ids_.clear();
+        }
+
+    private:
+        std::vector<std::string> names_;
+        std::map<std::string, int> ids_;
+};
+
+class AtomTable;
+
+/**
+ * A lightweight view of one atom of an AtomTable with the same accessors as
+ * Atom. It holds only the table and the index, so it is only valid as long as
+ * the table it came from.
+ */
+class AtomRef {
+    public:
+        AtomRef(AtomTable const* table, int i) : table_(table), index_(i) {}
+
+        inline std::string const& getName(void) const;
+        inline std::string const& getType(void) const;
+
+        int getIndex(void) const {return index_;}
+        inline int getElement(void) const;
+
+        inline double getMass(void) const;
+        inline double getCharge(void) const;
+        inline double getLJRadius(void) const;
+        inline double getLJEpsilon(void) const;
+        inline double getGBRadius(void) const;
+        inline double getGBScreen(void) const;
+
+        /// Copies the atom out of the table
+        inline operator Atom(void) const;
+
+    private:
+        friend class AtomTable;
+        AtomTable const* table_;
+        int index_;
+};
+
+/**
+ * Stores the atoms of a system as a structure of arrays: each property is its
+ * own contiguous array indexed by atom, and names and types are IDs into a
+ * NameTable. Loops over a single property (e.g., the charges) stream through
+ * dense memory rather than striding over whole Atom records.
+ */
+class AtomTable {
+    public:
+        /// Iterates through the atoms as AtomRef views
+        class const_iterator {
+            public:
+                typedef std::random_access_iterator_tag iterator_category;
+                typedef AtomRef value_type;
+                typedef std::ptrdiff_t difference_type;
+                typedef AtomRef const* pointer;
+                typedef AtomRef const& reference;
+
+                const_iterator(AtomTable const* table, int i) : ref_(table, i) {}
+
+                reference operator*(void) const {return ref_;}
+                pointer operator->(void) const {return &ref_;}
+                AtomRef operator[](difference_type n) const {
+                    return AtomRef(ref_.table_, ref_.index_ + (int) n);
+                }
+
+                const_iterator& operator++(void) {ref_.index_++; return *this;}
+                const_iterator& operator--(void) {ref_.index_--; return *this;}
+                const_iterator operator++(int) {
+                    const_iterator old(*this);
+                    ref_.index_++;
+                    return old;
+                }
+                const_iterator operator--(int) {
+                    const_iterator old(*this);
+                    ref_.index_--;
+                    return old;
+                }
+                const_iterator& operator+=(difference_type n) {
+                    ref_.index_ += (int) n;
+                    return *this;
+                }
+                const_iterator& operator-=(difference_type n) {
+                    ref_.index_ -= (int) n;
+                    return *this;
+                }
+                const_iterator operator+(difference_type n) const {
+                    return const_iterator(ref_.table_, ref_.index_ + (int) n);
+                }
+                const_iterator operator-(difference_type n) const {
+                    return const_iterator(ref_.table_, ref_.index_ - (int) n);
+                }
+                difference_type operator-(const_iterator const& other) const {
+                    return ref_.index_ - other.ref_.index_;
+                }
+
+                bool operator==(const_iterator const& other) const {
+                    return ref_.index_ == other.ref_.index_;
+                }
+                bool operator!=(const_iterator const& other) const {
+                    return ref_.index_ != other.ref_.index_;
+                }
+                bool operator<(const_iterator const& other) const {
+                    return ref_.index_ < other.ref_.index_;
+                }
+
+            private:
+                AtomRef ref_;
+        };
+
+        int size(void) const {return (int) masses_.size();}
+        bool empty(void) const {return masses_.empty();}
+
+        void reserve(int natom);
+        void clear(void);
+        /// Appends ncopies-1 more copies of every atom (the copies share the
+        /// name and type IDs of the originals)
+        void repeat(int ncopies);
+
+        /// Appends an atom (its index is ignored; atoms are numbered in order)
+        void push_back(Atom const& atom) {
+            add(names_.intern(atom.getName()), types_.intern(atom.getType()),
+                atom.getElement(), atom.getMass(), atom.getCharge(),
+                atom.getLJRadius(), atom.getLJEpsilon(), atom.getGBRadius(),
+                atom.getGBScreen());
+        }
+
+        /**
+         * \brief Appends an atom whose name and type are already interned
+         *
+         * \param name ID of the atom name in names()
+         * \param type ID of the atom type in types()
+         *
+         * The remaining parameters are as for Atom
+         */
+        void add(int name, int type, int element, double mass, double charge,
+                 double lj_rad, double lj_eps, double gb_rad, double gb_screen);
+
+        /// Interns an atom name or type for use with add()
+        int internName(std::string const& name) {return names_.intern(name);}
+        int internType(std::string const& type) {return types_.intern(type);}
+
+        // Whole properties, indexed by atom
+        std::vector<int> const& elements(void) const {return elements_;}
+        std::vector<double> const& masses(void) const {return masses_;}
+        std::vector<double> const& charges(void) const {return charges_;}
+        std::vector<double> const& ljRadii(void) const {return lj_radii_;}
+        std::vector<double> const& ljEpsilons(void) const {return lj_epsilons_;}
+        std::vector<double> const& gbRadii(void) const {return gb_radii_;}
+        std::vector<double> const& gbScreens(void) const {return gb_screens_;}
+        std::vector<int> const& nameIds(void) const {return name_ids_;}
+        std::vector<int> const& typeIds(void) const {return type_ids_;}
+
+        /// The distinct atom names and types that nameIds and typeIds refer to
+        NameTable const& names(void) const {return names_;}
+        NameTable const& types(void) const {return types_;}
+
+        /// Changes the charge of one atom (electron fractions)
+        void setCharge(int i, double charge) {charges_[i] = charge;}
+
+        AtomRef operator[](int i) const {return AtomRef(this, i);}
+
+        const_iterator begin(void) const {return const_iterator(this, 0);}
+        const_iterator end(void) const {return const_iterator(this, size());}
+
+        /// Copies all atoms into an AtomList
+        AtomList toList(void) const;
+
+    private:
+        std::vector<int> elements_, name_ids_, type_ids_;
+        std::vector<double> masses_, charges_, lj_radii_, lj_epsilons_,
+                            gb_radii_, gb_screens_;
+        NameTable names_, types_;
+};
+
+std::string const& AtomRef::getName(void) const {
+    return table_->names()[table_->nameIds()[index_]];
+}
+std::string const& AtomRef::getType(void) const {
+    return table_->types()[table_->typeIds()[index_]];
+}
+int AtomRef::getElement(void) const {return table_->elements()[index_];}
+double AtomRef::getMass(void) const {return table_->masses()[index_];}
+double AtomRef::getCharge(void) const {return table_->charges()[index_];}
+double AtomRef::getLJRadius(void) const {return table_->ljRadii()[index_];}
+double AtomRef::getLJEpsilon(void) const {
+    return table_->ljEpsilons()[index_];
+}
+double AtomRef::getGBRadius(void) const {return table_->gbRadii()[index_];}
+double AtomRef::getGBScreen(void) const {return table_->gbScreens()[index_];}
+
+AtomRef::operator Atom(void) const {
+    return Atom(index_, getName(), getType(), getElement(), getMass(),
+                getCharge(), getLJRadius(), getLJEpsilon(), getGBRadius(),
+                getGBScreen());
+}
+
 }; // namespace CpHMD
 #endif /* TOPOLOGY_H */
@@ -1,22 +1,42 @@
 /** ambercrd.cpp -- Contains the functionality to read and write Amber
   * coordinate files
   */
+#include <algorithm>
+#include <climits>
 #include <cstdio>
-#include <fstream>
 #include <sstream>
 #include <iostream>
 
 #include "amber/NetCDFFile.h"
 #include "amber/amber_constants.h"
 #include "amber/ambercrd.h"
+#include "amber/fixedwidth.h"
+#include "amber/inputstream.h"
 #include "amber/readparm.h"
 #include "amber/string_manip.h"
+#include "amber/unitcell.h"
 #include "OpenMM.h"
 
 using namespace Amber;
 using namespace std;
 using namespace OpenMM;
 
+/// Width of each coordinate, velocity, and box field in an ASCII restart
+#define RST7_FIELD_WIDTH 12
+
+/// Decodes the idx'th 12-character field of a restart file line
+static double rst7Field(string const& line, int idx) {
+    size_t begin = idx * RST7_FIELD_WIDTH;
+    if (begin > line.size()) begin = line.size();
+    size_t end = begin + RST7_FIELD_WIDTH;
+    if (end > line.size()) end = line.size();
+    double value;
+    if (!decodeReal(line.data() + begin, line.data() + end, value))
+        throw InvalidDecimal("Could not convert [[ " +
+                line.substr(begin, end - begin) + " ]] to a decimal!");
+    return value;
+}
+
 void AmberCoordinateFrame::readRst7(string const& filename) {
     if (readNetCDF_(filename) != 0)
         readASCII_(filename);
@@ -29,8 +49,9 @@ AmberCoordinateFrame::~AmberCoordinateFrame() {
 
 void AmberCoordinateFrame::readASCII_(string const& filename) {
 
-    ifstream input;
-    input.open(filename.c_str());
+    // Handles gzip- and bzip2-compressed restarts, too
+    InputStream input;
+    input.open(filename);
     string line;
 
     bool has_velocities = false;
@@ -39,10 +60,15 @@ void AmberCoordinateFrame::readASCII_(string const& filename) {
     // Parse all lines and save in memory
     vector<string> lines;
 
-    while (getline(input, line)) {
+    while (input.getline(line)) {
         lines.push_back(line);
     }
 
+    if (!input.good()) {
+        string msg = "Could not decompress " + filename;
+        throw AmberCrdError(msg.c_str());
+    }
+
     if (lines.size() < 2) {
         throw AmberCrdError("Too few lines in inpcrd/restart");
     }
@@ -86,13 +112,13 @@ void AmberCoordinateFrame::readASCII_(string const& filename) {
     int atomno = 0;
     for (int i = 0; i < (natom_+1)/2; i++) {
         int cl = current_line + i;
-        coordinates_->push_back(OpenMM::Vec3(StringToDouble(lines[cl].substr(0, 12)),
-                                             StringToDouble(lines[cl].substr(12, 12)),
-                                             StringToDouble(lines[cl].substr(24, 12))));
+        coordinates_->push_back(OpenMM::Vec3(rst7Field(lines[cl], 0),
+                                             rst7Field(lines[cl], 1),
+                                             rst7Field(lines[cl], 2)));
         if (++atomno < natom_) {
-            coordinates_->push_back(OpenMM::Vec3(StringToDouble(lines[cl].substr(36, 12)),
-                                                 StringToDouble(lines[cl].substr(48, 12)),
-                                                 StringToDouble(lines[cl].substr(60, 12))));
+            coordinates_->push_back(OpenMM::Vec3(rst7Field(lines[cl], 3),
+                                                 rst7Field(lines[cl], 4),
+                                                 rst7Field(lines[cl], 5)));
             ++atomno;
         }
     }
@@ -104,14 +130,14 @@ void AmberCoordinateFrame::readASCII_(string const& filename) {
         for (int i = 0; i < (natom_+1)/2; i++) {
             int cl = current_line + i;
             velocities_->push_back(
-                    OpenMM::Vec3(StringToDouble(lines[cl].substr(0, 12)) * AMBER_TIME_PER_PS,
-                                 StringToDouble(lines[cl].substr(12, 12)) * AMBER_TIME_PER_PS,
-                                 StringToDouble(lines[cl].substr(24, 12)) * AMBER_TIME_PER_PS));
+                    OpenMM::Vec3(rst7Field(lines[cl], 0) * AMBER_TIME_PER_PS,
+                                 rst7Field(lines[cl], 1) * AMBER_TIME_PER_PS,
+                                 rst7Field(lines[cl], 2) * AMBER_TIME_PER_PS));
             if (++atomno < natom_) {
                 velocities_->push_back(
-                        OpenMM::Vec3(StringToDouble(lines[cl].substr(36, 12)) * AMBER_TIME_PER_PS,
-                                     StringToDouble(lines[cl].substr(48, 12)) * AMBER_TIME_PER_PS,
-                                     StringToDouble(lines[cl].substr(60, 12)) * AMBER_TIME_PER_PS));
+                        OpenMM::Vec3(rst7Field(lines[cl], 3) * AMBER_TIME_PER_PS,
+                                     rst7Field(lines[cl], 4) * AMBER_TIME_PER_PS,
+                                     rst7Field(lines[cl], 5) * AMBER_TIME_PER_PS));
                 ++atomno;
             }
         }
@@ -119,12 +145,12 @@ void AmberCoordinateFrame::readASCII_(string const& filename) {
     }
 
     if (has_box) {
-        a_ = StringToDouble(lines[current_line].substr(0, 12));
-        b_ = StringToDouble(lines[current_line].substr(12, 12));
-        c_ = StringToDouble(lines[current_line].substr(24, 12));
-        alpha_ = StringToDouble(lines[current_line].substr(36, 12));
-        beta_ = StringToDouble(lines[current_line].substr(48, 12));
-        gama_ = StringToDouble(lines[current_line].substr(60, 12));
+        a_ = rst7Field(lines[current_line], 0);
+        b_ = rst7Field(lines[current_line], 1);
+        c_ = rst7Field(lines[current_line], 2);
+        alpha_ = rst7Field(lines[current_line], 3);
+        beta_ = rst7Field(lines[current_line], 4);
+        gama_ = rst7Field(lines[current_line], 5);
     }
 }
 
@@ -165,6 +191,102 @@ int AmberCoordinateFrame::readNetCDF_(string const& filename) {
     return 0;
 }
 
+void AmberCoordinateFrame::subset(AtomSelection const& keep,
+                                  AmberCoordinateFrame &out) const {
+    if (keep.numAtoms() != (int) coordinates_->size())
+        throw AmberCrdError("Selection does not match the number of atoms");
+    vector<int> atoms = keep.indices();
+    bool hasVelocities = velocities_->size() == coordinates_->size();
+
+    vector<OpenMM::Vec3> *crd = new vector<OpenMM::Vec3>(atoms.size());
+    vector<OpenMM::Vec3> *vel = new vector<OpenMM::Vec3>;
+    if (hasVelocities) vel->resize(atoms.size());
+    for (size_t n = 0; n < atoms.size(); n++) {
+        (*crd)[n] = (*coordinates_)[atoms[n]];
+        if (hasVelocities) (*vel)[n] = (*velocities_)[atoms[n]];
+    }
+
+    // out may be this frame, so everything is read before it is replaced
+    delete out.coordinates_;
+    delete out.velocities_;
+    out.coordinates_ = crd;
+    out.velocities_ = vel;
+    out.natom_ = (int) atoms.size();
+    out.temp0_ = temp0_;
+    out.has_remd_ = has_remd_;
+    out.a_ = a_;
+    out.b_ = b_;
+    out.c_ = c_;
+    out.alpha_ = alpha_;
+    out.beta_ = beta_;
+    out.gama_ = gama_;
+}
+
+void AmberCoordinateFrame::tile(int na, int nb, int nc,
+                                AmberCoordinateFrame &out) const {
+    if (a_ <= 0 || b_ <= 0 || c_ <= 0)
+        throw AmberCrdError("Cannot tile along the box of a frame without one");
+    UnitCell cell(a_, b_, c_, alpha_, beta_, gama_);
+    double a = a_, b = b_, c = c_;
+    tile_(na, nb, nc, cell.getVectorA(), cell.getVectorB(), cell.getVectorC(),
+          out);
+    out.a_ = a * na;
+    out.b_ = b * nb;
+    out.c_ = c * nc;
+}
+
+void AmberCoordinateFrame::tile(int na, int nb, int nc,
+                                OpenMM::Vec3 const& spacing,
+                                AmberCoordinateFrame &out) const {
+    tile_(na, nb, nc, OpenMM::Vec3(spacing[0], 0, 0),
+          OpenMM::Vec3(0, spacing[1], 0), OpenMM::Vec3(0, 0, spacing[2]), out);
+}
+
+void AmberCoordinateFrame::tile_(int na, int nb, int nc,
+                                 OpenMM::Vec3 const& avec,
+                                 OpenMM::Vec3 const& bvec,
+                                 OpenMM::Vec3 const& cvec,
+                                 AmberCoordinateFrame &out) const {
+    if (na < 1 || nb < 1 || nc < 1)
+        throw AmberCrdError("Tiling needs at least one copy in each direction");
+    int natom = (int) coordinates_->size();
+    if ((double) na * nb * nc * natom > INT_MAX)
+        throw AmberCrdError("Too many atoms in the tiled frame");
+    int ncopies = na * nb * nc;
+    bool hasVelocities = velocities_->size() == coordinates_->size();
+
+    vector<OpenMM::Vec3> *crd = new vector<OpenMM::Vec3>((size_t) natom * ncopies);
+    vector<OpenMM::Vec3> *vel = new vector<OpenMM::Vec3>;
+    if (hasVelocities) vel->resize(crd->size());
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static)
+#endif
+    for (int t = 0; t < ncopies; t++) {
+        int i = t / (nb * nc), j = (t / nc) % nb, k = t % nc;
+        OpenMM::Vec3 shift = avec * i + bvec * j + cvec * k;
+        size_t start = (size_t) t * natom;
+        for (int n = 0; n < natom; n++)
+            (*crd)[start + n] = (*coordinates_)[n] + shift;
+        if (hasVelocities)
+            copy(velocities_->begin(), velocities_->end(), vel->begin() + start);
+    }
+
+    // out may be this frame, so everything is read before it is replaced
+    delete out.coordinates_;
+    delete out.velocities_;
+    out.coordinates_ = crd;
+    out.velocities_ = vel;
+    out.natom_ = (int) crd->size();
+    out.temp0_ = temp0_;
+    out.has_remd_ = has_remd_;
+    out.a_ = a_;
+    out.b_ = b_;
+    out.c_ = c_;
+    out.alpha_ = alpha_;
+    out.beta_ = beta_;
+    out.gama_ = gama_;
+}
+
 void AmberCoordinateFrame::readRst7(const char* filename) {
     readRst7(string(filename));
 }
@@ -4,118 +4,202 @@
 
 #include "amber/amber_constants.h"
 #include "amber/amberparm.h"
+#include "amber/atommask.h"
 #include "amber/exceptions.h"
 #include "amber/gbmodels.h"
+#include "amber/parmsections.h"
 #include "amber/unitcell.h"
 
+#include <algorithm>
+#include <climits>
 #include <cmath>
+#include <cstring>
 #include <iostream>
+#include <map>
 #include <sstream>
 
 using namespace std;
 using namespace Amber;
 
-AmberParm::AmberParm(string const& filename) {
-    rdparm(filename);
+AmberParm::AmberParm(string const& filename, bool useCache) :
+    graph_stale_(false) {
+    rdparm(filename, useCache);
 }
 
-AmberParm::AmberParm(const char* filename) {
-    rdparm(filename);
+AmberParm::AmberParm(const char* filename, bool useCache) :
+    graph_stale_(false) {
+    rdparm(filename, useCache);
+}
+
+/// A key for the atom pair (i, j) that sorts by the lower index first
+static inline uint64_t pairKey(int i, int j) {
+    if (j < i) swap(i, j);
+    return (uint64_t) i << 32 | (uint32_t) j;
+}
+
+/* IDs already handed out for each distinct 4-character name, keyed on its raw
+ * bytes so that most atoms are interned without building a string
+ */
+typedef map<uint32_t, int> NameIds;
+
+static int internName(ParmName const& name, NameIds &ids, AtomTable &atoms,
+                      bool isType) {
+    uint32_t key;
+    memcpy(&key, name.c, sizeof(key));
+    NameIds::const_iterator it = ids.find(key);
+    if (it != ids.end()) return it->second;
+    int id = isType ? atoms.internType(nameString(name))
+                    : atoms.internName(nameString(name));
+    ids.insert(make_pair(key, id));
+    return id;
 }
 
 /// Implement the add**** methods
 void AmberParm::addAtom(Atom& new_atom) {
-    if (new_atom.getIndex() != (int) atoms_.size())
+    if (new_atom.getIndex() != atoms_.size())
         throw AmberParmError("Atoms must be added sequentially!");
     atoms_.push_back(new_atom);
+    graph_stale_ = true;
 }
 
 void AmberParm::addAtom(std::string const& name, std::string const& type,
                         int element, double mass, double charge, double lj_rad,
                         double lj_eps, double gb_rad, double gb_screen) {
-    int i = (int) atoms_.size();
-    atoms_.push_back(Atom(i, name, type, element, mass, charge, lj_rad,
-                          lj_eps, gb_rad, gb_screen));
+    atoms_.add(atoms_.internName(name), atoms_.internType(type), element,
+               mass, charge, lj_rad, lj_eps, gb_rad, gb_screen);
+    graph_stale_ = true;
 }
 
 void AmberParm::addAtom(const char* name, const char* type,
                         int element, double mass, double charge, double lj_rad,
                         double lj_eps, double gb_rad, double gb_screen) {
-    int i = (int) atoms_.size();
-    atoms_.push_back(Atom(i, name, type, element, mass, charge, lj_rad,
-                          lj_eps, gb_rad, gb_screen));
+    addAtom(string(name), string(type), element, mass, charge, lj_rad, lj_eps,
+            gb_rad, gb_screen);
+}
+
+int AmberParm::getResidueOf(int atom) const {
+    if (residue_labels_.empty() || atom < 0 || atom >= residue_pointers_.back())
+        return -1;
+    // The first residue that starts after the atom, minus one
+    return (int) (upper_bound(residue_pointers_.begin(),
+                              residue_pointers_.end(), atom) -
+                  residue_pointers_.begin()) - 1;
 }
 
 // addBonds
 void AmberParm::addBond(Bond& new_bond) {
-    int i = new_bond.getAtomI();
-    int j = new_bond.getAtomJ();
+    addBond(new_bond.getAtomI(), new_bond.getAtomJ(),
+            new_bond.getForceConstant(), new_bond.getEquilibriumDistance());
+}
+
+void AmberParm::addBond(int i, int j, double kf, double req) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom)
         throw AmberParmError("Bond atom index out of range");
-    bonds_.push_back(new_bond);
+    bonds_.add(BondTerm(i, j, bonds_.internType(BondType(kf, req))));
+    graph_stale_ = true;
 }
 
-void AmberParm::addBond(int i, int j, double kf, double req) {
+void AmberParm::addBond(int i, int j, int type) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom)
         throw AmberParmError("Bond atom index out of range");
-    bonds_.push_back(Bond(i, j, kf, req));
+    if (type < 0 || type >= bonds_.numTypes())
+        throw AmberParmError("Bond type out of range");
+    bonds_.add(BondTerm(i, j, type));
+    graph_stale_ = true;
 }
 
 // addAngles
 void AmberParm::addAngle(Angle& new_angle) {
-    int i = new_angle.getAtomI();
-    int j = new_angle.getAtomJ();
-    int k = new_angle.getAtomK();
+    addAngle(new_angle.getAtomI(), new_angle.getAtomJ(), new_angle.getAtomK(),
+             new_angle.getForceConstant(), new_angle.getEquilibriumAngle());
+}
+
+void AmberParm::addAngle(int i, int j, int k, double kf, double theteq) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom || k < 0 || k >= natom)
         throw AmberParmError("Angle atom index out of range");
-    angles_.push_back(new_angle);
+    angles_.add(AngleTerm(i, j, k, angles_.internType(AngleType(kf, theteq))));
 }
 
-void AmberParm::addAngle(int i, int j, int k, double kf, double theteq) {
+void AmberParm::addAngle(int i, int j, int k, int type) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom || k < 0 || k >= natom)
         throw AmberParmError("Angle atom index out of range");
-    angles_.push_back(Angle(i, j, k, kf, theteq));
+    if (type < 0 || type >= angles_.numTypes())
+        throw AmberParmError("Angle type out of range");
+    angles_.add(AngleTerm(i, j, k, type));
 }
 
 // addDihedrals
 void AmberParm::addDihedral(Dihedral& new_dihedral) {
-    int i = new_dihedral.getAtomI();
-    int j = new_dihedral.getAtomJ();
-    int k = new_dihedral.getAtomK();
-    int l = new_dihedral.getAtomL();
+    addDihedral(new_dihedral.getAtomI(), new_dihedral.getAtomJ(),
+                new_dihedral.getAtomK(), new_dihedral.getAtomL(),
+                new_dihedral.getForceConstant(), new_dihedral.getPhase(),
+                new_dihedral.getPeriodicity(), new_dihedral.getScee(),
+                new_dihedral.getScnb(), new_dihedral.ignoreEndGroups());
+}
+
+void AmberParm::addDihedral(int i, int j, int k, int l, double kf, double phase,
+                            int periodicity, double scee, double scnb,
+                            bool ignore_end) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom || k < 0 || k >= natom ||
         l < 0 || l >= natom)
         throw AmberParmError("Dihedral atom index out of range");
-    dihedrals_.push_back(new_dihedral);
+    int type = dihedrals_.internType(DihedralType(kf, phase, periodicity,
+                                                  scee, scnb));
+    dihedrals_.add(DihedralTerm(i, j, k, l, type, ignore_end));
 }
 
-void AmberParm::addDihedral(int i, int j, int k, int l, double kf, double phase,
-                            int periodicity, double scee, double scnb,
+void AmberParm::addDihedral(int i, int j, int k, int l, int type,
                             bool ignore_end) {
     int natom = (int)atoms_.size();
     if (i < 0 || i >= natom || j < 0 || j >= natom || k < 0 || k >= natom ||
         l < 0 || l >= natom)
         throw AmberParmError("Dihedral atom index out of range");
-    dihedrals_.push_back(Dihedral(i, j, k, l, kf, phase, periodicity,
-                                  scee, scnb, ignore_end));
+    if (type < 0 || type >= dihedrals_.numTypes())
+        throw AmberParmError("Dihedral type out of range");
+    dihedrals_.add(DihedralTerm(i, j, k, l, type, ignore_end));
 }
 
-void AmberParm::rdparm(string const& filename) {
+// Parameter types
+void AmberParm::setBondType(int id, BondType const& type) {
+    if (id < 0 || id >= bonds_.numTypes())
+        throw AmberParmError("Bond type out of range");
+    bonds_.setType(id, type);
+}
 
-    // Data structures for parsing data from the prmtop
-    ParmDataMap parmData;
-    ParmStringMap parmComments, unkParmData;
-    ParmFormatMap parmFormats;
-    vector<string> flagList;
-    string version;
+void AmberParm::setAngleType(int id, AngleType const& type) {
+    if (id < 0 || id >= angles_.numTypes())
+        throw AmberParmError("Angle type out of range");
+    angles_.setType(id, type);
+}
 
-    ExitStatus retval = readparm(filename, flagList, parmData, parmComments,
-                                 unkParmData, parmFormats, version);
+void AmberParm::setDihedralType(int id, DihedralType const& type) {
+    if (id < 0 || id >= dihedrals_.numTypes())
+        throw AmberParmError("Dihedral type out of range");
+    dihedrals_.setType(id, type);
+}
+
+void AmberParm::rdparm(string const& filename, bool useCache) {
+
+    uint64_t hash = 0, size = 0;
+    graph_stale_ = true; // until the new topology is completely read
+    if (useCache && readCache_(filename, hash, size)) {
+        graph_.build(atoms_.size(), bonds_);
+        graph_stale_ = false;
+        return;
+    }
+
+    /* Sections are decoded the first time they are used below, so the ones we
+     * never look at (SOLTY, HBOND_ACOEF, TREE_CHAIN_CLASSIFICATION, JOIN_ARRAY,
+     * IROTAT, ...) are never decoded at all
+     */
+    ParmSectionStore parmData;
+
+    ExitStatus retval = parmData.open(filename);
 
     if (retval == NOOPEN) {
         string msg = "Could not open " + filename + " for reading";
@@ -140,301 +224,612 @@ void AmberParm::rdparm(string const& filename) {
     // If we got here, we must have been successful in our parsing
 
     // First add our atoms
-    string atomic_number = "ATOMIC_NUMBER";
-    string atom_name = "ATOM_NAME";
-    string atom_type = "AMBER_ATOM_TYPE";
-    string radii = "RADII";
-    string screen = "SCREEN";
-    string acoef = "LENNARD_JONES_ACOEF";
-    string bcoef = "LENNARD_JONES_BCOEF";
-    string ljtype = "ATOM_TYPE_INDEX";
-    string nbidx = "NONBONDED_PARM_INDEX";
-    string pointers = "POINTERS";
-    string mass = "MASS";
-    string charge = "CHARGE";
-    string resptr = "RESIDUE_POINTER";
-    string reslab = "RESIDUE_LABEL";
-
-    if (parmData.count(pointers) < 1)
+    if (!parmData.has(PRM_POINTERS) || parmData.size(PRM_POINTERS) <= IFBOX)
         throw AmberParmError("Missing POINTERS in prmtop");
-    int N = parmData[pointers][NATOM].i;
-    int NR = parmData[pointers][NRES].i;
-    ifbox_ = parmData[pointers][IFBOX].i;
+    vector<int32_t> const& pointers = parmData.ints(PRM_POINTERS);
+    int N = pointers[NATOM];
+    int NR = pointers[NRES];
+    ifbox_ = pointers[IFBOX];
 
-    // Allocate space for the exclusion and exception lists
-    exclusion_list_.reserve(N);
-    vector<set<int> > exception_list(N);
-    for (int i = 0; i < N; i++) {
-        set<int> s1;
-        set<int> s2;
-        exclusion_list_.push_back(s1);
-        exception_list.push_back(s2);
-    }
+    /* The 1-4 pairs of the dihedrals, which are exceptions rather than
+     * exclusions, as pairKey(lower index, higher index)
+     */
+    vector<uint64_t> exception_list;
 
-    if (parmData.count(atomic_number) < 1 || parmData[atomic_number].size() != N)
+    if (!parmData.has(PRM_ATOMIC_NUMBER) || parmData.size(PRM_ATOMIC_NUMBER) != N)
         throw AmberParmError(
                 "Missing ATOMIC_NUMBER in prmtop or wrong # of elements");
-    if (parmData.count(atom_name) < 1 || parmData[atom_name].size() != N)
+    if (!parmData.has(PRM_ATOM_NAME) || parmData.size(PRM_ATOM_NAME) != N)
         throw AmberParmError("Missing  ATOM_NAME in prmtop");
-    if (parmData.count(atom_type) < 1 || parmData[atom_type].size() != N)
+    if (!parmData.has(PRM_AMBER_ATOM_TYPE) || parmData.size(PRM_AMBER_ATOM_TYPE) != N)
         throw AmberParmError(
                 "Missing AMBER_ATOM_TYPE in prmtop or wrong # of elements");
-    if (parmData.count(radii) < 1 || parmData[radii].size() != N)
+    if (!parmData.has(PRM_RADII) || parmData.size(PRM_RADII) != N)
         throw AmberParmError("Missing RADII in prmtop or wrong # of elements");
-    if (parmData.count(screen) < 1 || parmData[screen].size() != N)
+    if (!parmData.has(PRM_SCREEN) || parmData.size(PRM_SCREEN) != N)
         throw AmberParmError("Missing SCREEN in prmtop or wrong # of elements");
-    if (parmData.count(acoef) < 1)
+    if (!parmData.has(PRM_LENNARD_JONES_ACOEF))
         throw AmberParmError("Missing LENNARD_JONES_ACOEF in prmtop");
-    if (parmData.count(bcoef) < 1)
+    if (!parmData.has(PRM_LENNARD_JONES_BCOEF))
         throw AmberParmError("Missing LENNARD_JONES_BCOEF in prmtop");
-    if (parmData.count(ljtype) < 1 || parmData[ljtype].size() != N)
+    if (!parmData.has(PRM_ATOM_TYPE_INDEX) || parmData.size(PRM_ATOM_TYPE_INDEX) != N)
         throw AmberParmError(
                 "Missing ATOM_TYPE_INDEX in prmtop or wrong # of elements");
-    if (parmData.count(nbidx) < 1)
+    if (!parmData.has(PRM_NONBONDED_PARM_INDEX))
         throw AmberParmError("Missing NONBONDED_PARM_INDEX in prmtop");
-    if (parmData.count(mass) < 1 || parmData[mass].size() != N)
+    if (!parmData.has(PRM_MASS) || parmData.size(PRM_MASS) != N)
         throw AmberParmError("Missing MASS in prmtop or wrong # of elements");
-    if (parmData.count(charge) < 1 || parmData[charge].size() != N)
+    if (!parmData.has(PRM_CHARGE) || parmData.size(PRM_CHARGE) != N)
         throw AmberParmError("Missing CHARGE in prmtop or wrong # of elements");
-    if (parmData.count(reslab) < 1 || parmData[reslab].size() != NR)
+    if (!parmData.has(PRM_RESIDUE_LABEL) || parmData.size(PRM_RESIDUE_LABEL) != NR)
         throw AmberParmError(
                 "Missing RESIDUE_LABEL in prmtop or wrong # of elements");
-    if (parmData.count(resptr) < 1 || parmData[resptr].size() != NR)
+    if (!parmData.has(PRM_RESIDUE_POINTER) || parmData.size(PRM_RESIDUE_POINTER) != NR)
         throw AmberParmError(
                 "Missing RESIDUE_POINTER in prmtop or wrong # of elements");
 
     // Now extract the per-particle LJ rmin/epsilon parameters
+    vector<double> const& acoef = parmData.reals(PRM_LENNARD_JONES_ACOEF);
+    vector<double> const& bcoef = parmData.reals(PRM_LENNARD_JONES_BCOEF);
+    vector<int32_t> const& nbidx = parmData.ints(PRM_NONBONDED_PARM_INDEX);
     vector<double> lj_rmin, lj_eps;
-    int ntypes = parmData[pointers][NTYPES].i;
+    int ntypes = pointers[NTYPES];
     const double ONE_SIXTH = 1.0 / 6.0;
     for (int i = 0; i < ntypes; i++) {
-        int lj_index = parmData[nbidx][ntypes*i+i].i - 1;
-        if (parmData[acoef][lj_index].f < 1.0e-10) {
+        int lj_index = nbidx[ntypes*i+i] - 1;
+        if (acoef[lj_index] < 1.0e-10) {
             lj_rmin.push_back(0.5);
             lj_eps.push_back(0);
         } else {
-            double factor = 2 * parmData[acoef][lj_index].f /
-                                parmData[bcoef][lj_index].f;
+            double factor = 2 * acoef[lj_index] / bcoef[lj_index];
             lj_rmin.push_back(pow(factor, ONE_SIXTH) * 0.5);
-            lj_eps.push_back(parmData[bcoef][lj_index].f * 0.5 / factor);
+            lj_eps.push_back(bcoef[lj_index] * 0.5 / factor);
         }
     }
 
     // Now add the atoms
-    for (int i = 0; i < parmData[pointers][NATOM].i; i++) {
-        int typ = parmData[ljtype][i].i;
-        double chg = parmData[charge][i].f / 18.2223;
-        addAtom(parmData[atom_name][i].c, parmData[atom_type][i].c,
-                parmData[atomic_number][i].i, parmData[mass][i].f,
-                chg, lj_rmin[typ-1], lj_eps[typ-1],
-                parmData[radii][i].f, parmData[screen][i].f);
+    vector<ParmName> const& atom_name = parmData.names(PRM_ATOM_NAME);
+    vector<ParmName> const& atom_type = parmData.names(PRM_AMBER_ATOM_TYPE);
+    vector<int32_t> const& atomic_number = parmData.ints(PRM_ATOMIC_NUMBER);
+    vector<int32_t> const& ljtype = parmData.ints(PRM_ATOM_TYPE_INDEX);
+    vector<double> const& mass = parmData.reals(PRM_MASS);
+    vector<double> const& charge = parmData.reals(PRM_CHARGE);
+    vector<double> const& radii = parmData.reals(PRM_RADII);
+    vector<double> const& screen = parmData.reals(PRM_SCREEN);
+    atoms_.clear();
+    atoms_.reserve(N);
+    NameIds name_ids, type_ids;
+    for (int i = 0; i < N; i++) {
+        int typ = ljtype[i];
+        double chg = charge[i] / 18.2223;
+        atoms_.add(internName(atom_name[i], name_ids, atoms_, false),
+                   internName(atom_type[i], type_ids, atoms_, true),
+                   atomic_number[i], mass[i], chg, lj_rmin[typ-1],
+                   lj_eps[typ-1], radii[i], screen[i]);
     }
 
     // Now add the residues
-    for (int i = 0; i < parmData[pointers][NRES].i; i++) {
-        residue_pointers_.push_back(parmData[resptr][i].i-1);
-        residue_labels_.push_back(string(parmData[reslab][i].c));
+    vector<int32_t> const& resptr = parmData.ints(PRM_RESIDUE_POINTER);
+    vector<ParmName> const& reslab = parmData.names(PRM_RESIDUE_LABEL);
+    residue_pointers_.clear();
+    residue_labels_.clear();
+    residue_pointers_.reserve(NR + 1);
+    residue_labels_.reserve(NR);
+    for (int i = 0; i < NR; i++) {
+        residue_pointers_.push_back(resptr[i]-1);
+        residue_labels_.push_back(nameString(reslab[i]));
     }
     // Make it so the trick of subtracting pointers[n+1]-pointers[n] works even
     // for the last residue
     residue_pointers_.push_back(N);
 
     // Now add the bonds
-    string bonds = "BONDS_WITHOUT_HYDROGEN";
-    string bondsh = "BONDS_INC_HYDROGEN";
-    string bondk = "BOND_FORCE_CONSTANT";
-    string bondeq = "BOND_EQUIL_VALUE";
-    int nbonh = parmData[pointers][NBONH].i;
-    int mbona = parmData[pointers][MBONA].i;
-    int numbnd = parmData[pointers][NUMBND].i;
-
-    if (mbona != 0 && (parmData.count(bonds) < 1 || parmData[bonds].size() != mbona*3))
+    int nbonh = pointers[NBONH];
+    int mbona = pointers[MBONA];
+    int numbnd = pointers[NUMBND];
+
+    if (mbona != 0 && (!parmData.has(PRM_BONDS_WITHOUT_HYDROGEN) ||
+                parmData.size(PRM_BONDS_WITHOUT_HYDROGEN) != mbona*3))
         throw AmberParmError("Bad (or missing) BONDS_WITHOUT_HYDROGEN section");
-    if (nbonh != 0 && (parmData.count(bondsh) < 1 || parmData[bondsh].size() != nbonh*3))
+    if (nbonh != 0 && (!parmData.has(PRM_BONDS_INC_HYDROGEN) ||
+                parmData.size(PRM_BONDS_INC_HYDROGEN) != nbonh*3))
         throw AmberParmError("Bad (or missing) BONDS_INC_HYDROGEN section");
-    if (numbnd != 0 && (parmData.count(bondk) < 1 || parmData[bondk].size() != numbnd))
+    if (numbnd != 0 && (!parmData.has(PRM_BOND_FORCE_CONSTANT) ||
+                parmData.size(PRM_BOND_FORCE_CONSTANT) != numbnd))
         throw AmberParmError("Bad (or missing) BOND_FORCE_CONSTANT section");
-    if (numbnd != 0 && (parmData.count(bondeq) < 1 || parmData[bondeq].size() != numbnd))
+    if (numbnd != 0 && (!parmData.has(PRM_BOND_EQUIL_VALUE) ||
+                parmData.size(PRM_BOND_EQUIL_VALUE) != numbnd))
         throw AmberParmError("Bad (or missing) BOND_EQUIL_VALUE section");
+
+    vector<int32_t> const& bondsh = parmData.ints(PRM_BONDS_INC_HYDROGEN);
+    vector<int32_t> const& bonds = parmData.ints(PRM_BONDS_WITHOUT_HYDROGEN);
+    vector<double> const& bondk = parmData.reals(PRM_BOND_FORCE_CONSTANT);
+    vector<double> const& bondeq = parmData.reals(PRM_BOND_EQUIL_VALUE);
+    bonds_.clear();
+    bonds_.reserve(nbonh + mbona);
+    for (int i = 0; i < numbnd; i++)
+        bonds_.addType(BondType(bondk[i], bondeq[i]));
     for (int i = 0; i < nbonh; i++) {
         int i3 = i * 3;
-        int ii = parmData[bondsh][i3  ].i / 3;
-        int jj = parmData[bondsh][i3+1].i / 3;
-        int bi = parmData[bondsh][i3+2].i - 1;
-        addBond(ii, jj, parmData[bondk][bi].f, parmData[bondeq][bi].f);
+        int ii = bondsh[i3  ] / 3;
+        int jj = bondsh[i3+1] / 3;
+        int bi = bondsh[i3+2] - 1;
+        addBond(ii, jj, bi);
     }
     for (int i = 0; i < mbona; i++) {
         int i3 = i * 3;
-        int ii = parmData[bonds][i3  ].i / 3;
-        int jj = parmData[bonds][i3+1].i / 3;
-        int bi = parmData[bonds][i3+2].i - 1;
-        addBond(ii, jj, parmData[bondk][bi].f, parmData[bondeq][bi].f);
+        int ii = bonds[i3  ] / 3;
+        int jj = bonds[i3+1] / 3;
+        int bi = bonds[i3+2] - 1;
+        addBond(ii, jj, bi);
     }
+    // Free the index arrays as soon as they are consumed to keep peak memory
+    // down for large systems
+    parmData.release(PRM_BONDS_INC_HYDROGEN);
+    parmData.release(PRM_BONDS_WITHOUT_HYDROGEN);
 
     // Now add the angles
-    string angles = "ANGLES_WITHOUT_HYDROGEN";
-    string anglesh = "ANGLES_INC_HYDROGEN";
-    string anglek = "ANGLE_FORCE_CONSTANT";
-    string angleeq = "ANGLE_EQUIL_VALUE";
-    int ntheth = parmData[pointers][NTHETH].i;
-    int mtheta = parmData[pointers][MTHETA].i;
-    int numang = parmData[pointers][NUMANG].i;
-
-    if (mtheta != 0 && (parmData.count(angles) < 1 || parmData[angles].size() != mtheta*4))
+    int ntheth = pointers[NTHETH];
+    int mtheta = pointers[MTHETA];
+    int numang = pointers[NUMANG];
+
+    if (mtheta != 0 && (!parmData.has(PRM_ANGLES_WITHOUT_HYDROGEN) ||
+                parmData.size(PRM_ANGLES_WITHOUT_HYDROGEN) != mtheta*4))
         throw AmberParmError("Bad (or missing) ANGLES_WITHOUT_HYDROGEN section");
-    if (ntheth != 0 && (parmData.count(anglesh) < 1 || parmData[anglesh].size() != ntheth*4))
+    if (ntheth != 0 && (!parmData.has(PRM_ANGLES_INC_HYDROGEN) ||
+                parmData.size(PRM_ANGLES_INC_HYDROGEN) != ntheth*4))
         throw AmberParmError("Bad (or missing) ANGLES_INC_HYDROGEN section");
-    if (numang != 0 && (parmData.count(anglek) < 1 || parmData[anglek].size() != numang))
+    if (numang != 0 && (!parmData.has(PRM_ANGLE_FORCE_CONSTANT) ||
+                parmData.size(PRM_ANGLE_FORCE_CONSTANT) != numang))
         throw AmberParmError("Bad (or missing) ANGLE_FORCE_CONSTANT section");
-    if (numang != 0 && (parmData.count(angleeq) < 1 || parmData[angleeq].size() != numang))
+    if (numang != 0 && (!parmData.has(PRM_ANGLE_EQUIL_VALUE) ||
+                parmData.size(PRM_ANGLE_EQUIL_VALUE) != numang))
         throw AmberParmError("Bad (or missing) ANGLE_EQUIL_VALUE section");
 
+    vector<int32_t> const& anglesh = parmData.ints(PRM_ANGLES_INC_HYDROGEN);
+    vector<int32_t> const& angles = parmData.ints(PRM_ANGLES_WITHOUT_HYDROGEN);
+    vector<double> const& anglek = parmData.reals(PRM_ANGLE_FORCE_CONSTANT);
+    vector<double> const& angleeq = parmData.reals(PRM_ANGLE_EQUIL_VALUE);
+    angles_.clear();
+    angles_.reserve(ntheth + mtheta);
+    for (int i = 0; i < numang; i++)
+        angles_.addType(AngleType(anglek[i], angleeq[i] * 180.0 / M_PI));
     for (int i = 0; i < ntheth; i++) {
         int i4 = i * 4;
-        int ii = parmData[anglesh][i4  ].i / 3;
-        int jj = parmData[anglesh][i4+1].i / 3;
-        int kk = parmData[anglesh][i4+2].i / 3;
-        int ai = parmData[anglesh][i4+3].i - 1;
-        double ang = parmData[angleeq][ai].f * 180.0 / M_PI;
-        addAngle(ii, jj, kk, parmData[anglek][ai].f, ang);
+        int ii = anglesh[i4  ] / 3;
+        int jj = anglesh[i4+1] / 3;
+        int kk = anglesh[i4+2] / 3;
+        int ai = anglesh[i4+3] - 1;
+        addAngle(ii, jj, kk, ai);
     }
     for (int i = 0; i < mtheta; i++) {
         int i4 = i * 4;
-        int ii = parmData[angles][i4  ].i / 3;
-        int jj = parmData[angles][i4+1].i / 3;
-        int kk = parmData[angles][i4+2].i / 3;
-        int ai = parmData[angles][i4+3].i - 1;
-        double ang = parmData[angleeq][ai].f * 180.0 / M_PI;
-        addAngle(ii, jj, kk, parmData[anglek][ai].f, ang);
+        int ii = angles[i4  ] / 3;
+        int jj = angles[i4+1] / 3;
+        int kk = angles[i4+2] / 3;
+        int ai = angles[i4+3] - 1;
+        addAngle(ii, jj, kk, ai);
     }
+    parmData.release(PRM_ANGLES_INC_HYDROGEN);
+    parmData.release(PRM_ANGLES_WITHOUT_HYDROGEN);
 
     // Now add the dihedrals
-    string dihedrals = "DIHEDRALS_WITHOUT_HYDROGEN";
-    string dihedralsh = "DIHEDRALS_INC_HYDROGEN";
-    string dihedralk = "DIHEDRAL_FORCE_CONSTANT";
-    string dihedralphase = "DIHEDRAL_PHASE";
-    string dihedralperiodicity = "DIHEDRAL_PERIODICITY";
-    string scee = "SCEE_SCALE_FACTOR";
-    string scnb = "SCNB_SCALE_FACTOR";
-    int nphih = parmData[pointers][NPHIH].i;
-    int mphia = parmData[pointers][MPHIA].i;
-    int nptra = parmData[pointers][NPTRA].i;
+    int nphih = pointers[NPHIH];
+    int mphia = pointers[MPHIA];
+    int nptra = pointers[NPTRA];
 
     vector<double> sceefac(nptra, 1.2);
     vector<double> scnbfac(nptra, 2.0);
 
-    if (mphia != 0 && (parmData.count(dihedrals) < 1 || parmData[dihedrals].size() != mphia*5))
+    if (mphia != 0 && (!parmData.has(PRM_DIHEDRALS_WITHOUT_HYDROGEN) ||
+                parmData.size(PRM_DIHEDRALS_WITHOUT_HYDROGEN) != mphia*5))
         throw AmberParmError("Bad (or missing) DIHEDRALS_WITHOUT_HYDROGEN section");
-    if (nphih != 0 && (parmData.count(dihedralsh) < 1 || parmData[dihedralsh].size() != nphih*5))
+    if (nphih != 0 && (!parmData.has(PRM_DIHEDRALS_INC_HYDROGEN) ||
+                parmData.size(PRM_DIHEDRALS_INC_HYDROGEN) != nphih*5))
         throw AmberParmError("Bad (or missing) DIHEDRALS_INC_HYDROGEN section");
-    if (nptra != 0 && (parmData.count(dihedralk) < 1 || parmData[dihedralk].size() != nptra))
+    if (nptra != 0 && (!parmData.has(PRM_DIHEDRAL_FORCE_CONSTANT) ||
+                parmData.size(PRM_DIHEDRAL_FORCE_CONSTANT) != nptra))
         throw AmberParmError("Bad (or missing) DIHEDRAL_FORCE_CONSTANT section");
-    if (nptra != 0 && (parmData.count(dihedralphase) < 1 || 
-                parmData[dihedralphase].size() != nptra))
+    if (nptra != 0 && (!parmData.has(PRM_DIHEDRAL_PHASE) ||
+                parmData.size(PRM_DIHEDRAL_PHASE) != nptra))
         throw AmberParmError("Bad (or missing) DIHEDRAL_PHASE section");
-    if (nptra != 0 && (parmData.count(dihedralperiodicity) < 1 || 
-                parmData[dihedralperiodicity].size() != nptra))
+    if (nptra != 0 && (!parmData.has(PRM_DIHEDRAL_PERIODICITY) ||
+                parmData.size(PRM_DIHEDRAL_PERIODICITY) != nptra))
         throw AmberParmError("Bad (or missing) DIHEDRAL_PERIODICITY section");
-    if (parmData.count(scee) > 0) {
+    if (parmData.has(PRM_SCEE_SCALE_FACTOR)) {
+        vector<double> const& scee = parmData.reals(PRM_SCEE_SCALE_FACTOR);
         for (int i = 0; i < nptra; i++)
-            sceefac[i] = parmData[scee][i].f;
+            sceefac[i] = scee[i];
     }
-    if (parmData.count(scnb) > 0) {
+    if (parmData.has(PRM_SCNB_SCALE_FACTOR)) {
+        vector<double> const& scnb = parmData.reals(PRM_SCNB_SCALE_FACTOR);
         for (int i = 0; i < nptra; i++)
-            scnbfac[i] = parmData[scnb][i].f;
+            scnbfac[i] = scnb[i];
     }
 
+    vector<int32_t> const& dihedralsh =
+            parmData.ints(PRM_DIHEDRALS_INC_HYDROGEN);
+    vector<int32_t> const& dihedrals =
+            parmData.ints(PRM_DIHEDRALS_WITHOUT_HYDROGEN);
+    vector<double> const& dihedralk = parmData.reals(PRM_DIHEDRAL_FORCE_CONSTANT);
+    vector<double> const& dihedralphase = parmData.reals(PRM_DIHEDRAL_PHASE);
+    vector<double> const& dihedralperiodicity =
+            parmData.reals(PRM_DIHEDRAL_PERIODICITY);
+    dihedrals_.clear();
+    dihedrals_.reserve(nphih + mphia);
+    for (int i = 0; i < nptra; i++)
+        dihedrals_.addType(DihedralType(dihedralk[i],
+                                        dihedralphase[i] * 180.0 / M_PI,
+                                        (int) dihedralperiodicity[i],
+                                        sceefac[i], scnbfac[i]));
     for (int i = 0; i < nphih; i++) {
         int i5 = i * 5;
-        int ii = parmData[dihedralsh][i5  ].i / 3;
-        int jj = parmData[dihedralsh][i5+1].i / 3;
-        int kk = parmData[dihedralsh][i5+2].i / 3;
-        int ll = parmData[dihedralsh][i5+3].i / 3;
-        int ai = parmData[dihedralsh][i5+4].i - 1;
-        double phase = parmData[dihedralphase][ai].f * 180.0 / M_PI;
-        int per = (int) parmData[dihedralperiodicity][ai].f;
+        int ii = dihedralsh[i5  ] / 3;
+        int jj = dihedralsh[i5+1] / 3;
+        int kk = dihedralsh[i5+2] / 3;
+        int ll = dihedralsh[i5+3] / 3;
+        int ai = dihedralsh[i5+4] - 1;
         bool ignore_end = kk < 0 || ll < 0;
-        addDihedral(ii, jj, abs(kk), abs(ll), parmData[dihedralk][ai].f, phase,
-                    per, sceefac[ai], scnbfac[ai], ignore_end);
+        addDihedral(ii, jj, abs(kk), abs(ll), ai, ignore_end);
         // Add this to the exception list (NOT the exclusion list)
-        if (!ignore_end) {
-            if (ii < ll) {
-                exception_list[ii].insert(ll);
-            } else {
-                exception_list[ll].insert(ii);
-            }
-        }
+        if (!ignore_end)
+            exception_list.push_back(pairKey(ii, ll));
     }
     for (int i = 0; i < mphia; i++) {
         int i5 = i * 5;
-        int ii = parmData[dihedrals][i5  ].i / 3;
-        int jj = parmData[dihedrals][i5+1].i / 3;
-        int kk = parmData[dihedrals][i5+2].i / 3;
-        int ll = parmData[dihedrals][i5+3].i / 3;
-        int ai = parmData[dihedrals][i5+4].i - 1;
-        double phase = parmData[dihedralphase][ai].f * 180.0 / M_PI;
-        int per = (int) parmData[dihedralperiodicity][ai].f;
+        int ii = dihedrals[i5  ] / 3;
+        int jj = dihedrals[i5+1] / 3;
+        int kk = dihedrals[i5+2] / 3;
+        int ll = dihedrals[i5+3] / 3;
+        int ai = dihedrals[i5+4] - 1;
         bool ignore_end = kk < 0 || ll < 0;
-        addDihedral(ii, jj, abs(kk), abs(ll), parmData[dihedralk][ai].f, phase,
-                    per, sceefac[ai], scnbfac[ai], ignore_end);
+        addDihedral(ii, jj, abs(kk), abs(ll), ai, ignore_end);
         // Add this to the exception list (NOT the exclusion list)
-        if (!ignore_end) {
-            if (ii < ll) {
-                exception_list[ii].insert(ll);
-            } else {
-                exception_list[ll].insert(ii);
-            }
-        }
+        if (!ignore_end)
+            exception_list.push_back(pairKey(ii, ll));
     }
 
-    // Now go through and build the exclusion list
-    string num_exclusions = "NUMBER_EXCLUDED_ATOMS";
-    string exclusions = "EXCLUDED_ATOMS_LIST";
+    parmData.release(PRM_DIHEDRALS_INC_HYDROGEN);
+    parmData.release(PRM_DIHEDRALS_WITHOUT_HYDROGEN);
 
-    if (parmData.count(num_exclusions) < 1 ||
-            parmData[num_exclusions].size() != N)
+    // Now go through and build the exclusion list
+    if (!parmData.has(PRM_NUMBER_EXCLUDED_ATOMS) ||
+            parmData.size(PRM_NUMBER_EXCLUDED_ATOMS) != N)
         throw AmberParmError("Bad (or missing) NUMBER_EXCLUDED_ATOMS section");
+    vector<int32_t> const& num_exclusions =
+            parmData.ints(PRM_NUMBER_EXCLUDED_ATOMS);
+    vector<int32_t> const& exclusions = parmData.ints(PRM_EXCLUDED_ATOMS_LIST);
+    int nexcltot = (int) exclusions.size();
     int exclptr = 0;
+    sort(exception_list.begin(), exception_list.end());
+    // The exceptions of atom i follow those of atom i-1 in the sorted list
+    vector<uint64_t>::const_iterator exc_begin = exception_list.begin();
+    vector<uint64_t>::const_iterator exc_end = exc_begin;
+    vector<int> row;
+    exclusion_list_.clear();
+    exclusion_list_.reserve(N, exclusions.size());
     for (int i = 0; i < N; i++) {
-        int nexcl = parmData[num_exclusions][i].i;
+        int nexcl = num_exclusions[i];
+        if (nexcl < 0 || exclptr + nexcl > nexcltot)
+            throw AmberParmError("Bad (or missing) EXCLUDED_ATOMS_LIST section");
+        exc_begin = exc_end;
+        while (exc_end != exception_list.end() && (int) (*exc_end >> 32) == i)
+            exc_end++;
+        row.clear();
         for (int j = exclptr; j < exclptr + nexcl; j++) {
-            int e = parmData[exclusions][j].i - 1;
+            int e = exclusions[j] - 1;
             if (e < 0) continue;
-            if (exception_list[i].count(e) > 0) continue; // it is an exception
-            exclusion_list_[i].insert(e);
+            // Skip the exceptions
+            if (e > i && binary_search(exc_begin, exc_end, pairKey(i, e)))
+                continue;
+            row.push_back(e);
         }
+        exclusion_list_.addAtom(row.empty() ? NULL : &row[0], (int) row.size());
         exclptr += nexcl;
     }
 
     // Now see if we have to set the unit cell
     if (ifbox_ > 0) {
-        string box = "BOX_DIMENSIONS";
-        double a = parmData[box][1].f,
-               b = parmData[box][2].f,
-               c = parmData[box][3].f,
-               alpha = parmData[box][0].f,
-               beta = parmData[box][0].f,
-               gamma = parmData[box][0].f;
+        if (parmData.size(PRM_BOX_DIMENSIONS) < 4)
+            throw AmberParmError("Bad (or missing) BOX_DIMENSIONS section");
+        vector<double> const& box = parmData.reals(PRM_BOX_DIMENSIONS);
+        double a = box[1],
+               b = box[2],
+               c = box[3],
+               alpha = box[0],
+               beta = box[0],
+               gamma = box[0];
         unit_cell_.setUnitCell(a, b, c, alpha, beta, gamma);
+    } else {
+        unit_cell_ = UnitCell();
     }
+
+    graph_.build(atoms_.size(), bonds_);
+    graph_stale_ = false;
+
+    // A cache we cannot write (e.g., read-only directory) is not an error
+    if (useCache && size > 0)
+        writeCache_(filename, hash, size);
 }
 
-void AmberParm::rdparm(const char* filename) {
-    rdparm(string(filename));
+void AmberParm::rdparm(const char* filename, bool useCache) {
+    rdparm(string(filename), useCache);
+}
+
+AmberParm AmberParm::subset(AtomSelection const& keep) const {
+    int natom = atoms_.size();
+    if (keep.numAtoms() != natom)
+        throw AmberParmError("Selection does not match the number of atoms");
+
+    // Old -> new atom index, or -1 for atoms that are removed
+    vector<int> newIndex(natom, -1);
+    int nkept = 0;
+    for (int i = 0; i < natom; i++)
+        if (keep.contains(i)) newIndex[i] = nkept++;
+
+    AmberParm parm;
+    parm.ifbox_ = ifbox_;
+    parm.unit_cell_ = unit_cell_;
+
+    // Atoms, interning each distinct name and type once
+    vector<int> nameMap(atoms_.names().size(), -1);
+    vector<int> typeMap(atoms_.types().size(), -1);
+    parm.atoms_.reserve(nkept);
+    for (int i = 0; i < natom; i++) {
+        if (newIndex[i] < 0) continue;
+        int name = atoms_.nameIds()[i], type = atoms_.typeIds()[i];
+        if (nameMap[name] < 0)
+            nameMap[name] = parm.atoms_.internName(atoms_.names()[name]);
+        if (typeMap[type] < 0)
+            typeMap[type] = parm.atoms_.internType(atoms_.types()[type]);
+        parm.atoms_.add(nameMap[name], typeMap[type], atoms_.elements()[i],
+                        atoms_.masses()[i], atoms_.charges()[i],
+                        atoms_.ljRadii()[i], atoms_.ljEpsilons()[i],
+                        atoms_.gbRadii()[i], atoms_.gbScreens()[i]);
+    }
+
+    // Residues that keep at least one atom
+    for (int r = 0; r < getNumResidues(); r++) {
+        int first = -1;
+        for (int i = residue_pointers_[r]; i < residue_pointers_[r+1]; i++)
+            if (newIndex[i] >= 0) {
+                first = newIndex[i];
+                break;
+            }
+        if (first < 0) continue;
+        parm.residue_pointers_.push_back(first);
+        parm.residue_labels_.push_back(residue_labels_[r]);
+    }
+    if (!residue_pointers_.empty())
+        parm.residue_pointers_.push_back(nkept);
+
+    // Bonded terms whose atoms are all kept
+    Span<BondType> bondTypes = bonds_.types();
+    for (size_t n = 0; n < bondTypes.size(); n++)
+        parm.bonds_.addType(bondTypes[n]);
+    Span<BondTerm> bonds = bonds_.terms();
+    for (size_t n = 0; n < bonds.size(); n++) {
+        int i = newIndex[bonds[n].i], j = newIndex[bonds[n].j];
+        if (i >= 0 && j >= 0)
+            parm.bonds_.add(BondTerm(i, j, bonds[n].type));
+    }
+
+    Span<AngleType> angleTypes = angles_.types();
+    for (size_t n = 0; n < angleTypes.size(); n++)
+        parm.angles_.addType(angleTypes[n]);
+    Span<AngleTerm> angles = angles_.terms();
+    for (size_t n = 0; n < angles.size(); n++) {
+        int i = newIndex[angles[n].i], j = newIndex[angles[n].j],
+            k = newIndex[angles[n].k];
+        if (i >= 0 && j >= 0 && k >= 0)
+            parm.angles_.add(AngleTerm(i, j, k, angles[n].type));
+    }
+
+    Span<DihedralType> dihedralTypes = dihedrals_.types();
+    for (size_t n = 0; n < dihedralTypes.size(); n++)
+        parm.dihedrals_.addType(dihedralTypes[n]);
+    Span<DihedralTerm> dihedrals = dihedrals_.terms();
+    for (size_t n = 0; n < dihedrals.size(); n++) {
+        DihedralTerm const& d = dihedrals[n];
+        int i = newIndex[d.i], j = newIndex[d.j], k = newIndex[d.k],
+            l = newIndex[d.l];
+        if (i >= 0 && j >= 0 && k >= 0 && l >= 0)
+            parm.dihedrals_.add(DihedralTerm(i, j, k, l, d.type,
+                                             d.ignore_end != 0));
+    }
+
+    // Exclusions between kept atoms (if the system has them, which systems
+    // built with addAtom do not). Renumbering keeps the rows sorted
+    if (exclusion_list_.numAtoms() == natom)
+        parm.exclusion_list_.reserve(nkept, exclusion_list_.size());
+    vector<int> row;
+    for (int i = 0; i < natom && exclusion_list_.numAtoms() == natom; i++) {
+        if (newIndex[i] < 0) continue;
+        Span<int> excluded = exclusion_list_.excluded(i);
+        row.clear();
+        for (size_t n = 0; n < excluded.size(); n++)
+            if (newIndex[excluded[n]] >= 0)
+                row.push_back(newIndex[excluded[n]]);
+        parm.exclusion_list_.addAtom(row.empty() ? NULL : &row[0],
+                                     (int) row.size());
+    }
+
+    parm.graph_.build(nkept, parm.bonds_);
+    parm.graph_stale_ = false;
+    return parm;
+}
+
+AmberParm AmberParm::subset(string const& mask) const {
+    return subset(AtomMask(*this, mask).evaluate());
+}
+
+AmberParm AmberParm::strip(string const& mask) const {
+    AtomSelection keep = AtomMask(*this, mask).evaluate();
+    keep.invert();
+    return subset(keep);
+}
+
+AmberParm AmberParm::tile(int na, int nb, int nc) const {
+    if (na < 1 || nb < 1 || nc < 1)
+        throw AmberParmError("Tiling needs at least one copy in each direction");
+    int natom = atoms_.size();
+    double ncopies = (double) na * nb * nc;
+    if (ncopies * natom > INT_MAX || ncopies * exclusion_list_.size() > INT_MAX)
+        throw AmberParmError("Too many atoms in the tiled system");
+    int n = na * nb * nc;
+
+    // Each table is sized once and the copies filled in parallel
+    AmberParm parm(*this);
+    parm.atoms_.repeat(n);
+    parm.bonds_.repeat(n, natom);
+    parm.angles_.repeat(n, natom);
+    parm.dihedrals_.repeat(n, natom);
+    if (exclusion_list_.numAtoms() == natom)
+        parm.exclusion_list_.repeat(n);
+
+    int nres = getNumResidues();
+    if (nres > 0) {
+        parm.residue_labels_.resize((size_t) nres * n);
+        parm.residue_pointers_.resize((size_t) nres * n + 1);
+        for (int c = 0; c < n; c++)
+            for (int r = 0; r < nres; r++) {
+                parm.residue_labels_[c * nres + r] = residue_labels_[r];
+                parm.residue_pointers_[c * nres + r] =
+                        residue_pointers_[r] + c * natom;
+            }
+        parm.residue_pointers_[(size_t) nres * n] = natom * n;
+    }
+
+    if (ifbox_ > 0)
+        parm.unit_cell_ = UnitCell(unit_cell_.getVectorA() * na,
+                                   unit_cell_.getVectorB() * nb,
+                                   unit_cell_.getVectorC() * nc);
+
+    parm.graph_.build(parm.atoms_.size(), parm.bonds_);
+    parm.graph_stale_ = false;
+    return parm;
 }
 
 void AmberParm::printExclusions(int i) {
     cout << "The atoms excluded from atom " << i << " are:" << endl << "\t";
-    if (exclusion_list_[i].size() == 0) {
+    Span<int> excluded = exclusion_list_.excluded(i);
+    if (excluded.empty()) {
         cout << "None." << endl;
     } else {
-        for (set<int>::const_iterator it = exclusion_list_[i].begin();
-                it != exclusion_list_[i].end(); it++)
+        for (Span<int>::const_iterator it = excluded.begin();
+                it != excluded.end(); it++)
             cout << *it << " ";
         cout << endl;
     }
 }
 
+/// Residue names used for water by Amber, CHARMM and GROMACS force fields
+static const char* WATER_NAMES[] = {
+    "WAT", "HOH", "H2O", "SOL", "TIP3", "TP3", "T3P", "TIP4", "TP4", "T4P",
+    "T4E", "TIP5", "TP5", "T5P", "SPC", "SPCE", "SPE", "OPC", "OPC3", "OP3",
+};
+
+static bool isWaterName(string const& name) {
+    for (size_t n = 0; n < sizeof(WATER_NAMES) / sizeof(WATER_NAMES[0]); n++)
+        if (name == WATER_NAMES[n]) return true;
+    return false;
+}
+
+vector<int> AmberParm::getWaterResidues(void) const {
+    vector<int> waters;
+    vector<int> const& elements = atoms_.elements();
+    vector<double> const& masses = atoms_.masses();
+    BondGraph const& graph = getBondGraph();
+    for (int r = 0; r < getNumResidues(); r++) {
+        if (!isWaterName(residue_labels_[r])) continue;
+        int first = residue_pointers_[r], end = residue_pointers_[r+1];
+        if (end - first < 3 || end - first > 5) continue;
+
+        int oxygen = -1, nhydrogen = 0;
+        bool ok = true;
+        for (int i = first; i < end && ok; i++) {
+            if (elements[i] == 8 && oxygen < 0)
+                oxygen = i;
+            else if (elements[i] == 1)
+                nhydrogen++;
+            else
+                ok = masses[i] == 0;    // extra points only
+            Span<int> bonded = graph.neighbors(i);
+            for (size_t n = 0; n < bonded.size(); n++)
+                if (bonded[n] < first || bonded[n] >= end) ok = false;
+        }
+        if (!ok || oxygen < 0 || nhydrogen != 2) continue;
+        for (int i = first; i < end; i++)
+            if (elements[i] == 1 && !graph.bonded(oxygen, i)) ok = false;
+        if (ok) waters.push_back(r);
+    }
+    return waters;
+}
+
+/* Whether oxygen is the oxygen of a water molecule, ignoring the extra points
+ * (massless sites) of 4- and 5-site models: its molecule has three atoms with
+ * mass, and two of them are hydrogens bonded to it
+ */
+static bool isWaterOxygen(BondGraph const& graph, vector<int> const& elements,
+                          vector<double> const& masses, int oxygen) {
+    if (elements[oxygen] != 8) return false;
+    Span<int> mol = graph.molecule(graph.getMoleculeOf(oxygen));
+    int nmassive = 0, nhydrogen = 0;
+    for (size_t n = 0; n < mol.size(); n++)
+        if (masses[mol[n]] != 0) nmassive++;
+    Span<int> bonded = graph.neighbors(oxygen);
+    for (size_t n = 0; n < bonded.size(); n++)
+        if (elements[bonded[n]] == 1 && masses[bonded[n]] != 0) nhydrogen++;
+    return nmassive == 3 && nhydrogen == 2;
+}
+
+vector<double> AmberParm::getRepartitionedMasses(double hydrogenMass) const {
+    if (hydrogenMass < 0)
+        throw AmberParmError("Hydrogen mass must not be negative");
+    vector<double> masses = atoms_.masses();
+    if (hydrogenMass == 0) return masses;
+
+    vector<int> const& elements = atoms_.elements();
+    vector<double> const& orig = atoms_.masses();
+    BondGraph const& graph = getBondGraph();
+    vector<bool> done(masses.size(), false);
+
+    /* Water is normally kept rigid, so its masses are left alone: the water
+     * residues rigidWater constrains, as well as any other molecule that is
+     * water apart from its extra points
+     */
+    vector<int> waters = getWaterResidues();
+    for (size_t w = 0; w < waters.size(); w++)
+        for (int i = residue_pointers_[waters[w]];
+                i < residue_pointers_[waters[w]+1]; i++)
+            done[i] = true;
+
+    Span<BondTerm> bond_terms = bonds_.terms();
+    for (size_t n = 0; n < bond_terms.size(); n++) {
+        int h = bond_terms[n].i, heavy = bond_terms[n].j;
+        if (elements[h] != 1) swap(h, heavy);
+        if (elements[h] != 1 || elements[heavy] <= 1) continue;
+        if (done[h] || masses[h] == 0) continue;
+        done[h] = true;
+        if (isWaterOxygen(graph, elements, orig, heavy)) continue;
+
+        masses[heavy] -= hydrogenMass - masses[h];
+        masses[h] = hydrogenMass;
+        if (masses[heavy] <= 0) {
+            stringstream ss;
+            ss << "Repartitioning hydrogen masses leaves atom " << heavy + 1
+               << " (" << atoms_[heavy].getName() << ") without mass";
+            throw AmberParmError(ss.str());
+        }
+    }
+    return masses;
+}
+
+/// Whether atoms i and j are both constrained atoms of the same rigid water
+static inline bool isWaterBond(vector<int> const& water_of, int i, int j) {
+    return !water_of.empty() && water_of[i] >= 0 && water_of[i] == water_of[j];
+}
+
 OpenMM::System* AmberParm::createSystem(
                 OpenMM::NonbondedForce::NonbondedMethod nonbondedMethod,
                 double nonbondedCutoff,
@@ -449,7 +844,8 @@ OpenMM::System* AmberParm::createSystem(
                 bool removeCMMotion,
                 double ewaldErrorTolerance,
                 bool flexibleConstraints,
-                bool useSASA) {
+                bool useSASA,
+                double hydrogenMass) {
 
     OpenMM::System* system = new OpenMM::System();
 
@@ -469,11 +865,6 @@ OpenMM::System* AmberParm::createSystem(
         throw AmberParmError(msg.c_str());
     }
 
-    if (rigidWater && (constraints != "HBonds" && constraints != "AllBonds")) {
-        cerr << "rigidWater is incompatible with constraints=None; setting to "
-             << "false" << endl;
-    }
-
     // Catch illegal nonbonded choice for system
 
     if (isPeriodic()) {
@@ -488,22 +879,163 @@ OpenMM::System* AmberParm::createSystem(
     }
 
     // Add all particles
-    for (atom_iterator it = AtomBegin(); it != AtomEnd(); it++) {
-        system->addParticle(it->getMass());
-    }
+    vector<double> masses = getRepartitionedMasses(hydrogenMass);
+    for (int i = 0; i < atoms_.size(); i++)
+        system->addParticle(masses[i]);
 
     // Add constraints
     bool hcons = constraints == "HBonds" || constraints == "AllBonds";
     bool allcons = constraints == "AllBonds";
-    for (bond_iterator it = BondBegin(); it != BondEnd(); it++) {
-        Atom a1 = atoms_[it->getAtomI()];
-        Atom a2 = atoms_[it->getAtomJ()];
-        if (hcons && (a1.getElement() == 1 || a2.getElement() == 1)) {
-            system->addConstraint(it->getAtomI(), it->getAtomJ(),
-                                  it->getEquilibriumDistance()*NANOMETER_PER_ANGSTROM);
+    vector<int> const& elements = atoms_.elements();
+    Span<BondTerm> bond_terms = bonds_.terms();
+    Span<BondType> bond_types = bonds_.types();
+    Span<AngleTerm> angle_terms = angles_.terms();
+    Span<AngleType> angle_types = angles_.types();
+
+    /* The O, both H and the extra points (massless sites) of every water,
+     * with its O-H1, O-H2 and H1-H2 distances (the last from an H-H
+     * pseudo-bond, or else from the H-O-H angle). Rigid waters get exactly
+     * their three distance constraints (O-H1, O-H2, H1-H2) so OpenMM
+     * recognizes them for SETTLE. water_of marks their O and H atoms, whose
+     * bonds are then left out of the constraints below. The extra points of
+     * 4- and 5-site waters become virtual sites placed from the O and H
+     * atoms, so none of their bonds or angles are added either
+     */
+    vector<int> waters = getWaterResidues();
+    vector<int> water_of, member(atoms_.size(), -1);
+    vector<bool> extra_point(atoms_.size(), false);
+    vector<int> water_atoms(3 * waters.size());
+    vector<double> water_dists(3 * waters.size(), -1);
+    // Up to two extra points per water, their distances from the O, and the
+    // distance between them
+    vector<int> water_eps(2 * waters.size(), -1);
+    vector<double> ep_dists(2 * waters.size(), -1);
+    vector<double> ep_seps(waters.size(), -1);
+    for (size_t w = 0; w < waters.size(); w++) {
+        int nh = 0, nep = 0;
+        for (int i = residue_pointers_[waters[w]];
+                i < residue_pointers_[waters[w]+1]; i++) {
+            if (elements[i] == 8) {
+                water_atoms[3*w] = i;
+            } else if (elements[i] == 1) {
+                water_atoms[3*w + 1 + nh++] = i;
+            } else {
+                water_eps[2*w + nep++] = i;
+                extra_point[i] = true;
+            }
+            member[i] = (int) w;
+        }
+    }
+    for (size_t n = 0; n < bond_terms.size(); n++) {
+        BondTerm const& b = bond_terms[n];
+        if (member[b.i] < 0 || member[b.i] != member[b.j]) continue;
+        int w = member[b.i];
+        double req = bond_types[b.type].req;
+        if (extra_point[b.i] && extra_point[b.j]) {
+            ep_seps[w] = req;
+        } else if (extra_point[b.i] || extra_point[b.j]) {
+            int ep = extra_point[b.i] ? b.i : b.j;
+            if (b.i + b.j - ep == water_atoms[3*w])
+                ep_dists[2*w + (ep == water_eps[2*w] ? 0 : 1)] = req;
+        } else {
+            // O-H bonds fill slots 0 and 1, the H-H pseudo-bond slot 2
+            int slot = elements[b.i] == 1 && elements[b.j] == 1 ? 2 :
+                       (b.i == water_atoms[3*w+1] || b.j == water_atoms[3*w+1])
+                       ? 0 : 1;
+            water_dists[3*w + slot] = req;
+        }
+    }
+    // Without an H-H pseudo-bond, the H-O-H angle gives the H-H distance
+    for (size_t n = 0; n < angle_terms.size(); n++) {
+        AngleTerm const& a = angle_terms[n];
+        int w = member[a.j];
+        if (w < 0 || a.j != water_atoms[3*w] || member[a.i] != w ||
+                member[a.k] != w || elements[a.i] != 1 ||
+                elements[a.k] != 1 || water_dists[3*w + 2] >= 0)
+            continue;
+        double d1 = water_dists[3*w], d2 = water_dists[3*w + 1];
+        double theta = angle_types[a.type].theteq * RADIAN_PER_DEGREE;
+        water_dists[3*w + 2] = sqrt(d1*d1 + d2*d2 - 2*d1*d2*cos(theta));
+    }
+
+    if (rigidWater) water_of.assign(atoms_.size(), -1);
+    for (size_t w = 0; w < waters.size(); w++) {
+        bool has_eps = water_eps[2*w] >= 0;
+        if (!rigidWater && !has_eps) continue;
+        if (water_dists[3*w + 2] < 0) {
+            stringstream ss;
+            if (rigidWater)
+                ss << "Cannot make water residue " << waters[w] + 1 << " rigid";
+            else
+                ss << "Cannot place the extra points of water residue "
+                   << waters[w] + 1;
+            ss << ": it has no H-H bond or H-O-H angle";
+            throw AmberParmError(ss.str());
+        }
+        int o = water_atoms[3*w], h1 = water_atoms[3*w+1],
+            h2 = water_atoms[3*w+2];
+        if (rigidWater) {
+            water_of[o] = water_of[h1] = water_of[h2] = (int) w;
+            system->addConstraint(o, h1, water_dists[3*w]*NANOMETER_PER_ANGSTROM);
+            system->addConstraint(o, h2,
+                                  water_dists[3*w+1]*NANOMETER_PER_ANGSTROM);
+            system->addConstraint(h1, h2,
+                                  water_dists[3*w+2]*NANOMETER_PER_ANGSTROM);
+        }
+        if (!has_eps) continue;
+
+        /* With a = H1-O and b = H2-O, a single extra point (TIP4P, OPC) sits
+         * on the H-O-H bisector, at O + d (a + b) / |a + b|. A pair of them
+         * (TIP5P) sits on the other side of the O, out of the plane of the
+         * water, at O - d cos(phi/2) (a + b) / |a + b| +/- d sin(phi/2)
+         * (a x b) / |a x b|, where phi is the angle between them (from their
+         * pseudo-bond, or else tetrahedral)
+         */
+        double d1 = water_dists[3*w], d2 = water_dists[3*w + 1],
+               d12 = water_dists[3*w + 2];
+        double cos_hoh = (d1*d1 + d2*d2 - d12*d12) / (2*d1*d2);
+        double sum = sqrt(2*d1*d1 + 2*d2*d2 - d12*d12);
+        double cross = d1 * d2 * sqrt(1 - cos_hoh*cos_hoh);
+        int nep = water_eps[2*w + 1] >= 0 ? 2 : 1;
+        for (int k = 0; k < nep; k++) {
+            int ep = water_eps[2*w + k];
+            double d = ep_dists[2*w + k];
+            if (d < 0) {
+                stringstream ss;
+                ss << "Cannot place extra point " << ep + 1 << " ("
+                   << atoms_[ep].getName() << ") of water residue "
+                   << waters[w] + 1 << ": it is not bonded to the oxygen";
+                throw AmberParmError(ss.str());
+            }
+            if (nep == 1) {
+                double wh = d / sum;
+                system->setVirtualSite(ep, new OpenMM::ThreeParticleAverageSite(
+                            o, h1, h2, 1 - 2*wh, wh, wh));
+                continue;
+            }
+            double half = ep_seps[w] > 0 ?
+                    asin(min(1.0, ep_seps[w] / (ep_dists[2*w] +
+                                                ep_dists[2*w + 1]))) :
+                    0.5 * acos(-1.0 / 3.0);
+            double wh = -d * cos(half) / sum;
+            double wc = (k == 0 ? 1 : -1) * d * sin(half) / cross *
+                        ANGSTROM_PER_NANOMETER;
+            system->setVirtualSite(ep, new OpenMM::OutOfPlaneSite(
+                        o, h1, h2, wh, wh, wc));
+        }
+    }
+
+    for (size_t n = 0; n < bond_terms.size(); n++) {
+        BondTerm const& b = bond_terms[n];
+        if (isWaterBond(water_of, b.i, b.j) || extra_point[b.i] ||
+                extra_point[b.j]) {
+            continue;
+        } else if (hcons && (elements[b.i] == 1 || elements[b.j] == 1)) {
+            system->addConstraint(b.i, b.j,
+                                  bond_types[b.type].req*NANOMETER_PER_ANGSTROM);
         } else if (allcons) {
-            system->addConstraint(it->getAtomI(), it->getAtomJ(),
-                                  it->getEquilibriumDistance()*NANOMETER_PER_ANGSTROM);
+            system->addConstraint(b.i, b.j,
+                                  bond_types[b.type].req*NANOMETER_PER_ANGSTROM);
         }
     }
     
@@ -512,16 +1044,18 @@ OpenMM::System* AmberParm::createSystem(
         OpenMM::HarmonicBondForce *bond_force = new OpenMM::HarmonicBondForce();
         bond_force->setForceGroup(BOND_FORCE_GROUP);
         double conv = ANGSTROM_PER_NANOMETER*ANGSTROM_PER_NANOMETER*JOULE_PER_CALORIE;
-        for (bond_iterator it=BondBegin(); it != BondEnd(); it++) {
+        for (size_t n = 0; n < bond_terms.size(); n++) {
+            BondTerm const& b = bond_terms[n];
             // See if this bond needs to be skipped due to constraints
-            Atom a1 = atoms_[it->getAtomI()];
-            Atom a2 = atoms_[it->getAtomJ()];
-            if (hcons && (a1.getElement() == 1 || a2.getElement() == 1) &&
+            if (hcons && (elements[b.i] == 1 || elements[b.j] == 1) &&
                         !flexibleConstraints) continue;
+            if (isWaterBond(water_of, b.i, b.j) && !flexibleConstraints) continue;
+            // The extra points of waters follow their virtual site
+            if (extra_point[b.i] || extra_point[b.j]) continue;
 
-            bond_force->addBond(it->getAtomI(), it->getAtomJ(),
-                                it->getEquilibriumDistance()*NANOMETER_PER_ANGSTROM,
-                                2*it->getForceConstant()*conv);
+            BondType const& type = bond_types[b.type];
+            bond_force->addBond(b.i, b.j, type.req*NANOMETER_PER_ANGSTROM,
+                                2*type.k*conv);
         }
         system->addForce(bond_force);
     }
@@ -529,22 +1063,29 @@ OpenMM::System* AmberParm::createSystem(
     // Add all angles
     OpenMM::HarmonicAngleForce *angle_force = new OpenMM::HarmonicAngleForce();
     angle_force->setForceGroup(ANGLE_FORCE_GROUP);
-    for (angle_iterator it = AngleBegin(); it != AngleEnd(); it++) {
-        angle_force->addAngle(it->getAtomI(), it->getAtomJ(), it->getAtomK(),
-                              it->getEquilibriumAngle()*RADIAN_PER_DEGREE,
-                              2*it->getForceConstant()*JOULE_PER_CALORIE);
+    for (size_t n = 0; n < angle_terms.size(); n++) {
+        AngleTerm const& a = angle_terms[n];
+        // The angle of a rigid water is fixed by its constraints
+        if (isWaterBond(water_of, a.i, a.j) && isWaterBond(water_of, a.j, a.k) &&
+                !flexibleConstraints) continue;
+        if (extra_point[a.i] || extra_point[a.j] || extra_point[a.k]) continue;
+        AngleType const& type = angle_types[a.type];
+        angle_force->addAngle(a.i, a.j, a.k, type.theteq*RADIAN_PER_DEGREE,
+                              2*type.k*JOULE_PER_CALORIE);
     }
     system->addForce(angle_force);
 
     // Add all torsions
     OpenMM::PeriodicTorsionForce *dihedral_force = new OpenMM::PeriodicTorsionForce();
     dihedral_force->setForceGroup(DIHEDRAL_FORCE_GROUP);
-    for (dihedral_iterator it = DihedralBegin(); it != DihedralEnd(); it++) {
-        dihedral_force->addTorsion(it->getAtomI(), it->getAtomJ(),
-                                   it->getAtomK(), it->getAtomL(),
-                                   it->getPeriodicity(),
-                                   it->getPhase()*RADIAN_PER_DEGREE,
-                                   it->getForceConstant()*JOULE_PER_CALORIE);
+    Span<DihedralTerm> dihedral_terms = dihedrals_.terms();
+    Span<DihedralType> dihedral_types = dihedrals_.types();
+    for (size_t n = 0; n < dihedral_terms.size(); n++) {
+        DihedralTerm const& d = dihedral_terms[n];
+        DihedralType const& type = dihedral_types[d.type];
+        dihedral_force->addTorsion(d.i, d.j, d.k, d.l, type.periodicity,
+                                   type.phase*RADIAN_PER_DEGREE,
+                                   type.k*JOULE_PER_CALORIE);
     }
     system->addForce(dihedral_force);
 
@@ -556,31 +1097,33 @@ OpenMM::System* AmberParm::createSystem(
         nonb_frc->setCutoffDistance(nonbondedCutoff*NANOMETER_PER_ANGSTROM);
     const double ONE_SIXTH = 1.0 / 6.0;
     const double SIGMA_SCALE = pow(2, -ONE_SIXTH) * 2 * NANOMETER_PER_ANGSTROM;
-    for (atom_iterator it = AtomBegin(); it != AtomEnd(); it++) {
-        nonb_frc->addParticle(it->getCharge(),
-                              it->getLJRadius()*SIGMA_SCALE,
-                              it->getLJEpsilon()*JOULE_PER_CALORIE);
+    vector<double> const& charges = atoms_.charges();
+    vector<double> const& lj_radii = atoms_.ljRadii();
+    vector<double> const& lj_epsilons = atoms_.ljEpsilons();
+    for (int i = 0; i < atoms_.size(); i++) {
+        nonb_frc->addParticle(charges[i], lj_radii[i]*SIGMA_SCALE,
+                              lj_epsilons[i]*JOULE_PER_CALORIE);
     }
     // Now do exceptions
     const double SIGMA_SCALE2 = pow(2, -ONE_SIXTH) * NANOMETER_PER_ANGSTROM;
-    for (dihedral_iterator it = DihedralBegin(); it != DihedralEnd(); it++) {
-        if (it->ignoreEndGroups()) continue;
-        Atom a1 = atoms_[it->getAtomI()];
-        Atom a2 = atoms_[it->getAtomL()];
-        double eps = sqrt(a1.getLJEpsilon() * a2.getLJEpsilon()) *
-                     JOULE_PER_CALORIE / it->getScnb();
-        double sig = (a1.getLJRadius() + a2.getLJRadius()) * SIGMA_SCALE2;
-        nonb_frc->addException(it->getAtomI(), it->getAtomL(),
-                               a1.getCharge()*a2.getCharge()/it->getScee(),
+    for (size_t n = 0; n < dihedral_terms.size(); n++) {
+        DihedralTerm const& d = dihedral_terms[n];
+        if (d.ignore_end) continue;
+        DihedralType const& type = dihedral_types[d.type];
+        double eps = sqrt(lj_epsilons[d.i] * lj_epsilons[d.l]) *
+                     JOULE_PER_CALORIE / type.scnb;
+        // Keep the pair computed whatever charges its atoms take later
+        if (eps == 0) eps = PLACEHOLDER_EPSILON;
+        double sig = (lj_radii[d.i] + lj_radii[d.l]) * SIGMA_SCALE2;
+        nonb_frc->addException(d.i, d.l, charges[d.i]*charges[d.l]/type.scee,
                                sig, eps);
     }
     // Now do exclusions
-    for (int i = 0; i < atoms_.size(); i++) {
-        if (exclusion_list_[i].size() == 0) continue; // No exclusions here
-        for (set<int>::const_iterator it = exclusion_list_[i].begin();
-                it != exclusion_list_[i].end(); it++) {
-            nonb_frc->addException(i, *it, 0.0, 1.0, 0.0);
-        }
+    vector<size_t> const& excl_offsets = exclusion_list_.offsets();
+    vector<int> const& excl_partners = exclusion_list_.partners();
+    for (int i = 0; i < exclusion_list_.numAtoms(); i++) {
+        for (size_t k = excl_offsets[i]; k < excl_offsets[i+1]; k++)
+            nonb_frc->addException(i, excl_partners[k], 0.0, 1.0, 0.0);
     }
     // Set the ewald error tolerance
     if (nonbondedMethod == OpenMM::NonbondedForce::PME ||
@@ -0,0 +1,515 @@
+/// atommask.cpp -- compiles Amber masks and evaluates them frame by frame
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
+#include "amber/atommask.h"
+#include "amber/exceptions.h"
+
+using namespace std;
+using namespace Amber;
+
+// Selecting atoms from the topology
+
+/* Matches a name against a pattern in which * and = match any run of
+ * characters and ? matches any single character
+ */
+static bool matchName(string const& pattern, string const& name) {
+    size_t p = 0, n = 0, star = string::npos, mark = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n])) {
+            p++;
+            n++;
+        } else if (p < pattern.size() &&
+                (pattern[p] == '*' || pattern[p] == '=')) {
+            star = p++;
+            mark = n;
+        } else if (star != string::npos) {
+            p = star + 1;
+            n = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && (pattern[p] == '*' || pattern[p] == '='))
+        p++;
+    return p == pattern.size();
+}
+
+/// Parses "N" or "N-M" (both from 1) into [first, last]
+static bool parseRange(string const& item, int &first, int &last) {
+    size_t dash = item.find('-');
+    string a = item.substr(0, dash);
+    string b = dash == string::npos ? a : item.substr(dash + 1);
+    if (a.empty() || b.empty() ||
+            a.find_first_not_of("0123456789") != string::npos ||
+            b.find_first_not_of("0123456789") != string::npos)
+        return false;
+    first = atoi(a.c_str());
+    last = atoi(b.c_str());
+    return true;
+}
+
+/* Adds to sel every atom i for which flags[ids[i]] is set. Each thread fills
+ * whole 64-atom words, so no two threads ever write the same word
+ */
+static void selectByID(AtomSelection &sel, vector<int> const& ids,
+                       vector<char> const& flags) {
+    int natom = sel.numAtoms();
+    int nwords = (int) sel.words().size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static)
+#endif
+    for (int w = 0; w < nwords; w++) {
+        uint64_t bits = sel.words()[w];
+        int begin = w * 64, end = min(begin + 64, natom);
+        for (int i = begin; i < end; i++)
+            bits |= (uint64_t) (flags[ids[i]] != 0) << (i - begin);
+        sel.setWord(w, bits);
+    }
+}
+
+// Parsing
+
+AtomMask::AtomMask(AmberParm const& parm, string const& expression) :
+    parm_(&parm), expression_(expression), root_(-1), pos_(0) {
+    skipSpace_();
+    if (pos_ == expression_.size())
+        error_("the mask is empty");
+    root_ = parseOr_();
+    skipSpace_();
+    if (pos_ != expression_.size())
+        error_(string("unexpected '") + expression_[pos_] + "'");
+}
+
+void AtomMask::error_(string const& msg) const {
+    ostringstream oss;
+    oss << "Bad mask '" << expression_ << "' at character " << pos_ + 1
+        << ": " << msg;
+    throw AmberMaskError(oss.str());
+}
+
+void AtomMask::skipSpace_(void) {
+    while (pos_ < expression_.size() && isspace(expression_[pos_]))
+        pos_++;
+}
+
+int AtomMask::parseOr_(void) {
+    int node = parseAnd_();
+    skipSpace_();
+    while (pos_ < expression_.size() && expression_[pos_] == '|') {
+        pos_++;
+        node = combine_(OR, node, parseAnd_());
+        skipSpace_();
+    }
+    return node;
+}
+
+int AtomMask::parseAnd_(void) {
+    int node = parseUnary_();
+    skipSpace_();
+    while (pos_ < expression_.size() && expression_[pos_] == '&') {
+        pos_++;
+        node = combine_(AND, node, parseUnary_());
+        skipSpace_();
+    }
+    return node;
+}
+
+int AtomMask::parseUnary_(void) {
+    skipSpace_();
+    if (pos_ < expression_.size() && expression_[pos_] == '!') {
+        pos_++;
+        return combine_(NOT, parseUnary_(), -1);
+    }
+    return parseDistance_(parsePrimary_());
+}
+
+int AtomMask::parsePrimary_(void) {
+    skipSpace_();
+    if (pos_ == expression_.size())
+        error_("expected a selection");
+    char c = expression_[pos_];
+    if (c == '(') {
+        pos_++;
+        int node = parseOr_();
+        skipSpace_();
+        if (pos_ == expression_.size() || expression_[pos_] != ')')
+            error_("expected ')'");
+        pos_++;
+        return node;
+    }
+    if (c == '*') {
+        pos_++;
+        return fixed_(AtomSelection(parm_->getNumAtoms(), true));
+    }
+    if (c != ':' && c != '@' && c != '^')
+        error_("expected a selection (:, @, ^, *, ! or '(')");
+
+    // Selectors written back to back (e.g., :1-10@CA) select their overlap
+    AtomSelection sel(parm_->getNumAtoms(), true);
+    while (pos_ < expression_.size()) {
+        c = expression_[pos_];
+        if (c == ':') {
+            pos_++;
+            sel &= parseResidues_();
+        } else if (c == '@') {
+            pos_++;
+            sel &= parseAtoms_();
+        } else if (c == '^') {
+            pos_++;
+            sel &= parseMolecules_();
+        } else {
+            break;
+        }
+    }
+    return fixed_(sel);
+}
+
+int AtomMask::parseDistance_(int node) {
+    skipSpace_();
+    while (pos_ < expression_.size() &&
+            (expression_[pos_] == '<' || expression_[pos_] == '>')) {
+        Node within;
+        within.kind = WITHIN;
+        within.left = node;
+        within.right = -1;
+        within.outside = expression_[pos_] == '>';
+        pos_++;
+        if (pos_ == expression_.size() ||
+                (expression_[pos_] != ':' && expression_[pos_] != '@'))
+            error_("expected : or @ after a distance operator");
+        within.byResidue = expression_[pos_] == ':';
+        pos_++;
+        const char* start = expression_.c_str() + pos_;
+        char* end;
+        within.cutoff = strtod(start, &end);
+        if (end == start || !(within.cutoff >= 0 && within.cutoff < HUGE_VAL))
+            error_("expected a distance");
+        pos_ += end - start;
+        nodes_.push_back(within);
+        node = (int) nodes_.size() - 1;
+        skipSpace_();
+    }
+    return node;
+}
+
+/// The comma-separated names or numbers following a selector
+vector<string> AtomMask::parseList_(void) {
+    static const char* terminators = "&|!()<>:@^";
+    size_t start = pos_;
+    while (pos_ < expression_.size() && !isspace(expression_[pos_]) &&
+            strchr(terminators, expression_[pos_]) == NULL)
+        pos_++;
+    vector<string> items;
+    string list = expression_.substr(start, pos_ - start);
+    size_t begin = 0;
+    while (true) {
+        size_t comma = list.find(',', begin);
+        string item = list.substr(begin, comma == string::npos ?
+                                         string::npos : comma - begin);
+        if (item.empty())
+            error_("expected a name or number");
+        items.push_back(item);
+        if (comma == string::npos) break;
+        begin = comma + 1;
+    }
+    return items;
+}
+
+AtomSelection AtomMask::parseResidues_(void) {
+    vector<string> items = parseList_();
+    int nres = parm_->getNumResidues();
+    Span<std::string> labels = parm_->getResidueLabels();
+    Span<int> pointers = parm_->getResiduePointers();
+
+    vector<char> flags(nres, 0);
+    for (size_t n = 0; n < items.size(); n++) {
+        int first, last;
+        if (parseRange(items[n], first, last)) {
+            for (int r = max(first, 1); r <= min(last, nres); r++)
+                flags[r-1] = 1;
+            continue;
+        }
+        string const& pattern = items[n];
+#ifdef _OPENMP
+#       pragma omp parallel for schedule(static)
+#endif
+        for (int r = 0; r < nres; r++)
+            if (!flags[r] && matchName(pattern, labels[r]))
+                flags[r] = 1;
+    }
+
+    AtomSelection sel(parm_->getNumAtoms());
+    for (int r = 0; r < nres; r++)
+        if (flags[r]) sel.setRange(pointers[r], pointers[r+1]);
+    return sel;
+}
+
+AtomSelection AtomMask::parseAtoms_(void) {
+    bool byType = pos_ < expression_.size() && expression_[pos_] == '%';
+    if (byType) pos_++;
+    vector<string> items = parseList_();
+    AtomTable const& atoms = parm_->getAtomTable();
+    int natom = atoms.size();
+
+    // Names are interned, so each distinct name is matched only once
+    NameTable const& names = byType ? atoms.types() : atoms.names();
+    vector<char> flags(names.size(), 0);
+    bool byName = false;
+    AtomSelection sel(natom);
+    for (size_t n = 0; n < items.size(); n++) {
+        int first, last;
+        if (!byType && parseRange(items[n], first, last)) {
+            sel.setRange(max(first, 1) - 1, min(last, natom));
+            continue;
+        }
+        for (int id = 0; id < names.size(); id++)
+            if (matchName(items[n], names[id])) flags[id] = 1;
+        byName = true;
+    }
+    if (byName)
+        selectByID(sel, byType ? atoms.typeIds() : atoms.nameIds(), flags);
+    return sel;
+}
+
+AtomSelection AtomMask::parseMolecules_(void) {
+    vector<string> items = parseList_();
+    BondGraph const& graph = parm_->getBondGraph();
+    int nmol = graph.numMolecules();
+
+    vector<char> flags(nmol, 0);
+    for (size_t n = 0; n < items.size(); n++) {
+        int first, last;
+        if (!parseRange(items[n], first, last))
+            error_("molecules are selected by number");
+        for (int m = max(first, 1); m <= min(last, nmol); m++)
+            flags[m-1] = 1;
+    }
+
+    AtomSelection sel(parm_->getNumAtoms());
+    selectByID(sel, graph.moleculeIds(), flags);
+    return sel;
+}
+
+// Compiling
+
+int AtomMask::fixed_(AtomSelection const& value) {
+    Node node;
+    node.kind = FIXED;
+    node.left = node.right = -1;
+    node.value = value;
+    node.cutoff = 0;
+    node.byResidue = node.outside = false;
+    nodes_.push_back(node);
+    return (int) nodes_.size() - 1;
+}
+
+int AtomMask::combine_(NodeKind kind, int left, int right) {
+    // Fold operations on fixed selections right away
+    if (kind == NOT && nodes_[left].kind == FIXED) {
+        nodes_[left].value.invert();
+        return left;
+    }
+    if (kind != NOT && nodes_[left].kind == FIXED &&
+            nodes_[right].kind == FIXED) {
+        if (kind == AND)
+            nodes_[left].value &= nodes_[right].value;
+        else
+            nodes_[left].value |= nodes_[right].value;
+        nodes_[right].value = AtomSelection();
+        return left;
+    }
+    Node node;
+    node.kind = kind;
+    node.left = left;
+    node.right = right;
+    node.cutoff = 0;
+    node.byResidue = node.outside = false;
+    nodes_.push_back(node);
+    return (int) nodes_.size() - 1;
+}
+
+// Evaluating
+
+bool AtomMask::needsPositions(void) const {
+    // Without distance operators, everything folds into one fixed selection
+    return nodes_[root_].kind != FIXED;
+}
+
+AtomSelection AtomMask::evaluate(void) const {
+    if (needsPositions())
+        throw AmberMaskError("Mask '" + expression_ + "' needs positions");
+    return nodes_[root_].value;
+}
+
+AtomSelection AtomMask::evaluate(vector<OpenMM::Vec3> const& positions) const {
+    AtomSelection result;
+    evaluate(positions, result);
+    return result;
+}
+
+void AtomMask::evaluate(vector<OpenMM::Vec3> const& positions,
+                        AtomSelection &result) const {
+    if ((int) positions.size() != parm_->getNumAtoms())
+        throw AmberMaskError("Wrong number of positions for mask '" +
+                             expression_ + "'");
+    evaluate_(root_, &positions, result);
+}
+
+void AtomMask::evaluate_(int index, vector<OpenMM::Vec3> const* positions,
+                         AtomSelection &result) const {
+    Node const& node = nodes_[index];
+    AtomSelection other;
+    switch (node.kind) {
+        case FIXED:
+            result = node.value;
+            break;
+        case AND:
+            evaluate_(node.left, positions, result);
+            evaluate_(node.right, positions, other);
+            result &= other;
+            break;
+        case OR:
+            evaluate_(node.left, positions, result);
+            evaluate_(node.right, positions, other);
+            result |= other;
+            break;
+        case NOT:
+            evaluate_(node.left, positions, result);
+            result.invert();
+            break;
+        case WITHIN:
+            evaluate_(node.left, positions, other);
+            within_(node, other, *positions, result);
+            break;
+    }
+}
+
+/* Largest number of grid cells per reference atom. Cells are made bigger than
+ * the cutoff when the reference atoms are sparse (e.g., two ligands far apart
+ * with a small cutoff), so the grid never outgrows the atoms in it
+ */
+#define MAX_CELLS_PER_ATOM 8
+
+void AtomMask::within_(Node const& node, AtomSelection const& reference,
+                       vector<OpenMM::Vec3> const& positions,
+                       AtomSelection &result) const {
+    int natom = parm_->getNumAtoms();
+    result = AtomSelection(natom);
+    vector<int> refs = reference.indices();
+    if (refs.empty()) {
+        if (node.outside) result.invert();
+        return;
+    }
+
+    // Bin the reference atoms into a grid of cells at least cutoff wide, so
+    // only the 27 cells around an atom can hold reference atoms within range
+    double lo[3], hi[3];
+    for (int k = 0; k < 3; k++)
+        lo[k] = hi[k] = positions[refs[0]][k];
+    for (size_t n = 1; n < refs.size(); n++)
+        for (int k = 0; k < 3; k++) {
+            lo[k] = min(lo[k], positions[refs[n]][k]);
+            hi[k] = max(hi[k], positions[refs[n]][k]);
+        }
+    double cell = max(node.cutoff, 1e-3);
+    double maxcells = (double) MAX_CELLS_PER_ATOM * refs.size() + 64;
+    int dims[3];
+    while (true) {
+        double ncells = 1;
+        for (int k = 0; k < 3; k++) {
+            dims[k] = (int) ((hi[k] - lo[k]) / cell) + 1;
+            ncells *= dims[k];
+        }
+        if (ncells <= maxcells) break;
+        cell *= max(1.1, pow(ncells / maxcells, 1.0 / 3.0));
+    }
+
+    size_t ncells = (size_t) dims[0] * dims[1] * dims[2];
+    vector<size_t> cellStart(ncells + 1, 0);
+    vector<size_t> refCell(refs.size());
+    for (size_t n = 0; n < refs.size(); n++) {
+        OpenMM::Vec3 const& p = positions[refs[n]];
+        size_t c = 0;
+        for (int k = 0; k < 3; k++)
+            c = c * dims[k] + min((int) ((p[k] - lo[k]) / cell), dims[k] - 1);
+        refCell[n] = c;
+        cellStart[c + 1]++;
+    }
+    for (size_t c = 0; c < ncells; c++)
+        cellStart[c + 1] += cellStart[c];
+    vector<OpenMM::Vec3> cellAtoms(refs.size());
+    vector<size_t> fill(cellStart.begin(), cellStart.end() - 1);
+    for (size_t n = 0; n < refs.size(); n++)
+        cellAtoms[fill[refCell[n]]++] = positions[refs[n]];
+
+    double cut2 = node.cutoff * node.cutoff;
+    int nwords = (int) result.words().size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (int w = 0; w < nwords; w++) {
+        uint64_t bits = 0;
+        int begin = w * 64, end = min(begin + 64, natom);
+        for (int i = begin; i < end; i++) {
+            OpenMM::Vec3 const& p = positions[i];
+            int from[3], to[3];
+            bool inside = true;
+            for (int k = 0; k < 3; k++) {
+                double x = (p[k] - lo[k]) / cell;
+                if (x < -1 || x >= dims[k] + 1) {
+                    inside = false;
+                    break;
+                }
+                int c = (int) floor(x);
+                from[k] = max(c - 1, 0);
+                to[k] = min(c + 1, dims[k] - 1);
+            }
+            if (!inside) continue;
+            bool found = false;
+            for (int a = from[0]; a <= to[0] && !found; a++)
+            for (int b = from[1]; b <= to[1] && !found; b++)
+            for (int c = from[2]; c <= to[2] && !found; c++) {
+                size_t index = ((size_t) a * dims[1] + b) * dims[2] + c;
+                for (size_t n = cellStart[index]; n < cellStart[index+1]; n++) {
+                    OpenMM::Vec3 d = cellAtoms[n] - p;
+                    if (d.dot(d) <= cut2) {
+                        found = true;
+                        break;
+                    }
+                }
+            }
+            if (found) bits |= (uint64_t) 1 << (i - begin);
+        }
+        result.setWord(w, bits);
+    }
+
+    if (node.byResidue) {
+        // Extend to every residue with an atom in range
+        int nres = parm_->getNumResidues();
+        Span<int> pointers = parm_->getResiduePointers();
+        vector<char> flags(nres, 0);
+#ifdef _OPENMP
+#       pragma omp parallel for schedule(static)
+#endif
+        for (int r = 0; r < nres; r++)
+            for (int i = pointers[r]; i < pointers[r+1]; i++)
+                if (result.contains(i)) {
+                    flags[r] = 1;
+                    break;
+                }
+        for (int r = 0; r < nres; r++)
+            if (flags[r]) result.setRange(pointers[r], pointers[r+1]);
+    }
+
+    if (node.outside) result.invert();
+}
@@ -0,0 +1,543 @@
+/// constph.cpp -- protonation state changes in an existing OpenMM::System
+
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <sstream>
+
+#include "amber/amber_constants.h"
+#include "amber/constph.h"
+#include "amber/exceptions.h"
+
+using namespace std;
+using namespace Amber;
+
+ProtonationStateUpdater::ProtonationStateUpdater(TitratableSites const& sites,
+                                                 OpenMM::System &system) :
+    sites_(&sites), nonbonded_(NULL), gb_(NULL), dirty_(false) {
+
+    AmberParm const& parm = sites.getParm();
+    int natom = parm.getNumAtoms();
+    if (system.getNumParticles() != natom)
+        throw AmberParmError("System and titratable sites have different atoms");
+    for (int f = 0; f < system.getNumForces(); f++) {
+        OpenMM::Force &force = system.getForce(f);
+        if (nonbonded_ == NULL)
+            nonbonded_ = dynamic_cast<OpenMM::NonbondedForce*>(&force);
+        if (gb_ == NULL)
+            gb_ = dynamic_cast<OpenMM::CustomGBForce*>(&force);
+    }
+    if (nonbonded_ == NULL)
+        throw AmberParmError("System has no NonbondedForce");
+
+    vector<int> site_of(natom, -1);
+    for (int s = 0; s < sites.size(); s++)
+        for (int i = sites.getFirstAtom(s); i < sites.getEndAtom(s); i++)
+            site_of[i] = s;
+
+    /* createSystem adds one exception per dihedral that is not flagged to
+     * skip its 1-4 pair, in the order of the dihedral table, ahead of the
+     * exclusions. Pick out those touching a site in two passes (count, fill)
+     */
+    Span<DihedralTerm> terms = parm.getDihedrals().terms();
+    Span<DihedralType> types = parm.getDihedrals().types();
+    pair_offsets_.assign(sites.size() + 1, 0);
+    for (int pass = 0; pass < 2; pass++) {
+        vector<size_t> next(pair_offsets_.begin(), pair_offsets_.end() - 1);
+        int k = 0;
+        for (size_t n = 0; n < terms.size(); n++) {
+            DihedralTerm const& d = terms[n];
+            if (d.ignore_end) continue;
+            int owners[2] = {site_of[d.i], site_of[d.l]};
+            if (owners[1] == owners[0]) owners[1] = -1;
+            for (int o = 0; o < 2; o++) {
+                int s = owners[o];
+                if (s < 0) continue;
+                if (pass == 0) {
+                    pair_offsets_[s+1]++;
+                    continue;
+                }
+                int a, b;
+                double qq, sigma, epsilon;
+                if (k >= nonbonded_->getNumExceptions())
+                    throw AmberParmError("System is missing 1-4 exceptions");
+                nonbonded_->getExceptionParameters(k, a, b, qq, sigma, epsilon);
+                if (a != d.i || b != d.l)
+                    throw AmberParmError("System 1-4 exceptions do not match "
+                                         "the dihedrals of the topology");
+                // Keep the pair among the exceptions OpenMM computes when
+                // the charges of the site go to zero (see createSystem)
+                if (epsilon == 0) {
+                    epsilon = PLACEHOLDER_EPSILON;
+                    nonbonded_->setExceptionParameters(k, a, b, qq, sigma,
+                                                       epsilon);
+                }
+                size_t p = next[s]++;
+                pair_exception_[p] = k;
+                pair_i_[p] = d.i;
+                pair_j_[p] = d.l;
+                pair_scale_[p] = 1.0 / types[d.type].scee;
+                pair_sigma_[p] = sigma;
+                pair_epsilon_[p] = epsilon;
+            }
+            k++;
+        }
+        if (pass == 0) {
+            for (int s = 0; s < sites.size(); s++)
+                pair_offsets_[s+1] += pair_offsets_[s];
+            size_t npairs = pair_offsets_.back();
+            pair_exception_.resize(npairs);
+            pair_i_.resize(npairs);
+            pair_j_.resize(npairs);
+            pair_scale_.resize(npairs);
+            pair_sigma_.resize(npairs);
+            pair_epsilon_.resize(npairs);
+        }
+    }
+
+    // Start every site in its initial state, whatever the topology had
+    charges_ = parm.getAtomTable().charges();
+    states_ = sites.getInitialStates();
+    for (int s = 0; s < sites.size(); s++) {
+        states_[s] = -1;
+        setState(s, sites.getInitialState(s));
+    }
+}
+
+void ProtonationStateUpdater::setState(int site, int state) {
+    if (site < 0 || site >= sites_->size() || state < 0 ||
+            state >= sites_->getNumStates(site)) {
+        stringstream ss;
+        ss << "No state " << state << " for titratable site " << site;
+        throw AmberCpinError(ss.str());
+    }
+    if (states_[site] == state) return;
+    states_[site] = state;
+    sites_->applyState(site, state, charges_);
+
+    int first = sites_->getFirstAtom(site), end = sites_->getEndAtom(site);
+    for (int i = first; i < end; i++) {
+        double q, sigma, epsilon;
+        nonbonded_->getParticleParameters(i, q, sigma, epsilon);
+        nonbonded_->setParticleParameters(i, charges_[i], sigma, epsilon);
+        if (gb_ != NULL) {
+            gb_->getParticleParameters(i, gb_params_);
+            gb_params_[0] = charges_[i];
+            gb_->setParticleParameters(i, gb_params_);
+        }
+    }
+    for (size_t p = pair_offsets_[site]; p < pair_offsets_[site+1]; p++) {
+        int i = pair_i_[p], j = pair_j_[p];
+        nonbonded_->setExceptionParameters(pair_exception_[p], i, j,
+                                           charges_[i] * charges_[j] *
+                                           pair_scale_[p], pair_sigma_[p],
+                                           pair_epsilon_[p]);
+    }
+    dirty_ = true;
+}
+
+void ProtonationStateUpdater::setStates(vector<int> const& states) {
+    if ((int) states.size() != sites_->size())
+        throw AmberCpinError("Need one state for every titratable site");
+    for (int s = 0; s < sites_->size(); s++)
+        setState(s, states[s]);
+}
+
+void ProtonationStateUpdater::updateContext(OpenMM::Context &context) {
+    if (!dirty_) return;
+    nonbonded_->updateParametersInContext(context);
+    if (gb_ != NULL)
+        gb_->updateParametersInContext(context);
+    dirty_ = false;
+}
+
+// ProtonationSampler
+
+ProtonationSampler::ProtonationSampler(TitratableSites const& sites,
+                                       OpenMM::System &system,
+                                       OpenMM::Context &context, double pH,
+                                       double temperature, uint64_t seed) :
+    updater_(sites, system), context_(&context), pH_(pH),
+    temperature_(temperature), random_(seed),
+    attempts_(sites.size(), 0), accepted_(sites.size(), 0), evaluations_(0),
+    pair_cutoff_(5.0), independence_(0.0),
+    evaluator_(NULL), native_min_moves_(1) {
+    if (random_ == 0)
+        random_ = (uint64_t) time(NULL) * 2654435761u;
+    // xorshift needs a nonzero state; mix the seed so small seeds differ
+    random_ ^= 0x9e3779b97f4a7c15ull;
+    if (random_ == 0) random_ = 1;
+    updater_.updateContext(context);
+
+    // Beyond the cutoff of the nonbonded (and GB) force sites do not interact
+    for (int f = 0; f < system.getNumForces(); f++) {
+        OpenMM::NonbondedForce *nonbonded =
+                dynamic_cast<OpenMM::NonbondedForce*>(&system.getForce(f));
+        if (nonbonded == NULL) continue;
+        OpenMM::NonbondedForce::NonbondedMethod method =
+                nonbonded->getNonbondedMethod();
+        if (method == OpenMM::NonbondedForce::CutoffNonPeriodic ||
+                method == OpenMM::NonbondedForce::CutoffPeriodic)
+            independence_ = nonbonded->getCutoffDistance() *
+                            ANGSTROM_PER_NANOMETER;
+        break;
+    }
+
+    // Sites joined by a bond (e.g., neighboring residues) always interact
+    AmberParm const& parm = sites.getParm();
+    int nsite = sites.size();
+    vector<int> site_of(parm.getNumAtoms(), -1);
+    for (int s = 0; s < nsite; s++)
+        for (int i = sites.getFirstAtom(s); i < sites.getEndAtom(s); i++)
+            site_of[i] = s;
+    bonded_.assign((size_t) nsite * nsite, 0);
+    for (int s = 0; s < nsite; s++)
+        for (int i = sites.getFirstAtom(s); i < sites.getEndAtom(s); i++) {
+            Span<int> neighbors = parm.getNeighbors(i);
+            for (size_t n = 0; n < neighbors.size(); n++) {
+                int t = site_of[neighbors[n]];
+                if (t >= 0 && t != s) bonded_[(size_t) s * nsite + t] = 1;
+            }
+        }
+}
+
+void ProtonationSampler::setPairCutoff(double cutoff) {
+    if (cutoff < 0)
+        throw AmberCpinError("Pair cutoff must not be negative");
+    pair_cutoff_ = cutoff;
+}
+
+double ProtonationSampler::uniform_(void) {
+    // xorshift64*
+    random_ ^= random_ >> 12;
+    random_ ^= random_ << 25;
+    random_ ^= random_ >> 27;
+    uint64_t bits = random_ * 2685821657736338717ull;
+    return (bits >> 11) * (1.0 / 9007199254740992.0);
+}
+
+double ProtonationSampler::energy_(void) {
+    OpenMM::State state = context_->getState(OpenMM::State::Energy, false,
+                                             1 << AmberParm::NONBONDED_FORCE_GROUP);
+    evaluations_++;
+    return state.getPotentialEnergy() * CALORIE_PER_JOULE;
+}
+
+int ProtonationSampler::propose_(int site) {
+    TitratableSites const& sites = updater_.getSites();
+    int nstates = sites.getNumStates(site);
+    int old = updater_.getState(site);
+    if (nstates < 2) return old;
+    int proposed = random_int_(nstates - 1);
+    return proposed >= old ? proposed + 1 : proposed;
+}
+
+double ProtonationSampler::reference_(int site, int old, int proposed) const {
+    TitratableSites const& sites = updater_.getSites();
+    double kT = BOLTZMANN_KCAL * temperature_;
+    return -(sites.getStateEnergy(site, proposed) -
+             sites.getStateEnergy(site, old)) +
+           kT * M_LN10 * pH_ * (sites.getProtonCount(site, proposed) -
+                                sites.getProtonCount(site, old));
+}
+
+int ProtonationSampler::attemptMoves(int nmoves) {
+    TitratableSites const& sites = updater_.getSites();
+    if (sites.empty()) return 0;
+    double kT = BOLTZMANN_KCAL * temperature_;
+    int naccepted = 0;
+    if (evaluator_ != NULL && nmoves >= native_min_moves_) {
+        updateEvaluator_();
+        for (int m = 0; m < nmoves; m++) {
+            int site = random_int_(sites.size());
+            int old = updater_.getState(site);
+            int proposed = propose_(site);
+            if (proposed == old) continue;
+
+            double dG = evaluator_->getEnergyChange(updater_.getCharges(),
+                            sites.getFirstAtom(site), sites.getEndAtom(site),
+                            sites.getCharges(site, proposed)) +
+                        reference_(site, old, proposed);
+            attempts_[site]++;
+            if (dG <= 0 || uniform_() < exp(-dG / kT)) {
+                accepted_[site]++;
+                naccepted++;
+                updater_.setState(site, proposed);
+            }
+        }
+        updater_.updateContext(*context_);
+        return naccepted;
+    }
+
+    double energy = energy_();
+    for (int m = 0; m < nmoves; m++) {
+        int site = random_int_(sites.size());
+        int old = updater_.getState(site);
+        int proposed = propose_(site);
+        if (proposed == old) continue;
+
+        updater_.setState(site, proposed);
+        updater_.updateContext(*context_);
+        double trial = energy_();
+        double dG = trial - energy + reference_(site, old, proposed);
+        attempts_[site]++;
+        if (dG <= 0 || uniform_() < exp(-dG / kT)) {
+            accepted_[site]++;
+            naccepted++;
+            energy = trial;
+        } else {
+            updater_.setState(site, old);
+            updater_.updateContext(*context_);
+        }
+    }
+    return naccepted;
+}
+
+void ProtonationSampler::run(int nsteps, int interval, int nmoves) {
+    if (interval < 1)
+        throw AmberCpinError("Protonation moves need a positive interval");
+    OpenMM::Integrator &integrator = context_->getIntegrator();
+    for (int done = 0; done < nsteps; done += interval) {
+        int n = nsteps - done < interval ? nsteps - done : interval;
+        integrator.step(n);
+        if (n == interval) attemptMoves(nmoves);
+    }
+}
+
+void ProtonationSampler::setEvaluator(GBElectrostatics *evaluator) {
+    AmberParm const& parm = updater_.getSites().getParm();
+    if (evaluator != NULL && evaluator->getNumAtoms() != parm.getNumAtoms())
+        throw AmberParmError("GB evaluator and titratable sites have different "
+                             "atoms");
+    evaluator_ = evaluator;
+}
+
+void ProtonationSampler::setNativeMinMoves(int nmoves) {
+    if (nmoves < 1)
+        throw AmberCpinError("Native moves need at least one move per round");
+    native_min_moves_ = nmoves;
+}
+
+void ProtonationSampler::updateEvaluator_(void) {
+    OpenMM::State state = context_->getState(OpenMM::State::Positions);
+    vector<OpenMM::Vec3> positions = state.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= ANGSTROM_PER_NANOMETER;
+    evaluator_->setPositions(positions);
+}
+
+double ProtonationSampler::nativeChange_(int const* unit, int const* proposed,
+                                         int n, vector<double> &scratch) const {
+    TitratableSites const& sites = updater_.getSites();
+    double change = 0;
+    vector<double> const* charges = &updater_.getCharges();
+    for (int k = 0; k < n; k++) {
+        int site = unit[k];
+        if (updater_.getState(site) == proposed[k]) continue;
+        change += evaluator_->getEnergyChange(*charges,
+                        sites.getFirstAtom(site), sites.getEndAtom(site),
+                        sites.getCharges(site, proposed[k]));
+        // The second site of a pair sees the charges of the first
+        if (k + 1 < n) {
+            scratch = *charges;
+            sites.applyState(site, proposed[k], scratch);
+            charges = &scratch;
+        }
+    }
+    return change;
+}
+
+void ProtonationSampler::siteDistances_(double cutoff,
+                                        vector<double> &distances) {
+    TitratableSites const& sites = updater_.getSites();
+    int nsite = sites.size();
+    OpenMM::State state = context_->getState(OpenMM::State::Positions);
+    vector<OpenMM::Vec3> const& pos = state.getPositions();
+
+    // Bounding spheres skip the atom pairs of sites that are far apart
+    vector<OpenMM::Vec3> centers(nsite);
+    vector<double> radii(nsite, 0.0);
+    for (int s = 0; s < nsite; s++) {
+        int first = sites.getFirstAtom(s), end = sites.getEndAtom(s);
+        for (int i = first; i < end; i++)
+            centers[s] += pos[i];
+        if (end > first) centers[s] *= 1.0 / (end - first);
+        for (int i = first; i < end; i++) {
+            OpenMM::Vec3 d = pos[i] - centers[s];
+            radii[s] = max(radii[s], sqrt(d.dot(d)));
+        }
+    }
+
+    distances.assign((size_t) nsite * nsite, HUGE_VAL);
+    for (int s = 0; s < nsite; s++) {
+        distances[(size_t) s * nsite + s] = 0.0;
+        for (int t = s + 1; t < nsite; t++) {
+            OpenMM::Vec3 d = centers[t] - centers[s];
+            if (sqrt(d.dot(d)) - radii[s] - radii[t] > cutoff) continue;
+            double closest = HUGE_VAL;
+            for (int i = sites.getFirstAtom(s); i < sites.getEndAtom(s); i++)
+                for (int j = sites.getFirstAtom(t); j < sites.getEndAtom(t);
+                        j++) {
+                    d = pos[j] - pos[i];
+                    closest = min(closest, d.dot(d));
+                }
+            distances[(size_t) s * nsite + t] = sqrt(closest);
+            distances[(size_t) t * nsite + s] = sqrt(closest);
+        }
+    }
+}
+
+int ProtonationSampler::attemptSweep(void) {
+    TitratableSites const& sites = updater_.getSites();
+    int nsite = sites.size();
+    if (nsite == 0) return 0;
+    GBElectrostatics *evaluator = nsite >= native_min_moves_ ? evaluator_
+                                                             : NULL;
+    bool batched = evaluator != NULL && independence_ > 0;
+    double independence = independence_ * NANOMETER_PER_ANGSTROM;
+    double pairing = pair_cutoff_ * NANOMETER_PER_ANGSTROM;
+    vector<double> distances;
+    siteDistances_(batched ? max(independence, pairing) : pairing, distances);
+
+    /* Split the sites into units that move together: pairs of neighbors, each
+     * taken half the time so that the sites also move alone, and single
+     * sites. The split depends on the positions and random numbers but never
+     * on the states, so every move is its own reverse
+     */
+    vector<int> partner(nsite, -1);
+    vector<pair<int, int> > neighbors;
+    for (int s = 0; s < nsite; s++)
+        for (int t = s + 1; t < nsite; t++) {
+            size_t st = (size_t) s * nsite + t;
+            if (bonded_[st] || distances[st] < pairing)
+                neighbors.push_back(make_pair(s, t));
+        }
+    for (int n = (int) neighbors.size() - 1; n > 0; n--)
+        swap(neighbors[n], neighbors[random_int_(n + 1)]);
+    for (size_t n = 0; n < neighbors.size(); n++) {
+        int s = neighbors[n].first, t = neighbors[n].second;
+        if (partner[s] < 0 && partner[t] < 0 && uniform_() < 0.5) {
+            partner[s] = t;
+            partner[t] = s;
+        }
+    }
+    vector<int> units;
+    for (int s = 0; s < nsite; s++)
+        if (partner[s] < 0 || s < partner[s]) units.push_back(s);
+    for (int n = (int) units.size() - 1; n > 0; n--)
+        swap(units[n], units[random_int_(n + 1)]);
+
+    /* With native energies, pack the units first-fit into batches whose sites
+     * are all out of each other's reach, so that their energy changes from
+     * the same charges add up. Otherwise every unit is a batch of its own
+     */
+    vector<vector<int> > batches, batch_sites;
+    for (size_t u = 0; u < units.size(); u++) {
+        int members[2] = {units[u], partner[units[u]]};
+        size_t b = batched ? 0 : batches.size();
+        for (; b < batches.size(); b++) {
+            bool coupled = false;
+            for (size_t k = 0; k < batch_sites[b].size() && !coupled; k++)
+                for (int m = 0; m < 2 && !coupled; m++) {
+                    if (members[m] < 0) continue;
+                    size_t st = (size_t) members[m] * nsite + batch_sites[b][k];
+                    coupled = bonded_[st] || distances[st] < independence;
+                }
+            if (!coupled) break;
+        }
+        if (b == batches.size()) {
+            batches.push_back(vector<int>());
+            batch_sites.push_back(vector<int>());
+        }
+        batches[b].push_back(units[u]);
+        for (int m = 0; m < 2; m++)
+            if (members[m] >= 0) batch_sites[b].push_back(members[m]);
+    }
+
+    double kT = BOLTZMANN_KCAL * temperature_;
+    double energy = 0;
+    if (evaluator != NULL)
+        updateEvaluator_();
+    else
+        energy = energy_();
+    int nchanged = 0;
+    vector<int> old, proposed;
+    vector<double> changes;
+    for (size_t b = 0; b < batches.size(); b++) {
+        vector<int> const& batch = batches[b];
+        int nunit = (int) batch.size();
+        old.resize(2 * nunit);
+        proposed.resize(2 * nunit);
+        changes.assign(nunit, 0.0);
+        for (int u = 0; u < nunit; u++)
+            for (int m = 0; m < 2; m++) {
+                int site = m == 0 ? batch[u] : partner[batch[u]];
+                old[2*u+m] = proposed[2*u+m] = -1;
+                if (site < 0) continue;
+                old[2*u+m] = updater_.getState(site);
+                proposed[2*u+m] = propose_(site);
+            }
+
+        // The energy change of every unit of the batch from the same charges
+        if (evaluator != NULL) {
+#ifdef _OPENMP
+#           pragma omp parallel for schedule(dynamic, 1) if (nunit > 1)
+#endif
+            for (int u = 0; u < nunit; u++) {
+                int members[2] = {batch[u], partner[batch[u]]};
+                vector<double> scratch;
+                changes[u] = nativeChange_(members, &proposed[2*u],
+                                           members[1] < 0 ? 1 : 2, scratch);
+            }
+        }
+
+        // Every unit is accepted or rejected on its own
+        for (int u = 0; u < nunit; u++) {
+            int members[2] = {batch[u], partner[batch[u]]};
+            double dG = 0;
+            int nmoving = 0;
+            for (int m = 0; m < 2; m++) {
+                if (members[m] < 0 || proposed[2*u+m] == old[2*u+m]) continue;
+                dG += reference_(members[m], old[2*u+m], proposed[2*u+m]);
+                nmoving++;
+            }
+            if (nmoving == 0) continue;
+
+            double trial = energy;
+            if (evaluator != NULL) {
+                dG += changes[u];
+            } else {
+                for (int m = 0; m < 2; m++)
+                    if (members[m] >= 0)
+                        updater_.setState(members[m], proposed[2*u+m]);
+                updater_.updateContext(*context_);
+                trial = energy_();
+                dG += trial - energy;
+            }
+            bool accept = dG <= 0 || uniform_() < exp(-dG / kT);
+            for (int m = 0; m < 2; m++) {
+                int site = members[m];
+                if (site < 0 || proposed[2*u+m] == old[2*u+m]) continue;
+                attempts_[site]++;
+                if (accept)
+                    accepted_[site]++;
+                updater_.setState(site, accept ? proposed[2*u+m] : old[2*u+m]);
+            }
+            if (accept) {
+                nchanged += nmoving;
+                energy = trial;
+            } else if (evaluator == NULL) {
+                updater_.updateContext(*context_);
+            }
+        }
+    }
+    if (evaluator != NULL)
+        updater_.updateContext(*context_);
+    return nchanged;
+}
+
+void ProtonationSampler::resetStatistics(void) {
+    attempts_.assign(attempts_.size(), 0);
+    accepted_.assign(accepted_.size(), 0);
+    evaluations_ = 0;
+}
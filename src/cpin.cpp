@@ -0,0 +1,331 @@
+/// cpin.cpp -- reads the titratable sites of an Amber cpin file
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <map>
+#include <sstream>
+
+#include "amber/cpin.h"
+#include "amber/exceptions.h"
+#include "amber/inputstream.h"
+
+using namespace std;
+using namespace Amber;
+
+// The &CNSTPH namelist
+
+/* Every variable of the namelist as a list of (unparsed) values. Indexed
+ * variables land at their index, so "STATEINF(3)%NUM_ATOMS=20" sets element 3
+ * of STATEINF%NUM_ATOMS. Empty strings are elements that were never set
+ */
+typedef map<string, vector<string> > Namelist;
+
+static void cpinError(string const& filename, string const& msg) {
+    throw AmberCpinError(filename + ": " + msg);
+}
+
+/// Splits the text of a namelist into names, '=' and values
+static vector<string> tokenize(string const& text, string const& filename) {
+    vector<string> tokens;
+    size_t i = 0;
+    while (i < text.size()) {
+        char c = text[i];
+        if (isspace(c) || c == ',') {
+            i++;
+        } else if (c == '=') {
+            tokens.push_back("=");
+            i++;
+        } else if (c == '\'' || c == '"') {
+            // Quoted strings keep their quote so they are never names
+            size_t end = text.find(c, i + 1);
+            if (end == string::npos) cpinError(filename, "unterminated string");
+            tokens.push_back(text.substr(i, end - i));
+            i = end + 1;
+        } else if (c == '!') {
+            while (i < text.size() && text[i] != '\n') i++;
+        } else {
+            size_t start = i;
+            while (i < text.size() && !isspace(text[i]) && text[i] != ',' &&
+                    text[i] != '=')
+                i++;
+            tokens.push_back(text.substr(start, i - start));
+        }
+    }
+    return tokens;
+}
+
+/// Splits NAME(index)%FIELD into "NAME%FIELD" and index (0 if none is given)
+static string variableName(string const& token, int &index,
+                           string const& filename) {
+    string name;
+    for (size_t i = 0; i < token.size(); i++)
+        name += toupper(token[i]);
+    index = 0;
+    size_t open = name.find('(');
+    if (open == string::npos) return name;
+    size_t close = name.find(')', open);
+    string number = close == string::npos ? "" :
+                    name.substr(open + 1, close - open - 1);
+    if (number.empty() ||
+            number.find_first_not_of("0123456789") != string::npos)
+        cpinError(filename, "bad index in " + token);
+    index = atoi(number.c_str());
+    return name.substr(0, open) + name.substr(close + 1);
+}
+
+/// Reads the &CNSTPH namelist of a cpin file
+static Namelist readNamelist(string const& filename) {
+    InputStream input;
+    if (!input.open(filename))
+        cpinError(filename, "could not open file");
+    string text, line;
+    while (input.getline(line))
+        text += line + '\n';
+    if (!input.good())
+        cpinError(filename, "could not read file");
+
+    // The namelist runs from &CNSTPH to a '/' or &END outside of a string
+    string upperText = text;
+    for (size_t i = 0; i < upperText.size(); i++)
+        upperText[i] = toupper(upperText[i]);
+    size_t start = upperText.find("&CNSTPH");
+    while (start != string::npos && start + 7 < upperText.size() &&
+            (isalnum(upperText[start+7]) || upperText[start+7] == '_'))
+        start = upperText.find("&CNSTPH", start + 1);
+    if (start == string::npos)
+        cpinError(filename, "no &CNSTPH namelist");
+    start += 7;
+    size_t end = start;
+    char quote = 0;
+    for (; end < text.size(); end++) {
+        char c = text[end];
+        if (quote) {
+            if (c == quote) quote = 0;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+        } else if (c == '/' || upperText.compare(end, 4, "&END") == 0) {
+            break;
+        }
+    }
+    if (end == text.size())
+        cpinError(filename, "&CNSTPH namelist is not terminated");
+
+    vector<string> tokens = tokenize(text.substr(start, end - start), filename);
+    Namelist namelist;
+    size_t t = 0;
+    while (t < tokens.size()) {
+        if (t + 1 >= tokens.size() || tokens[t+1] != "=" ||
+                tokens[t][0] == '\'' || tokens[t][0] == '"')
+            cpinError(filename, "expected a variable name before " + tokens[t]);
+        int index;
+        string name = variableName(tokens[t], index, filename);
+        vector<string> &values = namelist[name];
+        t += 2;
+        // Values run up to the next name (the token before an '=')
+        for (; t < tokens.size() && tokens[t] != "=" &&
+                (t + 1 >= tokens.size() || tokens[t+1] != "="); t++) {
+            // n*value repeats value n times
+            string value = tokens[t];
+            int repeat = 1;
+            size_t star = value.find('*');
+            if (value[0] != '\'' && value[0] != '"' && star != string::npos) {
+                repeat = atoi(value.substr(0, star).c_str());
+                value = value.substr(star + 1);
+                if (repeat < 1 || value.empty())
+                    cpinError(filename, "bad repeated value " + tokens[t]);
+            }
+            for (int r = 0; r < repeat; r++, index++) {
+                if ((int) values.size() <= index) values.resize(index + 1);
+                values[index] = value;
+            }
+        }
+    }
+    return namelist;
+}
+
+/// The values of a variable, which must be present
+static vector<string> const& required(Namelist const& namelist,
+                                      string const& name,
+                                      string const& filename) {
+    Namelist::const_iterator it = namelist.find(name);
+    if (it == namelist.end())
+        cpinError(filename, "missing " + name);
+    return it->second;
+}
+
+static int toInt(vector<string> const& values, size_t i, string const& name,
+                 string const& filename) {
+    if (i >= values.size() || values[i].empty()) {
+        stringstream ss;
+        ss << "missing value " << i << " of " << name;
+        cpinError(filename, ss.str());
+    }
+    char *end;
+    errno = 0;
+    long value = strtol(values[i].c_str(), &end, 10);
+    if (*end != '\0' || errno != 0 || value != (int) value)
+        cpinError(filename, "bad integer " + values[i] + " in " + name);
+    return (int) value;
+}
+
+static double toDouble(vector<string> const& values, size_t i,
+                       string const& name, string const& filename) {
+    if (i >= values.size() || values[i].empty()) {
+        stringstream ss;
+        ss << "missing value " << i << " of " << name;
+        cpinError(filename, ss.str());
+    }
+    // Fortran writes exponents as D as well as E
+    string text = values[i];
+    replace(text.begin(), text.end(), 'd', 'e');
+    replace(text.begin(), text.end(), 'D', 'e');
+    char *end;
+    double value = strtod(text.c_str(), &end);
+    if (*end != '\0' || !(fabs(value) < HUGE_VAL))
+        cpinError(filename, "bad number " + values[i] + " in " + name);
+    return value;
+}
+
+/// The residue name in 'Residue: NAME NUMBER', or the whole string otherwise
+static string residueName(string const& resname, int &number) {
+    string text = resname;
+    if (!text.empty() && (text[0] == '\'' || text[0] == '"'))
+        text = text.substr(1);
+    istringstream iss(text);
+    string word, name;
+    number = -1;
+    if (iss >> word && word == "Residue:" && iss >> name) {
+        if (!(iss >> number)) number = -1;
+        return name;
+    }
+    return text;
+}
+
+// TitratableSites
+
+TitratableSites::TitratableSites(void) :
+    parm_(NULL), igb_(0), intdiel_(1.0) {}
+
+TitratableSites::TitratableSites(AmberParm const& parm,
+                                 string const& filename) :
+    parm_(NULL), igb_(0), intdiel_(1.0) {
+    readCpin(parm, filename);
+}
+
+void TitratableSites::readCpin(AmberParm const& parm, string const& filename) {
+    Namelist namelist = readNamelist(filename);
+
+    int nres = toInt(required(namelist, "TRESCNT", filename), 0, "TRESCNT",
+                     filename);
+    if (nres < 0) cpinError(filename, "negative TRESCNT");
+    vector<string> const& chrgdat = required(namelist, "CHRGDAT", filename);
+    vector<string> const& protcnt = required(namelist, "PROTCNT", filename);
+    vector<string> const& statene = required(namelist, "STATENE", filename);
+    vector<string> const& first_atom =
+            required(namelist, "STATEINF%FIRST_ATOM", filename);
+    vector<string> const& num_atoms =
+            required(namelist, "STATEINF%NUM_ATOMS", filename);
+    vector<string> const& first_state =
+            required(namelist, "STATEINF%FIRST_STATE", filename);
+    vector<string> const& num_states =
+            required(namelist, "STATEINF%NUM_STATES", filename);
+    vector<string> const& first_charge =
+            required(namelist, "STATEINF%FIRST_CHARGE", filename);
+    Namelist::const_iterator it = namelist.find("RESSTATE");
+    vector<string> resstate;
+    if (it != namelist.end()) resstate = it->second;
+    it = namelist.find("RESNAME");
+    vector<string> resname;
+    if (it != namelist.end()) resname = it->second;
+
+    // Build everything aside so a bad file leaves this object alone
+    TitratableSites sites;
+    sites.parm_ = &parm;
+    it = namelist.find("CPH_IGB");
+    if (it != namelist.end())
+        sites.igb_ = toInt(it->second, 0, "CPH_IGB", filename);
+    it = namelist.find("CPH_INTDIEL");
+    if (it != namelist.end())
+        sites.intdiel_ = toDouble(it->second, 0, "CPH_INTDIEL", filename);
+
+    int natom = parm.getNumAtoms();
+    int nstates = 0;
+    size_t ncharges = 0;
+    for (int i = 0; i < nres; i++) {
+        stringstream where;
+        where << "titratable residue " << i << ": ";
+        int first = toInt(first_atom, i, "STATEINF%FIRST_ATOM", filename) - 1;
+        int n = toInt(num_atoms, i, "STATEINF%NUM_ATOMS", filename);
+        int state0 = toInt(first_state, i, "STATEINF%FIRST_STATE", filename);
+        int ns = toInt(num_states, i, "STATEINF%NUM_STATES", filename);
+        int charge0 = toInt(first_charge, i, "STATEINF%FIRST_CHARGE", filename);
+        if (n < 1 || ns < 1 || first < 0 || state0 < 0 || charge0 < 0)
+            cpinError(filename, where.str() + "bad STATEINF");
+        if (first + n > natom)
+            cpinError(filename, where.str() + "atoms beyond the topology");
+        if ((size_t) charge0 + (size_t) ns * n > chrgdat.size())
+            cpinError(filename, where.str() + "CHRGDAT is too short");
+        if ((size_t) state0 + ns > protcnt.size() ||
+                (size_t) state0 + ns > statene.size())
+            cpinError(filename, where.str() + "PROTCNT or STATENE is too short");
+
+        // A site is part of one residue, the one RESNAME names if it does
+        int residue = parm.getResidueOf(first);
+        if (residue != parm.getResidueOf(first + n - 1))
+            cpinError(filename, where.str() + "atoms span several residues");
+        int number = -1;
+        string name = (size_t) i + 1 < resname.size() ?
+                      residueName(resname[i+1], number) :
+                      parm.getResidue(residue).getName();
+        if (number != -1 && number != residue + 1) {
+            stringstream ss;
+            ss << where.str() << "atoms are in residue " << residue + 1
+               << ", not " << number;
+            cpinError(filename, ss.str());
+        }
+
+        int initial = resstate.empty() ? 0 :
+                      toInt(resstate, i, "RESSTATE", filename);
+        if (initial < 0 || initial >= ns)
+            cpinError(filename, where.str() + "bad RESSTATE");
+
+        sites.names_.push_back(name);
+        sites.residue_.push_back(residue);
+        sites.first_atom_.push_back(first);
+        sites.num_atoms_.push_back(n);
+        sites.num_states_.push_back(ns);
+        sites.first_state_.push_back(nstates);
+        sites.initial_state_.push_back(initial);
+        sites.charge_offset_.push_back(ncharges);
+        for (size_t c = 0; c < (size_t) ns * n; c++)
+            sites.charges_.push_back(toDouble(chrgdat, charge0 + c, "CHRGDAT",
+                                              filename));
+        for (int s = 0; s < ns; s++) {
+            sites.proton_counts_.push_back(toInt(protcnt, state0 + s,
+                                                 "PROTCNT", filename));
+            sites.state_energies_.push_back(toDouble(statene, state0 + s,
+                                                     "STATENE", filename));
+        }
+        nstates += ns;
+        ncharges += (size_t) ns * n;
+    }
+
+    *this = sites;
+}
+
+void TitratableSites::applyState(int i, int state,
+                                 vector<double> &charges) const {
+    Span<double> row = getCharges(i, state);
+    copy(row.begin(), row.end(), charges.begin() + first_atom_[i]);
+}
+
+void TitratableSites::applyStates(vector<int> const& states,
+                                  vector<double> &charges) const {
+    if ((int) states.size() != size())
+        throw AmberCpinError("Need one state for every titratable site");
+    for (int i = 0; i < size(); i++)
+        applyState(i, states[i], charges);
+}
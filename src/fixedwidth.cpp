@@ -0,0 +1,190 @@
+/// fixedwidth.cpp -- slow paths for the fixed-width numeric decoders, and the
+/// fixed-width encoders
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "amber/fixedwidth.h"
+
+using namespace Amber;
+
+const double Amber::FIXEDWIDTH_POW10[FIXEDWIDTH_MAX_EXACT_POW10+1] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Fields are narrow (at most a few dozen characters), so anything longer than
+ * this is truncated just as the fixed-width layout would truncate it
+ */
+#define SLOW_BUFFER_SIZE 64
+
+static inline const char* toBuffer(const char* begin, const char* end,
+                                   char* buf) {
+    size_t n = end - begin;
+    if (n >= SLOW_BUFFER_SIZE) n = SLOW_BUFFER_SIZE - 1;
+    memcpy(buf, begin, n);
+    buf[n] = '\0';
+    return buf;
+}
+
+double Amber::decodeRealSlow(const char* begin, const char* end) {
+    char buf[SLOW_BUFFER_SIZE];
+    return atof(toBuffer(begin, end, buf));
+}
+
+int Amber::decodeIntSlow(const char* begin, const char* end) {
+    char buf[SLOW_BUFFER_SIZE];
+    return atoi(toBuffer(begin, end, buf));
+}
+
+bool Amber::decodeRealSlow(const char* begin, const char* end, double &value) {
+    char buf[SLOW_BUFFER_SIZE];
+    char* stop;
+    double d = strtod(toBuffer(begin, end, buf), &stop);
+    if (stop == buf) return false;
+    value = d;
+    return true;
+}
+
+/// Pads the len characters at s on the left to width and copies them to out
+static inline int justify(const char* s, int len, int width, char* out) {
+    int pad = width > len ? width - len : 0;
+    memset(out, ' ', pad);
+    memcpy(out + pad, s, len);
+    return pad + len;
+}
+
+static int encodeSlow(const char* fmt, double value, int width, int prec,
+                      char* out) {
+    int len = snprintf(out, width + prec + FIXEDWIDTH_ENCODE_SIZE, fmt, width,
+                       prec, value);
+    return len < 0 ? 0 : len;
+}
+
+static inline bool isNegative(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return (bits >> 63) != 0;    // catches -0.0, which printf writes as such
+}
+
+/* Rounds a * 10^shift (a >= 0) to the nearest integer. The scaling is a single
+ * correctly-rounded operation, so the result is only off by half an ulp; values
+ * that close to a rounding tie (or too large to round in a double) are left to
+ * printf, since the exact decimal expansion decides those
+ */
+static inline bool roundScaled(double a, int shift, uint64_t &m) {
+    if (shift > FIXEDWIDTH_MAX_EXACT_POW10 || shift < -FIXEDWIDTH_MAX_EXACT_POW10)
+        return false;
+    double scaled = shift >= 0 ? a * FIXEDWIDTH_POW10[shift]
+                               : a / FIXEDWIDTH_POW10[-shift];
+    if (!(scaled < 4503599627370496.0)) return false; // 2^52
+    uint64_t whole = (uint64_t) scaled;     // exact, and cheaper than floor
+    double frac = scaled - (double) whole;
+    if (fabs(frac - 0.5) <= scaled * 1e-15) return false;
+    m = whole + (frac > 0.5 ? 1 : 0);
+    return true;
+}
+
+/// Estimates floor(log10(a)) for a > 0 from the binary exponent. The result is
+/// exact or one too small
+static inline int decimalExponent(double a) {
+    uint64_t bits;
+    memcpy(&bits, &a, sizeof(bits));
+    int e2 = (int) ((bits >> 52) & 0x7FF) - 1023;
+    if (e2 == -1023) {
+        // Subnormal -- fall back to the library
+        return (int) floor(log10(a));
+    }
+    // 78913 / 2^18 is log10(2) rounded down, and >> rounds toward -infinity
+    return (e2 * 78913) >> 18;
+}
+
+/// Writes the decimal digits of m, at least ndigits of them, ending at end
+static inline char* writeDigits(uint64_t m, int ndigits, char* end) {
+    char* p = end;
+    do {
+        *--p = (char) ('0' + m % 10);
+        m /= 10;
+        ndigits--;
+    } while (m > 0 || ndigits > 0);
+    return p;
+}
+
+int Amber::encodeInt(int value, int width, char* out) {
+    char buf[16];
+    char* end = buf + sizeof(buf);
+    unsigned int u = value < 0 ? 0u - (unsigned int) value : (unsigned int) value;
+    char* p = writeDigits(u, 1, end);
+    if (value < 0) *--p = '-';
+    return justify(p, (int) (end - p), width, out);
+}
+
+/// Most digits after the decimal point the E-format fast path handles
+#define MAX_FAST_EXP_PREC 14
+
+int Amber::encodeExp(double value, int width, int prec, char* out) {
+    if (prec < 0 || prec > MAX_FAST_EXP_PREC || value != value ||
+            fabs(value) > 1.7976931348623157e308)
+        return encodeSlow("%*.*E", value, width, prec, out);
+
+    double a = fabs(value);
+    uint64_t m = 0;
+    int e = 0;
+    if (a != 0) {
+        // The estimate can be one too small, and rounding can carry into a
+        // new digit, so adjust until there are exactly prec+1 digits
+        uint64_t lo = (uint64_t) FIXEDWIDTH_POW10[prec];
+        uint64_t hi = (uint64_t) FIXEDWIDTH_POW10[prec + 1];
+        e = decimalExponent(a);
+        int tries;
+        for (tries = 0; tries < 3; tries++) {
+            if (!roundScaled(a, prec - e, m))
+                return encodeSlow("%*.*E", value, width, prec, out);
+            if (m < lo)
+                e--;
+            else if (m >= hi)
+                e++;
+            else
+                break;
+        }
+        if (tries == 3) return encodeSlow("%*.*E", value, width, prec, out);
+    }
+
+    char buf[MAX_FAST_EXP_PREC + 16];
+    char* end = buf + sizeof(buf);
+    char* p = writeDigits(e < 0 ? -e : e, 2, end);
+    *--p = e < 0 ? '-' : '+';
+    *--p = 'E';
+    char* mend = p;
+    p = writeDigits(m, prec + 1, mend);
+    if (prec > 0) {
+        // Slide the leading digit over to make room for the decimal point
+        p[-1] = p[0];
+        p[0] = '.';
+        p--;
+    }
+    if (isNegative(value)) *--p = '-';
+    return justify(p, (int) (end - p), width, out);
+}
+
+int Amber::encodeFixed(double value, int width, int prec, char* out) {
+    uint64_t m;
+    if (prec < 0 || prec > FIXEDWIDTH_MAX_EXACT_POW10 || value != value ||
+            !roundScaled(fabs(value), prec, m))
+        return encodeSlow("%*.*f", value, width, prec, out);
+
+    char buf[FIXEDWIDTH_MAX_EXACT_POW10 + 24];
+    char* end = buf + sizeof(buf);
+    char* p = writeDigits(m, prec + 1, end);
+    if (prec > 0) {
+        // Move the integer digits over to make room for the decimal point
+        char* point = end - prec;
+        memmove(p - 1, p, point - p);
+        point[-1] = '.';
+        p--;
+    }
+    if (isNegative(value)) *--p = '-';
+    return justify(p, (int) (end - p), width, out);
+}
@@ -0,0 +1,476 @@
+/// gbenergy.cpp -- native GB electrostatics and charge-change energies
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#include "amber/amber_constants.h"
+#include "amber/exceptions.h"
+#include "amber/gbenergy.h"
+#include "amber/gbmodels.h"
+
+using namespace std;
+using namespace Amber;
+
+// Coulomb's constant in kJ nm/(mol e^2): OpenMM's for the NonbondedForce, and
+// the one written into the energy expressions of the GB forces
+static const double COULOMB_KE = 138.935456;
+static const double GB_KE = 138.935485;
+
+// Atoms per block of the pair loops that are spread over threads
+static const int PAIR_BLOCK = 512;
+
+/* exp(x) with no branches or library calls, so that loops calling it
+ * vectorize (libm's exp does not without -ffast-math). Cody-Waite reduction to
+ * x = n ln2 + r with |r| <= ln2/2, a degree 13 Taylor polynomial of exp(r)
+ * (within an ulp or two of libm), and 2^n built from the bits of the rounding
+ * constant. Arguments are clamped to -708 (below it 2^n would leave the normal
+ * range), which gives 3e-308 rather than 0; the pair loops never pass positive
+ * ones
+ */
+static inline double fastExp(double x) {
+    const double ROUND = 6755399441055744.0;    // 1.5 * 2^52
+    const double LN2_HI = 6.93147180369123816490e-01;
+    const double LN2_LO = 1.90821492927058770002e-10;
+    x = max(x, -708.0);
+    double t = x * 1.44269504088896340736 + ROUND;
+    double n = t - ROUND;
+    double r = (x - n * LN2_HI) - n * LN2_LO;
+    double p = 1.0 / 6227020800.0;
+    p = p * r + 1.0 / 479001600.0;
+    p = p * r + 1.0 / 39916800.0;
+    p = p * r + 1.0 / 3628800.0;
+    p = p * r + 1.0 / 362880.0;
+    p = p * r + 1.0 / 40320.0;
+    p = p * r + 1.0 / 5040.0;
+    p = p * r + 1.0 / 720.0;
+    p = p * r + 1.0 / 120.0;
+    p = p * r + 1.0 / 24.0;
+    p = p * r + 1.0 / 6.0;
+    p = p * r + 0.5;
+    p = p * r + 1.0;
+    p = p * r + 1.0;
+    // The low bits of t hold n: shift them into the exponent field
+    uint64_t bits;
+    memcpy(&bits, &t, sizeof(bits));
+    bits = (bits << 52) + ((uint64_t) 1023 << 52);
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+/* Sum over j in [begin, end) of (GB + Coulomb pair coefficient) * q[j]. The
+ * arrays are passed as plain pointers and the loop has no branches or calls,
+ * so that it vectorizes: gbenergy.o is built with -fno-math-errno (sqrt is an
+ * instruction) and -fno-trapping-math (the cutoff mask is not turned back
+ * into a branch). SALT leaves the exponential out when kappa is 0
+ */
+template <bool SALT>
+static double pairSum(int i, int begin, int end, const double* x,
+                      const double* y, const double* z, const double* born,
+                      const double* q, double cutoff, double kappa, double pre,
+                      double post) {
+    double xi = x[i], yi = y[i], zi = z[i], bi = born[i];
+    double cut2 = cutoff > 0 ? cutoff * cutoff : HUGE_VAL;
+    double invcut = cutoff > 0 ? 1 / cutoff : 0.0;
+    double sum = 0;
+#ifdef _OPENMP
+#   pragma omp simd reduction(+:sum)
+#endif
+    for (int j = begin; j < end; j++) {
+        double dx = x[j] - xi, dy = y[j] - yi, dz = z[j] - zi;
+        double r2 = dx * dx + dy * dy + dz * dz;
+        double bb = bi * born[j];
+        double f = sqrt(r2 + bb * fastExp(-r2 / (4 * bb)));
+        double screen = SALT ? pre - post * fastExp(-kappa * f) : pre - post;
+        double gb = -GB_KE * screen * (1 / f - invcut);
+        double coulomb = COULOMB_KE * (1 / sqrt(r2) - invcut);
+        sum += (gb + coulomb) * q[j] * (r2 < cut2);
+    }
+    return sum;
+}
+
+GBElectrostatics::GBElectrostatics(AmberParm const& parm,
+                                   string const& implicitSolvent,
+                                   double cutoff, double kappa,
+                                   double soluteDielectric,
+                                   double solventDielectric) :
+    parm_(&parm), model_(implicitSolvent), natom_(parm.getNumAtoms()),
+    has_positions_(false), offset_(0.009), neck_scale_(0.0) {
+
+    OpenMM::CustomGBForce *force = NULL;
+    if (implicitSolvent == "HCT") {
+        kind_ = HCT;
+        force = GB_HCT(parm, solventDielectric, soluteDielectric, false,
+                       cutoff, kappa);
+    } else if (implicitSolvent == "OBC1") {
+        kind_ = OBC1;
+        force = GB_OBC1(parm, solventDielectric, soluteDielectric, false,
+                        cutoff, kappa);
+    } else if (implicitSolvent == "OBC2") {
+        kind_ = OBC2;
+        force = GB_OBC2(parm, solventDielectric, soluteDielectric, false,
+                        cutoff, kappa);
+    } else if (implicitSolvent == "GBn") {
+        kind_ = GBN;
+        neck_scale_ = 0.361825;
+        force = GB_GBn(parm, solventDielectric, soluteDielectric, false,
+                       cutoff, kappa);
+    } else if (implicitSolvent == "GBn2") {
+        kind_ = GBN2;
+        offset_ = 0.0195141;
+        neck_scale_ = 0.826836;
+        force = GB_GBn2(parm, solventDielectric, soluteDielectric, false,
+                        cutoff, kappa);
+    } else {
+        throw AmberParmError("implicitSolvent must be HCT, OBC1, OBC2, GBn, "
+                             "or GBn2; not " + implicitSolvent);
+    }
+    cutoff_ = cutoff > 0 ? cutoff * NANOMETER_PER_ANGSTROM : 0.0;
+    kappa_ = kappa * ANGSTROM_PER_NANOMETER;
+    pre_ = 1 / soluteDielectric;
+    post_ = 1 / solventDielectric;
+
+    /* Take the radii from the force the model builds, so they are the same
+     * by construction. Its parameters are q, or, sr (and for GBn2, alpha,
+     * beta and gamma); the other models share one set of tanh coefficients
+     */
+    const double coefficients[4][3] = {
+        {0.0, 0.0, 0.0},                            // HCT (unused)
+        {0.8, 0.0, 2.909125},                       // OBC1
+        {1.0, 0.8, 4.85},                           // OBC2
+        {1.09511284, 1.907992938, 2.50798245},      // GBn
+    };
+    or_.resize(natom_);
+    sr_.resize(natom_);
+    alpha_.resize(natom_);
+    beta_.resize(natom_);
+    gamma_.resize(natom_);
+    vector<double> params;
+    for (int i = 0; i < natom_; i++) {
+        force->getParticleParameters(i, params);
+        or_[i] = params[1];
+        sr_[i] = params[2];
+        if (kind_ == GBN2) {
+            alpha_[i] = params[3];
+            beta_[i] = params[4];
+            gamma_[i] = params[5];
+        } else {
+            alpha_[i] = coefficients[kind_][0];
+            beta_[i] = coefficients[kind_][1];
+            gamma_[i] = coefficients[kind_][2];
+        }
+    }
+    delete force;
+
+    /* The exceptions createSystem gives the NonbondedForce: the 1-4 pair of
+     * every dihedral not flagged to skip it, and the exclusions. Fill the rows
+     * in two passes (count, fill)
+     */
+    Span<DihedralTerm> terms = parm.getDihedrals().terms();
+    Span<DihedralType> types = parm.getDihedrals().types();
+    ExclusionTable const& exclusions = parm.getExclusions();
+    bool has_exclusions = exclusions.numAtoms() == natom_;
+    exc_offsets_.assign(natom_ + 1, 0);
+    for (int pass = 0; pass < 2; pass++) {
+        vector<size_t> next(exc_offsets_.begin(), exc_offsets_.end() - 1);
+        for (size_t n = 0; n < terms.size(); n++) {
+            DihedralTerm const& d = terms[n];
+            if (d.ignore_end) continue;
+            int ends[2] = {d.i, d.l};
+            for (int e = 0; e < 2; e++) {
+                if (pass == 0) {
+                    exc_offsets_[ends[e]+1]++;
+                    continue;
+                }
+                size_t p = next[ends[e]]++;
+                exc_partner_[p] = ends[1-e];
+                exc_scale_[p] = 1.0 / types[d.type].scee;
+            }
+        }
+        for (int i = 0; i < natom_ && has_exclusions; i++) {
+            Span<int> excluded = exclusions.excluded(i);
+            for (size_t k = 0; k < excluded.size(); k++) {
+                int ends[2] = {i, excluded[k]};
+                for (int e = 0; e < 2; e++) {
+                    if (pass == 0) {
+                        exc_offsets_[ends[e]+1]++;
+                        continue;
+                    }
+                    size_t p = next[ends[e]]++;
+                    exc_partner_[p] = ends[1-e];
+                    exc_scale_[p] = 0.0;
+                }
+            }
+        }
+        if (pass == 0) {
+            for (int i = 0; i < natom_; i++)
+                exc_offsets_[i+1] += exc_offsets_[i];
+            exc_partner_.resize(exc_offsets_.back());
+            exc_scale_.resize(exc_offsets_.back());
+        }
+    }
+}
+
+void GBElectrostatics::setPositions(vector<OpenMM::Vec3> const& positions) {
+    if ((int) positions.size() != natom_)
+        throw AmberParmError("Need one position for every atom");
+    x_.resize(natom_);
+    y_.resize(natom_);
+    z_.resize(natom_);
+    for (int i = 0; i < natom_; i++) {
+        x_[i] = positions[i][0] * NANOMETER_PER_ANGSTROM;
+        y_[i] = positions[i][1] * NANOMETER_PER_ANGSTROM;
+        z_[i] = positions[i][2] * NANOMETER_PER_ANGSTROM;
+    }
+    if (cutoff_ > 0)
+        buildCells_();
+
+    born_.resize(natom_);
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic, 64)
+#endif
+    for (int i = 0; i < natom_; i++) {
+        double I = bornIntegral_(i);
+        if (kind_ == HCT) {
+            born_[i] = 1 / (1 / or_[i] - I);
+        } else {
+            double psi = I * or_[i], radius = or_[i] + offset_;
+            double t = tanh(alpha_[i] * psi - beta_[i] * psi * psi +
+                            gamma_[i] * psi * psi * psi);
+            born_[i] = 1 / (1 / or_[i] - t / radius);
+        }
+    }
+    has_positions_ = true;
+}
+
+void GBElectrostatics::buildCells_(void) {
+    if (natom_ == 0) return;
+    const double* coords[3] = {&x_[0], &y_[0], &z_[0]};
+    double lo[3], hi[3];
+    for (int d = 0; d < 3; d++) {
+        lo[d] = hi[d] = coords[d][0];
+        for (int i = 1; i < natom_; i++) {
+            lo[d] = min(lo[d], coords[d][i]);
+            hi[d] = max(hi[d], coords[d][i]);
+        }
+    }
+
+    // Cells as wide as the cutoff, but widened to keep a sparse system from
+    // needing more cells than atoms
+    double size = cutoff_, ncells = 1;
+    for (int d = 0; d < 3; d++)
+        ncells *= floor((hi[d] - lo[d]) / size) + 1;
+    if (ncells > natom_)
+        size *= cbrt(ncells / natom_);
+    for (int d = 0; d < 3; d++)
+        cell_dims_[d] = (int) floor((hi[d] - lo[d]) / size) + 1;
+
+    // Sort the atoms by cell in two passes (count, fill)
+    int ncell = cell_dims_[0] * cell_dims_[1] * cell_dims_[2];
+    cell_of_.resize(natom_);
+    cell_offsets_.assign(ncell + 1, 0);
+    for (int i = 0; i < natom_; i++) {
+        int c[3];
+        for (int d = 0; d < 3; d++)
+            c[d] = min((int) ((coords[d][i] - lo[d]) / size),
+                       cell_dims_[d] - 1);
+        cell_of_[i] = (c[0] * cell_dims_[1] + c[1]) * cell_dims_[2] + c[2];
+        cell_offsets_[cell_of_[i]+1]++;
+    }
+    for (int c = 0; c < ncell; c++)
+        cell_offsets_[c+1] += cell_offsets_[c];
+    vector<int> next(cell_offsets_.begin(), cell_offsets_.end() - 1);
+    cell_atoms_.resize(natom_);
+    for (int i = 0; i < natom_; i++)
+        cell_atoms_[next[cell_of_[i]]++] = i;
+}
+
+double GBElectrostatics::bornTerm_(int i, int j, double cut2) const {
+    double dx = x_[j] - x_[i], dy = y_[j] - y_[i], dz = z_[j] - z_[i];
+    double r2 = dx * dx + dy * dy + dz * dz;
+    if (j == i || r2 >= cut2) return 0.0;
+    double r = sqrt(r2), or1 = or_[i], sr2 = sr_[j];
+    double I = 0;
+    // The pairwise descreening integral of the HCT model
+    if (r + sr2 - or1 >= 0) {
+        double U = r + sr2, L = max(or1, fabs(r - sr2));
+        I += 0.5 * (1 / L - 1 / U + 0.25 * (r - sr2 * sr2 / r) *
+                    (1 / (U * U) - 1 / (L * L)) + 0.5 * log(L / U) / r);
+    }
+    // The neck correction of GBn and GBn2, from the tables in gbmodels.h
+    double radius1 = or1 + offset_, radius2 = or_[j] + offset_;
+    if (neck_scale_ == 0 || radius1 + radius2 + 0.68 - r < 0) return I;
+    /* The table index as the force computes it, rounded once as a
+     * Discrete1DFunction rounds its argument (the row and column are not
+     * rounded separately)
+     */
+    int index = (int) floor((radius2 * 200 - 20) * 21 +
+                            (radius1 * 200 - 20) + 0.5);
+    index = min(max(index, 0), 21 * 21 - 1);
+    double d0 = D0[index] / 10, m0 = M0[index] * 10;
+    double d = r - d0, d2 = d * d;
+    return I + neck_scale_ * m0 / (1 + 100 * d2 + 0.3 * 1000000 * d2 * d2 * d2);
+}
+
+double GBElectrostatics::bornIntegral_(int i) const {
+    double I = 0;
+    if (cutoff_ <= 0) {
+        for (int j = 0; j < natom_; j++)
+            I += bornTerm_(i, j, HUGE_VAL);
+        return I;
+    }
+
+    // Only the atoms in the cells around that of atom i are within reach
+    double cut2 = cutoff_ * cutoff_;
+    int c = cell_of_[i];
+    int ci[3] = {c / (cell_dims_[1] * cell_dims_[2]),
+                 c / cell_dims_[2] % cell_dims_[1], c % cell_dims_[2]};
+    int lo[3], hi[3];
+    for (int d = 0; d < 3; d++) {
+        lo[d] = max(ci[d] - 1, 0);
+        hi[d] = min(ci[d] + 1, cell_dims_[d] - 1);
+    }
+    for (int a = lo[0]; a <= hi[0]; a++)
+        for (int b = lo[1]; b <= hi[1]; b++)
+            for (int k = lo[2]; k <= hi[2]; k++) {
+                int cell = (a * cell_dims_[1] + b) * cell_dims_[2] + k;
+                for (int n = cell_offsets_[cell]; n < cell_offsets_[cell+1];
+                        n++)
+                    I += bornTerm_(i, cell_atoms_[n], cut2);
+            }
+    return I;
+}
+
+vector<double> GBElectrostatics::getBornRadii(void) const {
+    vector<double> radii(born_.size());
+    for (size_t i = 0; i < born_.size(); i++)
+        radii[i] = born_[i] * ANGSTROM_PER_NANOMETER;
+    return radii;
+}
+
+double GBElectrostatics::potential_(int i, int begin, int end,
+                                    const double* charges) const {
+    if (begin >= end) return 0.0;
+    if (kappa_ > 0)
+        return pairSum<true>(i, begin, end, &x_[0], &y_[0], &z_[0], &born_[0],
+                             charges, cutoff_, kappa_, pre_, post_);
+    return pairSum<false>(i, begin, end, &x_[0], &y_[0], &z_[0], &born_[0],
+                          charges, cutoff_, kappa_, pre_, post_);
+}
+
+double GBElectrostatics::pairCoefficient_(int i, int j) const {
+    double dx = x_[j] - x_[i], dy = y_[j] - y_[i], dz = z_[j] - z_[i];
+    double r2 = dx * dx + dy * dy + dz * dz;
+    if (cutoff_ > 0 && r2 >= cutoff_ * cutoff_) return 0.0;
+    double invcut = cutoff_ > 0 ? 1 / cutoff_ : 0.0;
+    double bb = born_[i] * born_[j];
+    double f = sqrt(r2 + bb * exp(-r2 / (4 * bb)));
+    double gb = -GB_KE * (pre_ - post_ * exp(-kappa_ * f)) * (1 / f - invcut);
+    return gb + COULOMB_KE * (1 / sqrt(r2) - invcut);
+}
+
+double GBElectrostatics::exceptionCorrection_(int i, int j,
+                                              double scale) const {
+    double dx = x_[j] - x_[i], dy = y_[j] - y_[i], dz = z_[j] - z_[i];
+    double r = sqrt(dx * dx + dy * dy + dz * dz);
+    // Exceptions are not cut off; every other pair is, with a shift
+    double coulomb = 0.0;
+    if (cutoff_ <= 0)
+        coulomb = 1 / r;
+    else if (r < cutoff_)
+        coulomb = 1 / r - 1 / cutoff_;
+    return COULOMB_KE * (scale / r - coulomb);
+}
+
+double GBElectrostatics::selfCoefficient_(int i) const {
+    double b = born_[i];
+    return -0.5 * GB_KE * (pre_ - post_ * exp(-kappa_ * b)) / b;
+}
+
+double GBElectrostatics::getEnergy(vector<double> const& charges) const {
+    if (!has_positions_)
+        throw AmberParmError("GB energies need positions");
+    if ((int) charges.size() != natom_)
+        throw AmberParmError("Need one charge for every atom");
+    if (natom_ == 0) return 0.0;
+    const double* q = &charges[0];
+    double energy = 0;
+#ifdef _OPENMP
+#   pragma omp parallel for reduction(+:energy) schedule(dynamic, 16)
+#endif
+    for (int i = 0; i < natom_; i++) {
+        double e = selfCoefficient_(i) * q[i] * q[i] +
+                   q[i] * potential_(i, i + 1, natom_, q);
+        for (size_t p = exc_offsets_[i]; p < exc_offsets_[i+1]; p++) {
+            int j = exc_partner_[p];
+            if (j > i)
+                e += exceptionCorrection_(i, j, exc_scale_[p]) * q[i] * q[j];
+        }
+        energy += e;
+    }
+    return energy * CALORIE_PER_JOULE;
+}
+
+double GBElectrostatics::getEnergyChange(vector<double> const& charges,
+                                         int first, int end,
+                                         Span<double> proposed) const {
+    if (!has_positions_)
+        throw AmberParmError("GB energies need positions");
+    if ((int) charges.size() != natom_)
+        throw AmberParmError("Need one charge for every atom");
+    if (first < 0 || end < first || end > natom_ ||
+            (int) proposed.size() != end - first)
+        throw AmberParmError("Proposed charges do not match the atom range");
+    int k = end - first;
+    if (k == 0) return 0.0;
+    const double* q = &charges[0];
+    vector<double> dq(k);
+    for (int n = 0; n < k; n++)
+        dq[n] = proposed[n] - q[first+n];
+
+    /* The changing atoms against every other atom, in blocks of the others
+     * spread over the threads. Only these pairs grow with the system
+     */
+    double change = 0;
+    int nblocks = (natom_ + PAIR_BLOCK - 1) / PAIR_BLOCK;
+#ifdef _OPENMP
+#   pragma omp parallel for reduction(+:change) schedule(static) \
+            if (nblocks > 1)
+#endif
+    for (int b = 0; b < nblocks; b++) {
+        int begin = b * PAIR_BLOCK, stop = min(natom_, begin + PAIR_BLOCK);
+        for (int n = 0; n < k; n++) {
+            if (dq[n] == 0) continue;
+            int i = first + n;
+            change += dq[n] * (potential_(i, begin, min(stop, first), q) +
+                               potential_(i, max(begin, end), stop, q));
+        }
+    }
+
+    // Self energies and the pairs among the changing atoms
+    for (int n = 0; n < k; n++) {
+        int i = first + n;
+        double qi = q[i], pi = proposed[n];
+        change += selfCoefficient_(i) * (pi * pi - qi * qi);
+        for (int m = n + 1; m < k; m++) {
+            int j = first + m;
+            change += pairCoefficient_(i, j) *
+                      (pi * proposed[m] - qi * q[j]);
+        }
+    }
+
+    // The exceptions of the changing atoms
+    for (int n = 0; n < k; n++) {
+        int i = first + n;
+        for (size_t p = exc_offsets_[i]; p < exc_offsets_[i+1]; p++) {
+            int j = exc_partner_[p];
+            double c = exceptionCorrection_(i, j, exc_scale_[p]);
+            if (j < first || j >= end)
+                change += c * dq[n] * q[j];
+            else if (j > i)
+                change += c * (proposed[n] * proposed[j-first] - q[i] * q[j]);
+        }
+    }
+    return change * CALORIE_PER_JOULE;
+}
@@ -96,13 +96,17 @@ OpenMM::CustomGBForce *GB_HCT(AmberParm const& amberParm,
     _createEnergyTerms(force, solventDielectric, soluteDielectric, 0.009,
                        cutoff, kappa, useSASA);
     // Now we've built our force -- populate it with the particles
-    for (AmberParm::atom_iterator it = amberParm.AtomBegin();
-            it != amberParm.AtomEnd(); it++) {
-        vector<double> params;
-        params.push_back(it->getCharge());
-        double rad = it->getGBRadius() * 0.1 - 0.009;
+    AtomTable const& atoms = amberParm.getAtomTable();
+    vector<double> const& charges = atoms.charges();
+    vector<double> const& gb_radii = atoms.gbRadii();
+    vector<double> const& gb_screens = atoms.gbScreens();
+    vector<double> params;
+    for (int i = 0; i < atoms.size(); i++) {
+        params.clear();
+        params.push_back(charges[i]);
+        double rad = gb_radii[i] * 0.1 - 0.009;
         params.push_back(rad);
-        params.push_back(rad*it->getGBScreen());
+        params.push_back(rad*gb_screens[i]);
         force->addParticle(params);
     }
     return force;
@@ -138,13 +142,17 @@ OpenMM::CustomGBForce *GB_OBC1(AmberParm const& amberParm,
     _createEnergyTerms(force, solventDielectric, soluteDielectric, 0.009,
                        cutoff, kappa, useSASA);
     // Now we've built our force -- populate it with the particles
-    for (AmberParm::atom_iterator it = amberParm.AtomBegin();
-            it != amberParm.AtomEnd(); it++) {
-        vector<double> params;
-        params.push_back(it->getCharge());
-        double rad = it->getGBRadius() * 0.1 - 0.009;
+    AtomTable const& atoms = amberParm.getAtomTable();
+    vector<double> const& charges = atoms.charges();
+    vector<double> const& gb_radii = atoms.gbRadii();
+    vector<double> const& gb_screens = atoms.gbScreens();
+    vector<double> params;
+    for (int i = 0; i < atoms.size(); i++) {
+        params.clear();
+        params.push_back(charges[i]);
+        double rad = gb_radii[i] * 0.1 - 0.009;
         params.push_back(rad);
-        params.push_back(rad*it->getGBScreen());
+        params.push_back(rad*gb_screens[i]);
         force->addParticle(params);
     }
     return force;
@@ -180,13 +188,17 @@ OpenMM::CustomGBForce *GB_OBC2(AmberParm const& amberParm,
     _createEnergyTerms(force, solventDielectric, soluteDielectric, 0.009,
                        cutoff, kappa, useSASA);
     // Now we've built our force -- populate it with the particles
-    for (AmberParm::atom_iterator it = amberParm.AtomBegin();
-            it != amberParm.AtomEnd(); it++) {
-        vector<double> params;
-        params.push_back(it->getCharge());
-        double rad = it->getGBRadius() * 0.1 - 0.009;
+    AtomTable const& atoms = amberParm.getAtomTable();
+    vector<double> const& charges = atoms.charges();
+    vector<double> const& gb_radii = atoms.gbRadii();
+    vector<double> const& gb_screens = atoms.gbScreens();
+    vector<double> params;
+    for (int i = 0; i < atoms.size(); i++) {
+        params.clear();
+        params.push_back(charges[i]);
+        double rad = gb_radii[i] * 0.1 - 0.009;
         params.push_back(rad);
-        params.push_back(rad*it->getGBScreen());
+        params.push_back(rad*gb_screens[i]);
         force->addParticle(params);
     }
     return force;
@@ -239,14 +251,18 @@ OpenMM::CustomGBForce *GB_GBn(AmberParm const& amberParm,
     _createEnergyTerms(force, solventDielectric, soluteDielectric, 0.009,
                        cutoff, kappa, useSASA);
     // Now we've built our force -- populate it with the particles
-    for (AmberParm::atom_iterator it = amberParm.AtomBegin();
-            it != amberParm.AtomEnd(); it++) {
-        vector<double> params;
-        params.push_back(it->getCharge());
-        double rad = it->getGBRadius() * 0.1 - 0.009;
+    AtomTable const& atoms = amberParm.getAtomTable();
+    vector<double> const& charges = atoms.charges();
+    vector<double> const& gb_radii = atoms.gbRadii();
+    vector<int> const& elements = atoms.elements();
+    vector<double> params;
+    for (int i = 0; i < atoms.size(); i++) {
+        params.clear();
+        params.push_back(charges[i]);
+        double rad = gb_radii[i] * 0.1 - 0.009;
         params.push_back(rad);
         // Screening parameters have been replaced
-        switch(it->getElement()) {
+        switch(elements[i]) {
             case 1:
                 params.push_back(rad*1.09085413633);
                 break;
@@ -321,14 +337,18 @@ OpenMM::CustomGBForce *GB_GBn2(AmberParm const& amberParm,
     _createEnergyTerms(force, solventDielectric, soluteDielectric, 0.0195141,
                        cutoff, kappa, useSASA);
     // Now we've built our force -- populate it with the particles
-    for (AmberParm::atom_iterator it = amberParm.AtomBegin();
-            it != amberParm.AtomEnd(); it++) {
-        vector<double> params;
-        params.push_back(it->getCharge());
-        double rad = it->getGBRadius() * 0.1 - 0.0195141;
+    AtomTable const& atoms = amberParm.getAtomTable();
+    vector<double> const& charges = atoms.charges();
+    vector<double> const& gb_radii = atoms.gbRadii();
+    vector<int> const& elements = atoms.elements();
+    vector<double> params;
+    for (int i = 0; i < atoms.size(); i++) {
+        params.clear();
+        params.push_back(charges[i]);
+        double rad = gb_radii[i] * 0.1 - 0.0195141;
         params.push_back(rad);
         // Screening parameters have been replaced
-        switch(it->getElement()) {
+        switch(elements[i]) {
             case 1:
                 params.push_back(rad*1.425952); // screen
                 params.push_back(0.788440); // alpha
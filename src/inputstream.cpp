@@ -0,0 +1,375 @@
+/// inputstream.cpp -- streaming reads of plain, gzip, and bzip2 files
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef HASGZ
+#   include <zlib.h>
+#endif
+#ifdef HASBZ2
+#   include <bzlib.h>
+#endif
+
+#include "amber/inputstream.h"
+
+using namespace std;
+using namespace Amber;
+
+/// Size of each decompressed block handed from the reader thread
+#define BLOCK_SIZE (1 << 20)
+
+/// Size of the reads from the (compressed) file
+#define INPUT_SIZE (1 << 18)
+
+Compression Amber::detectCompression(const char* data, size_t size) {
+    if (size >= 2 && (unsigned char) data[0] == 0x1f &&
+            (unsigned char) data[1] == 0x8b)
+        return GZIP_COMPRESSION;
+    if (size >= 4 && data[0] == 'B' && data[1] == 'Z' && data[2] == 'h' &&
+            data[3] >= '1' && data[3] <= '9')
+        return BZIP2_COMPRESSION;
+    return NO_COMPRESSION;
+}
+
+bool Amber::canDecompress(Compression compression) {
+    switch (compression) {
+        case NO_COMPRESSION:
+            return true;
+#ifdef HASGZ
+        case GZIP_COMPRESSION:
+            return true;
+#endif
+#ifdef HASBZ2
+        case BZIP2_COMPRESSION:
+            return true;
+#endif
+        default:
+            return false;
+    }
+}
+
+InputStream::InputStream(void) :
+    fd_(-1), compression_(NO_COMPRESSION), sizeHint_(0), input_(NULL),
+    inputSize_(0), head_(0), tail_(0), filled_(0), pos_(0), heldLength_(0),
+    done_(false), error_(false), stop_(false), running_(false) {
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        blocks_[i] = NULL;
+        lengths_[i] = 0;
+    }
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+}
+
+InputStream::~InputStream(void) {
+    close();
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+}
+
+bool InputStream::open(string const& filename) {
+    close();
+
+    fd_ = ::open(filename.c_str(), O_RDONLY);
+    if (fd_ < 0) return false;
+
+    struct stat st;
+    input_ = (char*) malloc(INPUT_SIZE);
+    if (fstat(fd_, &st) != 0 || input_ == NULL || !readInput_(inputSize_)) {
+        close();
+        return false;
+    }
+
+    compression_ = detectCompression(input_, inputSize_);
+    if (!canDecompress(compression_)) {
+        close();
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        if (compression_ == NO_COMPRESSION) {
+            sizeHint_ = (size_t) st.st_size;
+        } else if (compression_ == GZIP_COMPRESSION && st.st_size >= 18) {
+            // ISIZE: the little-endian uncompressed size (mod 2^32) of the
+            // last member, which is the whole file for anything gzip writes
+            unsigned char isize[4];
+            if (pread(fd_, isize, 4, st.st_size - 4) == 4)
+                sizeHint_ = (size_t) isize[0] | (size_t) isize[1] << 8 |
+                            (size_t) isize[2] << 16 | (size_t) isize[3] << 24;
+        }
+    }
+
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        blocks_[i] = (char*) malloc(BLOCK_SIZE);
+        if (blocks_[i] == NULL) {
+            close();
+            return false;
+        }
+    }
+
+    if (pthread_create(&thread_, NULL, run_, this) != 0) {
+        close();
+        return false;
+    }
+    running_ = true;
+    return true;
+}
+
+void InputStream::close(void) {
+    if (running_) {
+        // Wake the reader if it is waiting for an empty block
+        pthread_mutex_lock(&mutex_);
+        stop_ = true;
+        pthread_cond_broadcast(&cond_);
+        pthread_mutex_unlock(&mutex_);
+        pthread_join(thread_, NULL);
+    }
+    if (fd_ >= 0) ::close(fd_);
+    free(input_);
+    for (int i = 0; i < NUM_BLOCKS; i++) {
+        free(blocks_[i]);
+        blocks_[i] = NULL;
+        lengths_[i] = 0;
+    }
+    fd_ = -1;
+    compression_ = NO_COMPRESSION;
+    sizeHint_ = 0;
+    input_ = NULL;
+    inputSize_ = 0;
+    head_ = tail_ = filled_ = 0;
+    pos_ = heldLength_ = 0;
+    done_ = error_ = stop_ = running_ = false;
+}
+
+bool InputStream::good(void) {
+    pthread_mutex_lock(&mutex_);
+    bool error = error_;
+    pthread_mutex_unlock(&mutex_);
+    return !error;
+}
+
+/* Makes sure the block at head_ has unread data, handing a drained block back
+ * to the reader thread and waiting for the next one if necessary. Returns false
+ * at the end of the data.
+ */
+bool InputStream::nextBlock_(void) {
+    if (pos_ < heldLength_) return true;
+    if (!running_) return false;
+
+    pthread_mutex_lock(&mutex_);
+    if (heldLength_ > 0) {
+        head_ = (head_ + 1) % NUM_BLOCKS;
+        filled_--;
+        pthread_cond_broadcast(&cond_);
+    }
+    while (filled_ == 0 && !done_)
+        pthread_cond_wait(&cond_, &mutex_);
+    pos_ = 0;
+    heldLength_ = filled_ > 0 ? lengths_[head_] : 0;
+    pthread_mutex_unlock(&mutex_);
+
+    return heldLength_ > 0;
+}
+
+size_t InputStream::read(char* buf, size_t n) {
+    size_t total = 0;
+    while (total < n && nextBlock_()) {
+        size_t count = heldLength_ - pos_;
+        if (count > n - total) count = n - total;
+        memcpy(buf + total, blocks_[head_] + pos_, count);
+        pos_ += count;
+        total += count;
+    }
+    return total;
+}
+
+bool InputStream::getline(string &line) {
+    line.clear();
+    bool found = false;
+    while (nextBlock_()) {
+        found = true;
+        const char* begin = blocks_[head_] + pos_;
+        const char* end = blocks_[head_] + heldLength_;
+        const char* nl = (const char*) memchr(begin, '\n', end - begin);
+        if (nl != NULL) {
+            line.append(begin, nl);
+            pos_ += nl - begin + 1;
+            return true;
+        }
+        line.append(begin, end);
+        pos_ = heldLength_;
+    }
+    return found;
+}
+
+// Reader thread
+
+void* InputStream::run_(void* stream) {
+    ((InputStream*) stream)->produce_();
+    return NULL;
+}
+
+/// Fills input_ (stopping early only at the end of the file)
+bool InputStream::readInput_(size_t &length) {
+    length = 0;
+    while (length < INPUT_SIZE) {
+        ssize_t n = ::read(fd_, input_ + length, INPUT_SIZE - length);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return false;
+        if (n == 0) break;
+        length += (size_t) n;
+    }
+    return true;
+}
+
+/// Waits for a free block to fill. Returns NULL if the stream is being closed
+char* InputStream::emptyBlock_(void) {
+    pthread_mutex_lock(&mutex_);
+    while (filled_ == NUM_BLOCKS && !stop_)
+        pthread_cond_wait(&cond_, &mutex_);
+    char* block = stop_ ? NULL : blocks_[tail_];
+    pthread_mutex_unlock(&mutex_);
+    return block;
+}
+
+/// Hands the block at tail_ (holding length bytes) to the caller
+void InputStream::pushBlock_(size_t length) {
+    if (length == 0) return;
+    pthread_mutex_lock(&mutex_);
+    lengths_[tail_] = length;
+    tail_ = (tail_ + 1) % NUM_BLOCKS;
+    filled_++;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
+
+void InputStream::produce_(void) {
+    bool ok = true;
+    char* out;
+
+    if (compression_ == NO_COMPRESSION) {
+        size_t avail = inputSize_;
+        bool eof = inputSize_ < INPUT_SIZE;
+        while ((out = emptyBlock_()) != NULL) {
+            size_t length = avail;
+            memcpy(out, input_, avail);
+            avail = 0;
+            while (!eof && length < BLOCK_SIZE) {
+                ssize_t n = ::read(fd_, out + length, BLOCK_SIZE - length);
+                if (n < 0 && errno == EINTR) continue;
+                if (n < 0) ok = false;
+                if (n <= 0) break;
+                length += (size_t) n;
+            }
+            pushBlock_(length);
+            if (length < BLOCK_SIZE || !ok) break;
+        }
+    }
+#ifdef HASGZ
+    else if (compression_ == GZIP_COMPRESSION) {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        zs.next_in = (Bytef*) input_;
+        zs.avail_in = (uInt) inputSize_;
+        bool eof = false, finished = false;
+        // 15 + 32: maximum window size, and expect a gzip (or zlib) header
+        if (inflateInit2(&zs, 15 + 32) != Z_OK) ok = false;
+        while (ok && !finished && (out = emptyBlock_()) != NULL) {
+            zs.next_out = (Bytef*) out;
+            zs.avail_out = BLOCK_SIZE;
+            while (ok && zs.avail_out > 0) {
+                size_t n;
+                if (zs.avail_in == 0 && !eof) {
+                    ok = readInput_(n);
+                    eof = n == 0;
+                    zs.next_in = (Bytef*) input_;
+                    zs.avail_in = (uInt) n;
+                }
+                int ret = inflate(&zs, Z_NO_FLUSH);
+                if (ret == Z_STREAM_END) {
+                    // Another member may follow (e.g., concatenated files)
+                    if (zs.avail_in == 0 && !eof) {
+                        ok = readInput_(n);
+                        eof = n == 0;
+                        zs.next_in = (Bytef*) input_;
+                        zs.avail_in = (uInt) n;
+                    }
+                    if (zs.avail_in == 0) {
+                        finished = true;
+                        break;
+                    }
+                    if (inflateReset(&zs) != Z_OK) ok = false;
+                } else if (ret != Z_OK) {
+                    // Includes Z_BUF_ERROR for a truncated file
+                    ok = false;
+                }
+            }
+            pushBlock_(BLOCK_SIZE - zs.avail_out);
+        }
+        inflateEnd(&zs);
+    }
+#endif
+#ifdef HASBZ2
+    else if (compression_ == BZIP2_COMPRESSION) {
+        bz_stream bs;
+        memset(&bs, 0, sizeof(bs));
+        bs.next_in = input_;
+        bs.avail_in = (unsigned int) inputSize_;
+        bool eof = false, finished = false;
+        if (BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) ok = false;
+        while (ok && !finished && (out = emptyBlock_()) != NULL) {
+            bs.next_out = out;
+            bs.avail_out = BLOCK_SIZE;
+            while (ok && bs.avail_out > 0) {
+                size_t n;
+                if (bs.avail_in == 0 && !eof) {
+                    ok = readInput_(n);
+                    eof = n == 0;
+                    bs.next_in = input_;
+                    bs.avail_in = (unsigned int) n;
+                }
+                unsigned int before = bs.avail_out;
+                int ret = BZ2_bzDecompress(&bs);
+                if (ret == BZ_STREAM_END) {
+                    // Another stream may follow (e.g., from pbzip2)
+                    if (bs.avail_in == 0 && !eof) {
+                        ok = readInput_(n);
+                        eof = n == 0;
+                        bs.next_in = input_;
+                        bs.avail_in = (unsigned int) n;
+                    }
+                    if (bs.avail_in == 0) {
+                        finished = true;
+                        break;
+                    }
+                    bz_stream next;
+                    memset(&next, 0, sizeof(next));
+                    next.next_in = bs.next_in;
+                    next.avail_in = bs.avail_in;
+                    next.next_out = bs.next_out;
+                    next.avail_out = bs.avail_out;
+                    BZ2_bzDecompressEnd(&bs);
+                    bs = next;
+                    if (BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) ok = false;
+                } else if (ret != BZ_OK) {
+                    ok = false;
+                } else if (eof && bs.avail_in == 0 && bs.avail_out == before) {
+                    ok = false; // truncated file
+                }
+            }
+            pushBlock_(BLOCK_SIZE - bs.avail_out);
+        }
+        BZ2_bzDecompressEnd(&bs);
+    }
+#endif
+
+    pthread_mutex_lock(&mutex_);
+    done_ = true;
+    error_ = !ok;
+    pthread_cond_broadcast(&cond_);
+    pthread_mutex_unlock(&mutex_);
+}
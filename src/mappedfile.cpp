@@ -0,0 +1,142 @@
+/// mappedfile.cpp -- read-only memory-mapped file access
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "amber/inputstream.h"
+#include "amber/mappedfile.h"
+
+using namespace std;
+using namespace Amber;
+
+bool MappedFile::open(string const& filename) {
+    close();
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+
+    if (S_ISREG(st.st_mode)) {
+        // Compressed files are decompressed into memory instead
+        char magic[4];
+        ssize_t nmagic = pread(fd, magic, sizeof(magic), 0);
+        if (nmagic > 0 && detectCompression(magic, nmagic) != NO_COMPRESSION) {
+            ::close(fd);
+            return decompress_(filename);
+        }
+        size_ = (size_t) st.st_size;
+        if (size_ == 0) {
+            // Nothing to map; an empty file is still a successful open
+            ::close(fd);
+            return true;
+        }
+        void *addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(addr, size_, MADV_SEQUENTIAL);
+#endif
+            ::close(fd);
+            data_ = (const char*) addr;
+            mapped_ = true;
+            return true;
+        }
+    }
+
+    // Fall back to slurping the whole file onto the heap
+    size_t capacity = S_ISREG(st.st_mode) && st.st_size > 0 ?
+                      (size_t) st.st_size : 1 << 16;
+    char *buf = (char*) malloc(capacity);
+    size_t nread = 0;
+    while (buf != NULL) {
+        ssize_t n = read(fd, buf + nread, capacity - nread);
+        if (n < 0) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        if (n == 0) break;
+        nread += (size_t) n;
+        if (nread == capacity) {
+            char *newbuf = (char*) realloc(buf, capacity * 2);
+            if (newbuf == NULL) {
+                free(buf);
+                buf = NULL;
+                break;
+            }
+            buf = newbuf;
+            capacity *= 2;
+        }
+    }
+    ::close(fd);
+
+    if (buf == NULL) {
+        size_ = 0;
+        return false;
+    }
+    data_ = buf;
+    size_ = nread;
+    mapped_ = false;
+    return true;
+}
+
+bool MappedFile::decompress_(string const& filename) {
+    InputStream input;
+    if (!input.open(filename)) return false;
+
+    // The gzip trailer tells us the final size, so this is usually exact
+    size_t capacity = input.sizeHint() > 0 ? input.sizeHint() : 1 << 20;
+    char *buf = (char*) malloc(capacity);
+    size_t nread = 0;
+    while (buf != NULL) {
+        nread += input.read(buf + nread, capacity - nread);
+        if (nread < capacity) break;
+        // Buffer full -- make sure there is more before growing it
+        char next;
+        if (input.read(&next, 1) == 0) break;
+        char *newbuf = (char*) realloc(buf, capacity * 2);
+        if (newbuf == NULL) {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        buf = newbuf;
+        buf[nread++] = next;
+        capacity *= 2;
+    }
+
+    if (buf == NULL || !input.good()) {
+        free(buf);
+        return false;
+    }
+    if (nread == 0) {
+        free(buf);
+        return true;
+    }
+    data_ = buf;
+    size_ = nread;
+    mapped_ = false;
+    return true;
+}
+
+void MappedFile::close(void) {
+    if (data_ != NULL) {
+        if (mapped_)
+            munmap((void*) data_, size_);
+        else
+            free((void*) data_);
+    }
+    data_ = NULL;
+    size_ = 0;
+    mapped_ = false;
+}
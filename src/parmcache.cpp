@@ -0,0 +1,519 @@
+/** parmcache.cpp -- binary cache of a parsed Amber topology file
+ *
+ * Parsing a large prmtop (and rebuilding the Lennard-Jones and exclusion
+ * tables from it) is far more expensive than reading back the finished
+ * AmberParm data structures. The cache stores those structures in a flat binary
+ * layout that is memory mapped and copied straight out on load. Each cache is
+ * keyed by the size and a 64-bit hash of the contents of its prmtop, so any
+ * change to the prmtop (whatever its timestamp says) invalidates it.
+ *
+ * Layout (every block is padded to a multiple of 8 bytes):
+ *      CacheHeader
+ *      CachedAtom[natom]
+ *      CachedBondType[nbondtype]
+ *      CachedAngleType[nangletype]
+ *      CachedDihedralType[ndihedraltype]
+ *      CachedBond[nbond]
+ *      CachedAngle[nangle]
+ *      CachedDihedral[ndihedral]
+ *      int32_t residue_pointers[nres+1]
+ *      uint32_t residue_labels[nres]   (offsets into the string pool)
+ *      int32_t exclusion_counts[natom]
+ *      int32_t exclusions[nexcl]
+ *      char strings[nstring]           (NUL-terminated strings)
+ */
+#include <cstdio>
+#include <cstring>
+#include <map>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "amber/amberparm.h"
+#include "amber/mappedfile.h"
+
+using namespace std;
+using namespace Amber;
+
+/// Bump whenever the layout below (or what gets stored in it) changes
+#define PARM_CACHE_VERSION 2
+
+static const char PARM_CACHE_MAGIC[8] = {'A', 'M', 'B', 'C', 'A', 'C', 'H', 'E'};
+
+/// Lets us detect (and ignore) a cache written on a machine of the other byte
+/// order, e.g., on a shared filesystem
+static const uint32_t PARM_CACHE_BYTE_ORDER = 0x01020304;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t source_size;
+    uint64_t source_hash;
+    int32_t ifbox;
+    int32_t natom;
+    int32_t nbond;
+    int32_t nangle;
+    int32_t ndihedral;
+    int32_t nres;
+    int32_t nexcl;
+    int32_t nstring;
+    int32_t nbondtype;
+    int32_t nangletype;
+    int32_t ndihedraltype;
+    int32_t reserved;
+    double box[9];
+} CacheHeader;
+
+typedef struct {
+    double mass, charge, lj_rad, lj_eps, gb_rad, gb_screen;
+    int32_t element;
+    uint32_t name, type;    ///< Offsets into the string pool
+    int32_t reserved;
+} CachedAtom;
+
+typedef struct {
+    double kf, req;
+} CachedBondType;
+
+typedef struct {
+    double kf, theteq;
+} CachedAngleType;
+
+typedef struct {
+    double kf, phase, scee, scnb;
+    int32_t periodicity, reserved;
+} CachedDihedralType;
+
+/// Bonded terms refer to their parameters by type ID
+typedef struct {
+    int32_t i, j, type;
+} CachedBond;
+
+typedef struct {
+    int32_t i, j, k, type;
+} CachedAngle;
+
+typedef struct {
+    int32_t i, j, k, l, type, ignore_end;
+} CachedDihedral;
+
+static inline size_t padded(size_t nbytes) {
+    return (nbytes + 7) & ~(size_t)7;
+}
+
+/// 64-bit hash of a block of memory. Not cryptographic -- just fast and well
+/// mixed, so any edit to a topology file changes it
+static uint64_t hashBytes(const char* data, size_t size) {
+    const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+    const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    uint64_t h[4] = {PRIME1, PRIME2, ~PRIME1, ~PRIME2};
+    size_t i = 0;
+    // Four independent lanes so the multiplies can overlap
+    for (; i + 32 <= size; i += 32) {
+        for (int lane = 0; lane < 4; lane++) {
+            uint64_t w;
+            memcpy(&w, data + i + 8 * lane, 8);
+            h[lane] += w * PRIME2;
+            h[lane] = (h[lane] << 31) | (h[lane] >> 33);
+            h[lane] *= PRIME1;
+        }
+    }
+    uint64_t hash = (uint64_t) size * PRIME1;
+    for (int lane = 0; lane < 4; lane++)
+        hash = (hash ^ h[lane]) * PRIME2 + lane;
+    for (; i < size; i++)
+        hash = (hash ^ (unsigned char) data[i]) * PRIME1;
+    // Final avalanche
+    hash ^= hash >> 33;
+    hash *= PRIME2;
+    hash ^= hash >> 29;
+    hash *= PRIME1;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/// Reads the next block of n elements of T from the cache, advancing p
+template <typename T>
+static inline const T* nextBlock(const char* &p, size_t n) {
+    const T* block = (const T*) p;
+    p += padded(n * sizeof(T));
+    return block;
+}
+
+/// Writes a block of n elements of T (and its padding) to the cache
+template <typename T>
+static bool writeBlock(FILE* fp, const T* data, size_t n) {
+    static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    size_t nbytes = n * sizeof(T);
+    if (nbytes > 0 && fwrite(data, 1, nbytes, fp) != nbytes) return false;
+    size_t npad = padded(nbytes) - nbytes;
+    return npad == 0 || fwrite(zeros, 1, npad, fp) == npad;
+}
+
+/// Whether an atom index read from the cache is a valid index
+static inline bool isAtom(int32_t i, int32_t natom) {
+    return i >= 0 && i < natom;
+}
+
+namespace {
+/// Builds the string pool, storing each distinct string only once
+class StringPool {
+    public:
+        uint32_t add(string const& s) {
+            map<string, uint32_t>::const_iterator it = offsets_.find(s);
+            if (it != offsets_.end()) return it->second;
+            uint32_t offset = (uint32_t) pool_.size();
+            pool_.insert(pool_.end(), s.begin(), s.end());
+            pool_.push_back('\0');
+            offsets_[s] = offset;
+            return offset;
+        }
+        vector<char> const& data(void) const {return pool_;}
+    private:
+        vector<char> pool_;
+        map<string, uint32_t> offsets_;
+};
+}
+
+string AmberParm::cacheFileName(string const& filename) {
+    return filename + ".cache";
+}
+
+bool AmberParm::readCache_(string const& filename, uint64_t &hash,
+                           uint64_t &size) {
+
+    MappedFile source;
+    if (!source.open(filename)) return false;
+    size = source.size();
+    hash = hashBytes(source.data(), source.size());
+    source.close();
+
+    MappedFile cache;
+    if (!cache.open(cacheFileName(filename))) return false;
+    if (cache.size() < sizeof(CacheHeader)) return false;
+
+    const char* p = cache.data();
+    const CacheHeader* header = nextBlock<CacheHeader>(p, 1);
+    if (memcmp(header->magic, PARM_CACHE_MAGIC, 8) != 0 ||
+            header->version != PARM_CACHE_VERSION ||
+            header->byte_order != PARM_CACHE_BYTE_ORDER ||
+            header->source_size != size || header->source_hash != hash)
+        return false;
+    if (header->natom < 0 || header->nbond < 0 || header->nangle < 0 ||
+            header->ndihedral < 0 || header->nres < 0 || header->nexcl < 0 ||
+            header->nstring < 0 || header->nbondtype < 0 ||
+            header->nangletype < 0 || header->ndihedraltype < 0)
+        return false;
+
+    // Make sure the file is not truncated before touching any of the data
+    size_t expected = padded(sizeof(CacheHeader)) +
+                      padded(header->natom * sizeof(CachedAtom)) +
+                      padded(header->nbondtype * sizeof(CachedBondType)) +
+                      padded(header->nangletype * sizeof(CachedAngleType)) +
+                      padded(header->ndihedraltype *
+                             sizeof(CachedDihedralType)) +
+                      padded(header->nbond * sizeof(CachedBond)) +
+                      padded(header->nangle * sizeof(CachedAngle)) +
+                      padded(header->ndihedral * sizeof(CachedDihedral)) +
+                      padded((header->nres + 1) * sizeof(int32_t)) +
+                      padded(header->nres * sizeof(uint32_t)) +
+                      padded(header->natom * sizeof(int32_t)) +
+                      padded(header->nexcl * sizeof(int32_t)) +
+                      padded(header->nstring);
+    if (cache.size() != expected) return false;
+
+    const CachedAtom* catoms = nextBlock<CachedAtom>(p, header->natom);
+    const CachedBondType* cbondtypes =
+            nextBlock<CachedBondType>(p, header->nbondtype);
+    const CachedAngleType* cangletypes =
+            nextBlock<CachedAngleType>(p, header->nangletype);
+    const CachedDihedralType* cdihedraltypes =
+            nextBlock<CachedDihedralType>(p, header->ndihedraltype);
+    const CachedBond* cbonds = nextBlock<CachedBond>(p, header->nbond);
+    const CachedAngle* cangles = nextBlock<CachedAngle>(p, header->nangle);
+    const CachedDihedral* cdihedrals =
+            nextBlock<CachedDihedral>(p, header->ndihedral);
+    const int32_t* resptr = nextBlock<int32_t>(p, header->nres + 1);
+    const uint32_t* reslab = nextBlock<uint32_t>(p, header->nres);
+    const int32_t* nexcl = nextBlock<int32_t>(p, header->natom);
+    const int32_t* excl = nextBlock<int32_t>(p, header->nexcl);
+    const char* strings = nextBlock<char>(p, header->nstring);
+    if (header->nstring == 0 || strings[header->nstring-1] != '\0')
+        return false;
+
+    // Check every offset and count before anything in this instance changes
+    uint32_t nstring = (uint32_t) header->nstring;
+    for (int i = 0; i < header->natom; i++)
+        if (catoms[i].name >= nstring || catoms[i].type >= nstring)
+            return false;
+    for (int i = 0; i < header->nres; i++)
+        if (reslab[i] >= nstring) return false;
+    int64_t nexcltot = 0;
+    for (int i = 0; i < header->natom; i++) {
+        if (nexcl[i] < 0) return false;
+        nexcltot += nexcl[i];
+    }
+    if (nexcltot != header->nexcl) return false;
+    for (int i = 0; i < header->nbond; i++)
+        if (cbonds[i].type < 0 || cbonds[i].type >= header->nbondtype)
+            return false;
+    for (int i = 0; i < header->nangle; i++)
+        if (cangles[i].type < 0 || cangles[i].type >= header->nangletype)
+            return false;
+    for (int i = 0; i < header->ndihedral; i++)
+        if (cdihedrals[i].type < 0 ||
+                cdihedrals[i].type >= header->ndihedraltype)
+            return false;
+    // ... and every atom index, since nothing downstream checks them again
+    int32_t natom = header->natom;
+    for (int i = 0; i < header->nbond; i++)
+        if (!isAtom(cbonds[i].i, natom) || !isAtom(cbonds[i].j, natom))
+            return false;
+    for (int i = 0; i < header->nangle; i++)
+        if (!isAtom(cangles[i].i, natom) || !isAtom(cangles[i].j, natom) ||
+                !isAtom(cangles[i].k, natom))
+            return false;
+    for (int i = 0; i < header->ndihedral; i++)
+        if (!isAtom(cdihedrals[i].i, natom) ||
+                !isAtom(cdihedrals[i].j, natom) ||
+                !isAtom(cdihedrals[i].k, natom) ||
+                !isAtom(cdihedrals[i].l, natom))
+            return false;
+    for (int i = 0; i < header->nexcl; i++)
+        if (!isAtom(excl[i], natom)) return false;
+    // Residues start at atom 0, never go backwards, and end at the last atom
+    if (header->nres > 0 && resptr[0] != 0) return false;
+    for (int i = 0; i < header->nres; i++)
+        if (resptr[i] > resptr[i+1]) return false;
+    if (resptr[header->nres] != natom) return false;
+
+    ifbox_ = header->ifbox;
+
+    // Names and types are stored once in the string pool, so their offsets
+    // map one-to-one onto interned IDs
+    atoms_.clear();
+    atoms_.reserve(header->natom);
+    map<uint32_t, int> name_ids, type_ids;
+    for (int i = 0; i < header->natom; i++) {
+        const CachedAtom &a = catoms[i];
+        map<uint32_t, int>::const_iterator name = name_ids.find(a.name);
+        if (name == name_ids.end())
+            name = name_ids.insert(make_pair(a.name,
+                        atoms_.internName(strings + a.name))).first;
+        map<uint32_t, int>::const_iterator type = type_ids.find(a.type);
+        if (type == type_ids.end())
+            type = type_ids.insert(make_pair(a.type,
+                        atoms_.internType(strings + a.type))).first;
+        atoms_.add(name->second, type->second, a.element, a.mass, a.charge,
+                   a.lj_rad, a.lj_eps, a.gb_rad, a.gb_screen);
+    }
+
+    bonds_.clear();
+    bonds_.reserve(header->nbond);
+    for (int i = 0; i < header->nbondtype; i++)
+        bonds_.addType(BondType(cbondtypes[i].kf, cbondtypes[i].req));
+    for (int i = 0; i < header->nbond; i++)
+        bonds_.add(BondTerm(cbonds[i].i, cbonds[i].j, cbonds[i].type));
+
+    angles_.clear();
+    angles_.reserve(header->nangle);
+    for (int i = 0; i < header->nangletype; i++)
+        angles_.addType(AngleType(cangletypes[i].kf, cangletypes[i].theteq));
+    for (int i = 0; i < header->nangle; i++)
+        angles_.add(AngleTerm(cangles[i].i, cangles[i].j, cangles[i].k,
+                              cangles[i].type));
+
+    dihedrals_.clear();
+    dihedrals_.reserve(header->ndihedral);
+    for (int i = 0; i < header->ndihedraltype; i++) {
+        const CachedDihedralType &t = cdihedraltypes[i];
+        dihedrals_.addType(DihedralType(t.kf, t.phase, t.periodicity, t.scee,
+                                        t.scnb));
+    }
+    for (int i = 0; i < header->ndihedral; i++) {
+        const CachedDihedral &d = cdihedrals[i];
+        dihedrals_.add(DihedralTerm(d.i, d.j, d.k, d.l, d.type,
+                                    d.ignore_end != 0));
+    }
+
+    residue_pointers_.assign(resptr, resptr + header->nres + 1);
+    residue_labels_.clear();
+    residue_labels_.reserve(header->nres);
+    for (int i = 0; i < header->nres; i++)
+        residue_labels_.push_back(string(strings + reslab[i]));
+
+    exclusion_list_.clear();
+    exclusion_list_.reserve(header->natom, header->nexcl);
+    int exclptr = 0;
+    for (int i = 0; i < header->natom; i++) {
+        exclusion_list_.addAtom(excl + exclptr, nexcl[i]);
+        exclptr += nexcl[i];
+    }
+
+    if (ifbox_ > 0)
+        unit_cell_ = UnitCell(
+                OpenMM::Vec3(header->box[0], header->box[1], header->box[2]),
+                OpenMM::Vec3(header->box[3], header->box[4], header->box[5]),
+                OpenMM::Vec3(header->box[6], header->box[7], header->box[8]));
+    else
+        unit_cell_ = UnitCell();
+
+    return true;
+}
+
+bool AmberParm::writeCache_(string const& filename, uint64_t hash,
+                            uint64_t size) const {
+
+    StringPool strings;
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PARM_CACHE_MAGIC, 8);
+    header.version = PARM_CACHE_VERSION;
+    header.byte_order = PARM_CACHE_BYTE_ORDER;
+    header.source_size = size;
+    header.source_hash = hash;
+    header.ifbox = ifbox_;
+    header.natom = (int32_t) atoms_.size();
+    header.nbond = (int32_t) bonds_.size();
+    header.nangle = (int32_t) angles_.size();
+    header.ndihedral = (int32_t) dihedrals_.size();
+    header.nbondtype = (int32_t) bonds_.numTypes();
+    header.nangletype = (int32_t) angles_.numTypes();
+    header.ndihedraltype = (int32_t) dihedrals_.numTypes();
+    header.nres = (int32_t) residue_labels_.size();
+    OpenMM::Vec3 vecs[3] = {unit_cell_.getVectorA(), unit_cell_.getVectorB(),
+                            unit_cell_.getVectorC()};
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            header.box[3*i+j] = vecs[i][j];
+
+    // The residue pointer list carries a trailing sentinel (the atom count)
+    if (residue_pointers_.size() != residue_labels_.size() + 1 ||
+            exclusion_list_.numAtoms() != atoms_.size())
+        return false;
+
+    vector<CachedAtom> catoms(atoms_.size());
+    for (int i = 0; i < atoms_.size(); i++) {
+        CachedAtom &a = catoms[i];
+        memset(&a, 0, sizeof(a));
+        a.mass = atoms_.masses()[i];
+        a.charge = atoms_.charges()[i];
+        a.lj_rad = atoms_.ljRadii()[i];
+        a.lj_eps = atoms_.ljEpsilons()[i];
+        a.gb_rad = atoms_.gbRadii()[i];
+        a.gb_screen = atoms_.gbScreens()[i];
+        a.element = atoms_.elements()[i];
+        a.name = strings.add(atoms_.names()[atoms_.nameIds()[i]]);
+        a.type = strings.add(atoms_.types()[atoms_.typeIds()[i]]);
+    }
+
+    vector<CachedBondType> cbondtypes(bonds_.numTypes());
+    for (int i = 0; i < bonds_.numTypes(); i++) {
+        cbondtypes[i].kf = bonds_.type(i).k;
+        cbondtypes[i].req = bonds_.type(i).req;
+    }
+    vector<CachedBond> cbonds(bonds_.size());
+    for (size_t i = 0; i < bonds_.size(); i++) {
+        BondTerm const& b = bonds_.term(i);
+        cbonds[i].i = b.i;
+        cbonds[i].j = b.j;
+        cbonds[i].type = b.type;
+    }
+
+    vector<CachedAngleType> cangletypes(angles_.numTypes());
+    for (int i = 0; i < angles_.numTypes(); i++) {
+        cangletypes[i].kf = angles_.type(i).k;
+        cangletypes[i].theteq = angles_.type(i).theteq;
+    }
+    vector<CachedAngle> cangles(angles_.size());
+    for (size_t i = 0; i < angles_.size(); i++) {
+        AngleTerm const& a = angles_.term(i);
+        cangles[i].i = a.i;
+        cangles[i].j = a.j;
+        cangles[i].k = a.k;
+        cangles[i].type = a.type;
+    }
+
+    vector<CachedDihedralType> cdihedraltypes(dihedrals_.numTypes());
+    for (int i = 0; i < dihedrals_.numTypes(); i++) {
+        CachedDihedralType &t = cdihedraltypes[i];
+        memset(&t, 0, sizeof(t));
+        t.kf = dihedrals_.type(i).k;
+        t.phase = dihedrals_.type(i).phase;
+        t.scee = dihedrals_.type(i).scee;
+        t.scnb = dihedrals_.type(i).scnb;
+        t.periodicity = dihedrals_.type(i).periodicity;
+    }
+    vector<CachedDihedral> cdihedrals(dihedrals_.size());
+    for (size_t i = 0; i < dihedrals_.size(); i++) {
+        DihedralTerm const& d = dihedrals_.term(i);
+        cdihedrals[i].i = d.i;
+        cdihedrals[i].j = d.j;
+        cdihedrals[i].k = d.k;
+        cdihedrals[i].l = d.l;
+        cdihedrals[i].type = d.type;
+        cdihedrals[i].ignore_end = d.ignore_end;
+    }
+
+    vector<int32_t> resptr(residue_pointers_.begin(), residue_pointers_.end());
+    vector<uint32_t> reslab(residue_labels_.size());
+    for (size_t i = 0; i < residue_labels_.size(); i++)
+        reslab[i] = strings.add(residue_labels_[i]);
+
+    vector<int32_t> nexcl(atoms_.size());
+    for (int i = 0; i < exclusion_list_.numAtoms(); i++)
+        nexcl[i] = (int32_t) exclusion_list_.excluded(i).size();
+    vector<int32_t> excl(exclusion_list_.partners().begin(),
+                         exclusion_list_.partners().end());
+    header.nexcl = (int32_t) excl.size();
+    strings.add(""); // makes sure the pool is never empty
+    header.nstring = (int32_t) strings.data().size();
+
+    /* Write to a private temporary file and rename it into place, so another
+     * process loading the same topology never sees a partially written cache.
+     * mkstemp makes the name unique, so threads (or processes) writing the
+     * cache of the same topology at once never share a temporary file
+     */
+    string pattern = cacheFileName(filename) + ".tmpXXXXXX";
+    vector<char> tmpname(pattern.begin(), pattern.end());
+    tmpname.push_back('\0');
+    int fd = mkstemp(&tmpname[0]);
+    if (fd < 0) return false;
+    // mkstemp makes the file private; make the cache as readable as the source
+    struct stat source;
+    if (stat(filename.c_str(), &source) == 0)
+        fchmod(fd, source.st_mode & 0666);
+    FILE* fp = fdopen(fd, "wb");
+    if (fp == NULL) {
+        close(fd);
+        remove(&tmpname[0]);
+        return false;
+    }
+
+    bool ok = writeBlock(fp, &header, 1) &&
+              writeBlock(fp, catoms.empty() ? NULL : &catoms[0], catoms.size()) &&
+              writeBlock(fp, cbondtypes.empty() ? NULL : &cbondtypes[0],
+                         cbondtypes.size()) &&
+              writeBlock(fp, cangletypes.empty() ? NULL : &cangletypes[0],
+                         cangletypes.size()) &&
+              writeBlock(fp, cdihedraltypes.empty() ? NULL : &cdihedraltypes[0],
+                         cdihedraltypes.size()) &&
+              writeBlock(fp, cbonds.empty() ? NULL : &cbonds[0], cbonds.size()) &&
+              writeBlock(fp, cangles.empty() ? NULL : &cangles[0], cangles.size()) &&
+              writeBlock(fp, cdihedrals.empty() ? NULL : &cdihedrals[0],
+                         cdihedrals.size()) &&
+              writeBlock(fp, &resptr[0], resptr.size()) &&
+              writeBlock(fp, reslab.empty() ? NULL : &reslab[0], reslab.size()) &&
+              writeBlock(fp, nexcl.empty() ? NULL : &nexcl[0], nexcl.size()) &&
+              writeBlock(fp, excl.empty() ? NULL : &excl[0], excl.size()) &&
+              writeBlock(fp, &strings.data()[0], strings.data().size());
+
+    if (fclose(fp) != 0) ok = false;
+    if (ok) ok = rename(&tmpname[0], cacheFileName(filename).c_str()) == 0;
+    if (!ok) remove(&tmpname[0]);
+    return ok;
+}
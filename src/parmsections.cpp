@@ -0,0 +1,184 @@
+/// parmsections.cpp -- typed, enum-indexed topology file section storage
+
+#include <cstring>
+
+#include "amber/parmsections.h"
+
+using namespace std;
+using namespace Amber;
+
+/// decoded_ bit for strings(), above the bits of the ParmDataTypes
+#define DECODED_STRINGS (1 << (HOLLERITH + 1))
+
+typedef struct {
+    const char* flag;
+    ParmDataType type;
+} ParmSectionInfo;
+
+/* Indexed by ParmSectionId, so it must be kept in the same order as the enum.
+ * The types are the ones the Amber file format specification gives each
+ * section.
+ */
+static const ParmSectionInfo PARM_SECTION_INFO[NUM_PRM_SECTIONS] = {
+    {"POINTERS", INTEGER},
+    {"ATOM_NAME", HOLLERITH},
+    {"CHARGE", FLOAT},
+    {"ATOMIC_NUMBER", INTEGER},
+    {"MASS", FLOAT},
+    {"ATOM_TYPE_INDEX", INTEGER},
+    {"NUMBER_EXCLUDED_ATOMS", INTEGER},
+    {"NONBONDED_PARM_INDEX", INTEGER},
+    {"RESIDUE_LABEL", HOLLERITH},
+    {"RESIDUE_POINTER", INTEGER},
+    {"BOND_FORCE_CONSTANT", FLOAT},
+    {"BOND_EQUIL_VALUE", FLOAT},
+    {"ANGLE_FORCE_CONSTANT", FLOAT},
+    {"ANGLE_EQUIL_VALUE", FLOAT},
+    {"DIHEDRAL_FORCE_CONSTANT", FLOAT},
+    {"DIHEDRAL_PERIODICITY", FLOAT},
+    {"DIHEDRAL_PHASE", FLOAT},
+    {"SCEE_SCALE_FACTOR", FLOAT},
+    {"SCNB_SCALE_FACTOR", FLOAT},
+    {"SOLTY", FLOAT},
+    {"LENNARD_JONES_ACOEF", FLOAT},
+    {"LENNARD_JONES_BCOEF", FLOAT},
+    {"BONDS_INC_HYDROGEN", INTEGER},
+    {"BONDS_WITHOUT_HYDROGEN", INTEGER},
+    {"ANGLES_INC_HYDROGEN", INTEGER},
+    {"ANGLES_WITHOUT_HYDROGEN", INTEGER},
+    {"DIHEDRALS_INC_HYDROGEN", INTEGER},
+    {"DIHEDRALS_WITHOUT_HYDROGEN", INTEGER},
+    {"EXCLUDED_ATOMS_LIST", INTEGER},
+    {"HBOND_ACOEF", FLOAT},
+    {"HBOND_BCOEF", FLOAT},
+    {"HBCUT", FLOAT},
+    {"AMBER_ATOM_TYPE", HOLLERITH},
+    {"TREE_CHAIN_CLASSIFICATION", HOLLERITH},
+    {"JOIN_ARRAY", INTEGER},
+    {"IROTAT", INTEGER},
+    {"SOLVENT_POINTERS", INTEGER},
+    {"ATOMS_PER_MOLECULE", INTEGER},
+    {"BOX_DIMENSIONS", FLOAT},
+    {"RADII", FLOAT},
+    {"SCREEN", FLOAT},
+    {"IPOL", INTEGER},
+};
+
+const char* Amber::parmSectionFlag(ParmSectionId id) {
+    return PARM_SECTION_INFO[id].flag;
+}
+
+ParmDataType Amber::parmSectionType(ParmSectionId id) {
+    return PARM_SECTION_INFO[id].type;
+}
+
+ParmSectionId Amber::parmSectionId(string const& flag) {
+    // Only done once per section when a file is opened
+    for (int i = 0; i < NUM_PRM_SECTIONS; i++)
+        if (strcmp(PARM_SECTION_INFO[i].flag, flag.c_str()) == 0)
+            return (ParmSectionId) i;
+    return NUM_PRM_SECTIONS;
+}
+
+ParmSectionStore::ParmSectionStore(void) {
+    memset(decoded_, 0, sizeof(decoded_));
+}
+
+ExitStatus ParmSectionStore::open(string const& fname) {
+
+    file_.close();
+    for (int i = 0; i < NUM_PRM_SECTIONS; i++) {
+        sections_[i].clear();
+        release((ParmSectionId) i);
+    }
+    otherSections_.clear();
+    otherStrings_.clear();
+    flagList_.clear();
+    version_.clear();
+
+    if (!file_.open(fname))
+        return NOOPEN;
+
+    ParmSectionList sections;
+    ParmStringMap parmComments;
+    ParmFormatMap parmFormats;
+    ExitStatus retval = indexparm(file_.data(), file_.size(), flagList_,
+                                  sections, parmComments, parmFormats,
+                                  version_);
+    if (retval != OK)
+        return retval;
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        ParmSectionId id = parmSectionId(sections[i].flag);
+        if (id != NUM_PRM_SECTIONS)
+            sections_[id].push_back(sections[i]);
+        else
+            otherSections_[sections[i].flag].push_back(sections[i]);
+    }
+
+    return OK;
+}
+
+size_t ParmSectionStore::size(ParmSectionId id) {
+    switch (PARM_SECTION_INFO[id].type) {
+        case INTEGER: return ints(id).size();
+        case FLOAT: return reals(id).size();
+        default: return names(id).size();
+    }
+}
+
+vector<int32_t> const& ParmSectionStore::ints(ParmSectionId id) {
+    if ((decoded_[id] & (1 << INTEGER)) == 0) {
+        decodeSections(file_.data(), sections_[id], ints_[id]);
+        decoded_[id] |= 1 << INTEGER;
+    }
+    return ints_[id];
+}
+
+vector<double> const& ParmSectionStore::reals(ParmSectionId id) {
+    if ((decoded_[id] & (1 << FLOAT)) == 0) {
+        decodeSections(file_.data(), sections_[id], reals_[id]);
+        decoded_[id] |= 1 << FLOAT;
+    }
+    return reals_[id];
+}
+
+vector<ParmName> const& ParmSectionStore::names(ParmSectionId id) {
+    if ((decoded_[id] & (1 << HOLLERITH)) == 0) {
+        decodeSections(file_.data(), sections_[id], names_[id]);
+        decoded_[id] |= 1 << HOLLERITH;
+    }
+    return names_[id];
+}
+
+ParmStringTable const& ParmSectionStore::strings(ParmSectionId id) {
+    if ((decoded_[id] & DECODED_STRINGS) == 0) {
+        decodeSections(file_.data(), sections_[id], strings_[id]);
+        decoded_[id] |= DECODED_STRINGS;
+    }
+    return strings_[id];
+}
+
+ParmStringTable const& ParmSectionStore::strings(string const& flag) {
+    ParmSectionId id = parmSectionId(flag);
+    if (id != NUM_PRM_SECTIONS)
+        return strings(id);
+    map<string, ParmStringTable>::iterator it = otherStrings_.find(flag);
+    if (it != otherStrings_.end())
+        return it->second;
+    ParmStringTable &table = otherStrings_[flag];
+    map<string, ParmSectionList>::const_iterator sit =
+            otherSections_.find(flag);
+    if (sit != otherSections_.end())
+        decodeSections(file_.data(), sit->second, table);
+    return table;
+}
+
+void ParmSectionStore::release(ParmSectionId id) {
+    // Swap with an empty vector -- clear() keeps the capacity
+    vector<int32_t>().swap(ints_[id]);
+    vector<double>().swap(reals_[id]);
+    vector<ParmName>().swap(names_[id]);
+    ParmStringTable().swap(strings_[id]);
+    decoded_[id] = 0;
+}
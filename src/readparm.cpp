@@ -1,15 +1,20 @@
 /* readparm.cpp
  *
  * This is optimized code written in C++ designed to speed up topology file
- * reading compared to what is possible in pure Python.
+ * reading compared to what is possible in pure Python. The file is memory
+ * mapped and every field is decoded straight from the mapped bytes.
  */
-#include <cstdlib>    //< atof and atoi
 #include <cstdio>     //< sscanf
-#include <cstring>    //< strncpy
-#include <fstream>
+#include <cstring>    //< memchr, memcpy
 
+#include "amber/fixedwidth.h"
+#include "amber/mappedfile.h"
 #include "amber/readparm.h"
 
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
 using namespace std;
 using namespace Amber;
 
@@ -18,10 +23,8 @@ ParmDataType Amber::parseFormat(const string &fmt, int &ncols, int &width) {
     string up = upper(fmt);
     int i, j, k;
     if (sscanf(up.c_str(), "%dA%d", &i, &j) == 2) {
-        // Must be characters, but in that case our data type only supports 4
-        // characters, so mark it as unknown if the strings are longer
-        if (j > 4) return UNKNOWN;
-        // OK, we have a string format
+        // Characters, of any width. Fields wider than a ParmData can hold are
+        // still HOLLERITH -- it is up to the decoder where they go
         ncols = i;
         width = j;
         return HOLLERITH;
@@ -46,19 +49,170 @@ ParmDataType Amber::parseFormat(const string &fmt, int &ncols, int &width) {
     return UNKNOWN;
 }
 
-/// Parse the actual topology file and store all of the data in hash tables
-ExitStatus Amber::readparm(const string &fname, vector<string> &flagList,
-                           ParmDataMap &parmData, ParmStringMap &parmComments,
-                           ParmStringMap &unkParmData, ParmFormatMap &parmFormats,
-                           string &version) {
+/* Helpers for walking the raw bytes of the topology file without making a
+ * std::string out of every line and every field
+ */
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/// Finds the end of the line starting at p (excluding the newline and any
+/// carriage return) and returns the start of the next line
+static inline const char* nextLine(const char* p, const char* end,
+                                   const char* &lineEnd) {
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    const char* next = nl == NULL ? end : nl + 1;
+    lineEnd = nl == NULL ? end : nl;
+    if (lineEnd > p && *(lineEnd - 1) == '\r') lineEnd--;
+    return next;
+}
 
-    string line;
+/// Returns the end of [begin, end) once trailing whitespace is removed
+static inline const char* rstripSpan(const char* begin, const char* end) {
+    while (end > begin && isBlank(*(end - 1))) end--;
+    return end;
+}
 
-    // First open the file, and make sure we can
-    ifstream parm(fname.c_str());
+/// Equivalent of strip(string(begin, end)) for a byte span
+static inline string stripSpan(const char* begin, const char* end) {
+    while (begin < end && isBlank(*begin)) begin++;
+    return string(begin, rstripSpan(begin, end));
+}
 
-    if (!parm)
-        return NOOPEN;
+static inline bool startsWith(const char* begin, const char* end,
+                              const string &prefix) {
+    return (size_t)(end - begin) >= prefix.size() &&
+           memcmp(begin, prefix.data(), prefix.size()) == 0;
+}
+
+/// RESIDUE_ICODE can have blank entries, so its lines are never stripped
+static inline bool keepsBlanks(ParmSection const& sec) {
+    return sec.format.dataType == HOLLERITH && sec.flag == "RESIDUE_ICODE";
+}
+
+/// Returns the end of the data on one line of a section
+static inline const char* dataEnd(const char* p, const char* lend,
+                                  bool keepBlanks) {
+    return keepBlanks ? lend : rstripSpan(p, lend);
+}
+
+/// Counts the fields in the line-aligned byte range [p, end)
+static size_t countFields(const char* p, const char* end, int width,
+                          bool keepBlanks) {
+    size_t n = 0;
+    const char* lend;
+    while (p < end) {
+        const char* next = nextLine(p, end, lend);
+        n += (dataEnd(p, lend, keepBlanks) - p + width - 1) / width;
+        p = next;
+    }
+    return n;
+}
+
+/* Stores one decoded field into an output element. The generic ParmData
+ * union keeps whatever type the file has, while the typed arrays convert
+ * numbers to the array type (and have no room for numbers in names, or names
+ * in numbers, which come out as zero)
+ */
+static inline void storeReal(ParmData &out, double v) {out.f = v;}
+static inline void storeReal(double &out, double v) {out = v;}
+static inline void storeReal(int32_t &out, double v) {out = (int32_t) v;}
+static inline void storeReal(ParmName &out, double) {
+    memset(out.c, 0, PARM_NAME_SIZE);
+}
+
+static inline void storeInt(ParmData &out, int v) {out.i = v;}
+static inline void storeInt(double &out, int v) {out = v;}
+static inline void storeInt(int32_t &out, int v) {out = v;}
+static inline void storeInt(ParmName &out, int) {
+    memset(out.c, 0, PARM_NAME_SIZE);
+}
+
+// Only a guard: wider character sections are kept as raw lines and never
+// decoded into the ParmData union, but never overrun it
+static inline void storeName(ParmData &out, const char* b, const char* e) {
+    if (e - b > MAX_HOLLERITH_SIZE) e = b + MAX_HOLLERITH_SIZE;
+    memset(out.c, 0, MAX_HOLLERITH_SIZE);
+    memcpy(out.c, b, e - b);
+}
+static inline void storeName(ParmName &out, const char* b, const char* e) {
+    if (e - b > PARM_NAME_SIZE) e = b + PARM_NAME_SIZE;
+    memset(out.c, 0, PARM_NAME_SIZE);
+    memcpy(out.c, b, e - b);
+}
+static inline void storeName(double &out, const char*, const char*) {out = 0;}
+static inline void storeName(int32_t &out, const char*, const char*) {out = 0;}
+
+/// Appends every field in the line-aligned byte range [p, end) to out, whole
+/// and without its leading and trailing blanks (numbers are kept as text)
+static void decodeStrings(const char* p, const char* end, int width,
+                          bool keepBlanks, ParmStringTable &out) {
+    const char* lend;
+    while (p < end) {
+        const char* next = nextLine(p, end, lend);
+        const char* rend = dataEnd(p, lend, keepBlanks);
+        for (const char* f = p; f < rend; f += width) {
+            const char* fend = f + width < rend ? f + width : rend;
+            const char* fbeg = f;
+            while (fbeg < fend && isBlank(*fbeg)) fbeg++;
+            out.push_back(fbeg, rstripSpan(fbeg, fend));
+        }
+        p = next;
+    }
+}
+
+/* Decodes the numeric fields on one line. WIDTH is the field width when it is
+ * known at compile time (which lets the compiler unroll the field stepping for
+ * the common prmtop layouts) and 0 when it must be taken from width
+ */
+template <int WIDTH, typename T>
+static inline T* decodeLine(const char* p, const char* rend,
+                            ParmDataType type, int width, T *out) {
+    const int w = WIDTH > 0 ? WIDTH : width;
+    if (type == FLOAT) {
+        for (; rend - p >= w; p += w, out++)
+            storeReal(*out, decodeReal(p, p + w));
+        if (p < rend) storeReal(*out++, decodeReal(p, rend));
+    } else {
+        for (; rend - p >= w; p += w, out++)
+            storeInt(*out, decodeInt(p, p + w));
+        if (p < rend) storeInt(*out++, decodeInt(p, rend));
+    }
+    return out;
+}
+
+/// Decodes every field in the line-aligned byte range [p, end) into out, which
+/// must have room for countFields(p, end, ...) entries
+template <typename T>
+static void decodeFields(const char* p, const char* end, ParmDataType type,
+                         int width, bool keepBlanks, T *out) {
+    const char* lend;
+    while (p < end) {
+        const char* next = nextLine(p, end, lend);
+        const char* rend = dataEnd(p, lend, keepBlanks);
+        if (type == HOLLERITH) {
+            for (const char* f = p; f < rend; f += width, out++) {
+                const char* fend = f + width < rend ? f + width : rend;
+                const char* fbeg = f;
+                while (fbeg < fend && isBlank(*fbeg)) fbeg++;
+                storeName(*out, fbeg, rstripSpan(fbeg, fend));
+            }
+        } else if (type == FLOAT && width == 16) {
+            out = decodeLine<16>(p, rend, type, width, out);    // 5E16.8
+        } else if (type == INTEGER && width == 8) {
+            out = decodeLine<8>(p, rend, type, width, out);     // 10I8
+        } else {
+            out = decodeLine<0>(p, rend, type, width, out);
+        }
+        p = next;
+    }
+}
+
+/// Scan the topology file and record where each section lives
+ExitStatus Amber::indexparm(const char* data, size_t size,
+                            vector<string> &flagList, ParmSectionList &sections,
+                            ParmStringMap &parmComments,
+                            ParmFormatMap &parmFormats, string &version) {
 
     const string VERSIONFLAG = "%VERSION";
     const string COMMENTFLAG = "%COMMENT";
@@ -70,94 +224,278 @@ ExitStatus Amber::readparm(const string &fname, vector<string> &flagList,
     const size_t FORMATLEN = FORMATFLAG.size();
     const size_t FLAGLEN = DATAFLAG.size();
 
+    const char* p = data;
+    const char* end = data + size;
+    const char* lend = NULL;
+
     // The first line needs to start with %VERSION
-    if (getline(parm, line).eof()) {
-        parm.close();
+    if (size == 0)
         return EMPTY;
-    }
 
-    if (line.substr(0,VERSIONLEN) != VERSIONFLAG) {
-        parm.close();
+    const char* next = nextLine(p, end, lend);
+    if (!startsWith(p, lend, VERSIONFLAG))
         return NOVERSION;
-    }
     // Now get our version
-    version = strip(line.substr(VERSIONLEN));
-
-    // We have successfully parsed our version. Now parse the rest of the file
-    string curflag = "";
-    int ncols = -1;
-    int width = -1;
-    size_t linewidth = -1;
-    ParmDataType curtype = UNKNOWN;
-    ParmData d;
-    string word;
-
-    while (!getline(parm, line).eof()) {
-        // RESIDUE_ICODE can have blank entries, so don't strip it...
-        if (line[0] == '%') {
-            if (line.substr(0, FLAGLEN) == DATAFLAG) {
-                // This is a new flag -- push the data back to
-                curflag = strip(line.substr(FLAGLEN));
-                flagList.push_back(curflag);
-            } else if (line.substr(0, COMMENTLEN) == COMMENTFLAG) {
-                parmComments[curflag].push_back(strip(line.substr(COMMENTLEN)));
-            } else if (line.substr(0, FORMATLEN) == FORMATFLAG) {
-                size_t start = line.find_first_of('(') + 1;
-                size_t end = line.find_last_of(')');
-                string fmt = line.substr(start, end-start);
-                // why is Amber:: needed here?
-                curtype = Amber::parseFormat(fmt, ncols, width);
-                ParmFormatType typ;
-                typ.dataType = curtype;
-                typ.fmt = fmt;
-                parmFormats[curflag] = typ;
-                linewidth = ncols * width;
-            } else {
-                // No idea what this is if it starts with % and doesn't match
-                // any of these flags...
-                parm.close();
-                return ERR;
-            }
+    version = stripSpan(p + VERSIONLEN, lend);
+
+    /* Anything between %VERSION and the first %FLAG goes in a nameless
+     * section. Sections inherit the format of the one before them until they
+     * see their own %FORMAT line.
+     */
+    ParmSection sec;
+    sec.flag = "";
+    sec.format.dataType = UNKNOWN;
+    sec.ncols = -1;
+    sec.width = -1;
+    sec.begin = sec.end = next - data;
+
+    for (p = next; p < end; p = next) {
+        next = nextLine(p, end, lend);
+        if (*p != '%') {
+            sec.end = next - data;
             continue;
         }
+        // Header line: close off whatever data the current section has
+        if (sec.end > sec.begin)
+            sections.push_back(sec);
+        if (startsWith(p, lend, DATAFLAG)) {
+            sec.flag = stripSpan(p + FLAGLEN, lend);
+            flagList.push_back(sec.flag);
+        } else if (startsWith(p, lend, COMMENTFLAG)) {
+            parmComments[sec.flag].push_back(stripSpan(p + COMMENTLEN, lend));
+        } else if (startsWith(p, lend, FORMATFLAG)) {
+            string line(p + FORMATLEN, lend);
+            size_t start = line.find_first_of('(') + 1;
+            size_t stop = line.find_last_of(')');
+            sec.format.fmt = line.substr(start, stop-start);
+            // why is Amber:: needed here?
+            sec.format.dataType = Amber::parseFormat(sec.format.fmt, sec.ncols,
+                                                     sec.width);
+            if (sec.width <= 0) sec.format.dataType = UNKNOWN;
+            // Sections too wide for a ParmData never reach parmData, so keep
+            // reporting them as UNKNOWN like any other untyped section
+            parmFormats[sec.flag] = sec.format;
+            if (wideHollerith(sec)) parmFormats[sec.flag].dataType = UNKNOWN;
+        } else {
+            // No idea what this is if it starts with % and doesn't match
+            // any of these flags...
+            return ERR;
+        }
+        sec.begin = sec.end = next - data;
+    }
+    if (sec.end > sec.begin)
+        sections.push_back(sec);
+
+    return OK;
+}
+
+namespace {
+/// One line-aligned piece of a section handed to a single thread
+struct DecodeChunk {
+    const ParmSection *sec;
+    size_t begin, end;
+    size_t offset, count;
+};
+}
+
+/* Sections larger than this are split so one huge section (e.g., the
+ * EXCLUDED_ATOMS_LIST or DIHEDRALS_INC_HYDROGEN of a big system) does not
+ * leave the other threads idle
+ */
+#define MIN_CHUNK_BYTES (64*1024)
+
+/// Cuts the typed sections into line-aligned chunks and counts the fields in
+/// each one (in parallel). Wide character sections are left out if skipWide
+static void makeChunks(const char* data, ParmSectionList const& sections,
+                       vector<DecodeChunk> &chunks, bool skipWide) {
+
+    int nthreads = 1;
+#ifdef _OPENMP
+    nthreads = omp_get_max_threads();
+#endif
+
+    size_t total = 0;
+    for (size_t i = 0; i < sections.size(); i++)
+        total += sections[i].end - sections[i].begin;
+    size_t chunkBytes = total / (4 * nthreads) + 1;
+    if (chunkBytes < MIN_CHUNK_BYTES) chunkBytes = MIN_CHUNK_BYTES;
+
+    for (size_t i = 0; i < sections.size(); i++) {
+        ParmSection const& sec = sections[i];
+        if (sec.format.dataType == UNKNOWN) continue;
+        if (skipWide && wideHollerith(sec)) continue;
+        size_t pos = sec.begin;
+        while (pos < sec.end) {
+            DecodeChunk chunk;
+            chunk.sec = &sec;
+            chunk.begin = pos;
+            chunk.end = sec.end;
+            chunk.offset = chunk.count = 0;
+            if (sec.end - pos > chunkBytes + chunkBytes / 2) {
+                const char* nl = (const char*) memchr(data + pos + chunkBytes,
+                        '\n', sec.end - pos - chunkBytes);
+                if (nl != NULL) chunk.end = nl + 1 - data;
+            }
+            chunks.push_back(chunk);
+            pos = chunk.end;
+        }
+    }
 
-        // This is where the actual data processing occurs
-        switch (curtype) {
-            case UNKNOWN:
-                unkParmData[curflag].push_back(rstrip(line));
-                break;
-            case FLOAT:
-                line = rstrip(line);
-                for (size_t i = 0; i < line.size(); i += width) {
-                    d.f = atof(line.substr(i, width).c_str());
-                    parmData[curflag].push_back(d);
-                }
-                break;
-            case INTEGER:
-                line = rstrip(line);
-                for (size_t i = 0; i < line.size(); i += width) {
-                    d.i = atoi(line.substr(i, width).c_str());
-                    parmData[curflag].push_back(d);
-                }
-                break;
-            case HOLLERITH:
-                if (curflag != "RESIDUE_ICODE")
-                    line = rstrip(line);
-                for (size_t i = 0; i < line.size(); i += width) {
-                    word = strip(line.substr(i, width));
-                    strncpy(d.c, word.c_str(), MAX_HOLLERITH_SIZE);
-                    parmData[curflag].push_back(d);
-                }
-                break;
-            default:
-                // Should not reach here
-                parm.close();
-                return ERR;
-                break;
+    int nchunks = (int) chunks.size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nchunks; i++) {
+        DecodeChunk &chunk = chunks[i];
+        chunk.count = countFields(data + chunk.begin, data + chunk.end,
+                                  chunk.sec->width, keepsBlanks(*chunk.sec));
+    }
+}
+
+/// Decodes every chunk straight into its slot (outs[i] + chunks[i].offset)
+template <typename T>
+static void decodeChunks(const char* data, vector<DecodeChunk> const& chunks,
+                         vector<T*> const& outs) {
+    int nchunks = (int) chunks.size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nchunks; i++) {
+        DecodeChunk const& chunk = chunks[i];
+        if (chunk.count == 0) continue;
+        decodeFields(data + chunk.begin, data + chunk.end,
+                     chunk.sec->format.dataType, chunk.sec->width,
+                     keepsBlanks(*chunk.sec), outs[i] + chunk.offset);
+    }
+}
+
+/// Decode the data in each section, in parallel where possible
+void Amber::decodeparm(const char* data, ParmSectionList const& sections,
+                       ParmDataMap &parmData, ParmStringMap &unkParmData) {
+
+    // Rare and small -- just keep the stripped lines
+    for (size_t i = 0; i < sections.size(); i++) {
+        ParmSection const& sec = sections[i];
+        if (sec.format.dataType != UNKNOWN && !wideHollerith(sec)) continue;
+        vector<string> &lines = unkParmData[sec.flag];
+        const char* end = data + sec.end;
+        const char* lend;
+        for (const char* p = data + sec.begin; p < end; ) {
+            const char* next = nextLine(p, end, lend);
+            lines.push_back(string(p, rstripSpan(p, lend)));
+            p = next;
         }
     }
 
-    parm.close();
+    vector<DecodeChunk> chunks;
+    makeChunks(data, sections, chunks, true);
+
+    // Lay the chunks out in their output vectors, in file order. Map insertion
+    // is not thread-safe, so every output vector is created up front.
+    vector<ParmDataVec*> vecs(chunks.size(), (ParmDataVec*) NULL);
+    for (size_t i = 0; i < chunks.size(); i++) {
+        DecodeChunk &chunk = chunks[i];
+        if (chunk.count == 0) continue;
+        vecs[i] = &parmData[chunk.sec->flag];
+        chunk.offset = vecs[i]->size();
+        vecs[i]->resize(chunk.offset + chunk.count);
+    }
+    // Vectors may still be growing above, so take the addresses afterwards
+    vector<ParmData*> outs(chunks.size(), (ParmData*) NULL);
+    for (size_t i = 0; i < chunks.size(); i++)
+        if (vecs[i] != NULL) outs[i] = &(*vecs[i])[0];
+
+    decodeChunks(data, chunks, outs);
+}
+
+/// Decodes all of the sections (assumed to be the same flag) into one array
+template <typename T>
+static void decodeTyped(const char* data, ParmSectionList const& sections,
+                        vector<T> &out) {
+    vector<DecodeChunk> chunks;
+    makeChunks(data, sections, chunks, false);
+    size_t n = out.size();
+    for (size_t i = 0; i < chunks.size(); i++) {
+        chunks[i].offset = n;
+        n += chunks[i].count;
+    }
+    out.resize(n);
+    vector<T*> outs(chunks.size(), n > 0 ? &out[0] : (T*) NULL);
+    decodeChunks(data, chunks, outs);
+}
+
+void Amber::decodeSections(const char* data, ParmSectionList const& sections,
+                           vector<int32_t> &out) {
+    decodeTyped(data, sections, out);
+}
+
+void Amber::decodeSections(const char* data, ParmSectionList const& sections,
+                           vector<double> &out) {
+    decodeTyped(data, sections, out);
+}
+
+void Amber::decodeSections(const char* data, ParmSectionList const& sections,
+                           vector<ParmName> &out) {
+    decodeTyped(data, sections, out);
+}
+
+void Amber::decodeSections(const char* data, ParmSectionList const& sections,
+                           ParmStringTable &out) {
+    vector<DecodeChunk> chunks;
+    makeChunks(data, sections, chunks, false);
+
+    // The lengths are not known until the fields are stripped, so each chunk
+    // fills a table of its own, and the pools are joined afterwards
+    vector<ParmStringTable> parts(chunks.size());
+    int nchunks = (int) chunks.size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nchunks; i++) {
+        DecodeChunk const& chunk = chunks[i];
+        parts[i].reserve(chunk.count, chunk.end - chunk.begin);
+        decodeStrings(data + chunk.begin, data + chunk.end, chunk.sec->width,
+                      keepsBlanks(*chunk.sec), parts[i]);
+    }
+
+    size_t n = 0, chars = 0;
+    for (size_t i = 0; i < parts.size(); i++) {
+        n += parts[i].size();
+        chars += chunks[i].end - chunks[i].begin;
+    }
+    out.reserve(n, chars);
+    for (size_t i = 0; i < parts.size(); i++)
+        out.append(parts[i]);
+}
+
+void ParmStringTable::append(ParmStringTable const& other) {
+    size_t base = pool_.size();
+    pool_.insert(pool_.end(), other.pool_.begin(), other.pool_.end());
+    for (size_t i = 1; i < other.offsets_.size(); i++)
+        offsets_.push_back(base + other.offsets_[i]);
+}
+
+/// Parse the actual topology file and store all of the data in hash tables
+ExitStatus Amber::readparm(const string &fname, vector<string> &flagList,
+                           ParmDataMap &parmData, ParmStringMap &parmComments,
+                           ParmStringMap &unkParmData, ParmFormatMap &parmFormats,
+                           string &version) {
+
+    // First map the file, and make sure we can
+    MappedFile parm;
+
+    if (!parm.open(fname))
+        return NOOPEN;
+
+    // Phase 1: find the sections
+    ParmSectionList sections;
+    ExitStatus retval = indexparm(parm.data(), parm.size(), flagList, sections,
+                                  parmComments, parmFormats, version);
+    if (retval != OK)
+        return retval;
+
+    // Phase 2: decode them
+    decodeparm(parm.data(), sections, parmData, unkParmData);
 
     return OK;
 }
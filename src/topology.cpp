@@ -0,0 +1,321 @@
+/// topology.cpp -- storage for the atoms, exclusions, bonds and atom
+/// selections of a system
+
+#include <algorithm>
+
+#include "amber/exceptions.h"
+#include "amber/topology.h"
+
+using namespace std;
+using namespace Amber;
+
+/// Number of set bits in a word
+static inline int popCount(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_popcountll(bits);
+#else
+    int n = 0;
+    for (; bits != 0; bits &= bits - 1) n++;
+    return n;
+#endif
+}
+
+/// Index of the lowest set bit of a (nonzero) word
+static inline int lowestBit(uint64_t bits) {
+#ifdef __GNUC__
+    return __builtin_ctzll(bits);
+#else
+    int n = 0;
+    while (!((bits >> n) & 1)) n++;
+    return n;
+#endif
+}
+
+// AtomSelection
+
+AtomSelection::AtomSelection(int natom, bool selected) :
+    natom_(natom), words_((natom + 63) / 64, selected ? ~(uint64_t) 0 : 0) {
+    trim_();
+}
+
+void AtomSelection::trim_(void) {
+    if (natom_ % 64 != 0)
+        words_.back() &= ((uint64_t) 1 << (natom_ % 64)) - 1;
+}
+
+void AtomSelection::setRange(int begin, int end) {
+    if (begin >= end) return;
+    int first = begin >> 6, last = (end - 1) >> 6;
+    uint64_t head = ~(uint64_t) 0 << (begin & 63);
+    uint64_t tail = ~(uint64_t) 0 >> (63 - ((end - 1) & 63));
+    if (first == last) {
+        words_[first] |= head & tail;
+        return;
+    }
+    words_[first] |= head;
+    for (int w = first + 1; w < last; w++)
+        words_[w] = ~(uint64_t) 0;
+    words_[last] |= tail;
+}
+
+int AtomSelection::count(void) const {
+    int n = 0;
+    for (size_t w = 0; w < words_.size(); w++)
+        n += popCount(words_[w]);
+    return n;
+}
+
+bool AtomSelection::none(void) const {
+    for (size_t w = 0; w < words_.size(); w++)
+        if (words_[w] != 0) return false;
+    return true;
+}
+
+vector<int> AtomSelection::indices(void) const {
+    vector<int> atoms;
+    atoms.reserve(count());
+    for (size_t w = 0; w < words_.size(); w++)
+        for (uint64_t bits = words_[w]; bits != 0; bits &= bits - 1)
+            atoms.push_back((int) w * 64 + lowestBit(bits));
+    return atoms;
+}
+
+AtomSelection& AtomSelection::operator&=(AtomSelection const& other) {
+    if (other.natom_ != natom_)
+        throw AmberMaskError("Cannot combine selections of different systems");
+    for (size_t w = 0; w < words_.size(); w++)
+        words_[w] &= other.words_[w];
+    return *this;
+}
+
+AtomSelection& AtomSelection::operator|=(AtomSelection const& other) {
+    if (other.natom_ != natom_)
+        throw AmberMaskError("Cannot combine selections of different systems");
+    for (size_t w = 0; w < words_.size(); w++)
+        words_[w] |= other.words_[w];
+    return *this;
+}
+
+void AtomSelection::invert(void) {
+    for (size_t w = 0; w < words_.size(); w++)
+        words_[w] = ~words_[w];
+    if (!words_.empty()) trim_();
+}
+
+void AtomTable::reserve(int natom) {
+    elements_.reserve(natom);
+    name_ids_.reserve(natom);
+    type_ids_.reserve(natom);
+    masses_.reserve(natom);
+    charges_.reserve(natom);
+    lj_radii_.reserve(natom);
+    lj_epsilons_.reserve(natom);
+    gb_radii_.reserve(natom);
+    gb_screens_.reserve(natom);
+}
+
+void AtomTable::clear(void) {
+    elements_.clear();
+    name_ids_.clear();
+    type_ids_.clear();
+    masses_.clear();
+    charges_.clear();
+    lj_radii_.clear();
+    lj_epsilons_.clear();
+    gb_radii_.clear();
+    gb_screens_.clear();
+    names_.clear();
+    types_.clear();
+}
+
+void AtomTable::add(int name, int type, int element, double mass,
+                    double charge, double lj_rad, double lj_eps, double gb_rad,
+                    double gb_screen) {
+    name_ids_.push_back(name);
+    type_ids_.push_back(type);
+    elements_.push_back(element);
+    masses_.push_back(mass);
+    charges_.push_back(charge);
+    lj_radii_.push_back(lj_rad);
+    lj_epsilons_.push_back(lj_eps);
+    gb_radii_.push_back(gb_rad);
+    gb_screens_.push_back(gb_screen);
+}
+
+/// Fills the column up to ncopies copies of its first n entries
+template <class T>
+static void repeatColumn(vector<T> &column, size_t n, int ncopies) {
+    column.resize(n * ncopies);
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static)
+#endif
+    for (int c = 1; c < ncopies; c++)
+        copy(column.begin(), column.begin() + n, column.begin() + c * n);
+}
+
+void AtomTable::repeat(int ncopies) {
+    size_t natom = size();
+    if (natom == 0 || ncopies <= 1) return;
+    repeatColumn(elements_, natom, ncopies);
+    repeatColumn(name_ids_, natom, ncopies);
+    repeatColumn(type_ids_, natom, ncopies);
+    repeatColumn(masses_, natom, ncopies);
+    repeatColumn(charges_, natom, ncopies);
+    repeatColumn(lj_radii_, natom, ncopies);
+    repeatColumn(lj_epsilons_, natom, ncopies);
+    repeatColumn(gb_radii_, natom, ncopies);
+    repeatColumn(gb_screens_, natom, ncopies);
+}
+
+AtomList AtomTable::toList(void) const {
+    AtomList atoms;
+    atoms.reserve(size());
+    for (const_iterator it = begin(); it != end(); it++)
+        atoms.push_back(*it);
+    return atoms;
+}
+
+void ExclusionTable::reserve(int natom, size_t npairs) {
+    offsets_.reserve(natom + 1);
+    masks_.reserve(natom);
+    partners_.reserve(npairs);
+}
+
+void ExclusionTable::clear(void) {
+    offsets_.assign(1, 0);
+    partners_.clear();
+    masks_.clear();
+}
+
+void ExclusionTable::addAtom(const int* partners, int n) {
+    int i = numAtoms();
+    for (int k = 0; k < n; k++)
+        if (partners[k] <= i)
+            throw AmberParmError("Excluded atoms must come after the atom "
+                                 "they are excluded from");
+    size_t begin = partners_.size();
+    partners_.insert(partners_.end(), partners, partners + n);
+    sort(partners_.begin() + begin, partners_.end());
+    partners_.erase(unique(partners_.begin() + begin, partners_.end()),
+                    partners_.end());
+
+    uint64_t mask = 0;
+    for (size_t k = begin; k < partners_.size(); k++) {
+        int d = partners_[k] - i;
+        if (d <= EXCLUSION_MASK_SPAN)
+            mask |= (uint64_t) 1 << (d - 1);
+    }
+    masks_.push_back(mask);
+    offsets_.push_back(partners_.size());
+}
+
+void ExclusionTable::repeat(int ncopies) {
+    int natom = numAtoms();
+    size_t npairs = partners_.size();
+    if (natom == 0 || ncopies <= 1) return;
+    offsets_.resize((size_t) natom * ncopies + 1);
+    partners_.resize(npairs * ncopies);
+    masks_.resize((size_t) natom * ncopies);
+    // The masks are relative to the row's own atom, so they copy unchanged
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static)
+#endif
+    for (int c = 1; c < ncopies; c++) {
+        size_t row = (size_t) c * natom, pair = c * npairs;
+        int shift = c * natom;
+        for (int i = 0; i < natom; i++) {
+            offsets_[row + i + 1] = offsets_[i + 1] + pair;
+            masks_[row + i] = masks_[i];
+        }
+        for (size_t k = 0; k < npairs; k++)
+            partners_[pair + k] = partners_[k] + shift;
+    }
+}
+
+bool ExclusionTable::searchRow_(int i, int j) const {
+    vector<int>::const_iterator begin = partners_.begin() + offsets_[i];
+    vector<int>::const_iterator end = partners_.begin() + offsets_[i+1];
+    return binary_search(begin, end, j);
+}
+
+/// Root of the union-find tree of atom i, halving the path on the way up
+static int findRoot(vector<int> &parent, int i) {
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+void BondGraph::build(int natom, BondTable const& bonds) {
+    Span<BondTerm> terms = bonds.terms();
+
+    // Count the degree of each atom, then fill each row and drop duplicates
+    offsets_.assign(natom + 1, 0);
+    for (size_t n = 0; n < terms.size(); n++) {
+        if (terms[n].i == terms[n].j) continue;
+        offsets_[terms[n].i + 1]++;
+        offsets_[terms[n].j + 1]++;
+    }
+    for (int i = 0; i < natom; i++)
+        offsets_[i+1] += offsets_[i];
+    neighbors_.resize(offsets_[natom]);
+    vector<size_t> fill(offsets_.begin(), offsets_.end() - 1);
+    for (size_t n = 0; n < terms.size(); n++) {
+        int i = terms[n].i, j = terms[n].j;
+        if (i == j) continue;
+        neighbors_[fill[i]++] = j;
+        neighbors_[fill[j]++] = i;
+    }
+    size_t pos = 0;
+    for (int i = 0; i < natom; i++) {
+        vector<int>::iterator begin = neighbors_.begin() + offsets_[i];
+        vector<int>::iterator end = neighbors_.begin() + offsets_[i+1];
+        sort(begin, end);
+        end = unique(begin, end);
+        offsets_[i] = pos;
+        for (vector<int>::iterator it = begin; it != end; it++)
+            neighbors_[pos++] = *it;
+    }
+    offsets_[natom] = pos;
+    neighbors_.resize(pos);
+
+    // Connected components. Rooting every tree at its lowest atom numbers the
+    // molecules in order of their first atom
+    vector<int> parent(natom);
+    for (int i = 0; i < natom; i++)
+        parent[i] = i;
+    for (size_t n = 0; n < terms.size(); n++) {
+        int a = findRoot(parent, terms[n].i), b = findRoot(parent, terms[n].j);
+        if (a < b)
+            parent[b] = a;
+        else if (b < a)
+            parent[a] = b;
+    }
+    molecule_ids_.resize(natom);
+    molecule_offsets_.assign(1, 0);
+    for (int i = 0; i < natom; i++) {
+        int root = findRoot(parent, i);
+        if (root == i) {
+            molecule_ids_[i] = (int) molecule_offsets_.size() - 1;
+            molecule_offsets_.push_back(0);
+        } else {
+            molecule_ids_[i] = molecule_ids_[root];
+        }
+        molecule_offsets_[molecule_ids_[i] + 1]++;
+    }
+    for (size_t m = 1; m < molecule_offsets_.size(); m++)
+        molecule_offsets_[m] += molecule_offsets_[m-1];
+    molecule_atoms_.resize(natom);
+    fill.assign(molecule_offsets_.begin(), molecule_offsets_.end() - 1);
+    for (int i = 0; i < natom; i++)
+        molecule_atoms_[fill[molecule_ids_[i]]++] = i;
+}
+
+void BondGraph::clear(void) {
+    offsets_.assign(1, 0);
+    neighbors_.clear();
+    molecule_ids_.clear();
+    molecule_offsets_.assign(1, 0);
+    molecule_atoms_.clear();
+}
@@ -0,0 +1,207 @@
+/// writeparm.cpp -- writes Amber topology files from the readparm data
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _OPENMP
+#   include <omp.h>
+#endif
+
+#include "amber/fixedwidth.h"
+#include "amber/readparm.h"
+
+using namespace std;
+using namespace Amber;
+
+namespace {
+/// Everything needed to write one field of a section
+struct FieldFormat {
+    ParmDataType type;
+    char kind;      // 'A', 'I', 'E' or 'F'
+    int ncols;
+    int width;
+    int prec;
+};
+
+/// A run of whole lines of one section, formatted by a single thread
+struct EncodeChunk {
+    const ParmDataVec *data;
+    FieldFormat format;
+    size_t begin, end;
+    string *out;
+};
+}
+
+/* Lines of data formatted together in one chunk. Large enough that the
+ * per-chunk overhead vanishes, small enough to spread a single big section
+ * (e.g., EXCLUDED_ATOMS_LIST) over all threads
+ */
+#define LINES_PER_CHUNK 4096
+
+/// Works out the layout of the fields of a section (the same formats that
+/// parseFormat understands)
+static bool fieldFormat(ParmFormatType const& fmt, FieldFormat &format) {
+    string up = upper(fmt.fmt);
+    int i, j, k;
+    format.type = fmt.dataType;
+    format.prec = 0;
+    if (fmt.dataType == HOLLERITH &&
+            sscanf(up.c_str(), "%dA%d", &i, &j) == 2) {
+        format.kind = 'A';
+    } else if (fmt.dataType == FLOAT &&
+            sscanf(up.c_str(), "%dE%d.%d", &i, &j, &k) == 3) {
+        format.kind = 'E';
+        format.prec = k;
+    } else if (fmt.dataType == INTEGER &&
+            sscanf(up.c_str(), "%dI%d", &i, &j) == 2) {
+        format.kind = 'I';
+    } else if (fmt.dataType == FLOAT &&
+            (sscanf(up.c_str(), "%d(F%d.%d)", &i, &j, &k) == 3 ||
+             sscanf(up.c_str(), "%dF%d.%d", &i, &j, &k) == 3)) {
+        format.kind = 'F';
+        format.prec = k;
+    } else {
+        return false;
+    }
+    format.ncols = i;
+    format.width = j;
+    return i > 0 && j > 0;
+}
+
+/// Formats the fields [chunk.begin, chunk.end) into chunk.out, ending each
+/// line (and the section) with a newline
+static void encodeChunk(EncodeChunk const& chunk) {
+    FieldFormat const& f = chunk.format;
+    ParmDataVec const& data = *chunk.data;
+    size_t total = data.size();
+    // Room for a field that overflows its width, as printf would write it
+    size_t slack = f.width + f.prec + FIXEDWIDTH_ENCODE_SIZE;
+
+    string &out = *chunk.out;
+    out.resize((chunk.end - chunk.begin) * (f.width + 1) + slack);
+    size_t pos = 0;
+    for (size_t i = chunk.begin; i < chunk.end; i++) {
+        if (out.size() - pos < slack + 1)
+            out.resize(out.size() * 2);
+        char* p = &out[pos];
+        if (f.kind == 'A') {
+            const char* c = data[i].c;
+            size_t len = 0;
+            while (len < MAX_HOLLERITH_SIZE && c[len] != '\0') len++;
+            if (len > (size_t) f.width) len = f.width;
+            memcpy(p, c, len);
+            memset(p + len, ' ', f.width - len);
+            pos += f.width;
+        } else if (f.kind == 'I') {
+            pos += encodeInt(data[i].i, f.width, p);
+        } else if (f.kind == 'E') {
+            pos += encodeExp(data[i].f, f.width, f.prec, p);
+        } else {
+            pos += encodeFixed(data[i].f, f.width, f.prec, p);
+        }
+        if ((i + 1) % f.ncols == 0 || i + 1 == total)
+            out[pos++] = '\n';
+    }
+    out.resize(pos);
+}
+
+ExitStatus Amber::writeparm(const string &fname,
+                            vector<string> const& flagList,
+                            ParmDataMap const& parmData,
+                            ParmStringMap const& parmComments,
+                            ParmStringMap const& unkParmData,
+                            ParmFormatMap const& parmFormats,
+                            string const& version) {
+
+    /* Lay the file out as a list of pieces -- the header lines of each section
+     * are assembled here, and the data lines are split into chunks that are
+     * formatted in parallel afterwards
+     */
+    vector<string> pieces(1);
+    vector<EncodeChunk> chunks;
+    vector<size_t> chunkPieces;
+
+    pieces.back() = "%VERSION  " + version + "\n";
+    ParmStringMap::const_iterator cit = parmComments.find("");
+    if (cit != parmComments.end())
+        for (size_t i = 0; i < cit->second.size(); i++)
+            pieces.back() += "%COMMENT " + cit->second[i] + "\n";
+    ParmStringMap::const_iterator uit = unkParmData.find("");
+    if (uit != unkParmData.end())
+        for (size_t i = 0; i < uit->second.size(); i++)
+            pieces.back() += uit->second[i] + "\n";
+
+    for (size_t n = 0; n < flagList.size(); n++) {
+        string const& flag = flagList[n];
+        ParmFormatMap::const_iterator fit = parmFormats.find(flag);
+        if (fit == parmFormats.end())
+            return ERR;
+
+        string &header = pieces.back();
+        header += "%FLAG " + flag + "\n";
+        cit = parmComments.find(flag);
+        if (cit != parmComments.end())
+            for (size_t i = 0; i < cit->second.size(); i++)
+                header += "%COMMENT " + cit->second[i] + "\n";
+        header += "%FORMAT(" + fit->second.fmt + ")\n";
+
+        ParmDataMap::const_iterator dit = parmData.find(flag);
+        uit = unkParmData.find(flag);
+        if (dit != parmData.end() && !dit->second.empty()) {
+            EncodeChunk chunk;
+            if (!fieldFormat(fit->second, chunk.format))
+                return ERR;
+            chunk.data = &dit->second;
+            size_t perChunk = (size_t) chunk.format.ncols * LINES_PER_CHUNK;
+            for (size_t i = 0; i < dit->second.size(); i += perChunk) {
+                chunk.begin = i;
+                chunk.end = min(i + perChunk, dit->second.size());
+                chunks.push_back(chunk);
+                chunkPieces.push_back(pieces.size());
+                pieces.push_back(string());
+            }
+            pieces.push_back(string());
+        } else if (uit != unkParmData.end()) {
+            // The lines were right-stripped when they were read. Character
+            // fields too wide for ParmData (e.g., the 1a80 RADIUS_SET) are
+            // blank-padded to their full width, so put that padding back
+            int ncols, width = 0;
+            if (sscanf(upper(fit->second.fmt).c_str(), "%dA%d", &ncols,
+                       &width) != 2)
+                width = 0;
+            for (size_t i = 0; i < uit->second.size(); i++) {
+                string const& line = uit->second[i];
+                header += line;
+                if (width > 0 && line.size() % width != 0)
+                    header.append(width - line.size() % width, ' ');
+                header += "\n";
+            }
+        } else {
+            // Empty sections get a blank line, as LEaP writes them
+            header += "\n";
+        }
+    }
+
+    // Now every piece is in place, so the addresses are stable
+    for (size_t i = 0; i < chunks.size(); i++)
+        chunks[i].out = &pieces[chunkPieces[i]];
+
+    int nchunks = (int) chunks.size();
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(dynamic)
+#endif
+    for (int i = 0; i < nchunks; i++)
+        encodeChunk(chunks[i]);
+
+    FILE *file = fopen(fname.c_str(), "w");
+    if (file == NULL)
+        return NOOPEN;
+    bool ok = true;
+    for (size_t i = 0; i < pieces.size() && ok; i++)
+        ok = fwrite(pieces[i].data(), 1, pieces[i].size(), file) ==
+             pieces[i].size();
+    if (fclose(file) != 0) ok = false;
+
+    return ok ? OK : ERR;
+}
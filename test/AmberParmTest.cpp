@@ -1,12 +1,23 @@
 
 // Testing program driving the unit tests for the AmberParm class
 
+#include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
 #include <iostream>
+#include <sstream>
+#include <string>
+
+#include <glob.h>
+#include <sys/stat.h>
 
 #include "amber/amberparm.h"
+#include "amber/atommask.h"
 #include "amber/exceptions.h"
+#include "amber/inputstream.h"
 
 using namespace std;
 
@@ -18,7 +29,7 @@ void check_add_atoms(void) {
     parm.addAtom(atom);
     parm.addAtom("H1", "H", 1, 1.008, 1.0, 0.5, 0.1, 0.8, 0.85);
 
-    assert(parm.Atoms().size() == 2);
+    assert(parm.getNumAtoms() == 2);
 }
 
 void check_bad_add_atoms(void) {
@@ -46,17 +57,104 @@ void check_add_bonds(void) {
     parm.addBond(bond);
     parm.addBond(1, 2, 500.0, 0.8);
 
-    assert(parm.Atoms().size() == 3);
-    assert(parm.Bonds().size() == 2);
-    assert(parm.Bonds()[0].getForceConstant() == 500);
-    assert(parm.Bonds()[1].getForceConstant() == 500);
-    assert(parm.Bonds()[0].getEquilibriumDistance() == 0.8);
-    assert(parm.Bonds()[1].getEquilibriumDistance() == 0.8);
-
-    assert(parm.Bonds()[0].getAtomI() == 0);
-    assert(parm.Bonds()[0].getAtomJ() == 1);
-    assert(parm.Bonds()[1].getAtomI() == 1);
-    assert(parm.Bonds()[1].getAtomJ() == 2);
+    assert(parm.getNumAtoms() == 3);
+    assert(parm.getBonds().size() == 2);
+    assert(parm.getBonds()[0].getForceConstant() == 500);
+    assert(parm.getBonds()[1].getForceConstant() == 500);
+    assert(parm.getBonds()[0].getEquilibriumDistance() == 0.8);
+    assert(parm.getBonds()[1].getEquilibriumDistance() == 0.8);
+
+    assert(parm.getBonds()[0].getAtomI() == 0);
+    assert(parm.getBonds()[0].getAtomJ() == 1);
+    assert(parm.getBonds()[1].getAtomI() == 1);
+    assert(parm.getBonds()[1].getAtomJ() == 2);
+}
+
+void check_bond_types(void) {
+    Amber::AmberParm parm;
+
+    parm.addAtom("N", "N3", 7, 14.01, -1.0, 0.95, 0.1, 1.3, 0.85);
+    parm.addAtom("H1", "H", 1, 1.008, 0.5, 0.5, 0.05, 0.8, 0.85);
+    parm.addAtom("H2", "H", 1, 1.008, 0.5, 0.5, 0.05, 0.8, 0.85);
+
+    // Bonds with the same parameters share a type
+    parm.addBond(0, 1, 500.0, 0.8);
+    parm.addBond(0, 2, 500.0, 0.8);
+    parm.addBond(1, 2, 300.0, 1.5);
+    assert(parm.getBonds().numTypes() == 2);
+    assert(parm.getBonds().term(0).type == parm.getBonds().term(1).type);
+    assert(parm.getBonds().term(0).type != parm.getBonds().term(2).type);
+
+    int type = parm.addBondType(Amber::BondType(100.0, 1.0));
+    parm.addBond(1, 2, type);
+    assert(parm.getBonds().size() == 4);
+    assert(parm.getBonds()[3].getForceConstant() == 100.0);
+
+    // Changing a type changes every bond that uses it
+    parm.setBondType(parm.getBonds().term(0).type,
+                     Amber::BondType(450.0, 0.9));
+    assert(parm.getBonds()[0].getForceConstant() == 450.0);
+    assert(parm.getBonds()[1].getEquilibriumDistance() == 0.9);
+    assert(parm.getBonds()[2].getForceConstant() == 300.0);
+
+    bool caught = false;
+    try {
+        parm.addBond(0, 1, parm.getBonds().numTypes());
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+
+    caught = false;
+    try {
+        parm.setAngleType(0, Amber::AngleType(50.0, 109.5));
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void check_bond_graph(void) {
+    Amber::AmberParm parm;
+
+    parm.addAtom("N", "N3", 7, 14.01, -1.0, 0.95, 0.1, 1.3, 0.85);
+    parm.addAtom("H1", "H", 1, 1.008, 0.5, 0.5, 0.05, 0.8, 0.85);
+    parm.addAtom("H2", "H", 1, 1.008, 0.5, 0.5, 0.05, 0.8, 0.85);
+    parm.addBond(0, 1, 500.0, 0.8);
+    assert(parm.getNumMolecules() == 2);
+    assert(parm.getMoleculeOf(2) == 1);
+
+    // Adding a bond rebuilds the graph on the next query
+    parm.addBond(0, 2, 500.0, 0.8);
+    assert(parm.getNumMolecules() == 1);
+    assert(parm.getNeighbors(0).size() == 2);
+    assert(parm.getBondGraph().bonded(2, 0));
+
+    // Water: each molecule is an O-H-H triangle
+    parm.rdparm("files/4096wat.parm7");
+    assert(parm.getNumMolecules() == 4096);
+    for (int m = 0; m < parm.getNumMolecules(); m++) {
+        Amber::Span<int> atoms = parm.getMolecule(m);
+        assert(atoms.size() == 3 && atoms[0] == 3 * m);
+        assert(parm.getBondGraph().isContiguous(m));
+        for (int k = 0; k < 3; k++) {
+            assert(parm.getNeighbors(atoms[k]).size() == 2);
+            assert(parm.getMoleculeOf(atoms[k]) == m);
+        }
+    }
+
+    // The protein is a single molecule, and every hydrogen has one neighbor
+    parm.rdparm("files/trx.prmtop");
+    assert(parm.getNumMolecules() == 1);
+    assert(parm.getBondGraph().numEdges() == parm.getBonds().size());
+    Amber::AtomTable const& atoms = parm.getAtomTable();
+    for (int i = 0; i < atoms.size(); i++) {
+        if (atoms[i].getElement() == 1)
+            assert(parm.getNeighbors(i).size() == 1);
+        Amber::Span<int> neighbors = parm.getNeighbors(i);
+        for (size_t k = 0; k < neighbors.size(); k++)
+            assert(parm.getBondGraph().bonded(neighbors[k], i));
+    }
 }
 
 void check_bad_add_bonds(void) {
@@ -85,21 +183,21 @@ void check_add_angles(void) {
     parm.addAngle(angle);
     parm.addAngle(1, 2, 3, 60.0, 120.0);
 
-    assert(parm.Atoms().size() == 4);
-    assert(parm.Bonds().size() == 0);
-    assert(parm.Angles().size() == 2);
-
-    assert(parm.Angles()[0].getAtomI() == 0);
-    assert(parm.Angles()[0].getAtomJ() == 1);
-    assert(parm.Angles()[0].getAtomK() == 2);
-    assert(parm.Angles()[1].getAtomI() == 1);
-    assert(parm.Angles()[1].getAtomJ() == 2);
-    assert(parm.Angles()[1].getAtomK() == 3);
-
-    assert(parm.Angles()[0].getForceConstant() == 50.0);
-    assert(parm.Angles()[1].getForceConstant() == 60.0);
-    assert(parm.Angles()[0].getEquilibriumAngle() == 109.47);
-    assert(parm.Angles()[1].getEquilibriumAngle() == 120.0);
+    assert(parm.getNumAtoms() == 4);
+    assert(parm.getBonds().size() == 0);
+    assert(parm.getAngles().size() == 2);
+
+    assert(parm.getAngles()[0].getAtomI() == 0);
+    assert(parm.getAngles()[0].getAtomJ() == 1);
+    assert(parm.getAngles()[0].getAtomK() == 2);
+    assert(parm.getAngles()[1].getAtomI() == 1);
+    assert(parm.getAngles()[1].getAtomJ() == 2);
+    assert(parm.getAngles()[1].getAtomK() == 3);
+
+    assert(parm.getAngles()[0].getForceConstant() == 50.0);
+    assert(parm.getAngles()[1].getForceConstant() == 60.0);
+    assert(parm.getAngles()[0].getEquilibriumAngle() == 109.47);
+    assert(parm.getAngles()[1].getEquilibriumAngle() == 120.0);
 }
 
 void check_bad_add_angles(void) {
@@ -131,33 +229,33 @@ void check_add_dihedrals(void) {
     parm.addDihedral(dihed2);
     parm.addDihedral(1, 2, 3, 4, 40.0, 0.0, 1, 1.2, 2.0, false);
 
-    assert(parm.Atoms().size() == 5);
-    assert(parm.Bonds().size() == 0);
-    assert(parm.Angles().size() == 0);
-    assert(parm.Dihedrals().size() == 3);
-
-    assert(parm.Dihedrals()[0].getAtomI() == 0);
-    assert(parm.Dihedrals()[0].getAtomJ() == 1);
-    assert(parm.Dihedrals()[0].getAtomK() == 2);
-    assert(parm.Dihedrals()[0].getAtomL() == 3);
-    assert(parm.Dihedrals()[1].getAtomI() == 0);
-    assert(parm.Dihedrals()[1].getAtomJ() == 1);
-    assert(parm.Dihedrals()[1].getAtomK() == 2);
-    assert(parm.Dihedrals()[1].getAtomL() == 3);
-    assert(parm.Dihedrals()[2].getAtomI() == 1);
-    assert(parm.Dihedrals()[2].getAtomJ() == 2);
-    assert(parm.Dihedrals()[2].getAtomK() == 3);
-    assert(parm.Dihedrals()[2].getAtomL() == 4);
-
-    assert(parm.Dihedrals()[0].getForceConstant() == 50.0);
-    assert(parm.Dihedrals()[1].getForceConstant() == 20.0);
-    assert(parm.Dihedrals()[2].getForceConstant() == 40.0);
-    assert(parm.Dihedrals()[0].getPhase() == 180);
-    assert(parm.Dihedrals()[1].getPhase() == 0);
-    assert(parm.Dihedrals()[2].getPhase() == 0);
-    assert(parm.Dihedrals()[0].getPeriodicity() == 2);
-    assert(parm.Dihedrals()[1].getPeriodicity() == 3);
-    assert(parm.Dihedrals()[2].getPeriodicity() == 1);
+    assert(parm.getNumAtoms() == 5);
+    assert(parm.getBonds().size() == 0);
+    assert(parm.getAngles().size() == 0);
+    assert(parm.getDihedrals().size() == 3);
+
+    assert(parm.getDihedrals()[0].getAtomI() == 0);
+    assert(parm.getDihedrals()[0].getAtomJ() == 1);
+    assert(parm.getDihedrals()[0].getAtomK() == 2);
+    assert(parm.getDihedrals()[0].getAtomL() == 3);
+    assert(parm.getDihedrals()[1].getAtomI() == 0);
+    assert(parm.getDihedrals()[1].getAtomJ() == 1);
+    assert(parm.getDihedrals()[1].getAtomK() == 2);
+    assert(parm.getDihedrals()[1].getAtomL() == 3);
+    assert(parm.getDihedrals()[2].getAtomI() == 1);
+    assert(parm.getDihedrals()[2].getAtomJ() == 2);
+    assert(parm.getDihedrals()[2].getAtomK() == 3);
+    assert(parm.getDihedrals()[2].getAtomL() == 4);
+
+    assert(parm.getDihedrals()[0].getForceConstant() == 50.0);
+    assert(parm.getDihedrals()[1].getForceConstant() == 20.0);
+    assert(parm.getDihedrals()[2].getForceConstant() == 40.0);
+    assert(parm.getDihedrals()[0].getPhase() == 180);
+    assert(parm.getDihedrals()[1].getPhase() == 0);
+    assert(parm.getDihedrals()[2].getPhase() == 0);
+    assert(parm.getDihedrals()[0].getPeriodicity() == 2);
+    assert(parm.getDihedrals()[1].getPeriodicity() == 3);
+    assert(parm.getDihedrals()[2].getPeriodicity() == 1);
 }
 
 void check_bad_add_dihedrals(void) {
@@ -180,68 +278,108 @@ void check_rdparm(void) {
 
     // Check atoms and atom properties
 
-    assert(parm.Atoms().size() == 1654);
-    assert(parm.Atoms()[0].getName() == "N");
-    assert(parm.Atoms()[0].getType() == "N3");
-    assert(parm.Atoms()[0].getMass() == 14.01);
-    assert(abs(parm.Atoms()[0].getCharge() - 0.1849) < 1e-4);
-    assert(parm.Atoms()[0].getGBRadius() == 1.55);
-    assert(parm.Atoms()[0].getGBScreen() == 0.79);
-    assert(abs(parm.Atoms()[0].getLJRadius() - 1.824) < 1e-4);
-    assert(abs(parm.Atoms()[0].getLJEpsilon() - 0.17) < 1e-4);
-
-    assert(parm.Atoms()[1653].getName() == "OXT");
-    assert(parm.Atoms()[1653].getType() == "O2");
-    assert(parm.Atoms()[1653].getMass() == 16.00);
-    assert(abs(parm.Atoms()[1653].getCharge() - -0.8055) < 1e-4);
-    assert(parm.Atoms()[1653].getGBRadius() == 1.5);
-    assert(parm.Atoms()[1653].getGBScreen() == 0.85);
-    assert(abs(parm.Atoms()[1653].getLJRadius() - 1.6612) < 1e-4);
-    assert(abs(parm.Atoms()[1653].getLJEpsilon() - 0.21) < 1e-4);
-
-    assert(parm.Bonds().size() == 1670);
-    assert(parm.Bonds()[0].getAtomI() == 9);
-    assert(parm.Bonds()[0].getAtomJ() == 10);
-    assert(parm.Bonds()[0].getForceConstant() == 553);
-    assert(parm.Bonds()[0].getEquilibriumDistance() == 0.96);
-
-    assert(parm.Angles().size() == 3049);
-    assert(parm.Angles()[0].getAtomI() == 11);
-    assert(parm.Angles()[0].getAtomJ() == 13);
-    assert(parm.Angles()[0].getAtomK() == 14);
-    assert(parm.Angles()[0].getForceConstant() == 30);
-    assert(abs(parm.Angles()[0].getEquilibriumAngle() - 120) < 5e-4);
-
-    assert(parm.Dihedrals().size() == 5402);
-    assert(parm.Dihedrals()[0].getAtomI() == 12);
-    assert(parm.Dihedrals()[0].getAtomJ() == 11);
-    assert(parm.Dihedrals()[0].getAtomK() == 13);
-    assert(parm.Dihedrals()[0].getAtomL() == 14);
-    assert(!parm.Dihedrals()[0].ignoreEndGroups());
-    assert(parm.Dihedrals()[0].getForceConstant() == 2.0);
-    assert(parm.Dihedrals()[0].getPhase() == 0);
-    assert(parm.Dihedrals()[0].getPeriodicity() == 1);
-    assert(parm.Dihedrals()[0].getScee() == 1.2);
-    assert(parm.Dihedrals()[0].getScnb() == 2.0);
-
-    assert(parm.Dihedrals()[1].getAtomI() == 12);
-    assert(parm.Dihedrals()[1].getAtomJ() == 11);
-    assert(parm.Dihedrals()[1].getAtomK() == 13);
-    assert(parm.Dihedrals()[1].getAtomL() == 14);
-    assert(parm.Dihedrals()[1].ignoreEndGroups());
-    assert(parm.Dihedrals()[1].getForceConstant() == 2.5);
-    assert(abs(parm.Dihedrals()[1].getPhase() - 180) < 1e-4);
-    assert(parm.Dihedrals()[1].getPeriodicity() == 2);
-    assert(parm.Dihedrals()[1].getScee() == 1.2);
-    assert(parm.Dihedrals()[1].getScnb() == 2.0);
+    assert(parm.getNumAtoms() == 1654);
+    assert(parm.getAtomTable()[0].getName() == "N");
+    assert(parm.getAtomTable()[0].getType() == "N3");
+    assert(parm.getAtomTable()[0].getMass() == 14.01);
+    assert(abs(parm.getAtomTable()[0].getCharge() - 0.1849) < 1e-4);
+    assert(parm.getAtomTable()[0].getGBRadius() == 1.55);
+    assert(parm.getAtomTable()[0].getGBScreen() == 0.79);
+    assert(abs(parm.getAtomTable()[0].getLJRadius() - 1.824) < 1e-4);
+    assert(abs(parm.getAtomTable()[0].getLJEpsilon() - 0.17) < 1e-4);
+
+    assert(parm.getAtomTable()[1653].getName() == "OXT");
+    assert(parm.getAtomTable()[1653].getType() == "O2");
+    assert(parm.getAtomTable()[1653].getMass() == 16.00);
+    assert(abs(parm.getAtomTable()[1653].getCharge() - -0.8055) < 1e-4);
+    assert(parm.getAtomTable()[1653].getGBRadius() == 1.5);
+    assert(parm.getAtomTable()[1653].getGBScreen() == 0.85);
+    assert(abs(parm.getAtomTable()[1653].getLJRadius() - 1.6612) < 1e-4);
+    assert(abs(parm.getAtomTable()[1653].getLJEpsilon() - 0.21) < 1e-4);
+
+    // The atom table interns the names and types shared by many atoms
+    Amber::AtomTable const& table = parm.getAtomTable();
+    assert(table.size() == 1654);
+    assert(table.names().size() < 100);
+    assert(table.types().size() < 50);
+    assert(table[1653].getName() == "OXT");
+    assert(table.charges()[0] == parm.Atoms()[0].getCharge());
+
+    assert(parm.getBonds().size() == 1670);
+    assert(parm.getBonds().numTypes() == 42);   // NUMBND
+    assert(parm.getAngles().numTypes() == 91);  // NUMANG
+    assert(parm.getDihedrals().numTypes() == 34); // NPTRA
+    assert(parm.getBonds()[0].getAtomI() == 9);
+    assert(parm.getBonds()[0].getAtomJ() == 10);
+    assert(parm.getBonds()[0].getForceConstant() == 553);
+    assert(parm.getBonds()[0].getEquilibriumDistance() == 0.96);
+
+    assert(parm.getAngles().size() == 3049);
+    assert(parm.getAngles()[0].getAtomI() == 11);
+    assert(parm.getAngles()[0].getAtomJ() == 13);
+    assert(parm.getAngles()[0].getAtomK() == 14);
+    assert(parm.getAngles()[0].getForceConstant() == 30);
+    assert(abs(parm.getAngles()[0].getEquilibriumAngle() - 120) < 5e-4);
+
+    assert(parm.getDihedrals().size() == 5402);
+    assert(parm.getDihedrals()[0].getAtomI() == 12);
+    assert(parm.getDihedrals()[0].getAtomJ() == 11);
+    assert(parm.getDihedrals()[0].getAtomK() == 13);
+    assert(parm.getDihedrals()[0].getAtomL() == 14);
+    assert(!parm.getDihedrals()[0].ignoreEndGroups());
+    assert(parm.getDihedrals()[0].getForceConstant() == 2.0);
+    assert(parm.getDihedrals()[0].getPhase() == 0);
+    assert(parm.getDihedrals()[0].getPeriodicity() == 1);
+    assert(parm.getDihedrals()[0].getScee() == 1.2);
+    assert(parm.getDihedrals()[0].getScnb() == 2.0);
+
+    assert(parm.getDihedrals()[1].getAtomI() == 12);
+    assert(parm.getDihedrals()[1].getAtomJ() == 11);
+    assert(parm.getDihedrals()[1].getAtomK() == 13);
+    assert(parm.getDihedrals()[1].getAtomL() == 14);
+    assert(parm.getDihedrals()[1].ignoreEndGroups());
+    assert(parm.getDihedrals()[1].getForceConstant() == 2.5);
+    assert(abs(parm.getDihedrals()[1].getPhase() - 180) < 1e-4);
+    assert(parm.getDihedrals()[1].getPeriodicity() == 2);
+    assert(parm.getDihedrals()[1].getScee() == 1.2);
+    assert(parm.getDihedrals()[1].getScnb() == 2.0);
 
     // Check the residue properties
-    assert(parm.ResidueLabels()[0] == "SER");
-    assert(parm.ResidueLabels()[107] == "ALA");
-    assert(parm.ResiduePointers()[1] - parm.ResiduePointers()[0] == 13);
-    assert(parm.ResiduePointers()[0] == 0);
-    assert(parm.ResiduePointers()[1] == 13);
-    assert(parm.ResiduePointers()[108] - parm.ResiduePointers()[107] == 11);
+    assert(parm.getResidueLabels()[0] == "SER");
+    assert(parm.getResidueLabels()[107] == "ALA");
+    assert(parm.getResiduePointers()[1] - parm.getResiduePointers()[0] == 13);
+    assert(parm.getResiduePointers()[0] == 0);
+    assert(parm.getResiduePointers()[1] == 13);
+    assert(parm.getResiduePointers()[108] - parm.getResiduePointers()[107] == 11);
+    assert(parm.getNumResidues() == 108);
+    assert(parm.getResiduePointers().size() == 109);
+    assert(parm.getResiduePointers().back() == parm.getNumAtoms());
+
+    Amber::ResidueRef res = parm.getResidue(1);
+    assert(res.getIndex() == 1);
+    assert(res.getName() == parm.getResidueLabels()[1]);
+    assert(res.getFirstAtom() == 13);
+    assert(res.size() == parm.getResiduePointers()[2] - 13);
+    assert(res.contains(13) && !res.contains(12));
+    assert(parm.getResidueOf(0) == 0);
+    assert(parm.getResidueOf(12) == 0);
+    assert(parm.getResidueOf(13) == 1);
+    assert(parm.getResidueOf(1653) == 107);
+    assert(parm.getResidueOf(1654) == -1);
+    assert(parm.getResidueOf(-1) == -1);
+    for (int i = 0; i < parm.getNumResidues(); i++) {
+        Amber::ResidueRef r = parm.getResidue(i);
+        for (int j = r.getFirstAtom(); j < r.getEndAtom(); j++)
+            assert(parm.getResidueOf(j) == i);
+    }
+
+    // The views see the same data the copying accessors return
+    assert(parm.getBonds().toList().size() == parm.Bonds().size());
+    assert(parm.getDihedrals()[5401].getAtomL() ==
+           parm.Dihedrals()[5401].getAtomL());
+    assert(parm.getResiduePointers().toVector() == parm.ResiduePointers());
+    assert(parm.getResidueLabels().toVector() == parm.ResidueLabels());
+    assert(Amber::Span<int>().empty());
 
     // Check the exclusions
     for (Amber::AmberParm::bond_iterator it = parm.BondBegin();
@@ -270,6 +408,20 @@ void check_rdparm(void) {
         }
     }
 
+    // isExcluded agrees with the rows of the exclusion table for every pair
+    Amber::ExclusionTable const& excl = parm.getExclusions();
+    assert(excl.numAtoms() == 1654);
+    size_t npairs = 0;
+    for (int i = 0; i < excl.numAtoms(); i++) {
+        Amber::Span<int> row = excl.excluded(i);
+        for (int j = i + 1; j < excl.numAtoms(); j++) {
+            bool listed = binary_search(row.begin(), row.end(), j);
+            assert(parm.isExcluded(i, j) == listed);
+            npairs += listed;
+        }
+    }
+    assert(npairs == excl.size());
+
     assert(!parm.isPeriodic());
     assert(parm.IfBox() == 0);
 }
@@ -293,10 +445,491 @@ void check_rdparm_box(void) {
     assert(parm.getUnitCell().getVectorB() == OpenMM::Vec3(0, 49.6, 0));
     assert(parm.getUnitCell().getVectorC() == OpenMM::Vec3(0, 0, 49.6));
 
-    assert(parm.Atoms().size() == 12288);
-    assert(parm.Bonds().size() == 12288);
-    assert(parm.Angles().size() == 0);    // None in TIPxP water
-    assert(parm.Dihedrals().size() == 0); // None in water
+    assert(parm.getNumAtoms() == 12288);
+    assert(parm.getBonds().size() == 12288);
+    assert(parm.getAngles().size() == 0);    // None in TIPxP water
+    assert(parm.getDihedrals().size() == 0); // None in water
+}
+
+void copy_file(const char* src, const char* dest) {
+    ifstream in(src);
+    ofstream out(dest);
+    out << in.rdbuf();
+}
+
+bool file_exists(string const& fname) {
+    ifstream f(fname.c_str());
+    return f.good();
+}
+
+void assert_same_parm(Amber::AmberParm const& a, Amber::AmberParm const& b) {
+    assert(a.IfBox() == b.IfBox());
+    assert(a.getUnitCell().getVectorA() == b.getUnitCell().getVectorA());
+    assert(a.getUnitCell().getVectorB() == b.getUnitCell().getVectorB());
+    assert(a.getUnitCell().getVectorC() == b.getUnitCell().getVectorC());
+
+    Amber::AtomTable const& atomsa = a.getAtomTable();
+    Amber::AtomTable const& atomsb = b.getAtomTable();
+    assert(atomsa.size() == atomsb.size());
+    for (int i = 0; i < atomsa.size(); i++) {
+        assert(atomsa[i].getIndex() == atomsb[i].getIndex());
+        assert(atomsa[i].getName() == atomsb[i].getName());
+        assert(atomsa[i].getType() == atomsb[i].getType());
+        assert(atomsa[i].getElement() == atomsb[i].getElement());
+        assert(atomsa[i].getMass() == atomsb[i].getMass());
+        assert(atomsa[i].getCharge() == atomsb[i].getCharge());
+        assert(atomsa[i].getLJRadius() == atomsb[i].getLJRadius());
+        assert(atomsa[i].getLJEpsilon() == atomsb[i].getLJEpsilon());
+        assert(atomsa[i].getGBRadius() == atomsb[i].getGBRadius());
+        assert(atomsa[i].getGBScreen() == atomsb[i].getGBScreen());
+    }
+    Amber::BondTable const& bondsa = a.getBonds();
+    Amber::BondTable const& bondsb = b.getBonds();
+    assert(bondsa.numTypes() == bondsb.numTypes());
+    assert(bondsa.size() == bondsb.size());
+    for (size_t i = 0; i < bondsa.size(); i++) {
+        assert(bondsa[i].getAtomI() == bondsb[i].getAtomI());
+        assert(bondsa[i].getAtomJ() == bondsb[i].getAtomJ());
+        assert(bondsa[i].getForceConstant() == bondsb[i].getForceConstant());
+        assert(bondsa[i].getEquilibriumDistance() ==
+               bondsb[i].getEquilibriumDistance());
+    }
+    Amber::AngleTable const& anglesa = a.getAngles();
+    Amber::AngleTable const& anglesb = b.getAngles();
+    assert(anglesa.numTypes() == anglesb.numTypes());
+    assert(anglesa.size() == anglesb.size());
+    for (size_t i = 0; i < anglesa.size(); i++) {
+        assert(anglesa[i].getAtomI() == anglesb[i].getAtomI());
+        assert(anglesa[i].getAtomJ() == anglesb[i].getAtomJ());
+        assert(anglesa[i].getAtomK() == anglesb[i].getAtomK());
+        assert(anglesa[i].getForceConstant() == anglesb[i].getForceConstant());
+        assert(anglesa[i].getEquilibriumAngle() ==
+               anglesb[i].getEquilibriumAngle());
+    }
+    Amber::DihedralTable const& dihedralsa = a.getDihedrals();
+    Amber::DihedralTable const& dihedralsb = b.getDihedrals();
+    assert(dihedralsa.numTypes() == dihedralsb.numTypes());
+    assert(dihedralsa.size() == dihedralsb.size());
+    for (size_t i = 0; i < dihedralsa.size(); i++) {
+        assert(dihedralsa[i].getAtomI() == dihedralsb[i].getAtomI());
+        assert(dihedralsa[i].getAtomJ() == dihedralsb[i].getAtomJ());
+        assert(dihedralsa[i].getAtomK() == dihedralsb[i].getAtomK());
+        assert(dihedralsa[i].getAtomL() == dihedralsb[i].getAtomL());
+        assert(dihedralsa[i].getForceConstant() ==
+               dihedralsb[i].getForceConstant());
+        assert(dihedralsa[i].getPhase() == dihedralsb[i].getPhase());
+        assert(dihedralsa[i].getPeriodicity() ==
+               dihedralsb[i].getPeriodicity());
+        assert(dihedralsa[i].getScee() == dihedralsb[i].getScee());
+        assert(dihedralsa[i].getScnb() == dihedralsb[i].getScnb());
+        assert(dihedralsa[i].ignoreEndGroups() ==
+               dihedralsb[i].ignoreEndGroups());
+    }
+    assert(a.getResiduePointers().toVector() ==
+           b.getResiduePointers().toVector());
+    assert(a.getResidueLabels().toVector() == b.getResidueLabels().toVector());
+    assert(a.getBondGraph().neighborList() == b.getBondGraph().neighborList());
+    assert(a.getBondGraph().moleculeIds() == b.getBondGraph().moleculeIds());
+    for (int i = 0; i < atomsa.size(); i++)
+        for (int j = i; j < atomsa.size(); j++)
+            assert(a.isExcluded(i, j) == b.isExcluded(i, j));
+}
+
+/// Overwrites the int32 at index of the first run of pattern in a file
+void patch_ints(string const& fname, vector<int32_t> const& pattern,
+                size_t index, int32_t value) {
+    ifstream in(fname.c_str(), ios::binary);
+    stringstream contents;
+    contents << in.rdbuf();
+    in.close();
+    string bytes = contents.str();
+    string needle((const char*) &pattern[0], pattern.size() * sizeof(int32_t));
+    size_t pos = bytes.find(needle);
+    assert(pos != string::npos);
+    memcpy(&bytes[pos + index * sizeof(int32_t)], &value, sizeof(int32_t));
+    ofstream out(fname.c_str(), ios::binary);
+    out << bytes;
+}
+
+/// A cache whose atom indexes were damaged must be ignored, not read
+void check_damaged_cache(string const& fname, string const& cname,
+                         Amber::AmberParm const& parsed) {
+    int32_t natom = parsed.getNumAtoms();
+    Amber::BondTerm const& b = parsed.getBonds().term(0);
+    vector<int> resptr = parsed.getResiduePointers().toVector();
+    vector<int32_t> bond, dihedral, residues, exclusions;
+    bond.push_back(b.i);
+    bond.push_back(b.j);
+    bond.push_back(b.type);
+    if (parsed.getDihedrals().size() > 0) {
+        Amber::DihedralTerm const& d = parsed.getDihedrals().term(0);
+        dihedral.push_back(d.i);
+        dihedral.push_back(d.j);
+        dihedral.push_back(d.k);
+        dihedral.push_back(d.l);
+        dihedral.push_back(d.type);
+    }
+    residues.assign(resptr.begin(), resptr.end());
+    for (int i = 0; exclusions.size() < 8 && i < natom; i++) {
+        Amber::Span<int> excluded = parsed.getExclusions().excluded(i);
+        exclusions.insert(exclusions.end(), excluded.begin(), excluded.end());
+    }
+
+    for (int n = 0; n < 6; n++) {
+        // Loading with the cache rewrites it whenever it was rejected
+        Amber::AmberParm fresh(fname, true);
+        switch (n) {
+            case 0: patch_ints(cname, bond, 1, natom); break;
+            case 1: if (!dihedral.empty())
+                        patch_ints(cname, dihedral, 3, -1);
+                    break;
+            case 2: patch_ints(cname, residues, 0, 1); break;
+            case 3: patch_ints(cname, residues, 1, resptr[2] + 1); break;
+            case 4: patch_ints(cname, residues, resptr.size()-1, natom+1);
+                    break;
+            case 5: patch_ints(cname, exclusions, 0, natom); break;
+        }
+        Amber::AmberParm reloaded(fname, true);
+        assert_same_parm(parsed, reloaded);
+    }
+}
+
+/// Reading another topology into the same instance replaces all of it
+void check_rdparm_reload(void) {
+    Amber::AmberParm parm;
+    parm.rdparm("files/4096wat.parm7");
+    parm.rdparm("files/trx.prmtop");
+    parm.rdparm("files/trx.prmtop");
+    Amber::AmberParm trx("files/trx.prmtop");
+    assert_same_parm(parm, trx);
+    assert(parm.getResidueOf(parm.getNumAtoms() - 1) ==
+           parm.getNumResidues() - 1);
+}
+
+void check_rdparm_cache(const char* source) {
+    const char* fname = "files/tmpcache.parm7";
+    string cname = Amber::AmberParm::cacheFileName(fname);
+    copy_file(source, fname);
+    remove(cname.c_str());
+
+    Amber::AmberParm parsed(fname);
+    assert(!file_exists(cname));
+
+    // The first load writes the cache, the second one reads it
+    Amber::AmberParm cold(fname, true);
+    assert(file_exists(cname));
+    assert_same_parm(parsed, cold);
+    Amber::AmberParm warm(fname, true);
+    assert_same_parm(parsed, warm);
+    check_damaged_cache(fname, cname, parsed);
+
+    // The cache is as readable as the prmtop
+    struct stat source_stat, cache_stat;
+    assert(stat(fname, &source_stat) == 0);
+    assert(stat(cname.c_str(), &cache_stat) == 0);
+    assert((source_stat.st_mode & 0666) == (cache_stat.st_mode & 0666));
+
+    // Threads writing the cache at once each use their own temporary file
+    remove(cname.c_str());
+#ifdef _OPENMP
+#   pragma omp parallel for schedule(static, 1)
+#endif
+    for (int n = 0; n < 8; n++) {
+        Amber::AmberParm concurrent(fname, true);
+        assert_same_parm(parsed, concurrent);
+    }
+    assert(file_exists(cname));
+    glob_t leftovers;
+    assert(glob((cname + ".tmp*").c_str(), 0, NULL, &leftovers) ==
+           GLOB_NOMATCH);
+    globfree(&leftovers);
+    Amber::AmberParm shared(fname, true);
+    assert_same_parm(parsed, shared);
+
+    // Changing the prmtop must invalidate the cache
+    ifstream in(fname);
+    stringstream contents;
+    contents << in.rdbuf();
+    in.close();
+    string text = contents.str();
+    // Skip the %FLAG and %FORMAT lines and overwrite the first atom's mass
+    size_t pos = text.find("%FLAG MASS");
+    pos = text.find('\n', text.find('\n', pos) + 1) + 1;
+    text.replace(pos, 16, "  2.00000000E+01");
+    ofstream out(fname);
+    out << text;
+    out.close();
+
+    Amber::AmberParm changed(fname, true);
+    assert(changed.getAtomTable()[0].getMass() == 20.0);
+    Amber::AmberParm changed_parsed(fname);
+    assert_same_parm(changed, changed_parsed);
+
+    remove(fname);
+    remove(cname.c_str());
+}
+
+bool is_even(int i) {return i % 2 == 0;}
+
+void check_subset(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+
+    // Keeping everything changes nothing
+    assert_same_parm(parm, parm.subset("*"));
+
+    // Stripping hydrogens leaves the heavy atoms, with the bonded terms and
+    // exclusions among them renumbered
+    Amber::AtomSelection keep = Amber::AtomMask(parm, "!@H=").evaluate();
+    Amber::AmberParm heavy = parm.strip("@H=");
+    vector<int> kept = keep.indices();
+    assert(heavy.getNumAtoms() == (int) kept.size());
+    assert(heavy.getNumResidues() == parm.getNumResidues());
+    assert(heavy.getResiduePointers().back() == heavy.getNumAtoms());
+    for (size_t n = 0; n < kept.size(); n++) {
+        assert(heavy.getAtomTable()[n].getName() ==
+               parm.getAtomTable()[kept[n]].getName());
+        assert(heavy.getAtomTable()[n].getCharge() ==
+               parm.getAtomTable()[kept[n]].getCharge());
+        assert(heavy.getResidueOf(n) == parm.getResidueOf(kept[n]));
+    }
+    size_t nbond = 0;
+    for (size_t n = 0; n < parm.getBonds().size(); n++) {
+        Amber::BondTerm const& b = parm.getBonds().term(n);
+        if (keep.contains(b.i) && keep.contains(b.j)) nbond++;
+    }
+    assert(heavy.getBonds().size() == nbond);
+    assert(heavy.getBonds().numTypes() == parm.getBonds().numTypes());
+    for (size_t n = 0; n < heavy.getBonds().size(); n++) {
+        Amber::Bond b = heavy.getBonds()[n];
+        assert(heavy.getAtomTable()[b.getAtomI()].getElement() != 1);
+        assert(heavy.getAtomTable()[b.getAtomJ()].getElement() != 1);
+    }
+    for (size_t n = 0; n < heavy.getDihedrals().size(); n++) {
+        Amber::Dihedral d = heavy.getDihedrals()[n];
+        assert(d.getAtomL() < heavy.getNumAtoms());
+    }
+    for (size_t a = 0; a < kept.size(); a += 7)
+        for (size_t b = a + 1; b < kept.size(); b++)
+            assert(heavy.isExcluded(a, b) == parm.isExcluded(kept[a], kept[b]));
+    assert(heavy.getNumMolecules() == 1);
+
+    // Residues left empty are dropped
+    Amber::AmberParm some = parm.subset(":3,5-6");
+    assert(some.getNumResidues() == 3);
+    assert(some.getResidue(0).getName() == parm.getResidue(2).getName());
+    assert(some.getResidue(1).getFirstAtom() == parm.getResidue(2).size());
+    assert(some.getNumAtoms() == parm.getResidue(2).size() +
+           parm.getResidue(4).size() + parm.getResidue(5).size());
+    assert(some.getNumMolecules() == 2);
+
+    Amber::AmberParm even = parm.subsetIf(is_even);
+    assert(even.getNumAtoms() == (parm.getNumAtoms() + 1) / 2);
+    nbond = 0;
+    for (size_t n = 0; n < parm.getBonds().size(); n++)
+        if (parm.getBonds().term(n).i % 2 == 0 &&
+                parm.getBonds().term(n).j % 2 == 0)
+            nbond++;
+    assert(even.getBonds().size() == nbond);
+    assert(even.getAtomTable()[1].getName() == parm.getAtomTable()[2].getName());
+
+    // Stripping the solvent of a water box leaves nothing
+    Amber::AmberParm water("files/4096wat.parm7");
+    Amber::AmberParm dry = water.strip(":WAT");
+    assert(dry.getNumAtoms() == 0 && dry.getNumResidues() == 0);
+    assert(dry.isPeriodic());
+    Amber::AmberParm ten = water.subset(":1-10");
+    assert(ten.getNumAtoms() == 30 && ten.getBonds().size() == 30);
+    assert(ten.getNumMolecules() == 10);
+    for (int i = 0; i < 30; i++)
+        for (int j = 0; j < 30; j++)
+            assert(ten.isExcluded(i, j) == water.isExcluded(i, j));
+
+    bool caught = false;
+    try {
+        parm.subset(Amber::AtomSelection(10, true));
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void check_compressed_rdparm(void) {
+    if (!Amber::canDecompress(Amber::GZIP_COMPRESSION)) return;
+    Amber::AmberParm plain("files/trx.prmtop");
+    Amber::AmberParm compressed("files/trx.prmtop.gz");
+    assert_same_parm(plain, compressed);
+}
+
+void check_tile(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    int natom = parm.getNumAtoms();
+
+    // A single copy changes nothing
+    assert_same_parm(parm, parm.tile(1, 1, 1));
+
+    Amber::AmberParm two = parm.tile(2);
+    assert(two.getNumAtoms() == 2 * natom);
+    assert(two.getNumResidues() == 2 * parm.getNumResidues());
+    assert(two.getResiduePointers().back() == 2 * natom);
+    assert(two.getBonds().size() == 2 * parm.getBonds().size());
+    assert(two.getAngles().size() == 2 * parm.getAngles().size());
+    assert(two.getDihedrals().size() == 2 * parm.getDihedrals().size());
+    assert(two.getBonds().numTypes() == parm.getBonds().numTypes());
+    assert(two.getNumMolecules() == 2);
+    assert((int) two.getMolecule(1).size() == natom);
+
+    int nres = parm.getNumResidues();
+    for (int r = 0; r < nres; r++) {
+        assert(two.getResidue(nres + r).getName() ==
+               parm.getResidue(r).getName());
+        assert(two.getResidue(nres + r).getFirstAtom() ==
+               parm.getResidue(r).getFirstAtom() + natom);
+    }
+    for (int i = 0; i < natom; i++) {
+        assert(two.getAtomTable()[natom + i].getName() ==
+               parm.getAtomTable()[i].getName());
+        assert(two.getAtomTable()[natom + i].getCharge() ==
+               parm.getAtomTable()[i].getCharge());
+    }
+    size_t nbond = parm.getBonds().size();
+    for (size_t n = 0; n < nbond; n++) {
+        Amber::Bond b = two.getBonds()[nbond + n];
+        Amber::Bond orig = parm.getBonds()[n];
+        assert(b.getAtomI() == orig.getAtomI() + natom);
+        assert(b.getAtomJ() == orig.getAtomJ() + natom);
+        assert(b.getForceConstant() == orig.getForceConstant());
+    }
+    size_t ndihed = parm.getDihedrals().size();
+    for (size_t n = 0; n < ndihed; n++)
+        assert(two.getDihedrals()[ndihed + n].getAtomL() ==
+               parm.getDihedrals()[n].getAtomL() + natom);
+    for (int i = 0; i < natom; i += 5)
+        for (int j = 0; j < natom; j++) {
+            assert(two.isExcluded(natom + i, natom + j) == parm.isExcluded(i, j));
+            assert(!two.isExcluded(i, natom + j));
+        }
+    assert(!two.isPeriodic());
+
+    // Periodic systems get a box of the stacked cells
+    Amber::AmberParm water("files/4096wat.parm7");
+    Amber::AmberParm block = water.tile(2, 1, 3);
+    assert(block.getNumAtoms() == 6 * water.getNumAtoms());
+    assert(block.getNumMolecules() == 6 * water.getNumMolecules());
+    assert(block.isPeriodic());
+    Amber::UnitCell cell = water.getUnitCell(), big = block.getUnitCell();
+    assert(fabs(big.getLengthA() - 2 * cell.getLengthA()) < 1e-10);
+    assert(fabs(big.getLengthB() - cell.getLengthB()) < 1e-10);
+    assert(fabs(big.getLengthC() - 3 * cell.getLengthC()) < 1e-10);
+    assert(fabs(big.getAlpha() - cell.getAlpha()) < 1e-8);
+    assert(block.getResidue(block.getNumResidues() - 1).getEndAtom() ==
+           block.getNumAtoms());
+
+    bool caught = false;
+    try {
+        parm.tile(2, 0, 1);
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+    caught = false;
+    try {
+        water.tile(1000, 1000, 1000);
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void check_repartitioned_masses(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    vector<double> const& orig = parm.getAtomTable().masses();
+    vector<int> const& elements = parm.getAtomTable().elements();
+
+    assert(parm.getRepartitionedMasses(0.0) == orig);
+
+    vector<double> masses = parm.getRepartitionedMasses(3.024);
+    assert(masses.size() == orig.size());
+    double total = 0, origTotal = 0;
+    for (size_t i = 0; i < masses.size(); i++) {
+        total += masses[i];
+        origTotal += orig[i];
+        if (elements[i] == 1) {
+            assert(masses[i] == 3.024);
+        } else {
+            // Heavy atoms lose what their hydrogens gained
+            double lost = 0;
+            Amber::Span<int> bonded = parm.getNeighbors(i);
+            for (size_t n = 0; n < bonded.size(); n++)
+                if (elements[bonded[n]] == 1)
+                    lost += 3.024 - orig[bonded[n]];
+            assert(fabs(masses[i] - (orig[i] - lost)) < 1e-10);
+        }
+    }
+    assert(fabs(total - origTotal) < 1e-8);
+
+    // Water is left alone
+    Amber::AmberParm water("files/4096wat.parm7");
+    assert(water.getRepartitionedMasses(3.024) ==
+           water.getAtomTable().masses());
+
+    // So are 4- and 5-site waters, whose extra points are bonded to the O,
+    // while a C-H next to them is still repartitioned
+    Amber::AmberParm sites;
+    for (int nsite = 4; nsite <= 5; nsite++) {
+        int o = sites.getNumAtoms();
+        sites.addAtom("O", "OW", 8, 16.0, 0.0, 1.8, 0.16, 1.5, 0.85);
+        sites.addAtom("H1", "HW", 1, 1.008, 0.52, 0.0, 0.0, 0.8, 0.85);
+        sites.addAtom("H2", "HW", 1, 1.008, 0.52, 0.0, 0.0, 0.8, 0.85);
+        for (int ep = 3; ep < nsite; ep++) {
+            sites.addAtom("EPW", "EP", 0, 0.0, -1.04 / (nsite - 3), 0.0, 0.0,
+                          0.0, 0.0);
+            sites.addBond(o, o + ep, 553.0, 0.125);
+        }
+        sites.addBond(o, o + 1, 553.0, 0.9572);
+        sites.addBond(o, o + 2, 553.0, 0.9572);
+        sites.addBond(o + 1, o + 2, 553.0, 1.5139);
+    }
+    int c = sites.getNumAtoms();
+    sites.addAtom("C", "CT", 6, 12.01, 0.0, 1.9, 0.1, 1.7, 0.72);
+    sites.addAtom("H", "HC", 1, 1.008, 0.0, 1.5, 0.02, 1.3, 0.85);
+    sites.addBond(c, c + 1, 340.0, 1.09);
+    masses = sites.getRepartitionedMasses(3.024);
+    for (int i = 0; i < c; i++)
+        assert(masses[i] == sites.getAtomTable()[i].getMass());
+    assert(masses[c+1] == 3.024);
+    assert(fabs(masses[c] - (12.01 - (3.024 - 1.008))) < 1e-10);
+
+    bool caught = false;
+    try {
+        parm.getRepartitionedMasses(-1.0);
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+    // A methyl carbon cannot give three hydrogens 6 daltons each
+    caught = false;
+    try {
+        parm.getRepartitionedMasses(6.0);
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+void check_water_residues(void) {
+    Amber::AmberParm water("files/4096wat.parm7");
+    vector<int> waters = water.getWaterResidues();
+    assert((int) waters.size() == water.getNumResidues());
+    for (size_t n = 0; n < waters.size(); n++)
+        assert(waters[n] == (int) n);
+
+    Amber::AmberParm parm("files/trx.prmtop");
+    assert(parm.getWaterResidues().empty());
+
+    // A residue named WAT that is missing a hydrogen is not water
+    Amber::AmberParm broken = water.strip("@2");
+    waters = broken.getWaterResidues();
+    assert(waters.size() == 4095 && waters[0] == 1);
 }
 
 int main() {
@@ -313,6 +946,14 @@ int main() {
     check_add_bonds();
     cout << " OK." << endl;
 
+    cout << "Checking bond parameter types in AmberParm...";
+    check_bond_types();
+    cout << " OK." << endl;
+
+    cout << "Checking the bond graph and molecules of AmberParm...";
+    check_bond_graph();
+    cout << " OK." << endl;
+
     cout << "Checking error catching in adding bonds to AmberParm...";
     check_bad_add_bonds();
     cout << " OK." << endl;
@@ -341,5 +982,37 @@ int main() {
     check_rdparm_box();
     cout << " OK." << endl;
 
+    cout << "Checking reading a topology into a used instance...";
+    check_rdparm_reload();
+    cout << " OK." << endl;
+
+    cout << "Checking Amber topology file caching...";
+    check_rdparm_cache("files/trx.prmtop");
+    cout << " OK." << endl;
+
+    cout << "Checking Amber topology file caching with box...";
+    check_rdparm_cache("files/4096wat.parm7");
+    cout << " OK." << endl;
+
+    cout << "Checking topology subsetting and stripping...";
+    check_subset();
+    cout << " OK." << endl;
+
+    cout << "Checking topology tiling...";
+    check_tile();
+    cout << " OK." << endl;
+
+    cout << "Checking hydrogen mass repartitioning...";
+    check_repartitioned_masses();
+    cout << " OK." << endl;
+
+    cout << "Checking water detection...";
+    check_water_residues();
+    cout << " OK." << endl;
+
+    cout << "Checking compressed Amber topology file reading...";
+    check_compressed_rdparm();
+    cout << " OK." << endl;
+
     return 0;
 }
@@ -0,0 +1,237 @@
+/// Tests compiling and evaluating Amber masks
+
+#include <cassert>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+/// The selection of every atom for which keep(parm, i) is true
+template <class Pred>
+AtomSelection brute_force(AmberParm const& parm, Pred keep) {
+    AtomSelection sel(parm.getNumAtoms());
+    for (int i = 0; i < parm.getNumAtoms(); i++)
+        if (keep(parm, i)) sel.set(i);
+    return sel;
+}
+
+bool has_name(AmberParm const& parm, int i, string const& name) {
+    return parm.getAtomTable()[i].getName() == name;
+}
+
+bool is_ca(AmberParm const& parm, int i) {return has_name(parm, i, "CA");}
+
+bool is_hydrogen_name(AmberParm const& parm, int i) {
+    return parm.getAtomTable()[i].getName()[0] == 'H';
+}
+
+bool is_heavy_in_first_250(AmberParm const& parm, int i) {
+    return parm.getResidueOf(i) < 250 && !is_hydrogen_name(parm, i);
+}
+
+bool is_ct(AmberParm const& parm, int i) {
+    return parm.getAtomTable()[i].getType() == "CT";
+}
+
+bool is_ca_in_first_10(AmberParm const& parm, int i) {
+    return parm.getResidueOf(i) < 10 && is_ca(parm, i);
+}
+
+bool is_lys_n(AmberParm const& parm, int i) {
+    string const& res = parm.getResidue(parm.getResidueOf(i)).getName();
+    return res.size() == 3 && res.substr(0, 2) == "LY" &&
+           has_name(parm, i, "N");
+}
+
+void check_selection(void) {
+    AtomSelection sel(130);
+    assert(sel.numAtoms() == 130 && sel.none() && sel.count() == 0);
+    sel.setRange(60, 129);
+    assert(sel.count() == 69 && !sel.contains(59) && sel.contains(60));
+    assert(sel.contains(128) && !sel.contains(129));
+    sel.set(3);
+    sel.reset(64);
+    vector<int> atoms = sel.indices();
+    assert(atoms.size() == 69 && atoms[0] == 3 && atoms[1] == 60);
+    assert(atoms[5] == 65 && atoms.back() == 128);
+
+    // Inverting leaves the bits past the last atom alone
+    sel.invert();
+    assert(sel.count() == 130 - 69);
+    assert(sel.words().back() >> 2 == 0);
+
+    AtomSelection all(130, true);
+    assert(all.count() == 130);
+    all &= sel;
+    assert(all == sel);
+    all |= AtomSelection(130, true);
+    assert(all == AtomSelection(130, true) && all != sel);
+}
+
+void check_static_masks(void) {
+    AmberParm parm("files/trx.prmtop");
+    int natom = parm.getNumAtoms();
+
+    AtomSelection sel = AtomMask(parm, ":1-10").evaluate();
+    AtomSelection expected(natom);
+    expected.setRange(0, parm.getResidue(9).getEndAtom());
+    assert(sel == expected);
+
+    assert(AtomMask(parm, "@CA").evaluate() == brute_force(parm, is_ca));
+    assert(AtomMask(parm, "@CA").evaluate().count() == parm.getNumResidues());
+    assert(AtomMask(parm, "@H=").evaluate() ==
+           brute_force(parm, is_hydrogen_name));
+    assert(AtomMask(parm, "@H*").evaluate() ==
+           brute_force(parm, is_hydrogen_name));
+    assert(AtomMask(parm, ":1-250&!@H=").evaluate() ==
+           brute_force(parm, is_heavy_in_first_250));
+    assert(AtomMask(parm, "@%CT").evaluate() == brute_force(parm, is_ct));
+    assert(AtomMask(parm, ":1-10@CA").evaluate() ==
+           brute_force(parm, is_ca_in_first_10));
+    assert(AtomMask(parm, "  :1-10 & @CA ").evaluate() ==
+           brute_force(parm, is_ca_in_first_10));
+    assert(AtomMask(parm, ":LY?@N").evaluate() == brute_force(parm, is_lys_n));
+
+    sel = AtomMask(parm, "@1-5,10").evaluate();
+    assert(sel.count() == 6 && sel.contains(4) && sel.contains(9));
+    assert(!sel.contains(5));
+
+    assert(AtomMask(parm, "*").evaluate().count() == natom);
+    assert(AtomMask(parm, "!*").evaluate().none());
+    assert(AtomMask(parm, "^1").evaluate().count() == natom);
+    assert(AtomMask(parm, ":1|:2").evaluate() ==
+           AtomMask(parm, ":1,2").evaluate());
+    assert(AtomMask(parm, "!(:1|@CA)").evaluate() ==
+           AtomMask(parm, "!:1&!@CA").evaluate());
+    // ! binds tighter than &, and & tighter than |
+    assert(AtomMask(parm, ":1|:2&@CA").evaluate() ==
+           AtomMask(parm, ":1|(:2&@CA)").evaluate());
+    assert(AtomMask(parm, ":9999").evaluate().none());
+    assert(!AtomMask(parm, ":1").needsPositions());
+}
+
+void check_bad_masks(void) {
+    AmberParm parm("files/trx.prmtop");
+    const char* bad[] = {"", "  ", ":", "@CA &", "(:1", ":1)", ":1<:",
+                         ":1<:x", ":1<5", "^CA", "CA", ":1,,2", "@CA @CB"};
+    for (size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+        bool caught = false;
+        try {
+            AtomMask mask(parm, bad[n]);
+        } catch (AmberMaskError &e) {
+            caught = true;
+        }
+        assert(caught);
+    }
+
+    // Distance masks cannot be evaluated without positions
+    AtomMask mask(parm, ":1<:5");
+    assert(mask.needsPositions());
+    bool caught = false;
+    try {
+        mask.evaluate();
+    } catch (AmberMaskError &e) {
+        caught = true;
+    }
+    assert(caught);
+    caught = false;
+    try {
+        mask.evaluate(vector<OpenMM::Vec3>(10));
+    } catch (AmberMaskError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+/// Atoms within cutoff of any atom of the reference, by checking every pair
+AtomSelection brute_within(vector<OpenMM::Vec3> const& pos,
+                           AtomSelection const& reference, double cutoff) {
+    vector<int> refs = reference.indices();
+    AtomSelection sel((int) pos.size());
+    for (size_t i = 0; i < pos.size(); i++)
+        for (size_t n = 0; n < refs.size(); n++) {
+            OpenMM::Vec3 d = pos[i] - pos[refs[n]];
+            if (d.dot(d) <= cutoff * cutoff) {
+                sel.set((int) i);
+                break;
+            }
+        }
+    return sel;
+}
+
+/// Extends a selection to the whole residues it touches
+AtomSelection whole_residues(AmberParm const& parm, AtomSelection const& sel) {
+    AtomSelection result(parm.getNumAtoms());
+    for (int r = 0; r < parm.getNumResidues(); r++) {
+        ResidueRef res = parm.getResidue(r);
+        for (int i = res.getFirstAtom(); i < res.getEndAtom(); i++)
+            if (sel.contains(i)) {
+                result.setRange(res.getFirstAtom(), res.getEndAtom());
+                break;
+            }
+    }
+    return result;
+}
+
+void check_distance_masks(const char* prmtop, const char* coords,
+                          const char* reference) {
+    AmberParm parm(prmtop);
+    AmberCoordinateFrame frame;
+    frame.readRst7(coords);
+    vector<OpenMM::Vec3> pos = frame.getPositions();
+    AtomSelection ref = AtomMask(parm, reference).evaluate();
+
+    double cutoffs[] = {0.0, 2.5, 5.0, 12.0};
+    for (int n = 0; n < 4; n++) {
+        double cutoff = cutoffs[n];
+        ostringstream atoms, residues, outside;
+        atoms << "(" << reference << ")<@" << cutoff;
+        residues << reference << "<:" << cutoff;
+        outside << reference << " >: " << cutoff;
+
+        AtomSelection near = brute_within(pos, ref, cutoff);
+        assert(AtomMask(parm, atoms.str()).evaluate(pos) == near);
+        AtomSelection nearRes = whole_residues(parm, near);
+        assert(AtomMask(parm, residues.str()).evaluate(pos) == nearRes);
+        nearRes.invert();
+        assert(AtomMask(parm, outside.str()).evaluate(pos) == nearRes);
+    }
+
+    // The same compiled mask follows the atoms from frame to frame
+    AtomMask mask(parm, string(reference) + "<@4.0&!" + reference);
+    AtomSelection before, after;
+    mask.evaluate(pos, before);
+    vector<int> refs = ref.indices();
+    for (size_t n = 0; n < refs.size(); n++)
+        pos[refs[n]] += OpenMM::Vec3(100.0, 0.0, 0.0);
+    mask.evaluate(pos, after);
+    assert(!before.none() && after.none());
+}
+
+int main() {
+
+    cout << "Checking atom selections...";
+    check_selection();
+    cout << " OK." << endl;
+
+    cout << "Checking masks that depend on the topology alone...";
+    check_static_masks();
+    cout << " OK." << endl;
+
+    cout << "Checking error catching in masks...";
+    check_bad_masks();
+    cout << " OK." << endl;
+
+    cout << "Checking distance masks...";
+    check_distance_masks("files/trx.prmtop", "files/trx.inpcrd", ":10");
+    check_distance_masks("files/4096wat.parm7", "files/4096wat.rst7",
+                         ":1,2000");
+    cout << " OK." << endl;
+
+    return 0;
+}
@@ -90,6 +90,26 @@ void check_inpcrd_crdvelbox_parsing(void) {
     assert(abs(frame.getBoxGamma() - 109.4712190) < 1e-5);
 }
 
+void check_compressed_inpcrd_parsing(void) {
+
+    if (!Amber::canDecompress(Amber::BZIP2_COMPRESSION)) return;
+
+    Amber::AmberCoordinateFrame plain, compressed;
+
+    plain.readRst7("files/crds_vels_box.rst7");
+    compressed.readRst7("files/crds_vels_box.rst7.bz2");
+
+    assert(compressed.getNatom() == plain.getNatom());
+    for (int i = 0; i < plain.getNatom(); i++) {
+        for (int j = 0; j < 3; j++) {
+            assert(compressed.getPositions()[i][j] == plain.getPositions()[i][j]);
+            assert(compressed.getVelocities()[i][j] == plain.getVelocities()[i][j]);
+        }
+    }
+    assert(compressed.getBoxA() == plain.getBoxA());
+    assert(compressed.getBoxGamma() == plain.getBoxGamma());
+}
+
 void check_inpcrd_crd_writing(void) {
     Amber::AmberCoordinateFrame frame;
 
@@ -253,6 +273,112 @@ void check_inpcrd_crdvelbox_writing(void) {
     }
 }
 
+void check_frame_subset(void) {
+
+    Amber::AmberCoordinateFrame frame, sub;
+
+    frame.readRst7("files/crds_vels_box.rst7");
+
+    Amber::AtomSelection keep(2101);
+    keep.setRange(100, 200);
+    keep.set(2100);
+    frame.subset(keep, sub);
+
+    assert(sub.getNatom() == 101);
+    assert(sub.getPositions().size() == 101);
+    assert(sub.getVelocities().size() == 101);
+    assert(sub.getPositions()[0] == frame.getPositions()[100]);
+    assert(sub.getPositions()[99] == frame.getPositions()[199]);
+    assert(sub.getVelocities()[100] == frame.getVelocities()[2100]);
+    assert(sub.getBoxA() == frame.getBoxA());
+    assert(sub.getBoxGamma() == frame.getBoxGamma());
+
+    // Subsetting a frame in place
+    Amber::AtomSelection first(101);
+    first.set(0);
+    sub.subset(first, sub);
+    assert(sub.getNatom() == 1);
+    assert(sub.getPositions()[0] == frame.getPositions()[100]);
+
+    // Frames without velocities stay that way
+    Amber::AmberCoordinateFrame crdonly;
+    crdonly.readRst7("files/crdsonly.rst7");
+    crdonly.subset(Amber::AtomSelection(28, true), sub);
+    assert(sub.getNatom() == 28 && sub.getVelocities().empty());
+
+    bool caught = false;
+    try {
+        frame.subset(Amber::AtomSelection(28), sub);
+    } catch (Amber::AmberCrdError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+bool close(OpenMM::Vec3 const& a, OpenMM::Vec3 const& b) {
+    OpenMM::Vec3 d = a - b;
+    return d.dot(d) < 1e-16;
+}
+
+void check_frame_tile(void) {
+
+    Amber::AmberCoordinateFrame frame, tiled;
+
+    frame.readRst7("files/crds_vels_box.rst7");
+    frame.tile(2, 1, 3, tiled);
+
+    assert(tiled.getNatom() == 2101 * 6);
+    assert(tiled.getPositions().size() == 2101 * 6);
+    assert(tiled.getVelocities().size() == 2101 * 6);
+    assert(tiled.getBoxA() == frame.getBoxA() * 2);
+    assert(tiled.getBoxB() == frame.getBoxB());
+    assert(tiled.getBoxC() == frame.getBoxC() * 3);
+    assert(tiled.getBoxAlpha() == frame.getBoxAlpha());
+
+    // Copy (i, j, k) is copy (i*nb + j)*nc + k, shifted by i a + k c
+    Amber::UnitCell cell(frame.getBoxA(), frame.getBoxB(), frame.getBoxC(),
+                         frame.getBoxAlpha(), frame.getBoxBeta(),
+                         frame.getBoxGamma());
+    OpenMM::Vec3 avec = cell.getVectorA(), cvec = cell.getVectorC();
+    for (int copy = 0; copy < 6; copy++) {
+        OpenMM::Vec3 shift = avec * (copy / 3) + cvec * (copy % 3);
+        for (int n = 0; n < 2101; n += 100) {
+            assert(close(tiled.getPositions()[copy * 2101 + n],
+                         frame.getPositions()[n] + shift));
+            assert(tiled.getVelocities()[copy * 2101 + n] ==
+                   frame.getVelocities()[n]);
+        }
+    }
+
+    // Tiling in place
+    tiled.tile(1, 2, 1, tiled);
+    assert(tiled.getNatom() == 2101 * 12);
+    assert(tiled.getBoxB() == frame.getBoxB() * 2);
+
+    // Frames without a box need a lattice spacing
+    Amber::AmberCoordinateFrame crdonly;
+    crdonly.readRst7("files/crdsonly.rst7");
+    bool caught = false;
+    try {
+        crdonly.tile(2, 2, 2, tiled);
+    } catch (Amber::AmberCrdError &e) {
+        caught = true;
+    }
+    assert(caught);
+    crdonly.tile(1, 2, 2, OpenMM::Vec3(10, 20, 30), tiled);
+    assert(tiled.getNatom() == 28 * 4 && tiled.getVelocities().empty());
+    assert(close(tiled.getPositions()[3 * 28 + 5],
+                 crdonly.getPositions()[5] + OpenMM::Vec3(0, 20, 30)));
+
+    caught = false;
+    try {
+        frame.tile(0, 1, 1, tiled);
+    } catch (Amber::AmberCrdError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
 int main() {
 
     cout << "Testing amber inpcrd file reading with just coordinates...";
@@ -271,6 +397,10 @@ int main() {
     check_inpcrd_crdvelbox_parsing();
     cout << " OK." << endl;
 
+    cout << "Testing compressed amber inpcrd file reading...";
+    check_compressed_inpcrd_parsing();
+    cout << " OK." << endl;
+
     cout << "Test writing amber inpcrd file with just coordinates...";
     check_inpcrd_crd_writing();
     cout << " OK." << endl;
@@ -282,4 +412,12 @@ int main() {
     cout << "Test writing amber inpcrd file with coordinates, velocities, and box...";
     check_inpcrd_crdvelbox_writing();
     cout << " OK." << endl;
+
+    cout << "Test subsetting coordinate frames...";
+    check_frame_subset();
+    cout << " OK." << endl;
+
+    cout << "Test tiling coordinate frames...";
+    check_frame_tile();
+    cout << " OK." << endl;
 }
@@ -0,0 +1,180 @@
+/// Tests reading titratable sites from cpin files
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+void check_trx_cpin(void) {
+    AmberParm parm("files/trx.prmtop");
+    TitratableSites sites(parm, "files/trx.cpin");
+    vector<double> const& charges = parm.getAtomTable().charges();
+
+    // Every lysine, tyrosine and protonated aspartate
+    assert(sites.size() == 13);
+    assert(sites.getIgb() == 5 && sites.getIntDiel() == 1.0);
+    assert(&sites.getParm() == &parm);
+    assert(sites.getResidue(0) == 2 && sites.getResidueName(0) == "LYS");
+    assert(sites.getResidue(2) == 25 && sites.getResidueName(2) == "ASH");
+    for (int i = 0; i < sites.size(); i++) {
+        ResidueRef res = parm.getResidue(sites.getResidue(i));
+        assert(res.getName() == sites.getResidueName(i));
+        assert(sites.getFirstAtom(i) == res.getFirstAtom());
+        assert(sites.getEndAtom(i) == res.getEndAtom());
+        assert(sites.getNumStates(i) == 2);
+        assert(sites.getInitialState(i) == 0);
+
+        // The initial state is the one in the topology
+        Span<double> initial = sites.getCharges(i, sites.getInitialState(i));
+        assert((int) initial.size() == sites.getNumAtoms(i));
+        for (int a = 0; a < sites.getNumAtoms(i); a++)
+            assert(fabs(initial[a] - charges[sites.getFirstAtom(i) + a]) < 1e-4);
+
+        // Losing a proton loses one unit of charge
+        double q0 = 0, q1 = 0;
+        for (int a = 0; a < sites.getNumAtoms(i); a++) {
+            q0 += sites.getCharges(i, 0)[a];
+            q1 += sites.getCharges(i, 1)[a];
+        }
+        assert(sites.getProtonCount(i, 0) - sites.getProtonCount(i, 1) == 1);
+        assert(fabs(q0 - q1 - 1.0) < 1e-3);
+
+        // Each site's states sit one after another in a single block
+        Span<double> table = sites.getChargeTable(i);
+        assert(table.size() == 2 * initial.size());
+        assert(table.begin() == sites.getCharges(i, 0).begin());
+        assert(sites.getCharges(i, 1).begin() == sites.getCharges(i, 0).end());
+    }
+    assert(sites.getStateEnergy(0, 1) == -15.2);
+    assert(sites.getStateEnergy(4, 1) == -65.1);
+
+    // Switching states copies one row of the table
+    vector<double> q(charges);
+    sites.applyState(4, 1, q);
+    for (int i = 0; i < parm.getNumAtoms(); i++) {
+        if (i < sites.getFirstAtom(4) || i >= sites.getEndAtom(4))
+            assert(q[i] == charges[i]);
+        else
+            assert(q[i] == sites.getCharges(4, 1)[i - sites.getFirstAtom(4)]);
+    }
+    sites.applyStates(sites.getInitialStates(), q);
+    for (int i = 0; i < parm.getNumAtoms(); i++)
+        assert(fabs(q[i] - charges[i]) < 1e-4);
+}
+
+void write_file(const char* fname, string const& text) {
+    ofstream out(fname);
+    out << text;
+}
+
+void check_namelist_syntax(void) {
+    AmberParm parm("files/trx.prmtop");
+    int natom = parm.getResidue(0).size();
+
+    // Lower case, repeated values, D exponents, comments and &END
+    char text[1000];
+    sprintf(text, "A comment line\n"
+            " &cnstph ! the titratable residues\n"
+            "  trescnt = 1, cph_igb = 2\n"
+            "  stateinf(0)%%first_atom = 1 stateinf(0)%%num_atoms = %d\n"
+            "  stateinf(0)%%first_state = 1, stateinf(0)%%num_states = 2,\n"
+            "  stateinf(0)%%first_charge = %d,\n"
+            "  chrgdat = %d*0.0, %d*1.0d-1,\n"
+            "  protcnt = 9, 1, 0, statene = 0.0 1.5D1 -2.0E0\n"
+            "  resname = 'System: test', 'Residue: MET 1',\n"
+            "  resstate = 1,\n"
+            " &end\n", natom, natom, natom, 2 * natom);
+    write_file("test.cpin", text);
+    TitratableSites sites(parm, "test.cpin");
+    assert(sites.size() == 1 && sites.getIgb() == 2);
+    assert(sites.getResidueName(0) == "MET" && sites.getResidue(0) == 0);
+    assert(sites.getInitialState(0) == 1);
+    assert(sites.getCharges(0, 0)[natom-1] == 0.1);
+    assert(sites.getCharges(0, 1)[0] == 0.1);
+    assert(sites.getProtonCount(0, 0) == 1 && sites.getProtonCount(0, 1) == 0);
+    assert(sites.getStateEnergy(0, 0) == 15.0);
+    assert(sites.getStateEnergy(0, 1) == -2.0);
+    remove("test.cpin");
+}
+
+void check_bad_cpin(void) {
+    AmberParm parm("files/trx.prmtop");
+    const char* bad[] = {
+        // No namelist, or an unterminated one
+        "&CNSTPHX trescnt=0 /\n",
+        "&CNSTPH trescnt=0\n",
+        // Missing or malformed variables
+        "&CNSTPH trescnt=1 /\n",
+        "&CNSTPH trescnt=x, chrgdat=0, protcnt=0, statene=0 /\n",
+        "&CNSTPH trescnt=1, chrgdat=0, protcnt=0, statene=0,\n"
+        " stateinf(0)%first_atom=1, stateinf(0)%num_atoms=1,\n"
+        " stateinf(0)%first_state=0, stateinf(0)%num_states=2,\n"
+        " stateinf(0)%first_charge=0 /\n",
+        // Atoms past the end of the topology
+        "&CNSTPH trescnt=1, chrgdat=0,0, protcnt=0, statene=0,\n"
+        " stateinf(0)%first_atom=99999, stateinf(0)%num_atoms=1,\n"
+        " stateinf(0)%first_state=0, stateinf(0)%num_states=1,\n"
+        " stateinf(0)%first_charge=0 /\n",
+        // Atoms of two residues
+        "&CNSTPH trescnt=1, chrgdat=100*0, protcnt=0, statene=0,\n"
+        " stateinf(0)%first_atom=1, stateinf(0)%num_atoms=30,\n"
+        " stateinf(0)%first_state=0, stateinf(0)%num_states=1,\n"
+        " stateinf(0)%first_charge=0 /\n",
+        // RESNAME naming another residue
+        "&CNSTPH trescnt=1, chrgdat=0, protcnt=0, statene=0,\n"
+        " stateinf(0)%first_atom=1, stateinf(0)%num_atoms=1,\n"
+        " stateinf(0)%first_state=0, stateinf(0)%num_states=1,\n"
+        " stateinf(0)%first_charge=0,\n"
+        " resname='System: x','Residue: MET 2' /\n",
+        // An initial state the residue does not have
+        "&CNSTPH trescnt=1, chrgdat=0, protcnt=0, statene=0, resstate=1,\n"
+        " stateinf(0)%first_atom=1, stateinf(0)%num_atoms=1,\n"
+        " stateinf(0)%first_state=0, stateinf(0)%num_states=1,\n"
+        " stateinf(0)%first_charge=0 /\n",
+    };
+    for (size_t n = 0; n < sizeof(bad) / sizeof(bad[0]); n++) {
+        write_file("test.cpin", bad[n]);
+        bool caught = false;
+        try {
+            TitratableSites sites(parm, "test.cpin");
+        } catch (AmberCpinError &e) {
+            caught = true;
+        }
+        assert(caught);
+    }
+    remove("test.cpin");
+
+    // A failed read leaves the sites as they were
+    TitratableSites sites(parm, "files/trx.cpin");
+    try {
+        sites.readCpin(parm, "files/no_such_file.cpin");
+        assert(false);
+    } catch (AmberCpinError &e) {
+    }
+    assert(sites.size() == 13);
+}
+
+int main() {
+
+    cout << "Checking the titratable sites of trx...";
+    check_trx_cpin();
+    cout << " OK." << endl;
+
+    cout << "Checking cpin namelist syntax...";
+    check_namelist_syntax();
+    cout << " OK." << endl;
+
+    cout << "Checking error catching in cpin files...";
+    check_bad_cpin();
+    cout << " OK." << endl;
+
+    return 0;
+}
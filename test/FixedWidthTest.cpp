@@ -0,0 +1,152 @@
+/// Tests the fixed-width numeric field decoders
+
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+/// The decoders must agree bit-for-bit with atof on every field
+void check_real(const char* field) {
+    double expected = atof(field);
+    double got = decodeReal(field, field + strlen(field));
+    assert(memcmp(&expected, &got, sizeof(double)) == 0);
+}
+
+void check_int(const char* field) {
+    assert(decodeInt(field, field + strlen(field)) == atoi(field));
+}
+
+void check_real_fields(void) {
+
+    // Topology (E16.8) and restart (F12.7) layouts
+    check_real("  1.00000000E+00");
+    check_real(" -2.50000000E-01");
+    check_real("  3.14159265E+02");
+    check_real("  0.00000000E+00");
+    check_real(" -0.00000000E+00");
+    check_real("  6.03194018E+05");
+    check_real("  1.23456789E-12");
+    check_real("  9.99999999E-30");
+    check_real("  4.79165412E+37");
+    check_real(" -12.6649955");
+    check_real("   0.0000001");
+    check_real("  65.3721047");
+    check_real("1234567.89012");
+    // Unusual but legal input that has to fall back to the C library
+    check_real("    ");
+    check_real("");
+    check_real("1.5D+00");
+    check_real("  1.5 E+00");
+    check_real("12345678901234567890.5");
+    check_real("0.1234567890123456789012");
+    check_real("+.5");
+    check_real("-.");
+    check_real("nan");
+    check_real("1e400");
+    check_real("3.");
+}
+
+void check_int_fields(void) {
+
+    check_int("       3");
+    check_int("      -2");
+    check_int("       0");
+    check_int("99999999");
+    check_int("-9999999");
+    check_int("  +12345");
+    check_int("        ");
+    check_int("");
+    check_int("  12  34");
+    check_int(" 2147483647");
+    check_int("-2147483648");
+}
+
+void check_strict_real(void) {
+
+    double value = -1;
+    const char* blank = "            ";
+    assert(!decodeReal(blank, blank + strlen(blank), value));
+    assert(value == -1);
+    const char* num = "  42.4969453";
+    assert(decodeReal(num, num + strlen(num), value));
+    assert(value == atof(num));
+    // Only the span is read, not the characters after it
+    const char* two = "   1.0000000   2.0000000";
+    assert(decodeReal(two + 12, two + 24, value));
+    assert(value == 2);
+}
+
+/// The encoders must write exactly what printf writes
+void check_encode(double value, int width, int prec) {
+    char got[16 + 16 + FIXEDWIDTH_ENCODE_SIZE], expected[sizeof(got)];
+    int len = encodeExp(value, width, prec, got);
+    snprintf(expected, sizeof(expected), "%*.*E", width, prec, value);
+    assert(string(got, len) == expected);
+    len = encodeFixed(value, width, prec, got);
+    snprintf(expected, sizeof(expected), "%*.*f", width, prec, value);
+    assert(string(got, len) == expected);
+}
+
+void check_encode_int(int value, int width) {
+    char got[64], expected[64];
+    int len = encodeInt(value, width, got);
+    snprintf(expected, sizeof(expected), "%*d", width, value);
+    assert(string(got, len) == expected);
+}
+
+void check_encoders(void) {
+
+    const double values[] = {0.0, -0.0, 1.0, -0.25, 314.159265, 1.0e-10,
+                             9.99999999e22, 9.9999999995, 0.5, 2.5, 1e22, 1e23,
+                             -332.0522173, 18.2223, 5e-324, 1.7976931348623157e308};
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); i++)
+        for (int prec = 0; prec <= 16; prec++)
+            check_encode(values[i], 16, prec);
+
+    // Every value read from a topology field must be written back the same
+    srand(2015);
+    for (int i = 0; i < 200000; i++) {
+        char field[32];
+        snprintf(field, sizeof(field), "%16.8E",
+                 (rand() - RAND_MAX / 2) * pow(10.0, rand() % 40 - 20));
+        char got[64];
+        int len = encodeExp(decodeReal(field, field + 16), 16, 8, got);
+        assert(string(got, len) == field);
+        check_encode((rand() - RAND_MAX / 2) / 1e4, 12, rand() % 10);
+    }
+
+    const int ints[] = {0, 1, -1, 42, -99999999, 2147483647, -2147483647 - 1};
+    for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+        check_encode_int(ints[i], 8);
+        check_encode_int(ints[i], 1);
+    }
+}
+
+int main() {
+
+    cout << "Checking fixed-width decimal decoding...";
+    check_real_fields();
+    cout << " OK." << endl;
+
+    cout << "Checking fixed-width integer decoding...";
+    check_int_fields();
+    cout << " OK." << endl;
+
+    cout << "Checking fixed-width decimal decoding error detection...";
+    check_strict_real();
+    cout << " OK." << endl;
+
+    cout << "Checking fixed-width field encoding...";
+    check_encoders();
+    cout << " OK." << endl;
+
+    return 0;
+}
@@ -0,0 +1,230 @@
+/// Tests the native GB electrostatics against Amber energies
+
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Amber.h"
+#include "amber/gbmodels.h"
+
+using namespace std;
+using namespace Amber;
+
+/* Lennard-Jones energy of the topology as createSystem sets it up (pairs cut
+ * off at the cutoff if it is positive, 1-4 pairs scaled by 1/scnb and never
+ * cut off, excluded pairs skipped), by checking every pair
+ */
+double lennard_jones(AmberParm const& parm, vector<OpenMM::Vec3> const& pos,
+                     double cutoff) {
+    int natom = parm.getNumAtoms();
+    vector<double> const& radii = parm.getAtomTable().ljRadii();
+    vector<double> const& epsilons = parm.getAtomTable().ljEpsilons();
+    vector<double> scale((size_t) natom * natom, 1.0);
+    for (int i = 0; i < natom; i++) {
+        Span<int> excluded = parm.getExclusions().excluded(i);
+        for (size_t k = 0; k < excluded.size(); k++)
+            scale[(size_t) i * natom + excluded[k]] = 0.0;
+    }
+    Span<DihedralTerm> terms = parm.getDihedrals().terms();
+    Span<DihedralType> types = parm.getDihedrals().types();
+    for (size_t n = 0; n < terms.size(); n++) {
+        if (terms[n].ignore_end) continue;
+        int i = min(terms[n].i, terms[n].l), j = max(terms[n].i, terms[n].l);
+        scale[(size_t) i * natom + j] = -1.0 / types[terms[n].type].scnb;
+    }
+
+    double energy = 0;
+    for (int i = 0; i < natom; i++)
+        for (int j = i + 1; j < natom; j++) {
+            double s = scale[(size_t) i * natom + j];
+            OpenMM::Vec3 d = pos[j] - pos[i];
+            double r = sqrt(d.dot(d));
+            if (s == 0 || (s > 0 && cutoff > 0 && r >= cutoff)) continue;
+            double rmin = radii[i] + radii[j];
+            double eps = sqrt(epsilons[i] * epsilons[j]) * fabs(s);
+            double x6 = pow(rmin / r, 6);
+            energy += eps * (x6 * x6 - 2 * x6);
+        }
+    return energy;
+}
+
+/// The kappa createSystem uses for a salt concentration
+double salt_kappa(double saltcon) {
+    return 50.33355 * 0.73 * sqrt(saltcon / (78.5 * 298.15));
+}
+
+void check_gb_energy(const char* model, double cutoff, double saltcon,
+                     double nonbe) {
+    AmberParm parm("files/trx.prmtop");
+    AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+
+    GBElectrostatics gb(parm, model, cutoff, salt_kappa(saltcon));
+    assert(gb.getNumAtoms() == parm.getNumAtoms() && gb.getModel() == model);
+    gb.setPositions(frame.getPositions());
+    vector<double> radii = gb.getBornRadii();
+    for (size_t i = 0; i < radii.size(); i++)
+        assert(radii[i] > 0);
+
+    double e = gb.getEnergy(parm.getAtomTable().charges()) +
+               lennard_jones(parm, frame.getPositions(), cutoff);
+    assert(fabs(1 - e / nonbe) < 5e-7);
+}
+
+void check_energy_change(const char* model, double cutoff, double saltcon) {
+    AmberParm parm("files/trx.prmtop");
+    AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    TitratableSites sites(parm, "files/trx.cpin");
+
+    GBElectrostatics gb(parm, model, cutoff, salt_kappa(saltcon));
+    gb.setPositions(frame.getPositions());
+    vector<double> charges = parm.getAtomTable().charges();
+    double energy = gb.getEnergy(charges);
+    for (int s = 0; s < sites.size(); s++) {
+        // Every site away from its state and back, from the same charges
+        for (int state = 0; state < sites.getNumStates(s); state++) {
+            vector<double> changed = charges;
+            sites.applyState(s, state, changed);
+            double change = gb.getEnergyChange(charges, sites.getFirstAtom(s),
+                                               sites.getEndAtom(s),
+                                               sites.getCharges(s, state));
+            assert(fabs(change - (gb.getEnergy(changed) - energy)) < 1e-6);
+            double back = gb.getEnergyChange(changed, sites.getFirstAtom(s),
+                               sites.getEndAtom(s),
+                               sites.getCharges(s, sites.getInitialState(s)));
+            assert(fabs(change + back) < 1e-6);
+        }
+        // Leave the site deprotonated, so later sites see other charges
+        sites.applyState(s, 1, charges);
+        energy = gb.getEnergy(charges);
+    }
+
+    // Changing nothing, or changing to the same charges, costs nothing
+    assert(gb.getEnergyChange(charges, 10, 10, Span<double>()) == 0);
+    Span<double> same(&charges[100], 20);
+    assert(fabs(gb.getEnergyChange(charges, 100, 120, same)) < 1e-12);
+}
+
+/* Born radius of the first of two atoms of radii rad1 and rad2 (angstroms)
+ * r nanometers apart, as the CustomGBForce of GBn or GBn2 computes it for
+ * atoms of an element without optimized parameters
+ */
+double neck_born_radius(double rad1, double rad2, double r, double offset,
+                        double neck_scale, double alpha, double beta,
+                        double gamma) {
+    double or1 = rad1 / 10 - offset, or2 = rad2 / 10 - offset;
+    double sr2 = 0.5 * or2, U = r + sr2, L = max(or1, fabs(r - sr2));
+    double I = 0.5 * (1 / L - 1 / U + 0.25 * (r - sr2 * sr2 / r) *
+                      (1 / (U * U) - 1 / (L * L)) + 0.5 * log(L / U) / r);
+    double radius1 = or1 + offset, radius2 = or2 + offset;
+    int index = (int) floor((radius2 * 200 - 20) * 21 +
+                            (radius1 * 200 - 20) + 0.5);
+    double d = r - D0[index] / 10;
+    I += neck_scale * M0[index] * 10 / (1 + 100 * d * d +
+                                        0.3 * 1000000 * pow(d, 6));
+    double psi = I * or1;
+    return 1 / (1 / or1 - tanh(alpha * psi - beta * psi * psi +
+                               gamma * psi * psi * psi) / radius1);
+}
+
+void check_neck_index(void) {
+    /* A radius of 1.17 A falls between rows (and columns) of the neck tables,
+     * at 3.4, so rounding the row and column separately picks another entry
+     * than the force, which rounds the whole index
+     */
+    AmberParm parm;
+    parm.addAtom("F1", "F", 9, 19.0, -0.5, 1.75, 0.06, 1.17, 0.5);
+    parm.addAtom("F2", "F", 9, 19.0, 0.5, 1.75, 0.06, 1.5, 0.5);
+    vector<OpenMM::Vec3> positions;
+    positions.push_back(OpenMM::Vec3(0.0, 0.0, 0.0));
+    positions.push_back(OpenMM::Vec3(3.0, 0.0, 0.0));
+
+    GBElectrostatics gbn(parm, "GBn");
+    gbn.setPositions(positions);
+    vector<double> radii = gbn.getBornRadii();
+    assert(fabs(radii[0] - 10 * neck_born_radius(1.17, 1.5, 0.3, 0.009,
+                0.361825, 1.09511284, 1.907992938, 2.50798245)) < 1e-10);
+    assert(fabs(radii[1] - 10 * neck_born_radius(1.5, 1.17, 0.3, 0.009,
+                0.361825, 1.09511284, 1.907992938, 2.50798245)) < 1e-10);
+
+    GBElectrostatics gbn2(parm, "GBn2");
+    gbn2.setPositions(positions);
+    radii = gbn2.getBornRadii();
+    assert(fabs(radii[0] - 10 * neck_born_radius(1.17, 1.5, 0.3, 0.0195141,
+                0.826836, 1.0, 0.8, 4.85)) < 1e-10);
+    assert(fabs(radii[1] - 10 * neck_born_radius(1.5, 1.17, 0.3, 0.0195141,
+                0.826836, 1.0, 0.8, 4.85)) < 1e-10);
+}
+
+void check_gb_errors(void) {
+    AmberParm parm("files/trx.prmtop");
+    bool caught = false;
+    try {
+        GBElectrostatics gb(parm, "OBC3");
+    } catch (AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+
+    GBElectrostatics gb(parm, "OBC2");
+    vector<double> charges = parm.getAtomTable().charges();
+    caught = false;
+    try {
+        gb.getEnergy(charges);
+    } catch (AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+
+    AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    gb.setPositions(frame.getPositions());
+    caught = false;
+    try {
+        gb.getEnergyChange(charges, 0, 5, Span<double>(&charges[0], 4));
+    } catch (AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+}
+
+int main() {
+
+    cout << "Checking native GB energies against Amber...";
+    check_gb_energy("HCT", 0.0, 0.0, -4380.6377735);
+    check_gb_energy("HCT", 0.0, 0.1, -4383.2215249);
+    check_gb_energy("OBC1", 0.0, 0.0, -4430.6048991);
+    check_gb_energy("OBC1", 0.0, 0.1, -4433.1897402);
+    check_gb_energy("OBC2", 0.0, 0.0, -4317.4276516);
+    check_gb_energy("OBC2", 0.0, 0.1, -4319.9948287);
+    check_gb_energy("GBn", 0.0, 0.0, -4252.4065109);
+    check_gb_energy("GBn", 0.0, 0.1, -4254.9660314);
+    check_gb_energy("GBn2", 0.0, 0.0, -4324.7676537);
+    check_gb_energy("GBn2", 0.0, 0.1, -4327.3449966);
+    cout << " OK." << endl;
+
+    cout << "Checking native GB energies with a cutoff...";
+    check_gb_energy("OBC1", 15.0, 0.0, -4593.9490639);
+    check_gb_energy("OBC2", 15.0, 0.1, -4488.8354190);
+    check_gb_energy("GBn2", 15.0, 0.0, -4480.8521321);
+    cout << " OK." << endl;
+
+    cout << "Checking energy changes of protonation moves...";
+    check_energy_change("OBC2", 0.0, 0.0);
+    check_energy_change("HCT", 0.0, 0.1);
+    check_energy_change("GBn2", 15.0, 0.1);
+    cout << " OK." << endl;
+
+    cout << "Checking the neck tables of GBn and GBn2...";
+    check_neck_index();
+    cout << " OK." << endl;
+
+    cout << "Checking error catching in GB energies...";
+    check_gb_errors();
+    cout << " OK." << endl;
+
+    return 0;
+}
@@ -0,0 +1,184 @@
+/// Tests the (possibly compressed) streaming file reader
+
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+/// Reads a whole file without going through InputStream
+string slurp(const char* fname) {
+    FILE *fp = fopen(fname, "rb");
+    assert(fp != NULL);
+    string contents;
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0)
+        contents.append(buf, n);
+    fclose(fp);
+    return contents;
+}
+
+void spit(const char* fname, string const& contents) {
+    FILE *fp = fopen(fname, "wb");
+    assert(fp != NULL);
+    assert(fwrite(contents.data(), 1, contents.size(), fp) == contents.size());
+    fclose(fp);
+}
+
+/// Reads a whole stream in pieces of the given size
+string stream(const char* fname, size_t chunk) {
+    InputStream input;
+    assert(input.open(fname));
+    string contents;
+    char buf[4096];
+    assert(chunk <= sizeof(buf));
+    size_t n;
+    while ((n = input.read(buf, chunk)) > 0)
+        contents.append(buf, n);
+    assert(input.good());
+    assert(input.read(buf, chunk) == 0);
+    return contents;
+}
+
+void check_detection(void) {
+    assert(detectCompression("\x1f\x8b\x08\x00", 4) == GZIP_COMPRESSION);
+    assert(detectCompression("BZh9", 4) == BZIP2_COMPRESSION);
+    assert(detectCompression("BZh", 3) == NO_COMPRESSION);
+    assert(detectCompression("%VERSION", 8) == NO_COMPRESSION);
+    assert(detectCompression("", 0) == NO_COMPRESSION);
+    assert(canDecompress(NO_COMPRESSION));
+
+    InputStream input;
+    assert(!input.open("files/does_not_exist.parm7"));
+    assert(input.open("files/trx.prmtop"));
+    assert(input.compression() == NO_COMPRESSION);
+    assert(input.sizeHint() == slurp("files/trx.prmtop").size());
+    if (canDecompress(GZIP_COMPRESSION)) {
+        assert(input.open("files/trx.prmtop.gz"));
+        assert(input.compression() == GZIP_COMPRESSION);
+        assert(input.sizeHint() == slurp("files/trx.prmtop").size());
+    }
+    if (canDecompress(BZIP2_COMPRESSION)) {
+        assert(input.open("files/crds_vels_box.rst7.bz2"));
+        assert(input.compression() == BZIP2_COMPRESSION);
+    }
+}
+
+void check_plain(void) {
+    string expected = slurp("files/trx.prmtop");
+    assert(stream("files/trx.prmtop", 4096) == expected);
+    assert(stream("files/trx.prmtop", 7) == expected);
+
+    // Lines come out the way std::getline splits them
+    InputStream input;
+    assert(input.open("files/crdsonly.rst7"));
+    FILE *fp = fopen("files/crdsonly.rst7", "r");
+    char buf[256];
+    string line;
+    while (fgets(buf, sizeof(buf), fp) != NULL) {
+        assert(input.getline(line));
+        assert(line + "\n" == buf);
+    }
+    fclose(fp);
+    assert(!input.getline(line));
+}
+
+void check_compressed(void) {
+    if (canDecompress(GZIP_COMPRESSION)) {
+        string expected = slurp("files/trx.prmtop");
+        assert(stream("files/trx.prmtop.gz", 4096) == expected);
+        assert(stream("files/trx.prmtop.gz", 13) == expected);
+    }
+    if (canDecompress(BZIP2_COMPRESSION)) {
+        string expected = slurp("files/crds_vels_box.rst7");
+        assert(stream("files/crds_vels_box.rst7.bz2", 4096) == expected);
+    }
+}
+
+void check_concatenated(const char* fname, const char* plain) {
+    // Enough copies to cycle through every buffer several times
+    string compressed = slurp(fname), expected = slurp(plain);
+    string many, manyExpected;
+    for (int i = 0; i < 12; i++) {
+        many += compressed;
+        manyExpected += expected;
+    }
+    spit("files/tmp_concatenated", many);
+    assert(stream("files/tmp_concatenated", 4096) == manyExpected);
+
+    // Closing in the middle of the stream must stop the reader thread
+    InputStream input;
+    assert(input.open("files/tmp_concatenated"));
+    char buf[10];
+    assert(input.read(buf, sizeof(buf)) == sizeof(buf));
+    assert(memcmp(buf, manyExpected.data(), sizeof(buf)) == 0);
+    input.close();
+    remove("files/tmp_concatenated");
+}
+
+void check_truncated(const char* fname) {
+    string compressed = slurp(fname);
+    spit("files/tmp_truncated", compressed.substr(0, compressed.size() / 2));
+    InputStream input;
+    assert(input.open("files/tmp_truncated"));
+    char buf[4096];
+    while (input.read(buf, sizeof(buf)) > 0);
+    assert(!input.good());
+
+    // Parsers built on top must not accept the partial file either
+    MappedFile file;
+    assert(!file.open("files/tmp_truncated"));
+    remove("files/tmp_truncated");
+}
+
+void check_mapped_file(void) {
+    if (!canDecompress(GZIP_COMPRESSION)) return;
+    MappedFile plain, compressed;
+    assert(plain.open("files/trx.prmtop"));
+    assert(compressed.open("files/trx.prmtop.gz"));
+    assert(!compressed.isMapped());
+    assert(compressed.size() == plain.size());
+    assert(memcmp(compressed.data(), plain.data(), plain.size()) == 0);
+}
+
+int main() {
+
+    cout << "Checking compression detection...";
+    check_detection();
+    cout << " OK." << endl;
+
+    cout << "Checking streaming plain files...";
+    check_plain();
+    cout << " OK." << endl;
+
+    cout << "Checking streaming compressed files...";
+    check_compressed();
+    cout << " OK." << endl;
+
+    cout << "Checking streaming concatenated compressed files...";
+    if (canDecompress(GZIP_COMPRESSION))
+        check_concatenated("files/trx.prmtop.gz", "files/trx.prmtop");
+    if (canDecompress(BZIP2_COMPRESSION))
+        check_concatenated("files/crds_vels_box.rst7.bz2",
+                           "files/crds_vels_box.rst7");
+    cout << " OK." << endl;
+
+    cout << "Checking truncated compressed file detection...";
+    if (canDecompress(GZIP_COMPRESSION))
+        check_truncated("files/trx.prmtop.gz");
+    if (canDecompress(BZIP2_COMPRESSION))
+        check_truncated("files/crds_vels_box.rst7.bz2");
+    cout << " OK." << endl;
+
+    cout << "Checking memory mapping compressed files...";
+    check_mapped_file();
+    cout << " OK." << endl;
+
+    return 0;
+}
@@ -191,6 +191,515 @@ void check_omm_gb(const char* model, double cutoff,
     check_omm_gb(string(model), cutoff, saltcon, nonbe);
 }
 
+void check_omm_hmr(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 10.0, string("HBonds"), false,
+            string("None"), 0.0, 0.0, 298.15, 1.0, 78.5, true, 0.0005, true,
+            false, 3.024);
+
+    double total = 0, origTotal = 0;
+    for (int i = 0; i < parm.getNumAtoms(); i++) {
+        double mass = system->getParticleMass(i);
+        if (parm.getAtomTable().elements()[i] == 1)
+            assert(mass == 3.024);
+        total += mass;
+        origTotal += parm.getAtomTable().masses()[i];
+    }
+    assert(abs(total - origTotal) < 1e-8);
+    delete system;
+}
+
+void check_omm_rigid_water(void) {
+    Amber::AmberParm parm("files/4096wat.parm7");
+    int nwat = parm.getNumResidues();
+
+    // Rigid water works without any other constraints, and HBonds does not
+    // add duplicates of the water constraints
+    const char* constraints[] = {"None", "HBonds", "AllBonds"};
+    for (int c = 0; c < 3; c++) {
+        OpenMM::System *system = parm.createSystem(
+                OpenMM::NonbondedForce::PME, 8.0, string(constraints[c]), true);
+        assert(system->getNumConstraints() == 3 * nwat);
+        for (int w = 0; w < nwat; w += 97) {
+            int i, j;
+            double d;
+            system->getConstraintParameters(3*w, i, j, d);
+            assert(i == 3*w && j == 3*w + 1 && abs(d - 0.09572) < 1e-10);
+            system->getConstraintParameters(3*w + 1, i, j, d);
+            assert(i == 3*w && j == 3*w + 2 && abs(d - 0.09572) < 1e-10);
+            system->getConstraintParameters(3*w + 2, i, j, d);
+            assert(i == 3*w + 1 && j == 3*w + 2 && abs(d - 0.15136) < 1e-10);
+        }
+        delete system;
+    }
+
+    // The protein gets the same constraints either way
+    Amber::AmberParm protein("files/trx.prmtop");
+    OpenMM::System *flexible = protein.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 10.0, string("HBonds"), false);
+    OpenMM::System *rigid = protein.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 10.0, string("HBonds"), true);
+    assert(flexible->getNumConstraints() == rigid->getNumConstraints());
+    delete flexible;
+    delete rigid;
+}
+
+/// The bond force of a system, or NULL if it has none
+OpenMM::HarmonicBondForce* bond_force(OpenMM::System &system) {
+    for (int f = 0; f < system.getNumForces(); f++) {
+        OpenMM::HarmonicBondForce *bonds =
+                dynamic_cast<OpenMM::HarmonicBondForce*>(&system.getForce(f));
+        if (bonds) return bonds;
+    }
+    return NULL;
+}
+
+/// Where a virtual site of a water puts its extra point, for a water with its
+/// O at the origin and the O-H distances and H-O-H angle given (in nm, rad)
+OpenMM::Vec3 site_position(OpenMM::VirtualSite const& site, double d1,
+                           double d2, double theta) {
+    OpenMM::Vec3 a(d1, 0, 0), b(d2 * cos(theta), d2 * sin(theta), 0);
+    OpenMM::ThreeParticleAverageSite const* average =
+            dynamic_cast<OpenMM::ThreeParticleAverageSite const*>(&site);
+    if (average)
+        return a * average->getWeight(1) + b * average->getWeight(2);
+    OpenMM::OutOfPlaneSite const& plane =
+            dynamic_cast<OpenMM::OutOfPlaneSite const&>(site);
+    return a * plane.getWeight12() + b * plane.getWeight13() +
+           a.cross(b) * plane.getWeightCross();
+}
+
+void check_omm_water_sites(void) {
+    // 4-site waters: the extra point is a virtual site on the H-O-H bisector,
+    // 0.125 A from the O, and none of its bonds become constraints
+    Amber::AmberParm tip4p("files/tip4pew.parm7");
+    int nwat = tip4p.getNumResidues();
+    assert((int) tip4p.getWaterResidues().size() == nwat);
+    double theta = 2 * asin(1.5139 / 2 / 0.9572);
+    const char* constraints[] = {"None", "HBonds", "AllBonds"};
+    for (int c = 0; c < 3; c++) {
+        OpenMM::System *system = tip4p.createSystem(
+                OpenMM::NonbondedForce::PME, 5.0, string(constraints[c]), true);
+        assert(system->getNumConstraints() == 3 * nwat);
+        for (int i = 0; i < system->getNumConstraints(); i++) {
+            int a, b;
+            double d;
+            system->getConstraintParameters(i, a, b, d);
+            assert(!system->isVirtualSite(a) && !system->isVirtualSite(b));
+        }
+        // Only the O-H and H-H bonds are kept for their energy
+        OpenMM::HarmonicBondForce *bonds = bond_force(*system);
+        assert(bonds == NULL || bonds->getNumBonds() == 3 * nwat);
+        for (int n = 0; bonds != NULL && n < bonds->getNumBonds(); n++) {
+            int a, b;
+            double d, k;
+            bonds->getBondParameters(n, a, b, d, k);
+            assert(a % 4 != 3 && b % 4 != 3);
+        }
+        for (int w = 0; w < nwat; w++) {
+            for (int k = 0; k < 3; k++)
+                assert(!system->isVirtualSite(4*w + k));
+            assert(system->isVirtualSite(4*w + 3));
+            assert(system->getParticleMass(4*w + 3) == 0);
+            OpenMM::VirtualSite const& site = system->getVirtualSite(4*w + 3);
+            assert(site.getParticle(0) == 4*w && site.getParticle(1) == 4*w+1 &&
+                   site.getParticle(2) == 4*w + 2);
+            OpenMM::Vec3 ep = site_position(site, 0.09572, 0.09572, theta);
+            assert(abs(sqrt(ep.dot(ep)) - 0.0125) < 1e-10);
+            assert(abs(atan2(ep[1], ep[0]) - theta / 2) < 1e-10);
+        }
+        delete system;
+    }
+
+    // Without flexible constraints rigid waters have no bonds left at all,
+    // and flexible waters still have the extra point as a virtual site
+    OpenMM::System *system = tip4p.createSystem(
+            OpenMM::NonbondedForce::PME, 5.0, string("None"), true, "None",
+            0.0, 0.0, 298.15, 1.0, 78.5, true, 0.0005, false);
+    assert(bond_force(*system)->getNumBonds() == 0);
+    delete system;
+    system = tip4p.createSystem(OpenMM::NonbondedForce::PME, 5.0,
+                                string("None"), false);
+    assert(system->getNumConstraints() == 0);
+    assert(bond_force(*system)->getNumBonds() == 3 * nwat);
+    for (int w = 0; w < nwat; w++)
+        assert(system->isVirtualSite(4*w + 3));
+    delete system;
+
+    // 5-site waters: two extra points 0.7 A from the O, 1.1431 A apart, on
+    // either side of the plane of the water and away from the hydrogens
+    Amber::AmberParm tip5p("files/tip5p.parm7");
+    nwat = tip5p.getNumResidues();
+    theta = 2 * asin(1.5136 / 2 / 0.9572);
+    system = tip5p.createSystem(OpenMM::NonbondedForce::PME, 5.0,
+                                string("AllBonds"), true);
+    assert(system->getNumConstraints() == 3 * nwat);
+    for (int w = 0; w < nwat; w++) {
+        OpenMM::Vec3 ep1 = site_position(system->getVirtualSite(5*w + 3),
+                                         0.09572, 0.09572, theta);
+        OpenMM::Vec3 ep2 = site_position(system->getVirtualSite(5*w + 4),
+                                         0.09572, 0.09572, theta);
+        assert(abs(sqrt(ep1.dot(ep1)) - 0.07) < 1e-10);
+        assert(abs(sqrt(ep2.dot(ep2)) - 0.07) < 1e-10);
+        OpenMM::Vec3 sep = ep1 - ep2;
+        assert(abs(sqrt(sep.dot(sep)) - 0.11431) < 1e-10);
+        assert(ep1[2] > 0 && abs(ep1[2] + ep2[2]) < 1e-12);
+        OpenMM::Vec3 bisector(cos(theta / 2), sin(theta / 2), 0);
+        assert(ep1.dot(bisector) < 0 && ep2.dot(bisector) < 0);
+    }
+    delete system;
+
+    // A flexible water model with an H-O-H angle rather than an H-H bond:
+    // the angle gives the H-H constraint, and is left out of the angle force
+    Amber::AmberParm spcfw("files/spcfw.parm7");
+    nwat = spcfw.getNumResidues();
+    system = spcfw.createSystem(OpenMM::NonbondedForce::PME, 5.0,
+                                string("None"), true, "None", 0.0, 0.0,
+                                298.15, 1.0, 78.5, true, 0.0005, false);
+    assert(system->getNumConstraints() == 3 * nwat);
+    for (int w = 0; w < nwat; w++) {
+        int i, j;
+        double d;
+        system->getConstraintParameters(3*w + 2, i, j, d);
+        assert(i == 3*w + 1 && j == 3*w + 2);
+        double hh = 2 * 0.1012 * sin(113.24 / 2 * Amber::RADIAN_PER_DEGREE);
+        assert(abs(d - hh) < 1e-8);
+    }
+    for (int f = 0; f < system->getNumForces(); f++) {
+        OpenMM::HarmonicAngleForce *angles =
+                dynamic_cast<OpenMM::HarmonicAngleForce*>(&system->getForce(f));
+        if (angles) assert(angles->getNumAngles() == 0);
+    }
+    delete system;
+    system = spcfw.createSystem(OpenMM::NonbondedForce::PME, 5.0,
+                                string("None"), false);
+    assert(system->getNumConstraints() == 0);
+    assert(bond_force(*system)->getNumBonds() == 2 * nwat);
+    delete system;
+}
+
+/// Checks the charges the system has for the given site states
+void check_site_charges(Amber::AmberParm const& parm,
+                        Amber::TitratableSites const& sites,
+                        vector<int> const& states, OpenMM::System &system) {
+    vector<double> charges = parm.getAtomTable().charges();
+    sites.applyStates(states, charges);
+
+    OpenMM::NonbondedForce *nonb = 0;
+    OpenMM::CustomGBForce *gb = 0;
+    for (int f = 0; f < system.getNumForces(); f++) {
+        if (!nonb) nonb = dynamic_cast<OpenMM::NonbondedForce*>(&system.getForce(f));
+        if (!gb) gb = dynamic_cast<OpenMM::CustomGBForce*>(&system.getForce(f));
+    }
+    assert(nonb && gb);
+    vector<double> params;
+    for (int i = 0; i < parm.getNumAtoms(); i++) {
+        double q, sig, eps;
+        nonb->getParticleParameters(i, q, sig, eps);
+        assert(q == charges[i]);
+        gb->getParticleParameters(i, params);
+        assert(params[0] == charges[i]);
+    }
+    // The 1-4 exceptions come first, one per dihedral with a 1-4 pair
+    Amber::Span<Amber::DihedralTerm> terms = parm.getDihedrals().terms();
+    int k = 0;
+    for (size_t n = 0; n < terms.size(); n++) {
+        if (terms[n].ignore_end) continue;
+        int a, b;
+        double qq, sig, eps;
+        nonb->getExceptionParameters(k++, a, b, qq, sig, eps);
+        double scee = parm.getDihedrals().type(terms[n].type).scee;
+        assert(abs(qq - charges[a] * charges[b] / scee) < 1e-12);
+    }
+}
+
+void check_omm_protonation(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    Amber::AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    Amber::TitratableSites sites(parm, "files/trx.cpin");
+
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= Amber::NANOMETER_PER_ANGSTROM;
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 0.0, string("None"), false,
+            string("HCT"));
+    Amber::ProtonationStateUpdater updater(sites, *system);
+    assert(updater.getStates() == sites.getInitialStates());
+    check_site_charges(parm, sites, updater.getStates(), *system);
+
+    OpenMM::VerletIntegrator integrator(0.002);
+    OpenMM::Context context(*system, integrator,
+                OpenMM::Platform::getPlatformByName(string("CPU")));
+    context.setPositions(positions);
+    double e0 = context.getState(OpenMM::State::Energy).getPotentialEnergy();
+
+    // Deprotonating two lysines changes the charges, 1-4 terms
+    // and the energy, and restoring them restores the energy
+    updater.setState(0, 1);
+    updater.setState(1, 1);
+    assert(updater.needsUpdate());
+    vector<int> states = sites.getInitialStates();
+    states[0] = states[1] = 1;
+    check_site_charges(parm, sites, states, *system);
+    updater.updateContext(context);
+    assert(!updater.needsUpdate());
+    double e1 = context.getState(OpenMM::State::Energy).getPotentialEnergy();
+    assert(abs(e1 - e0) > 1.0);
+
+    updater.setStates(sites.getInitialStates());
+    updater.updateContext(context);
+    double e2 = context.getState(OpenMM::State::Energy).getPotentialEnergy();
+    assert(abs(e2 - e0) < 1e-6 * abs(e0));
+
+    bool caught = false;
+    try {
+        updater.setState(0, 2);
+    } catch (Amber::AmberCpinError &e) {
+        caught = true;
+    }
+    assert(caught);
+    delete system;
+}
+
+void check_omm_protonation_neutral(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    Amber::AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    Amber::TitratableSites sites(parm, "files/trx.cpin");
+    const int ASH = 2, TYR = 4;
+    assert(sites.getResidueName(ASH) == "ASH");
+    assert(sites.getResidueName(TYR) == "TYR");
+
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= Amber::NANOMETER_PER_ANGSTROM;
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 0.0, string("None"), false,
+            string("OBC2"));
+
+    // The carboxyl H of ASH and the hydroxyl H of TYR have no LJ well, and
+    // no charge once removed: their 1-4 exceptions must stay computed. Make
+    // the context with the aspartate deprotonated, then protonate it
+    Amber::ProtonationStateUpdater updater(sites, *system);
+    updater.setState(ASH, 1);
+    OpenMM::VerletIntegrator integrator(0.002);
+    OpenMM::Context context(*system, integrator,
+                OpenMM::Platform::getPlatformByName(string("Reference")));
+    context.setPositions(positions);
+    double e0 = context.getState(OpenMM::State::Energy).getPotentialEnergy();
+
+    updater.setState(ASH, 0);
+    updater.updateContext(context);
+
+    // Deprotonate the tyrosine on its own
+    updater.setState(TYR, 1);
+    vector<int> states = sites.getInitialStates();
+    states[TYR] = 1;
+    check_site_charges(parm, sites, states, *system);
+    updater.updateContext(context);
+
+    // And back to the states the context started from
+    updater.setState(TYR, 0);
+    updater.updateContext(context);
+    updater.setState(ASH, 1);
+    updater.updateContext(context);
+    double e1 = context.getState(OpenMM::State::Energy).getPotentialEnergy();
+    assert(abs(e1 - e0) <= 1e-6 * abs(e0));
+    delete system;
+}
+
+void check_omm_protonation_mc(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    Amber::AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    Amber::TitratableSites sites(parm, "files/trx.cpin");
+
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= Amber::NANOMETER_PER_ANGSTROM;
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 0.0, string("HBonds"), false,
+            string("OBC2"));
+    OpenMM::LangevinIntegrator integrator(300.0, 1.0, 0.002);
+    OpenMM::Context context(*system, integrator,
+                OpenMM::Platform::getPlatformByName(string("CPU")));
+    context.setPositions(positions);
+
+    // Far above every pKa, every site loses its proton and keeps it off
+    Amber::ProtonationSampler sampler(sites, *system, context, 1000.0, 300.0,
+                                      7);
+    assert(sampler.getStates() == sites.getInitialStates());
+    int naccepted = sampler.attemptMoves(1000);
+    long nattempts = 0, ntotal = 0;
+    for (int i = 0; i < sites.size(); i++) {
+        assert(sampler.getStates()[i] == 1);
+        assert(sampler.getNumAccepted(i) == 1);
+        assert(sampler.getAcceptance(i) * sampler.getNumAttempts(i) == 1);
+        nattempts += sampler.getNumAttempts(i);
+        ntotal += sampler.getNumAccepted(i);
+    }
+    assert(nattempts == 1000 && ntotal == naccepted);
+
+    // Far below them, every site takes its proton back
+    sampler.setPH(-1000.0);
+    sampler.resetStatistics();
+    sampler.attemptMoves(1000);
+    for (int i = 0; i < sites.size(); i++) {
+        assert(sampler.getStates()[i] == 0);
+        assert(sampler.getNumAccepted(i) == 1);
+    }
+
+    // Moves between stretches of MD
+    sampler.resetStatistics();
+    sampler.run(25, 10, 4);
+    nattempts = 0;
+    for (int i = 0; i < sites.size(); i++)
+        nattempts += sampler.getNumAttempts(i);
+    assert(nattempts == 8);
+    delete system;
+}
+
+void check_omm_protonation_sweep(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    Amber::AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    Amber::TitratableSites sites(parm, "files/trx.cpin");
+
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= Amber::NANOMETER_PER_ANGSTROM;
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 0.0, string("HBonds"), false,
+            string("OBC2"));
+    OpenMM::LangevinIntegrator integrator(300.0, 1.0, 0.002);
+    OpenMM::Context context(*system, integrator,
+                OpenMM::Platform::getPlatformByName(string("CPU")));
+    context.setPositions(positions);
+    int nsite = sites.size();
+
+    // Every site moves once, each move decided on its own; context energies
+    // cannot tell moves apart, so each one costs an evaluation
+    Amber::ProtonationSampler sampler(sites, *system, context, 1000.0, 300.0,
+                                      11);
+    assert(sampler.getIndependenceDistance() == 0.0);
+    sampler.setPairCutoff(0.0);
+    int nchanged = sampler.attemptSweep();
+    assert(nchanged == nsite);
+    assert(sampler.getNumEvaluations() >= nsite);
+    for (int i = 0; i < nsite; i++) {
+        assert(sampler.getStates()[i] == 1);
+        assert(sampler.getNumAttempts(i) == 1);
+    }
+
+    // A sweep that only proposes uphill moves changes nothing
+    sampler.resetStatistics();
+    assert(sampler.attemptSweep() == 0);
+    for (int i = 0; i < nsite; i++)
+        assert(sampler.getStates()[i] == 1);
+    for (int i = 0; i < nsite; i++)
+        assert(sampler.getNumAttempts(i) == 1 && sampler.getNumAccepted(i) == 0);
+
+    // With a cutoff, native sweeps batch the sites that are farther apart,
+    // still with a decision per site and no context energies
+    OpenMM::System *cut = parm.createSystem(
+            OpenMM::NonbondedForce::CutoffNonPeriodic, 12.0, string("HBonds"),
+            false, string("OBC2"));
+    OpenMM::LangevinIntegrator cut_integrator(300.0, 1.0, 0.002);
+    OpenMM::Context cut_context(*cut, cut_integrator,
+                OpenMM::Platform::getPlatformByName(string("CPU")));
+    cut_context.setPositions(positions);
+    Amber::GBElectrostatics gb(parm, "OBC2", 12.0);
+    Amber::ProtonationSampler batched(sites, *cut, cut_context, -1000.0, 300.0,
+                                      11);
+    assert(abs(batched.getIndependenceDistance() - 12.0) < 1e-12);
+    batched.setEvaluator(&gb);
+    assert(batched.attemptSweep() == 0);
+    batched.setPH(1000.0);
+    assert(batched.attemptSweep() == nsite);
+    assert(batched.getNumEvaluations() == 0);
+    for (int i = 0; i < nsite; i++) {
+        assert(batched.getStates()[i] == 1);
+        assert(batched.getNumAttempts(i) == 2 && batched.getNumAccepted(i) == 1);
+    }
+    delete cut;
+    delete system;
+}
+
+void check_omm_native_protonation(void) {
+    Amber::AmberParm parm("files/trx.prmtop");
+    Amber::AmberCoordinateFrame frame;
+    frame.readRst7("files/trx.inpcrd");
+    Amber::TitratableSites sites(parm, "files/trx.cpin");
+
+    vector<OpenMM::Vec3> positions = frame.getPositions();
+    for (size_t i = 0; i < positions.size(); i++)
+        positions[i] *= Amber::NANOMETER_PER_ANGSTROM;
+    OpenMM::System *system = parm.createSystem(
+            OpenMM::NonbondedForce::NoCutoff, 0.0, string("HBonds"), false,
+            string("OBC2"));
+    OpenMM::LangevinIntegrator integrator(300.0, 1.0, 0.002);
+    OpenMM::Context context(*system, integrator,
+                OpenMM::Platform::getPlatformByName(string("CPU")));
+    context.setPositions(positions);
+    Amber::GBElectrostatics gb(parm, "OBC2");
+
+    // Native energy changes need no context energies at all
+    Amber::ProtonationSampler sampler(sites, *system, context, 1000.0, 300.0,
+                                      5);
+    sampler.setEvaluator(&gb);
+    assert(sampler.getEvaluator() == &gb);
+    sampler.attemptMoves(1000);
+    assert(sampler.getNumEvaluations() == 0);
+    for (int i = 0; i < sites.size(); i++)
+        assert(sampler.getStates()[i] == 1);
+    sampler.setPH(-1000.0);
+    assert(sampler.attemptSweep() == sites.size());
+    assert(sampler.getNumEvaluations() == 0);
+    for (int i = 0; i < sites.size(); i++)
+        assert(sampler.getStates()[i] == 0);
+
+    // Rounds too short to pay for the Born radii use context energies
+    assert(sampler.getNativeMinMoves() == 1);
+    sampler.setNativeMinMoves(10);
+    sampler.attemptMoves(9);
+    assert(sampler.getNumEvaluations() > 0);
+    sampler.resetStatistics();
+    sampler.attemptMoves(10);
+    assert(sampler.getNumEvaluations() == 0);
+    bool caught = false;
+    try {
+        sampler.setNativeMinMoves(0);
+    } catch (Amber::AmberCpinError &e) {
+        caught = true;
+    }
+    assert(caught);
+
+    // The native energy change of every move is the context's
+    Amber::ProtonationStateUpdater updater(sites, *system);
+    updater.updateContext(context);
+    OpenMM::State state = context.getState(OpenMM::State::Energy, false,
+                                    1 << Amber::AmberParm::NONBONDED_FORCE_GROUP);
+    double energy = state.getPotentialEnergy() * Amber::CALORIE_PER_JOULE;
+    gb.setPositions(frame.getPositions());
+    for (int i = 0; i < sites.size(); i++) {
+        double change = gb.getEnergyChange(updater.getCharges(),
+                                           sites.getFirstAtom(i),
+                                           sites.getEndAtom(i),
+                                           sites.getCharges(i, 1));
+        updater.setState(i, 1);
+        updater.updateContext(context);
+        state = context.getState(OpenMM::State::Energy, false,
+                                 1 << Amber::AmberParm::NONBONDED_FORCE_GROUP);
+        double trial = state.getPotentialEnergy() * Amber::CALORIE_PER_JOULE;
+        assert(abs(change - (trial - energy)) < 1e-2);
+        energy = trial;
+    }
+    delete system;
+}
+
 int main() {
 
     // Load the main plugins
@@ -202,6 +711,35 @@ int main() {
     check_omm_system();
     cout << " OK." << endl;
 
+    cout << "Testing OpenMM hydrogen mass repartitioning...";
+    check_omm_hmr();
+    cout << " OK." << endl;
+
+    cout << "Testing OpenMM rigid water...";
+    check_omm_rigid_water();
+    cout << " OK." << endl;
+
+    cout << "Testing OpenMM 4- and 5-site and flexible water models...";
+    check_omm_water_sites();
+    cout << " OK." << endl;
+
+    cout << "Testing OpenMM protonation state updates...";
+    check_omm_protonation();
+    check_omm_protonation_neutral();
+    cout << " OK." << endl;
+
+    cout << "Testing OpenMM Monte Carlo protonation moves...";
+    check_omm_protonation_mc();
+    cout << " OK." << endl;
+
+    cout << "Testing OpenMM batched protonation sweeps...";
+    check_omm_protonation_sweep();
+    cout << " OK." << endl;
+
+    cout << "Testing native GB energies in protonation moves...";
+    check_omm_native_protonation();
+    cout << " OK." << endl;
+
     cout << "Testing OpenMM gas phase energy...";
     check_gas_energy();
     cout << " OK." << endl;
@@ -0,0 +1,207 @@
+/// Tests the low-level topology file reading and writing routines
+
+#include <cassert>
+#include <cstdio>
+#include <iostream>
+
+#include "Amber.h"
+
+using namespace std;
+using namespace Amber;
+
+void check_typed_matches_eager(const char* fname) {
+    vector<string> flagList;
+    ParmDataMap parmData;
+    ParmStringMap parmComments, unkParmData;
+    ParmFormatMap parmFormats;
+    string version;
+
+    assert(readparm(fname, flagList, parmData, parmComments, unkParmData,
+                    parmFormats, version) == OK);
+
+    ParmSectionStore store;
+    assert(store.open(fname) == OK);
+    assert(store.flags() == flagList);
+    assert(store.version() == version);
+
+    for (int i = 0; i < NUM_PRM_SECTIONS; i++) {
+        ParmSectionId id = (ParmSectionId) i;
+        string flag = parmSectionFlag(id);
+        assert(parmSectionId(flag) == id);
+        assert(!store.isDecoded(id));
+        assert(store.has(id) == (parmData.count(flag) > 0));
+        if (!store.has(id)) continue;
+        ParmDataVec const& ref = parmData[flag];
+        assert(store.size(id) == ref.size());
+        ParmDataType type = parmSectionType(id);
+        for (size_t j = 0; j < ref.size(); j++) {
+            if (type == INTEGER)
+                assert(store.ints(id)[j] == ref[j].i);
+            else if (type == FLOAT)
+                assert(store.reals(id)[j] == ref[j].f);
+            else
+                assert(nameString(store.names(id)[j]) == string(ref[j].c));
+        }
+    }
+
+    // Numbers can be read as the other numeric type
+    vector<int32_t> const& natom = store.ints(PRM_ATOMIC_NUMBER);
+    vector<double> const& natomf = store.reals(PRM_ATOMIC_NUMBER);
+    assert(natom.size() == natomf.size());
+    for (size_t j = 0; j < natom.size(); j++)
+        assert(natomf[j] == natom[j]);
+
+    // Released sections are decoded again on request
+    store.release(PRM_CHARGE);
+    assert(!store.isDecoded(PRM_CHARGE));
+    assert(store.reals(PRM_CHARGE)[0] == parmData["CHARGE"][0].f);
+
+    assert(parmSectionId("TITLE") == NUM_PRM_SECTIONS);
+}
+
+void check_typed_errors(void) {
+    ParmSectionStore store;
+    assert(store.open("files/does_not_exist.parm7") == NOOPEN);
+    assert(store.open("files/crdsonly.rst7") == NOVERSION);
+    assert(!store.has(PRM_POINTERS));
+}
+
+void check_wide_strings(void) {
+    int ncols, width;
+    assert(parseFormat("1a80", ncols, width) == HOLLERITH);
+    assert(ncols == 1 && width == 80);
+
+    // readparm keeps what does not fit in a ParmData as text
+    vector<string> flagList;
+    ParmDataMap parmData;
+    ParmStringMap parmComments, unkParmData;
+    ParmFormatMap parmFormats;
+    string version;
+    const char* fname = "files/4096wat.parm7";
+    assert(readparm(fname, flagList, parmData, parmComments, unkParmData,
+                    parmFormats, version) == OK);
+    assert(parmFormats["RADIUS_SET"].dataType == UNKNOWN);
+    assert(parmFormats["RADIUS_SET"].fmt == "1a80");
+    assert(parmData.count("RADIUS_SET") == 0);
+    assert(unkParmData["RADIUS_SET"].size() == 1);
+
+    ParmSectionStore store;
+    assert(store.open(fname) == OK);
+    ParmStringTable const& radiusSet = store.strings("RADIUS_SET");
+    assert(radiusSet.size() == 1);
+    assert(radiusSet[0] == "H(N)-modified Bondi radii (mbondi2)");
+    assert(radiusSet.length(0) == radiusSet[0].size());
+    assert(store.strings("NOT_A_FLAG").empty());
+
+    // Standard sections come out whole as well
+    ParmStringTable const& names = store.strings(PRM_ATOM_NAME);
+    assert(names.size() == store.size(PRM_ATOM_NAME));
+    for (size_t i = 0; i < names.size(); i++)
+        assert(names[i] == nameString(store.names(PRM_ATOM_NAME)[i]));
+    assert(store.strings(PRM_POINTERS)[0] == "12288");
+
+    // A custom section of long labels, with a blank field and a short last
+    // line, split by a comment
+    FILE *fp = fopen("files/tmp_wide.parm7", "w");
+    assert(fp != NULL);
+    fprintf(fp, "%%VERSION  VERSION_STAMP = V0001.000\n");
+    fprintf(fp, "%%FLAG POINTERS\n%%FORMAT(10I8)\n%8d\n", 0);
+    fprintf(fp, "%%FLAG LONG_LABELS\n%%FORMAT(3a20)\n");
+    fprintf(fp, "%-20s%-20s%-20s\n", "first label", "", "  third label");
+    fprintf(fp, "%%COMMENT one more\n%-20s\n", "fourth label");
+    fclose(fp);
+
+    assert(store.open("files/tmp_wide.parm7") == OK);
+    ParmStringTable const& labels = store.strings("LONG_LABELS");
+    assert(labels.size() == 4);
+    assert(labels[0] == "first label");
+    assert(labels[1] == "" && labels.length(1) == 0);
+    assert(labels[2] == "third label");
+    assert(labels[3] == "fourth label");
+
+    remove("files/tmp_wide.parm7");
+
+    ParmStringTable table, more;
+    table.push_back("ab");
+    more.push_back(string());
+    more.push_back("cde");
+    table.append(more);
+    assert(table.size() == 3);
+    assert(table[0] == "ab" && table[1] == "" && table[2] == "cde");
+    ParmStringTable same;
+    same.push_back("ab");
+    same.push_back("");
+    same.push_back("cde");
+    assert(same == table);
+    same.clear();
+    assert(same.empty() && same != table);
+}
+
+string slurp(const char* fname) {
+    MappedFile file;
+    assert(file.open(fname));
+    return string(file.data(), file.size());
+}
+
+void check_writeparm_roundtrip(const char* fname) {
+    vector<string> flagList;
+    ParmDataMap parmData;
+    ParmStringMap parmComments, unkParmData;
+    ParmFormatMap parmFormats;
+    string version;
+
+    assert(readparm(fname, flagList, parmData, parmComments, unkParmData,
+                    parmFormats, version) == OK);
+    const char* out = "files/tmp_written.parm7";
+    assert(writeparm(out, flagList, parmData, parmComments, unkParmData,
+                     parmFormats, version) == OK);
+    assert(slurp(out) == slurp(fname));
+
+    // Changed data is written in the same layout
+    parmData["CHARGE"][0].f = -1.5;
+    parmData["ATOM_NAME"][0].c[0] = 'X';
+    assert(writeparm(out, flagList, parmData, parmComments, unkParmData,
+                     parmFormats, version) == OK);
+    vector<string> flagList2;
+    ParmDataMap parmData2;
+    ParmStringMap parmComments2, unkParmData2;
+    ParmFormatMap parmFormats2;
+    string version2;
+    assert(readparm(out, flagList2, parmData2, parmComments2, unkParmData2,
+                    parmFormats2, version2) == OK);
+    assert(flagList2 == flagList);
+    assert(version2 == version);
+    assert(unkParmData2 == unkParmData);
+    assert(parmData2["CHARGE"][0].f == -1.5);
+    assert(parmData2["ATOM_NAME"][0].c[0] == 'X');
+    assert(slurp(out).size() == slurp(fname).size());
+
+    // A flag without a format cannot be written
+    parmFormats.erase("CHARGE");
+    assert(writeparm(out, flagList, parmData, parmComments, unkParmData,
+                     parmFormats, version) == ERR);
+    remove(out);
+}
+
+int main() {
+
+    cout << "Checking topology file writing...";
+    check_writeparm_roundtrip("files/trx.prmtop");
+    check_writeparm_roundtrip("files/4096wat.parm7");
+    cout << " OK." << endl;
+
+    cout << "Checking typed topology sections...";
+    check_typed_matches_eager("files/trx.prmtop");
+    check_typed_matches_eager("files/4096wat.parm7");
+    cout << " OK." << endl;
+
+    cout << "Checking wide character sections...";
+    check_wide_strings();
+    cout << " OK." << endl;
+
+    cout << "Checking typed topology section error detection...";
+    check_typed_errors();
+    cout << " OK." << endl;
+
+    return 0;
+}
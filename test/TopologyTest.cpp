@@ -167,12 +167,206 @@ void check_dihedrals(void) {
     }
 }
 
+void check_atom_table(void) {
+    Amber::AtomTable atoms;
+    for (int i = 0; i < 10; i++) {
+        atoms.push_back(Amber::Atom(i, i % 2 ? "CA" : "HA", "CX", 6, 12.01,
+                                    0.1*i, 1.0, 0.5, 1.2, 0.85));
+    }
+    atoms.add(atoms.internName("CA"), atoms.internType("N3"), 7, 14.01, -0.3,
+              0.95, 0.1, 1.3, 0.8);
+
+    // Names and types are stored once and shared by ID
+    assert(atoms.size() == 11);
+    assert(atoms.names().size() == 2);
+    assert(atoms.types().size() == 2);
+    assert(atoms.names().find("CA") == atoms.nameIds()[1]);
+    assert(atoms.names().find("CB") == -1);
+    assert(atoms.nameIds()[10] == atoms.nameIds()[1]);
+    assert(atoms.typeIds()[10] != atoms.typeIds()[0]);
+
+    // The property arrays and the views agree
+    assert(atoms.charges().size() == 11);
+    assert(atoms[3].getCharge() == atoms.charges()[3]);
+    assert(atoms[10].getName() == "CA");
+    assert(atoms[10].getType() == "N3");
+    assert(atoms[10].getElement() == 7);
+    assert(atoms[10].getMass() == 14.01);
+    assert(atoms[10].getLJRadius() == 0.95);
+    assert(atoms[10].getLJEpsilon() == 0.1);
+    assert(atoms[10].getGBRadius() == 1.3);
+    assert(atoms[10].getGBScreen() == 0.8);
+
+    int i = 0;
+    for (Amber::AtomTable::const_iterator it = atoms.begin();
+            it != atoms.end(); it++) {
+        assert(it->getIndex() == i);
+        assert(it->getName() == (i == 10 || i % 2 ? "CA" : "HA"));
+        i++;
+    }
+    assert(atoms.end() - atoms.begin() == 11);
+
+    atoms.setCharge(3, -1.0);
+    assert(atoms[3].getCharge() == -1.0);
+
+    // Copying atoms out of the table
+    Amber::Atom atom = atoms[4];
+    assert(atom.getIndex() == 4);
+    assert(atom.getName() == "HA");
+    assert(atom.getCharge() == atoms.charges()[4]);
+    Amber::AtomList list = atoms.toList();
+    assert(list.size() == 11);
+    assert(list[3].getCharge() == -1.0);
+    assert(list[10].getType() == "N3");
+
+    atoms.clear();
+    assert(atoms.empty());
+    assert(atoms.names().size() == 0);
+}
+
+void check_exclusion_table(void) {
+    Amber::ExclusionTable table;
+    int row0[] = {3, 1, 200, 64, 65, 3};
+    int row1[] = {2};
+    int row3[] = {4};
+    table.addAtom(row0, 6);
+    table.addAtom(row1, 1);
+    table.addAtom(NULL, 0);
+    table.addAtom(row3, 1);
+
+    assert(table.numAtoms() == 4);
+    assert(table.size() == 7); // the duplicate 3 is dropped
+
+    // Partners must come after the atom, or isExcluded would miss the pair
+    int row4[] = {9, 0};
+    bool caught = false;
+    try {
+        table.addAtom(row4, 2);
+    } catch (Amber::AmberParmError &e) {
+        caught = true;
+    }
+    assert(caught);
+    assert(table.numAtoms() == 4 && table.size() == 7);
+
+    // Rows come out sorted
+    Amber::Span<int> excluded = table.excluded(0);
+    assert(excluded.size() == 5);
+    assert(excluded[0] == 1 && excluded[1] == 3 && excluded[2] == 64 &&
+           excluded[3] == 65 && excluded[4] == 200);
+    assert(table.excluded(2).empty());
+    assert(table.offsets().size() == 5);
+    assert(table.offsets()[4] == table.partners().size());
+
+    // Near pairs (through the mask) and far pairs (through the row), looked
+    // up in the row of the lower index
+    assert(table.isExcluded(0, 1) && table.isExcluded(1, 0));
+    assert(table.isExcluded(0, 3) && table.isExcluded(0, 64));
+    assert(table.isExcluded(0, 65) && table.isExcluded(200, 0));
+    assert(!table.isExcluded(0, 2) && !table.isExcluded(0, 66));
+    assert(!table.isExcluded(0, 199) && !table.isExcluded(0, 0));
+    assert(table.isExcluded(1, 2) && !table.isExcluded(1, 3));
+    assert(table.isExcluded(3, 4) && table.isExcluded(4, 3));
+
+    table.clear();
+    assert(table.numAtoms() == 0 && table.size() == 0);
+    assert(table.offsets().size() == 1);
+}
+
+void check_term_table(void) {
+    Amber::DihedralTable table;
+    int t0 = table.internType(Amber::DihedralType(1.0, 180.0, 2, 1.2, 2.0));
+    int t1 = table.internType(Amber::DihedralType(0.5, 0.0, 3, 1.2, 2.0));
+    assert(t0 == 0 && t1 == 1);
+    assert(table.internType(Amber::DihedralType(1.0, 180.0, 2, 1.2, 2.0)) == 0);
+    assert(table.numTypes() == 2);
+
+    table.add(Amber::DihedralTerm(0, 1, 2, 3, t0, false));
+    table.add(Amber::DihedralTerm(1, 2, 3, 4, t1, true));
+    table.add(Amber::DihedralTerm(0, 1, 2, 3, t1, true));
+    assert(table.size() == 3);
+
+    // Terms expand to the full parameters on access
+    assert(table[0].getPeriodicity() == 2 && table[0].getPhase() == 180.0);
+    assert(table[1].getAtomL() == 4 && table[1].ignoreEndGroups());
+    assert(table.term(2).type == 1);
+
+    Amber::DihedralTable::const_iterator it = table.begin();
+    assert(it->getForceConstant() == 1.0);
+    it += 2;
+    assert(it->getForceConstant() == 0.5);
+    assert(++it == table.end() && table.end() - table.begin() == 3);
+
+    Amber::DihedralList list = table.toList();
+    assert(list.size() == 3 && list[2].getPeriodicity() == 3);
+
+    table.setType(t1, Amber::DihedralType(0.25, 0.0, 3, 1.2, 2.0));
+    assert(table[1].getForceConstant() == 0.25);
+    assert(table[2].getForceConstant() == 0.25);
+
+    // Repeating copies the terms with shifted atoms and the same types
+    table.repeat(3, 10);
+    assert(table.size() == 9 && table.numTypes() == 2);
+    assert(table.term(4).i == 11 && table.term(4).l == 14);
+    assert(table.term(8).i == 20 && table.term(8).type == t1);
+    assert(table.term(8).ignore_end != 0);
+
+    table.clear();
+    assert(table.empty() && table.numTypes() == 0);
+}
+
+void check_bond_graph(void) {
+    // Two chains, 0-1-2 and 3-5, with a duplicate bond, plus a lone atom 4
+    Amber::BondTable bonds;
+    int t = bonds.addType(Amber::BondType(300.0, 1.0));
+    bonds.add(Amber::BondTerm(1, 0, t));
+    bonds.add(Amber::BondTerm(1, 2, t));
+    bonds.add(Amber::BondTerm(5, 3, t));
+    bonds.add(Amber::BondTerm(0, 1, t));
+
+    Amber::BondGraph graph;
+    graph.build(6, bonds);
+    assert(graph.numAtoms() == 6);
+    assert(graph.numEdges() == 3);
+    assert(graph.degree(1) == 2 && graph.degree(0) == 1);
+    assert(graph.degree(4) == 0 && graph.neighbors(4).empty());
+    assert(graph.neighbors(1)[0] == 0 && graph.neighbors(1)[1] == 2);
+    assert(graph.bonded(3, 5) && graph.bonded(5, 3) && !graph.bonded(0, 2));
+
+    // Molecules are numbered by their first atom
+    assert(graph.numMolecules() == 3);
+    assert(graph.getMoleculeOf(0) == 0 && graph.getMoleculeOf(2) == 0);
+    assert(graph.getMoleculeOf(3) == 1 && graph.getMoleculeOf(5) == 1);
+    assert(graph.getMoleculeOf(4) == 2);
+    assert(graph.molecule(1).size() == 2 && graph.molecule(1)[1] == 5);
+    assert(graph.isContiguous(0) && !graph.isContiguous(1));
+    assert(graph.isContiguous(2));
+
+    graph.clear();
+    assert(graph.numAtoms() == 0 && graph.numMolecules() == 0);
+}
+
 int main(int argc, char** argv) {
 
     cout << "Checking Atom class with list...";
     check_atoms();
     cout << " OK." << endl;
 
+    cout << "Checking AtomTable storage and views...";
+    check_atom_table();
+    cout << " OK." << endl;
+
+    cout << "Checking ExclusionTable...";
+    check_exclusion_table();
+    cout << " OK." << endl;
+
+    cout << "Checking bonded term tables...";
+    check_term_table();
+    cout << " OK." << endl;
+
+    cout << "Checking BondGraph...";
+    check_bond_graph();
+    cout << " OK." << endl;
+
     cout << "Checking Bond class with list...";
     check_bonds();
     cout << " OK." << endl;